@@ -54,6 +54,23 @@ CREATE TABLE choices(
  uid INT NOT NULL,
  log BLOB NOT NULL,
  PRIMARY KEY (gid, uid));
+
+# Choices appended since a player's log in choices was last rewritten;
+# pos is the index (in ints) of the first entry of the row
+CREATE TABLE choice_journal(
+ gid INT NOT NULL,
+ uid INT NOT NULL,
+ pos INT NOT NULL,
+ log BLOB NOT NULL,
+ PRIMARY KEY (gid, uid, pos));
+
+# Binary snapshot of a game at the end of its latest saved round; a restarted
+# server resumes from it and replays only later choices
+CREATE TABLE snapshots(
+ gid INT NOT NULL,
+ round INT NOT NULL,
+ state BLOB NOT NULL,
+ PRIMARY KEY (gid));
  
 # This table is only used from version 0.8.1k
 CREATE TABLE messages(
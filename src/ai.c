@@ -26,6 +26,28 @@
 
 /* #define DEBUG */
 
+/*
+ * Storage class for AI state that is private to each thread.
+ *
+ * The learner may play several games at once in separate threads, each
+ * with its own copy of the networks and search caches.  Statistics
+ * counters are shared, and updated atomically with ai_count() below.
+ */
+#ifdef __GNUC__
+#define ai_local __thread
+#else
+#define ai_local
+#endif
+
+/*
+ * Add to a statistics counter shared by all threads.
+ */
+#ifdef __GNUC__
+#define ai_count(x, n) __sync_fetch_and_add(&(x), (n))
+#else
+#define ai_count(x, n) ((x) += (n))
+#endif
+
 /*
  * Track number of times neural net is computed.
  */
@@ -35,21 +57,109 @@ static int num_computes;
 /*
  * A neural net for evaluating hand and active cards.
  */
-static net eval;
+static ai_local net eval;
 
 /*
  * A neural net for predicting role choices.
  */
-static net role;
+static ai_local net role;
+
+/*
+ * Smaller networks used by players of the fast AI tier.
+ *
+ * While a fast player is deciding, these are exchanged with the normal
+ * networks above, so that all of the search code uses them unchanged.
+ */
+static ai_local net fast_eval, fast_role;
+
+/*
+ * Whether fast networks are loaded, and whether they are in use.
+ */
+static ai_local int fast_loaded, fast_active;
 
 /*
  * Counters for tracking usefulness of role prediction.
  */
 static int role_hit, role_miss;
-static double role_avg;
+
+/*
+ * Sum of predicted probabilities of chosen actions, in millionths.
+ */
+static long role_avg;
 
 static int eval_cache_hit, eval_cache_miss;
 
+/*
+ * Use exact scores instead of the eval network in the final round.
+ */
+int ai_exact_endgame = 1;
+
+/*
+ * Train the networks while playing.
+ *
+ * Cleared by tools that only use the networks.
+ */
+int ai_train = 1;
+
+/*
+ * Share the networks loaded for each kind of game between all threads.
+ *
+ * Set by the server, which runs AI players on a pool of threads.  The
+ * networks are then never trained, and AI players must not be initialized
+ * by several threads at once.
+ */
+int ai_share_nets;
+
+/*
+ * Networks loaded for one kind of game, shared between threads.
+ */
+typedef struct shared_nets
+{
+	/* Kind of game */
+	int num_players, expanded, advanced;
+
+	/* Evaluator and role predictor networks */
+	net eval, role;
+
+	/* Next kind of game */
+	struct shared_nets *next;
+
+} shared_nets;
+
+/*
+ * List of networks shared between threads.
+ */
+static shared_nets *shared_list;
+
+/*
+ * Log to append evaluator training samples to (if any).
+ *
+ * Shared by all threads.
+ */
+FILE *ai_experience;
+
+/*
+ * Log to append role predictor training samples to (if any).
+ *
+ * Shared by all threads.
+ */
+FILE *ai_role_experience;
+
+/*
+ * Set when the current real decision is made in the final round.
+ */
+static ai_local int endgame;
+
+/*
+ * Counter for finished games scored exactly.
+ */
+static int exact_evals;
+
+/*
+ * Counters of AI work done by the calling thread.
+ */
+static ai_local ai_stats stats;
+
 /*
  * Size of evaluator neural net.
  */
@@ -60,6 +170,15 @@ static int eval_cache_hit, eval_cache_miss;
  */
 #define ROLE_HIDDEN 50
 
+/*
+ * Hidden layer sizes of new evaluator and role predictor networks.
+ *
+ * Networks loaded from disk use the sizes in their weights file instead.
+ * The second hidden layer is left out if its size is zero.
+ */
+int ai_eval_hidden[2] = { EVAL_HIDDEN, 0 };
+int ai_role_hidden[2] = { ROLE_HIDDEN, 0 };
+
 /*
  * Number of outputs for role predictor network (basic and advanced).
  */
@@ -92,19 +211,153 @@ static int eval_cache_hit, eval_cache_miss;
 static void initial_training(game *g);
 static void setup_nets(game *g);
 static void fill_adv_combo(void);
+static void clear_opp_place_cache(void);
+static void clear_eval_cache(void);
+static void ai_sample_clear(void);
+static void ai_fast_initialize(game *g, int who, double factor);
+
+
+/*
+ * Set the learning rates of the networks used by the calling thread.
+ */
+void ai_set_factor(double factor)
+{
+	/* Set learning rate */
+	eval.alpha = 0.0001 * factor;
+#ifdef DEBUG
+	eval.alpha = 0.0;
+#endif
+
+	/* Set learning rate */
+	role.alpha = 0.0005 * factor;
+#ifdef DEBUG
+	role.alpha = 0.0;
+#endif
+}
+
+/*
+ * Exchange the normal and the fast networks, if needed to make the
+ * networks of the given tier (0 for normal, 1 for fast) the ones in use.
+ */
+static void use_tier(int fast)
+{
+	net tmp;
+
+	/* Check for tier already in use */
+	if (fast_active == fast) return;
+
+	/* Check for no fast networks to use */
+	if (fast && !fast_loaded) return;
+
+	/* Exchange evaluators */
+	tmp = eval;
+	eval = fast_eval;
+	fast_eval = tmp;
+
+	/* Exchange role predictors */
+	tmp = role;
+	role = fast_role;
+	fast_role = tmp;
+
+	/* Remember tier in use (each tier keeps its own cached results) */
+	fast_active = fast;
+}
+
+/*
+ * Use the networks of the tier of the player making a real decision.
+ *
+ * Fast players are those initialized by the fast tier (possibly through
+ * a copy of its decision functions).  During simulations, the networks of
+ * the simulating player are kept.
+ */
+static void select_tier(game *g, int who)
+{
+	/* Keep networks during simulations */
+	if (g->simulation) return;
+
+	/* Use fast networks for fast players */
+	use_tier(g->p[who].control &&
+	         g->p[who].control->init == ai_fast_initialize);
+}
+
+/*
+ * Use the networks loaded by another thread for this kind of game.
+ *
+ * Return 0 if no networks were shared for this kind of game yet.
+ */
+static int use_shared_nets(game *g)
+{
+	shared_nets *s_ptr;
+
+	/* Loop over shared networks */
+	for (s_ptr = shared_list; s_ptr; s_ptr = s_ptr->next)
+	{
+		/* Check for matching kind of game */
+		if (s_ptr->num_players == g->num_players &&
+		    s_ptr->expanded == g->expanded &&
+		    s_ptr->advanced == g->advanced) break;
+	}
+
+	/* Check for no networks found */
+	if (!s_ptr) return 0;
+
+	/* Free networks just created */
+	free_net(&eval);
+	free_net(&role);
+
+	/* Compute with shared weights */
+	share_net(&eval, &s_ptr->eval);
+	share_net(&role, &s_ptr->role);
+
+	/* Success */
+	return 1;
+}
+
+/*
+ * Share the networks just loaded with other threads.
+ */
+static void add_shared_nets(game *g)
+{
+	shared_nets *s_ptr;
+
+	/* Create entry */
+	s_ptr = (shared_nets *)malloc(sizeof(shared_nets));
+
+	/* Set kind of game */
+	s_ptr->num_players = g->num_players;
+	s_ptr->expanded = g->expanded;
+	s_ptr->advanced = g->advanced;
+
+	/* Move networks to entry */
+	s_ptr->eval = eval;
+	s_ptr->role = role;
 
+	/* Compute with shared weights */
+	share_net(&eval, &s_ptr->eval);
+	share_net(&role, &s_ptr->role);
+
+	/* Add entry to list */
+	s_ptr->next = shared_list;
+	shared_list = s_ptr;
+}
 
 /*
  * Initialize AI.
  */
 static void ai_initialize(game *g, int who, double factor)
 {
-	char fname[1024], msg[1024];
-	static int loaded_p, loaded_e, loaded_a;
+	char fname[1024], msg[1024 + 64];
+	static ai_local int loaded_p, loaded_e, loaded_a;
 
 	/* Create table of advanced action combinations */
 	fill_adv_combo();
 
+	/* Put normal networks back in place */
+	use_tier(0);
+
+	/* Forget Explore samples of another player of this thread */
+	ai_sample_clear();
+
 	/* Do nothing if correct networks already loaded */
 	if (loaded_p == g->num_players && loaded_e == g->expanded &&
 	    loaded_a == g->advanced) return;
@@ -120,11 +373,21 @@ static void ai_initialize(game *g, int who, double factor)
 	/* Compute size and input names of networks */
 	setup_nets(g);
 
-	/* Set learning rate */
-	eval.alpha = 0.0001 * factor;
-#ifdef DEBUG
-	eval.alpha = 0.0;
-#endif
+	/* Forget opponent placement results from old networks */
+	clear_opp_place_cache();
+
+	/* Set learning rates */
+	ai_set_factor(factor);
+
+	/* Check for networks already loaded by another thread */
+	if (ai_share_nets && use_shared_nets(g))
+	{
+		/* Mark network as loaded */
+		loaded_p = g->num_players;
+		loaded_e = g->expanded;
+		loaded_a = g->advanced;
+		return;
+	}
 
 	/* Create evaluator filename */
 	sprintf(fname, RFTGDIR "/network/rftg.eval.%d.%d%s.net", g->expanded,
@@ -149,11 +412,8 @@ static void ai_initialize(game *g, int who, double factor)
 		}
 	}
 
-	/* Set learning rate */
-	role.alpha = 0.0005 * factor;
-#ifdef DEBUG
-	role.alpha = 0.0;
-#endif
+	/* Use integer weights if they exist and network is not trained */
+	if (eval.alpha == 0.0) load_quant(&eval, fname);
 
 	/* Create predictor filename */
 	sprintf(fname, RFTGDIR "/network/rftg.role.%d.%d%s.net", g->expanded,
@@ -175,12 +435,135 @@ static void ai_initialize(game *g, int who, double factor)
 		}
 	}
 
+	/* Use integer weights if they exist and network is not trained */
+	if (role.alpha == 0.0) load_quant(&role, fname);
+
+	/* Let other threads use networks */
+	if (ai_share_nets) add_shared_nets(g);
+
 	/* Mark network as loaded */
 	loaded_p = g->num_players;
 	loaded_e = g->expanded;
 	loaded_a = g->advanced;
 }
 
+/*
+ * Load one network of the fast tier, sized by its weights file.
+ *
+ * The inputs and outputs are the same as those of the given normal network.
+ */
+static int load_fast_net(net *learn, net *normal, char *kind, game *g)
+{
+	char fname[1024];
+	int input, hidden, output, i;
+
+	/* Create filename */
+	sprintf(fname, RFTGDIR "/network/rftg.%s.%d.%d%s.fast.net", kind,
+	        g->expanded, g->num_players, g->advanced ? "a" : "");
+
+	/* Check for file */
+	if (read_net_size(fname, &input, &hidden, &output))
+	{
+		/* Try looking under current directory */
+		sprintf(fname, "network/rftg.%s.%d.%d%s.fast.net", kind,
+		        g->expanded, g->num_players, g->advanced ? "a" : "");
+
+		/* Check again */
+		if (read_net_size(fname, &input, &hidden, &output)) return -1;
+	}
+
+	/* Check for mismatched inputs or outputs */
+	if (input != normal->num_inputs || output != normal->num_output)
+		return -1;
+
+	/* Create network */
+	make_learner(learn, input, hidden, 0, output);
+
+	/* Copy input names, so that loading checks them */
+	for (i = 0; i < input; i++)
+	{
+		/* Copy name */
+		learn->input_name[i] = strdup(normal->input_name[i]);
+	}
+
+	/* Load weights */
+	if (load_net(learn, fname))
+	{
+		/* Free network */
+		free_net(learn);
+
+		/* Failure */
+		return -1;
+	}
+
+	/* Fast networks are never trained */
+	learn->alpha = 0.0;
+
+	/* Use integer weights if they exist */
+	load_quant(learn, fname);
+
+	/* Success */
+	return 0;
+}
+
+/*
+ * Initialize AI for a player of the fast tier.
+ *
+ * Players use the normal networks if no fast networks are available.
+ */
+static void ai_fast_initialize(game *g, int who, double factor)
+{
+	char msg[1024];
+	static ai_local int loaded_p, loaded_e, loaded_a;
+
+	/* Initialize normal AI */
+	ai_initialize(g, who, factor);
+
+	/* Do nothing if correct networks already loaded (or missing) */
+	if (loaded_p == g->num_players && loaded_e == g->expanded &&
+	    loaded_a == g->advanced) return;
+
+	/* Free old networks if some already loaded */
+	if (fast_loaded)
+	{
+		/* Free old networks */
+		free_net(&fast_eval);
+		free_net(&fast_role);
+		fast_loaded = 0;
+	}
+
+	/* Load evaluator */
+	if (!load_fast_net(&fast_eval, &eval, "eval", g))
+	{
+		/* Load role predictor */
+		if (!load_fast_net(&fast_role, &role, "role", g))
+		{
+			/* Networks are available */
+			fast_loaded = 1;
+		}
+		else
+		{
+			/* Free evaluator */
+			free_net(&fast_eval);
+		}
+	}
+
+	/* Check for failure */
+	if (!fast_loaded)
+	{
+		/* Print warning */
+		sprintf(msg, "Warning: No fast networks for %d.%d%s, "
+		             "using normal networks\n", g->expanded,
+		        g->num_players, g->advanced ? "a" : "");
+		display_error(msg);
+	}
+
+	/* Mark networks as loaded */
+	loaded_p = g->num_players;
+	loaded_e = g->expanded;
+	loaded_a = g->advanced;
+}
+
 /*
  * Called when player spots have been rotated.
  *
@@ -248,7 +631,7 @@ typedef struct quick_discard
 /*
  * List of most discardable cards (per player).
  */
-quick_discard discard_list[MAX_PLAYER][MAX_DECK];
+ai_local quick_discard discard_list[MAX_PLAYER][MAX_DECK];
 
 /*
  * Compare two quick discard entries.
@@ -322,6 +705,9 @@ static void complete_turn(game *g, int partial)
 	/* Do nothing in aborted games */
 	if (g->game_over) return;
 
+	/* Always search to the end of the game in the final round */
+	if (endgame) partial = COMPLETE_ROUND;
+
 	/* Finish current phase */
 	for (i = g->turn + 1; i < g->num_players; i++)
 	{
@@ -965,7 +1351,7 @@ static int consume_ability(game *g, int who, int produce)
 /*
  * List of all advanced game action combinations.
  */
-static int adv_combo[ROLE_OUT_ADV_EXP3][2] =
+static ai_local int adv_combo[ROLE_OUT_ADV_EXP3][2] =
 {
 	{ ACT_EXPLORE_5_0, ACT_EXPLORE_1_1 },
 	{ ACT_EXPLORE_5_0, ACT_DEVELOP },
@@ -1017,8 +1403,8 @@ static int role_out[ROLE_OUT_EXP3] =
 /*
  * Mapping from card indices to neural network inputs.
  */
-static int card_input[MAX_DESIGN], num_c_input;
-static int good_input[MAX_DESIGN], num_g_input;
+static ai_local int card_input[MAX_DESIGN], num_c_input;
+static ai_local int good_input[MAX_DESIGN], num_g_input;
 
 /*
  * Setup mappings of card indices to neural net inputs.
@@ -1311,7 +1697,8 @@ static void setup_nets(game *g)
 	}
 
 	/* Create evaluator network */
-	make_learner(&eval, n, EVAL_HIDDEN, g->num_players);
+	make_learner(&eval, n, ai_eval_hidden[0], ai_eval_hidden[1],
+	             g->num_players);
 
 	/* Copy input names */
 	for (i = 0; i < n; i++)
@@ -1574,7 +1961,7 @@ static void setup_nets(game *g)
 	}
 
 	/* Create role predictor network */
-	make_learner(&role, n, ROLE_HIDDEN, outputs);
+	make_learner(&role, n, ai_role_hidden[0], ai_role_hidden[1], outputs);
 
 	/* Copy input names */
 	for (i = 0; i < n; i++)
@@ -1601,14 +1988,78 @@ typedef struct eval_cache
 } eval_cache;
 
 /*
- * Hash table for cached evaluation results.
+ * Hash tables for cached evaluation results, one per network tier.
+ */
+static ai_local eval_cache *eval_hash[2][65536];
+
+/*
+ * Cached result from opponent placement simulation.
+ *
+ * Unlike the evaluation cache, these entries survive across decisions
+ * (and rounds), since an opponent's placement choice depends mostly on
+ * their own tableau.  Entries are kept in a bounded pool and the least
+ * recently used entry is recycled once the pool is full.  Both network
+ * tiers share the pool, with the tier made part of each key.
+ */
+typedef struct opp_place_cache
+{
+	/* Hash value of opponent state */
+	uint64_t key;
+
+	/* Score to return */
+	double score;
+
+	/* Cache generation this entry was stored in */
+	int gen;
+
+	/* Game round this entry was stored in */
+	int round;
+
+	/* Next cache entry in chain */
+	struct opp_place_cache *next;
+
+	/* Neighbors in least-recently-used list */
+	struct opp_place_cache *lru_prev, *lru_next;
+
+} opp_place_cache;
+
+/*
+ * Memory budget (in bytes) for cached opponent placement results.
+ */
+#define OPP_PLACE_BUDGET (4 * 1024 * 1024)
+
+/*
+ * Number of rounds an opponent placement result stays valid.
  */
-static eval_cache *eval_hash[65536];
+#define OPP_PLACE_MAX_AGE 2
 
 /*
  * Hash table for cached opponent placement results.
  */
-static eval_cache *opp_place_hash[65536];
+static ai_local opp_place_cache *opp_place_hash[65536];
+
+/*
+ * Pool of opponent placement cache entries.
+ */
+static ai_local opp_place_cache *opp_place_pool;
+static ai_local int opp_place_used;
+
+/*
+ * Most and least recently used opponent placement cache entries.
+ */
+static ai_local opp_place_cache *opp_place_lru_head, *opp_place_lru_tail;
+
+/*
+ * Current opponent placement cache generation.
+ *
+ * Entries from older generations are treated as empty.
+ */
+static ai_local int opp_place_gen;
+
+/*
+ * Counters for tracking usefulness of opponent placement cache.
+ */
+static int opp_place_hit, opp_place_miss, opp_place_evict;
 
 /*
  * Generic hash mixer.
@@ -1768,7 +2219,8 @@ static eval_cache *lookup_eval(game *g, int who)
 	key = gen_hash(value, len);
 
 	/* Look for key in hash table */
-	for (e_ptr = eval_hash[key & 0xffff]; e_ptr; e_ptr = e_ptr->next)
+	for (e_ptr = eval_hash[fast_active][key & 0xffff]; e_ptr;
+	     e_ptr = e_ptr->next)
 	{
 		/* Check for match */
 		if (e_ptr->key == key) break;
@@ -1787,8 +2239,8 @@ static eval_cache *lookup_eval(game *g, int who)
 		e_ptr->score = -1;
 
 		/* Insert into hash table */
-		e_ptr->next = eval_hash[key & 0xffff];
-		eval_hash[key & 0xffff] = e_ptr;
+		e_ptr->next = eval_hash[fast_active][key & 0xffff];
+		eval_hash[fast_active][key & 0xffff] = e_ptr;
 	}
 
 	/* Return pointer */
@@ -1796,39 +2248,116 @@ static eval_cache *lookup_eval(game *g, int who)
 }
 
 /*
- * Lookup a score in the opponent placement cache.
+ * Move an opponent placement cache entry to the front of the LRU list.
  */
-static eval_cache *lookup_opp_place(game *g, int who, int opp, int which,
-                                    int special)
+static void touch_opp_place(opp_place_cache *e_ptr)
 {
-	eval_cache *e_ptr;
-	uint64_t key;
-	unsigned char value[1024];
-	int len = 0;
-	int x;
+	/* Check for already at front */
+	if (opp_place_lru_head == e_ptr) return;
 
-	/* Start at opponent's first card */
-	x = g->p[opp].head[WHERE_ACTIVE];
+	/* Unlink from current position */
+	if (e_ptr->lru_prev) e_ptr->lru_prev->lru_next = e_ptr->lru_next;
+	if (e_ptr->lru_next) e_ptr->lru_next->lru_prev = e_ptr->lru_prev;
 
-	/* Loop over active cards */
-	for ( ; x != -1; x = g->deck[x].next)
-	{
-		/* Add card index to value */
-		value[len++] = (unsigned char)x;
-	}
+	/* Check for entry at end of list */
+	if (opp_place_lru_tail == e_ptr) opp_place_lru_tail = e_ptr->lru_prev;
 
-	/* Add evaluating player to value */
-	value[len++] = (unsigned char)who;
+	/* Insert at front of list */
+	e_ptr->lru_prev = NULL;
+	e_ptr->lru_next = opp_place_lru_head;
 
-	/* Add opponent player to value */
-	value[len++] = (unsigned char)opp;
+	/* Link old front entry */
+	if (opp_place_lru_head) opp_place_lru_head->lru_prev = e_ptr;
 
-	/* Add opponent's actions to value */
-	value[len++] = (unsigned char)g->p[opp].action[0];
-	value[len++] = (unsigned char)g->p[opp].action[1];
+	/* Set new front */
+	opp_place_lru_head = e_ptr;
 
-	/* Add proposed card to value */
-	value[len++] = (unsigned char)which;
+	/* Check for first entry */
+	if (!opp_place_lru_tail) opp_place_lru_tail = e_ptr;
+}
+
+/*
+ * Get an unused opponent placement cache entry.
+ *
+ * If the pool is exhausted, the least recently used entry is recycled.
+ */
+static opp_place_cache *alloc_opp_place(void)
+{
+	opp_place_cache *e_ptr, **prev;
+	int max = OPP_PLACE_BUDGET / sizeof(opp_place_cache);
+
+	/* Create pool if needed */
+	if (!opp_place_pool)
+	{
+		/* Allocate pool */
+		opp_place_pool = (opp_place_cache *)malloc(sizeof(opp_place_cache) *
+		                                           max);
+	}
+
+	/* Check for unused entries in pool */
+	if (opp_place_used < max)
+	{
+		/* Get next unused entry */
+		e_ptr = &opp_place_pool[opp_place_used++];
+
+		/* Clear list pointers */
+		e_ptr->lru_prev = e_ptr->lru_next = NULL;
+
+		/* Return entry */
+		return e_ptr;
+	}
+
+	/* Take least recently used entry */
+	e_ptr = opp_place_lru_tail;
+
+	/* Find entry in hash chain */
+	prev = &opp_place_hash[e_ptr->key & 0xffff];
+	while (*prev != e_ptr) prev = &(*prev)->next;
+
+	/* Remove entry from hash chain */
+	*prev = e_ptr->next;
+
+	/* Count evictions */
+	if (e_ptr->gen == opp_place_gen) ai_count(opp_place_evict, 1);
+
+	/* Return entry */
+	return e_ptr;
+}
+
+/*
+ * Lookup a score in the opponent placement cache.
+ */
+static opp_place_cache *lookup_opp_place(game *g, int who, int opp, int which,
+                                         int special)
+{
+	opp_place_cache *e_ptr;
+	uint64_t key;
+	unsigned char value[1024];
+	int len = 0;
+	int x;
+
+	/* Start at opponent's first card */
+	x = g->p[opp].head[WHERE_ACTIVE];
+
+	/* Loop over active cards */
+	for ( ; x != -1; x = g->deck[x].next)
+	{
+		/* Add card index to value */
+		value[len++] = (unsigned char)x;
+	}
+
+	/* Add evaluating player to value */
+	value[len++] = (unsigned char)who;
+
+	/* Add opponent player to value */
+	value[len++] = (unsigned char)opp;
+
+	/* Add opponent's actions to value */
+	value[len++] = (unsigned char)g->p[opp].action[0];
+	value[len++] = (unsigned char)g->p[opp].action[1];
+
+	/* Add proposed card to value */
+	value[len++] = (unsigned char)which;
 
 	/* Add current phase to value */
 	value[len++] = (unsigned char)g->cur_action;
@@ -1836,6 +2365,9 @@ static eval_cache *lookup_opp_place(game *g, int who, int opp, int which,
 	/* Add special card used (if any) to value */
 	value[len++] = (unsigned char)special;
 
+	/* Add network tier in use to value */
+	value[len++] = (unsigned char)fast_active;
+
 	/* Get key for value */
 	key = gen_hash(value, len);
 
@@ -1849,74 +2381,99 @@ static eval_cache *lookup_opp_place(game *g, int who, int opp, int which,
 	/* Check for no match */
 	if (!e_ptr)
 	{
-		/* Make new entry */
-		e_ptr = (eval_cache *)malloc(sizeof(eval_cache));
+		/* Get new entry */
+		e_ptr = alloc_opp_place();
 
 		/* Set key of new entry */
 		e_ptr->key = key;
 
-		/* Clear score */
-		e_ptr->score = -1;
+		/* Mark entry as stale */
+		e_ptr->gen = opp_place_gen - 1;
 
 		/* Insert into hash table */
 		e_ptr->next = opp_place_hash[key & 0xffff];
 		opp_place_hash[key & 0xffff] = e_ptr;
 	}
 
+	/* Check for entry from old generation or too many rounds ago */
+	if (e_ptr->gen != opp_place_gen || g->round < e_ptr->round ||
+	    g->round - e_ptr->round > OPP_PLACE_MAX_AGE)
+	{
+		/* Clear score */
+		e_ptr->score = -1;
+
+		/* Set generation and round of entry */
+		e_ptr->gen = opp_place_gen;
+		e_ptr->round = g->round;
+	}
+
+	/* Mark entry as recently used */
+	touch_opp_place(e_ptr);
+
+	/* Count hits and misses */
+	if (e_ptr->score != -1) ai_count(opp_place_hit, 1);
+	else ai_count(opp_place_miss, 1);
+
+	/* Count lookups and hits of calling thread */
+	stats.opp_place_lookup++;
+	if (e_ptr->score != -1) stats.opp_place_hit++;
+
 	/* Return pointer */
 	return e_ptr;
 }
 
 /*
- * Delete the entries in the evaluation cache.
+ * Delete the entries in the evaluation cache of both network tiers.
  */
 static void clear_eval_cache(void)
 {
 	eval_cache *e_ptr;
-	int i;
+	int i, j;
 
-	/* Loop over each row in hash table */
-	for (i = 0; i < 65536; i++)
+	/* Loop over tiers */
+	for (i = 0; i < 2; i++)
 	{
-		/* Delete entries until clear */
-		while (eval_hash[i])
+		/* Loop over each row in hash table */
+		for (j = 0; j < 65536; j++)
 		{
-			/* Get pointer to first entry */
-			e_ptr = eval_hash[i];
+			/* Delete entries until clear */
+			while (eval_hash[i][j])
+			{
+				/* Get pointer to first entry */
+				e_ptr = eval_hash[i][j];
 
-			/* Move row to next entry */
-			eval_hash[i] = e_ptr->next;
+				/* Move row to next entry */
+				eval_hash[i][j] = e_ptr->next;
 
-			/* Delete entry */
-			free(e_ptr);
+				/* Delete entry */
+				free(e_ptr);
+			}
 		}
 	}
 }
 
 /*
- * Delete the entries in the opponent placement cache.
+ * Invalidate the entries in the opponent placement cache.
+ *
+ * The entries are not freed, but are marked as stale by advancing the
+ * cache generation.
  */
 static void clear_opp_place_cache(void)
 {
-	eval_cache *e_ptr;
-	int i;
-
-	/* Loop over each row in hash table */
-	for (i = 0; i < 65536; i++)
-	{
-		/* Delete entries until clear */
-		while (opp_place_hash[i])
-		{
-			/* Get pointer to first entry */
-			e_ptr = opp_place_hash[i];
-
-			/* Move row to next entry */
-			opp_place_hash[i] = e_ptr->next;
+	/* Advance generation */
+	opp_place_gen++;
+}
 
-			/* Delete entry */
-			free(e_ptr);
-		}
-	}
+/*
+ * Prepare the opponent placement cache for a new decision.
+ *
+ * Results remain valid as long as the evaluation network does not change,
+ * so the cache is only invalidated when we are training.
+ */
+static void age_opp_place_cache(void)
+{
+	/* Check for networks being trained */
+	if (eval.alpha != 0.0) clear_opp_place_cache();
 }
 
 #if 0
@@ -2277,6 +2834,82 @@ static int eval_game_leader(game *g, int who, int n, int leader[][MAX_LEADER],
 	return n;
 }
 
+/*
+ * Return true if the game will end at the end of the current round.
+ */
+static int game_ends_this_round(game *g)
+{
+	int i, target;
+
+	/* Check for VP pool exhausted */
+	if (g->vp_pool <= 0) return 1;
+
+	/* Loop over players */
+	for (i = 0; i < g->num_players; i++)
+	{
+		/* Assume player needs 12 cards to end game */
+		target = 12;
+
+		/* Check for "game ends at 14" flag */
+		if (count_active_flags(g, i, FLAG_GAME_END_14)) target = 14;
+
+		/* Check for enough cards */
+		if (count_player_area(g, i, WHERE_ACTIVE) >= target) return 1;
+
+		/* Check for enough prestige to end game */
+		if (g->p[i].prestige >= 15) return 1;
+	}
+
+	/* Game continues */
+	return 0;
+}
+
+/*
+ * Score a finished game exactly, without using the eval network.
+ *
+ * Winning is worth more than any margin of victory or defeat, and the
+ * margin against the best opponent breaks ties.  Scores are between 0 and 1,
+ * like the win probabilities of the eval network, since leaves scored either
+ * way are compared with each other.
+ */
+static double exact_score(game *g, int who)
+{
+	int i, best = -1000, margin;
+
+	/* Get end-of-game score */
+	score_game(g);
+
+	/* Declare winner */
+	declare_winner(g);
+
+	/* Loop over opponents */
+	for (i = 0; i < g->num_players; i++)
+	{
+		/* Skip ourself */
+		if (i == who) continue;
+
+		/* Track best opponent score */
+		if (g->p[i].end_vp > best) best = g->p[i].end_vp;
+	}
+
+	/* Compute margin over best opponent */
+	margin = g->p[who].end_vp - best;
+
+	/* Limit margin */
+	if (margin > 40) margin = 40;
+	if (margin < -40) margin = -40;
+
+	/* Count exact evaluations */
+	ai_count(exact_evals, 1);
+	stats.exact_eval++;
+
+	/* Check for win (margin is at least zero) */
+	if (g->p[who].winner) return 0.75 + margin / 160.0;
+
+	/* Score loss (margin is at most zero) */
+	return 0.25 + margin / 160.0;
+}
+
 /*
  * Evaluate the given game state from the point of view of the given
  * player.
@@ -2295,19 +2928,33 @@ static double eval_game(game *g, int who)
 	/* Lookup game state in cached results */
 	e_ptr = lookup_eval(g, who);
 
+	/* Count evaluation */
+	stats.eval_lookup++;
+
 #ifndef DEBUG
 	/* Check for valid result */
 	if (e_ptr->score > -1)
 	{
-		eval_cache_hit++;
+		stats.eval_hit++;
+		ai_count(eval_cache_hit, 1);
 		return e_ptr->score;
 	}
 	else
 	{
-		eval_cache_miss++;
+		ai_count(eval_cache_miss, 1);
 	}
 #endif
 
+	/* Check for finished game in the final round */
+	if (endgame && g->simulation && g->game_over)
+	{
+		/* Use exact score instead of network */
+		e_ptr->score = exact_score(g, who);
+
+		/* Return score */
+		return e_ptr->score;
+	}
+
 	/* Get end-of-game score */
 	score_game(g);
 
@@ -2534,7 +3181,8 @@ static double eval_game(game *g, int who)
 	/* Compute network */
 	compute_net(&eval);
 
-	num_computes++;
+	ai_count(num_computes, 1);
+	stats.eval_compute++;
 
 #if 0
 	insert_inputs();
@@ -2571,6 +3219,9 @@ static void perform_training(game *g, int who, double *desired)
 	/* Clear cached results of eval network */
 	clear_eval_cache();
 
+	/* Check for read-only networks */
+	if (!ai_train) return;
+
 	/* Get current state */
 	eval_game(g, who);
 
@@ -2600,14 +3251,13 @@ static void perform_training(game *g, int who, double *desired)
 	}
 
 	/* Loop over past input sets (starting with most recent) */
-	for (i = eval.num_past - 2; i >= 0; i--)
+	for (i = 1; i < eval.num_past; i++)
 	{
 		/* Skip input sets that do not belong to us */
-		if (eval.past_input_player[i] != who) continue;
+		if (past_player(&eval, i) != who) continue;
 
 		/* Copy past inputs to network */
-		memcpy(eval.input_value, eval.past_input[i],
-		       sizeof(double) * (eval.num_inputs + 1));
+		load_past(&eval, i);
 
 		/* Compute network */
 		compute_net(&eval);
@@ -3092,6 +3742,7 @@ static void predict_action(game *g, int who, double prob[MAX_ACTION],
 
 	/* Compute role choice probabilities */
 	compute_net(&role);
+	stats.role_compute++;
 
 #if 0
 	printf("%d %d\n", g->round, who);
@@ -3271,7 +3922,7 @@ static int claim_card(game *g, int who, int which)
 /*
  * Explore samples we've seen this turn.
  */
-static struct sample_score explore_seen[MAX_EXPLORE_SAMPLE];
+static ai_local struct sample_score explore_seen[MAX_EXPLORE_SAMPLE];
 
 /*
  * Clear sample results.
@@ -3722,7 +4373,7 @@ static void ai_choose_action_advanced(game *g, int who, int action[2], int one)
 	predict_action(g, who, desired, who);
 
 	/* Track stats on predicted actions */
-	role_avg += desired[b_a];
+	ai_count(role_avg, (long)(desired[b_a] * 1000000));
 
 	/* Clear best score */
 	b_p = -1;
@@ -3744,12 +4395,12 @@ static void ai_choose_action_advanced(game *g, int who, int action[2], int one)
 	if (b_i == b_a)
 	{
 		/* Count hits */
-		role_hit++;
+		ai_count(role_hit, 1);
 	}
 	else
 	{
 		/* Count miss */
-		role_miss++;
+		ai_count(role_miss, 1);
 	}
 
 	/* Check for failure to search */
@@ -3774,14 +4425,26 @@ static void ai_choose_action_advanced(game *g, int who, int action[2], int one)
 		desired[i] = exp(20 * (scores[i] / b_s)) / sum;
 	}
 
-	/* Train network */
-	train_net(&role, 1.0, desired);
+	/* Check for training */
+	if (ai_train)
+	{
+		/* Train network */
+		train_net(&role, 1.0, desired);
 
-	/* Apply training */
-	apply_training(&role);
+		/* Apply training */
+		apply_training(&role);
+	}
 
-	/* Clear placement cache */
-	clear_opp_place_cache();
+	/* Check for role experience log */
+	if (ai_role_experience)
+	{
+		/* Log current inputs with desired outputs */
+		write_experience(ai_role_experience, &role, role.input_value, who,
+		                 desired);
+	}
+
+	/* Age placement cache */
+	age_opp_place_cache();
 }
 
 /*
@@ -3799,8 +4462,8 @@ struct opponent_act
 /*
  * List of action choice combinations.
  */
-struct opponent_act *opponent_combos;
-int opponent_combo_len, opponent_combo_size;
+ai_local struct opponent_act *opponent_combos;
+ai_local int opponent_combo_len, opponent_combo_size;
 
 /*
  * Compare two opponent action choice combinations by probability.
@@ -3992,8 +4655,8 @@ static void ai_choose_action(game *g, int who, int action[2], int one)
 	/* Clear sample results */
 	ai_sample_clear();
 
-	/* Clear placement cache */
-	clear_opp_place_cache();
+	/* Age placement cache */
+	age_opp_place_cache();
 
 	/* Handle "advanced" game differently */
 	if (g->advanced) return ai_choose_action_advanced(g, who, action, one);
@@ -4209,7 +4872,7 @@ static void ai_choose_action(game *g, int who, int action[2], int one)
 	predict_action(g, who, desired, who);
 
 	/* Track stats on predicted actions */
-	role_avg += desired[best];
+	ai_count(role_avg, (long)(desired[best] * 1000000));
 
 	/* Clear best score */
 	b_p = -1;
@@ -4231,12 +4894,12 @@ static void ai_choose_action(game *g, int who, int action[2], int one)
 	if (b_i == best)
 	{
 		/* Count hits */
-		role_hit++;
+		ai_count(role_hit, 1);
 	}
 	else
 	{
 		/* Count miss */
-		role_miss++;
+		ai_count(role_miss, 1);
 	}
 
 	/* Compute probability sum */
@@ -4253,14 +4916,26 @@ static void ai_choose_action(game *g, int who, int action[2], int one)
 		desired[i] = exp(20 * (scores[i] / b_s)) / sum;
 	}
 
-	/* Train network */
-	train_net(&role, 1.0, desired);
+	/* Check for training */
+	if (ai_train)
+	{
+		/* Train network */
+		train_net(&role, 1.0, desired);
 
-	/* Apply training */
-	apply_training(&role);
+		/* Apply training */
+		apply_training(&role);
+	}
 
-	/* Clear placement cache */
-	clear_opp_place_cache();
+	/* Check for role experience log */
+	if (ai_role_experience)
+	{
+		/* Log current inputs with desired outputs */
+		write_experience(ai_role_experience, &role, role.input_value, who,
+		                 desired);
+	}
+
+	/* Age placement cache */
+	age_opp_place_cache();
 }
 
 /*
@@ -4924,6 +5599,9 @@ static void ai_explore_sample(game *g, int who, int draw, int keep,
 	int i, j, k;
 	unsigned int seed;
 
+	/* Use networks of player's tier */
+	select_tier(g, who);
+
 	/* Loop over previous results */
 	for (i = 0; i < MAX_EXPLORE_SAMPLE; i++)
 	{
@@ -5287,7 +5965,7 @@ static int ai_choose_place_opp(game *g, int who, int phase, int special)
 	int windfall_only = 0, force_place = 0;
 	int unknown[MAX_DECK], num_unknown = 0;
 	double score, no_place;
-	eval_cache *e_ptr;
+	opp_place_cache *e_ptr;
 	struct sample_score scores[MAX_DECK];
 
 	/* Determine type of card to look for */
@@ -5554,8 +6232,8 @@ static int ai_choose_place(game *g, int who, int list[], int num, int phase,
 	/* Check for real game */
 	if (!g->simulation)
 	{
-		/* Clear placement cache */
-		clear_opp_place_cache();
+		/* Age placement cache */
+		age_opp_place_cache();
 	}
 
 	/* Check for simulated game for opponent */
@@ -5745,123 +6423,202 @@ static int ai_choose_place(game *g, int who, int list[], int num, int phase,
 	return best;
 }
 
+/*
+ * Return true if two cards are interchangeable as payment.
+ */
+static int same_payment(game *g, int x, int y)
+{
+	/* Check for fake cards */
+	if (x == -1 || y == -1) return x == y;
+
+	/* Compare card designs */
+	return g->deck[x].d_ptr == g->deck[y].d_ptr;
+}
+
+/*
+ * Sort a list of payment cards so that identical designs are adjacent.
+ */
+static void sort_payment(game *g, int list[], int num)
+{
+	int i, j, x;
+
+	/* Loop over cards */
+	for (i = 1; i < num; i++)
+	{
+		/* Get card to insert */
+		x = list[i];
+
+		/* Search backwards for matching design */
+		for (j = i - 1; j >= 0; j--)
+		{
+			/* Stop at identical card */
+			if (same_payment(g, list[j], x)) break;
+		}
+
+		/* Check for no match or already adjacent */
+		if (j < 0 || j == i - 1) continue;
+
+		/* Move cards after match up one spot */
+		memmove(&list[j + 2], &list[j + 1], sizeof(int) * (i - j - 1));
+
+		/* Insert card next to match */
+		list[j + 1] = x;
+	}
+}
+
 /*
  * Helper function for "ai_choose_pay" below.
  *
- * Here we try different combinations of discards to pay the remaining cost
- * of a played card.
+ * Here we try one payment and evaluate the result.
+ *
+ * Return 0 if the payment is illegal.
  */
-static void ai_choose_pay_aux2(game *g, int who, int which, int list[],
-                               int special[], int num_special, int mil_only,
-                               int mil_bonus, int n, int c, int chosen,
-                               int chosen_special, int *best, int *best_special,
-                               double *b_s)
+static int ai_try_payment(game *g, int who, int which, int list[],
+                          int special[], int num_special, int mil_only,
+                          int mil_bonus, int chosen, int chosen_special,
+                          int *best, int *best_special, double *b_s)
 {
 	game sim;
 	int payment[MAX_DECK], num_payment = 0, used[MAX_DECK], n_used = 0;
 	double score;
 	int i;
 
-	/* Check for too few choices */
-	if (c > n) return;
-
-	/* Check for no more cards to try */
-	if (!n)
+	/* Loop over chosen special cards */
+	for (i = 0; i < num_special; i++)
 	{
-		/* Loop over chosen special cards */
-		for (i = 0; i < num_special; i++)
+		/* Check for bit set */
+		if (chosen_special & (1 << i))
 		{
-			/* Check for bit set */
-			if (chosen_special & (1 << i))
-			{
-				/* Add card to list */
-				used[n_used++] = special[i];
-			}
+			/* Add card to list */
+			used[n_used++] = special[i];
 		}
+	}
 
-		/* Loop over chosen payment cards */
-		for (i = 0; (1 << i) <= chosen; i++)
+	/* Loop over chosen payment cards */
+	for (i = 0; (1 << i) <= chosen; i++)
+	{
+		/* Check for bit set */
+		if (chosen & (1 << i))
 		{
-			/* Check for bit set */
-			if (chosen & (1 << i))
-			{
-				/* Add card to list */
-				payment[num_payment++] = list[i];
-			}
+			/* Add card to list */
+			payment[num_payment++] = list[i];
 		}
+	}
 
-		/* Simulate game */
-		simulate_game(&sim, g, who);
-
-		/* Attempt to pay */
-		if (!payment_callback(&sim, who, which, payment, num_payment,
-		                      used, n_used, mil_only, mil_bonus))
-		{
-			/* Illegal payment */
-			return;
-		}
+	/* Simulate game */
+	simulate_game(&sim, g, who);
 
-		/* Simulate most of rest of turn */
-		complete_turn(&sim, COMPLETE_ROUND);
+	/* Attempt to pay */
+	if (!payment_callback(&sim, who, which, payment, num_payment,
+	                      used, n_used, mil_only, mil_bonus))
+	{
+		/* Illegal payment */
+		return 0;
+	}
 
-		/* Evaluate result */
-		score = eval_game(&sim, who);
+	/* Simulate most of rest of turn */
+	complete_turn(&sim, COMPLETE_ROUND);
 
-		/* Check for better */
-		if (score_better(score, *b_s))
-		{
-			/* Save best */
-			*b_s = score;
-			*best = chosen;
-			*best_special = chosen_special;
-		}
+	/* Evaluate result */
+	score = eval_game(&sim, who);
 
-		/* Done */
-		return;
+	/* Check for better */
+	if (score_better(score, *b_s))
+	{
+		/* Save best */
+		*b_s = score;
+		*best = chosen;
+		*best_special = chosen_special;
 	}
 
-	/* Try without current card */
-	ai_choose_pay_aux2(g, who, which, list, special, num_special,
-	                   mil_only, mil_bonus, n - 1, c, chosen << 1,
-	                   chosen_special, best, best_special, b_s);
-
-	/* Try with current card */
-	if (c) ai_choose_pay_aux2(g, who, which, list, special,
-	                          num_special, mil_only, mil_bonus, n - 1,
-	                          c - 1, (chosen << 1) + 1, chosen_special,
-	                          best, best_special, b_s);
+	/* Legal payment */
+	return 1;
 }
 
 /*
- * Structure to hold calculated legal payment.
+ * Helper function for "ai_choose_pay" below.
+ *
+ * Here we try different combinations of discards to pay the remaining cost
+ * of a played card.
+ *
+ * The list of cards is sorted so that identical designs are adjacent, and
+ * we only try each number of copies of a design once, since which copy is
+ * discarded makes no difference.
  */
-struct legal_payment
+static void ai_choose_pay_aux2(game *g, int who, int which, int list[],
+                               int special[], int num_special, int mil_only,
+                               int mil_bonus, int n, int c, int chosen,
+                               int chosen_special, int *best, int *best_special,
+                               double *b_s)
 {
-	/* Chosen special cards */
-	int chosen_special;
+	int i, m;
 
-	/* Number of cards needed from hand */
-	int needed;
-};
+	/* Check for too few choices */
+	if (c > n) return;
+
+	/* Check for no more cards to try */
+	if (!n)
+	{
+		/* Try payment */
+		ai_try_payment(g, who, which, list, special, num_special,
+		               mil_only, mil_bonus, chosen, chosen_special,
+		               best, best_special, b_s);
+
+		/* Done */
+		return;
+	}
+
+	/* Count identical cards at end of remaining list */
+	for (m = 1; m < n; m++)
+	{
+		/* Stop at different card */
+		if (!same_payment(g, list[n - 1], list[n - 1 - m])) break;
+	}
+
+	/* Try each number of identical cards to use */
+	for (i = 0; i <= m && i <= c; i++)
+	{
+		/* Use lowest copies of card */
+		ai_choose_pay_aux2(g, who, which, list, special, num_special,
+		                   mil_only, mil_bonus, n - m, c - i,
+		                   (chosen << m) + (1 << i) - 1, chosen_special,
+		                   best, best_special, b_s);
+	}
+}
+
+/*
+ * Structure to hold calculated legal payment.
+ */
+struct legal_payment
+{
+	/* Chosen special cards */
+	int chosen_special;
+
+	/* Number of cards needed from hand */
+	int needed;
+};
+
+/*
+ * Maximum number of legal payments considered.
+ */
+#define MAX_LEGAL_PAYMENT 100
 
 /*
  * List of legal payments.
  */
-static struct legal_payment payment_list[100];
-int num_legal_payment;
+static ai_local struct legal_payment payment_list[MAX_LEGAL_PAYMENT];
+ai_local int num_legal_payment;
 
 /*
  * Helper function for "ai_choose_pay" below.
  *
- * Here we try different combinations of special abilities to pay for a
- * played card.
+ * Here we find the combinations of special abilities that can legally pay
+ * for a played card, and the number of cards from hand each one needs.
  */
-static void ai_choose_pay_aux1(game *g, int who, int which, int list[], int num,
+static void ai_choose_pay_aux1(game *g, int who, int which, int num,
                                int special[], int num_special, int mil_only,
-                               int mil_bonus, int next, int chosen_special,
-                               int *best, int *best_special, double *b_s)
+                               int mil_bonus, int next, int chosen_special)
 {
-	game sim;
 	int used[MAX_DECK], n_used = 0;
 	int i, need;
 
@@ -5889,47 +6646,118 @@ static void ai_choose_pay_aux1(game *g, int who, int which, int list[], int num,
 		/* Check for more cards needed than available */
 		if (need > num) return;
 
-		/* Check for simulated game */
-		if (g->simulation)
+		/* Check for too many payments */
+		if (num_legal_payment == MAX_LEGAL_PAYMENT) return;
+
+		/* Add payment to list */
+		payment_list[num_legal_payment].chosen_special = chosen_special;
+		payment_list[num_legal_payment].needed = need;
+		num_legal_payment++;
+
+		/* Done */
+		return;
+	}
+
+	/* Try without current ability */
+	ai_choose_pay_aux1(g, who, which, num, special, num_special,
+	                   mil_only, mil_bonus, next + 1, chosen_special);
+
+	/* Try with current ability */
+	ai_choose_pay_aux1(g, who, which, num, special, num_special,
+	                   mil_only, mil_bonus, next + 1,
+	                   chosen_special | (1 << next));
+}
+
+/*
+ * Remove legal payments that are dominated by another payment.
+ *
+ * A payment is dominated if another payment uses a strict subset of its
+ * special abilities and needs no more cards from hand.
+ */
+static void prune_payments(void)
+{
+	int dominated[MAX_LEGAL_PAYMENT];
+	int i, j, cs, n = 0;
+
+	/* Loop over payments */
+	for (i = 0; i < num_legal_payment; i++)
+	{
+		/* Assume not dominated */
+		dominated[i] = 0;
+
+		/* Get chosen special cards */
+		cs = payment_list[i].chosen_special;
+
+		/* Loop over other payments */
+		for (j = 0; j < num_legal_payment; j++)
 		{
-			/* Add payment to list */
-			payment_list[num_legal_payment].chosen_special =
-				chosen_special;
-			payment_list[num_legal_payment].needed = need;
-			num_legal_payment++;
+			/* Skip payments using same abilities */
+			if (payment_list[j].chosen_special == cs) continue;
 
-#if 0
-			/* Simulate game */
-			simulate_game(&sim, g, who);
+			/* Skip payments using abilities we do not use */
+			if ((payment_list[j].chosen_special & cs) !=
+			    payment_list[j].chosen_special) continue;
 
-			/* Attempt to pay */
-			if (!payment_callback(&sim, who, which, payment, need,
-			                      used, n_used, mil_only))
+			/* Check for no more cards needed */
+			if (payment_list[j].needed <= payment_list[i].needed)
 			{
-				/* Error */
-				printf("Payment failed!\n");
-				abort();
+				/* Mark as dominated */
+				dominated[i] = 1;
+				break;
 			}
+		}
+	}
 
-			/* Simulate rest of current phase only */
-			complete_turn(&sim, COMPLETE_PHASE);
+	/* Loop over payments */
+	for (i = 0; i < num_legal_payment; i++)
+	{
+		/* Keep payments that are not dominated */
+		if (!dominated[i]) payment_list[n++] = payment_list[i];
+	}
 
-			/* Evaluate result */
-			score = eval_game(&sim, who);
+	/* Set number of remaining payments */
+	num_legal_payment = n;
+}
 
-			/* Check for better */
-			if (score_better(score, *b_s))
-			{
-				/* Save best */
-				*b_s = score;
-				*best = (1 << need) - 1;
-				*best_special = chosen_special;
-			}
-#endif
+/*
+ * Choose method of payment.
+ */
+static void ai_choose_pay(game *g, int who, int which, int list[], int *num,
+                          int special[], int *num_special, int mil_only,
+                          int mil_bonus)
+{
+	game sim;
+	double b_s = -1, score;
+	int i, j, n = 0, n_used;
+	int best = 0, best_special = 0, cs;
+	int payment[MAX_DECK], used[MAX_DECK];
+	struct legal_payment legal[MAX_LEGAL_PAYMENT];
+	int num_legal, need, memo[MAX_DECK];
+	int m_best, m_best_special;
+	double m_s;
 
-			/* Done with simulated game */
-			return;
-		}
+	/* XXX Don't look at more than 15 cards to pay with */
+	if (*num > 15) *num = 15;
+
+	/* Clear list of legal payments */
+	num_legal_payment = 0;
+
+	/* Find legal sets of special abilities */
+	ai_choose_pay_aux1(g, who, which, *num, special, *num_special,
+	                   mil_only, mil_bonus, 0, 0);
+
+	/* Only consider payments not dominated by another */
+	prune_payments();
+
+	/* Copy legal payments (the global list is reused by simulations) */
+	num_legal = num_legal_payment;
+	memcpy(legal, payment_list, sizeof(struct legal_payment) * num_legal);
+
+	/* Check for real game */
+	if (!g->simulation && num_legal > 0)
+	{
+		/* Put identical cards next to each other */
+		sort_payment(g, list, *num);
 
 		/* Simulate game */
 		simulate_game(&sim, g, who);
@@ -5957,71 +6785,72 @@ static void ai_choose_pay_aux1(game *g, int who, int which, int list[], int num,
 			}
 		}
 
-		/* Try payment with different card combinations */
-		ai_choose_pay_aux2(&sim, who, which, list, special, num_special,
-		                   mil_only, mil_bonus, num, need, 0,
-		                   chosen_special, best, best_special, b_s);
+		/* No discards found yet for any remaining cost */
+		for (i = 0; i <= *num; i++) memo[i] = -1;
 
-		/* Done */
-		return;
-	}
+		/* Loop over strategies */
+		for (i = 0; i < num_legal; i++)
+		{
+			/* Get cards needed after special abilities */
+			need = legal[i].needed;
 
-	/* Try without current ability */
-	ai_choose_pay_aux1(g, who, which, list, num, special, num_special,
-	                   mil_only, mil_bonus, next + 1, chosen_special, best,
-	                   best_special, b_s);
+			/*
+			 * Discards only pay the remaining cost, so reuse the
+			 * best discards found for the same cost, if legal.
+			 */
+			if (memo[need] >= 0 &&
+			    ai_try_payment(&sim, who, which, list, special,
+			                   *num_special, mil_only, mil_bonus,
+			                   memo[need], legal[i].chosen_special,
+			                   &best, &best_special, &b_s)) continue;
 
-	/* Try with current ability */
-	ai_choose_pay_aux1(g, who, which, list, num, special, num_special,
-	                   mil_only, mil_bonus, next + 1,
-	                   chosen_special | (1 << next), best, best_special,
-	                   b_s);
-}
+			/* Clear best discards for this strategy */
+			m_best = m_best_special = 0;
+			m_s = -1;
 
-/*
- * Choose method of payment.
- */
-static void ai_choose_pay(game *g, int who, int which, int list[], int *num,
-                          int special[], int *num_special, int mil_only,
-                          int mil_bonus)
-{
-	game sim;
-	double b_s = -1, score;
-	int i, j, n = 0, n_used;
-	int best = 0, best_special = 0, cs;
-	int payment[MAX_DECK], used[MAX_DECK];
+			/* Try payment with different card combinations */
+			ai_choose_pay_aux2(&sim, who, which, list, special,
+			                   *num_special, mil_only, mil_bonus,
+			                   *num, need, 0, legal[i].chosen_special,
+			                   &m_best, &m_best_special, &m_s);
 
-	/* XXX Don't look at more than 15 cards to pay with */
-	if (*num > 15) *num = 15;
+			/* Check for no legal discards */
+			if (m_s == -1) continue;
 
-	/* Clear list of legal payments */
-	num_legal_payment = 0;
+			/* Remember best discards for remaining cost */
+			memo[need] = m_best;
 
-	/* Find best set of special abilities */
-	ai_choose_pay_aux1(g, who, which, list, *num, special, *num_special,
-	                   mil_only, mil_bonus, 0, 0, &best, &best_special,
-	                   &b_s);
+			/* Check for better */
+			if (score_better(m_s, b_s))
+			{
+				/* Save best */
+				b_s = m_s;
+				best = m_best;
+				best_special = m_best_special;
+			}
+		}
+	}
 
 	/* Check for only one payment strategy */
-	if (b_s == -1 && num_legal_payment == 1)
+	if (b_s == -1 && num_legal == 1)
 	{
 		/* Set payment */
 		b_s = 0;
-		best_special = payment_list[0].chosen_special;
-		best = (1 << payment_list[0].needed) - 1;
+		best_special = legal[0].chosen_special;
+		best = (1 << legal[0].needed) - 1;
 	}
 
 	/* Check for multiple payment strategies */
-	if (b_s == -1 && num_legal_payment > 0)
+	if (b_s == -1 && num_legal > 0)
 	{
 		/* Fill payment array with fake cards */
 		for (i = 0; i < *num; i++) payment[i] = -1;
 
 		/* Loop over strategies */
-		for (i = 0; i < num_legal_payment; i++)
+		for (i = 0; i < num_legal; i++)
 		{
 			/* Get chosen special cards */
-			cs = payment_list[i].chosen_special;
+			cs = legal[i].chosen_special;
 
 			/* Clear number of special cards used */
 			n_used = 0;
@@ -6042,7 +6871,7 @@ static void ai_choose_pay(game *g, int who, int which, int list[], int *num,
 
 			/* Attempt to pay */
 			if (!payment_callback(&sim, who, which, payment,
-			                      payment_list[i].needed,
+			                      legal[i].needed,
 			                      used, n_used, mil_only,
 			                      mil_bonus))
 			{
@@ -6062,7 +6891,7 @@ static void ai_choose_pay(game *g, int who, int which, int list[], int *num,
 			{
 				/* Save best */
 				b_s = score;
-				best = (1 << payment_list[i].needed) - 1;
+				best = (1 << legal[i].needed) - 1;
 				best_special = cs;
 			}
 		}
@@ -6209,103 +7038,133 @@ static int ai_choose_takeover(game *g, int who, int list[], int *num,
 }
 
 /*
- * Helper function for "ai_choose_defend" below.
- *
- * Here we try different combinations of discards to pay for special abilities
- * chosen in "ai_choose_defend_aux1" below.
+ * Compute the military and "military from hand" amounts a special card
+ * contributes when defending against a takeover.
  */
-static void ai_choose_defend_aux2(game *g, int who, int which, int opponent,
-                                  int deficit, int list[], int num,
-                                  int special[], int num_special,
-                                  int next, int chosen, int chosen_special,
-                                  int *best, int *best_special, double *b_s)
+static void defend_contribution(game *g, int x, int *military, int *hand)
 {
-	game sim;
 	card *c_ptr;
-	int payment[MAX_DECK], used[MAX_DECK], n = 0, n_used = 0;
-	double score;
-	int i, x, rv;
+	power *o_ptr;
+	int i;
 
-	/* Check for simulated game */
-	if (g->simulation)
+	/* Get card pointer */
+	c_ptr = &g->deck[x];
+
+	/* Clear contributions */
+	*military = *hand = 0;
+
+	/* Loop over card's powers */
+	for (i = 0; i < c_ptr->d_ptr->num_power; i++)
 	{
-		/* Fill payment array with fake cards */
-		for (i = 0; i < num; i++) payment[i] = -1;
+		/* Get power pointer */
+		o_ptr = &c_ptr->d_ptr->powers[i];
 
-		/* Loop over chosen special cards */
-		for (i = 0; i < num_special; i++)
+		/* Skip non-Settle power */
+		if (o_ptr->phase != PHASE_SETTLE) continue;
+
+		/* Check for discard for extra military */
+		if (o_ptr->code == (P3_DISCARD | P3_EXTRA_MILITARY))
 		{
-			/* Check for bit set */
-			if (chosen_special & (1 << i))
-			{
-				/* Add card to list */
-				used[n_used++] = special[i];
-			}
+			/* Add extra military */
+			*military += o_ptr->value;
 		}
 
-		/* Try varying number of payment cards */
-		for (i = 0; i <= num; i++)
+		/* Check for hand cards for military */
+		if (o_ptr->code & P3_MILITARY_HAND)
 		{
-			/* Simulate game */
-			simulate_game(&sim, g, who);
+			/* Add military from hand */
+			*hand += o_ptr->value;
+		}
 
-			/* Attempt to defend */
-			rv = defend_callback(&sim, who, deficit, payment, i,
-			                     used, n_used);
+		/* Check for consume or prestige to increase military */
+		if (o_ptr->code & (P3_CONSUME_RARE | P3_CONSUME_ALIEN |
+		                   P3_CONSUME_PRESTIGE))
+		{
+			/* Add extra military */
+			*military += o_ptr->value;
+		}
+	}
+}
 
-			/* Skip illegal combinations */
-			if (!rv) continue;
+/*
+ * Simulate a defense against a takeover and return the resulting score.
+ *
+ * Returns -1 if the defense is illegal.
+ */
+static double ai_choose_defend_try(game *g, int who, int which, int opponent,
+                                   int deficit, int payment[], int n,
+                                   int used[], int n_used)
+{
+	game sim;
+	card *c_ptr;
+	int x, rv;
 
-			/* Check for failure to defend */
-			if (rv == 1)
-			{
-				/* Get card pointer */
-				c_ptr = &sim.deck[which];
+	/* Simulate game */
+	simulate_game(&sim, g, who);
 
-				/* Move card to opponent */
-				move_card(&sim, which, opponent, WHERE_ACTIVE);
+	/* Attempt to defend */
+	rv = defend_callback(&sim, who, deficit, payment, n, used, n_used);
 
-				/* Check for good on card */
-				if (c_ptr->num_goods)
-				{
-					/* Start at first good */
-					x = sim.p[who].head[WHERE_GOOD];
+	/* Skip illegal combinations */
+	if (!rv) return -1;
 
-					/* Loop over goods */
-					for ( ; x != -1; x = sim.deck[x].next)
-					{
-						/* Check for covering good */
-						if (sim.deck[x].covering ==
-						    which)
-						{
-							/* Move good as well */
-							move_card(&sim, x,
-							          opponent,
-							          WHERE_GOOD);
-						}
-					}
-				}
-			}
+	/* Check for failure to defend */
+	if (rv == 1)
+	{
+		/* Get card pointer */
+		c_ptr = &sim.deck[which];
 
-			/* Evaluate result */
-			score = eval_game(&sim, who);
+		/* Move card to opponent */
+		move_card(&sim, which, opponent, WHERE_ACTIVE);
 
-			/* Check for better */
-			if (score_better(score, *b_s))
+		/* Check for good on card */
+		if (c_ptr->num_goods)
+		{
+			/* Start at first good */
+			x = sim.p[who].head[WHERE_GOOD];
+
+			/* Loop over goods */
+			for ( ; x != -1; x = sim.deck[x].next)
 			{
-				/* Save best */
-				*b_s = score;
-				*best = (1 << i) - 1;
-				*best_special = chosen_special;
+				/* Check for covering good */
+				if (sim.deck[x].covering == which)
+				{
+					/* Move good as well */
+					move_card(&sim, x, opponent,
+					          WHERE_GOOD);
+				}
 			}
 		}
-
-		/* Done */
-		return;
 	}
 
+	/* Evaluate result */
+	return eval_game(&sim, who);
+}
+
+/*
+ * Helper function for "ai_choose_defend" below.
+ *
+ * Here we try different combinations of discards to pay for special abilities
+ * chosen in "ai_choose_defend_aux1" below.
+ *
+ * As with payments, the list of cards is sorted so that identical designs
+ * are adjacent, and each number of copies of a design is tried only once.
+ */
+static void ai_choose_defend_aux2(game *g, int who, int which, int opponent,
+                                  int deficit, int list[], int special[],
+                                  int num_special, int n, int c, int chosen,
+                                  int chosen_special, int *best,
+                                  int *best_special, double *b_s)
+{
+	int payment[MAX_DECK], used[MAX_DECK], num_payment = 0, n_used = 0;
+	double score;
+	int i, m;
+
+	/* Check for too few choices */
+	if (c > n) return;
+
 	/* Check for no more cards to try */
-	if (next == num)
+	if (!n)
 	{
 		/* Loop over chosen special cards */
 		for (i = 0; i < num_special; i++)
@@ -6319,60 +7178,23 @@ static void ai_choose_defend_aux2(game *g, int who, int which, int opponent,
 		}
 
 		/* Loop over chosen payment cards */
-		for (i = 0; i < num; i++)
+		for (i = 0; (1 << i) <= chosen; i++)
 		{
 			/* Check for bit set */
 			if (chosen & (1 << i))
 			{
 				/* Add card to list */
-				payment[n++] = list[i];
-			}
-		}
-
-		/* Simulate game */
-		simulate_game(&sim, g, who);
-
-		/* Attempt to defend */
-		rv = defend_callback(&sim, who, deficit, payment, n, used,
-		                     n_used);
-
-		/* Skip illegal combinations */
-		if (!rv) return;
-
-		/* Check for failure to defend */
-		if (rv == 1)
-		{
-			/* Get card pointer */
-			c_ptr = &sim.deck[which];
-
-			/* Move card to opponent */
-			move_card(&sim, which, opponent, WHERE_ACTIVE);
-
-			/* Check for good on card */
-			if (c_ptr->num_goods)
-			{
-				/* Start at first good */
-				x = sim.p[who].head[WHERE_GOOD];
-
-				/* Loop over goods */
-				for ( ; x != -1; x = sim.deck[x].next)
-				{
-					/* Check for covering good */
-					if (sim.deck[x].covering == which)
-					{
-						/* Move good as well */
-						move_card(&sim, x, opponent,
-						          WHERE_GOOD);
-					}
-				}
+				payment[num_payment++] = list[i];
 			}
 		}
 
-		/* Evaluate result */
-		score = eval_game(&sim, who);
+		/* Get score for defense */
+		score = ai_choose_defend_try(g, who, which, opponent, deficit,
+		                             payment, num_payment, used,
+		                             n_used);
 
 		/* Check for better */
-		if (score_better(score, *b_s))
+		if (score != -1 && score_better(score, *b_s))
 		{
 			/* Save best */
 			*b_s = score;
@@ -6384,37 +7206,172 @@ static void ai_choose_defend_aux2(game *g, int who, int which, int opponent,
 		return;
 	}
 
-	/* Try without current card */
-	ai_choose_defend_aux2(g, who, which, opponent, deficit, list, num,
-	                      special, num_special, next + 1, chosen,
-	                      chosen_special, best, best_special, b_s);
-
-	/* Try with current card */
-	ai_choose_defend_aux2(g, who, which, opponent, deficit, list, num,
-	                      special, num_special, next + 1,
-	                      chosen | (1 << next), chosen_special,
-	                      best, best_special, b_s);
-}
+	/* Count identical cards at end of remaining list */
+	for (m = 1; m < n; m++)
+	{
+		/* Stop at different card */
+		if (!same_payment(g, list[n - 1], list[n - 1 - m])) break;
+	}
 
+	/* Try each number of identical cards to use */
+	for (i = 0; i <= m && i <= c; i++)
+	{
+		/* Use lowest copies of card */
+		ai_choose_defend_aux2(g, who, which, opponent, deficit, list,
+		                      special, num_special, n - m, c - i,
+		                      (chosen << m) + (1 << i) - 1,
+		                      chosen_special, best, best_special, b_s);
+	}
+}
 
 /*
- * Helper function for "ai_choose_defend" below.
+ * Check whether a set of special abilities is worth trying as a defense.
  *
- * Here we try different combinations of special abilities to defend
- * against a takeover.
+ * A set is skipped if an identical earlier ability is not also used, or
+ * if any ability in the set could be dropped and the defense would still
+ * succeed.
+ */
+static int defend_minimal(game *g, int special[], int num_special,
+                          int spec_mil[], int spec_hand[], int chosen_special,
+                          int military, int hand, int need)
+{
+	int i, j;
+
+	/* Loop over chosen special cards */
+	for (i = 0; i < num_special; i++)
+	{
+		/* Skip unchosen cards */
+		if (!(chosen_special & (1 << i))) continue;
+
+		/* Loop over earlier special cards */
+		for (j = 0; j < i; j++)
+		{
+			/* Check for identical card not used */
+			if (!(chosen_special & (1 << j)) &&
+			    g->deck[special[j]].d_ptr == g->deck[special[i]].d_ptr)
+			{
+				/* Equivalent set already tried */
+				return 0;
+			}
+		}
+
+		/* Check for unneeded extra military */
+		if (spec_mil[i] && military - spec_mil[i] >= need) return 0;
+
+		/* Check for unneeded military from hand */
+		if (!spec_mil[i] && (need <= military ||
+		                     need - military <= hand - spec_hand[i]))
+			return 0;
+	}
+
+	/* Set is minimal */
+	return 1;
+}
+
+/*
+ * Helper function for "ai_choose_defend" below.
+ *
+ * Here we try different combinations of special abilities to defend
+ * against a takeover.
+ *
+ * Only the empty defense and minimal successful defenses are evaluated,
+ * since spending resources on a failed defense is never better than not
+ * defending at all.
  */
 static void ai_choose_defend_aux1(game *g, int who, int which, int opponent,
                                   int deficit, int list[], int num,
                                   int special[], int num_special,
+                                  int spec_mil[], int spec_hand[],
                                   int next, int chosen_special,
+                                  int military, int hand,
                                   int *best, int *best_special, double *b_s)
 {
+	int payment[MAX_DECK], used[MAX_DECK], n_used = 0;
+	int i, need, max, max_hand;
+	double score;
+
+	/* Compute maximum military still achievable */
+	max = military;
+	max_hand = hand;
+
+	/* Loop over remaining special cards */
+	for (i = next; i < num_special; i++)
+	{
+		/* Add contributions */
+		max += spec_mil[i];
+		max_hand += spec_hand[i];
+	}
+
+	/* Add hand cards usable for military */
+	if (max_hand > num) max_hand = num;
+	if (max_hand > 0) max += max_hand;
+
+	/* Check for no successful defense possible from here */
+	if (max <= deficit && chosen_special) return;
+
 	/* Check for no more special abilities to try */
-	if (next == num_special)
+	if (next == num_special || max <= deficit)
 	{
-		/* Try payment with different card combinations */
+		/* Check for no defense */
+		if (!chosen_special)
+		{
+			/* Use no cards from hand */
+			need = 0;
+		}
+		else
+		{
+			/* Compute amount of military needed from hand */
+			need = deficit + 1 - military;
+			if (need < 0) need = 0;
+
+			/* Check for too few cards to succeed */
+			if (need > hand || need > num) return;
+
+			/* Check for unneeded abilities */
+			if (!defend_minimal(g, special, num_special, spec_mil,
+			                    spec_hand, chosen_special,
+			                    military, hand, deficit + 1))
+				return;
+		}
+
+		/* Check for simulated game */
+		if (g->simulation)
+		{
+			/* Loop over chosen special cards */
+			for (i = 0; i < num_special; i++)
+			{
+				/* Check for bit set */
+				if (chosen_special & (1 << i))
+				{
+					/* Add card to list */
+					used[n_used++] = special[i];
+				}
+			}
+
+			/* Fill payment array with fake cards */
+			for (i = 0; i < need; i++) payment[i] = -1;
+
+			/* Get score for defense */
+			score = ai_choose_defend_try(g, who, which, opponent,
+			                             deficit, payment, need,
+			                             used, n_used);
+
+			/* Check for better */
+			if (score != -1 && score_better(score, *b_s))
+			{
+				/* Save best */
+				*b_s = score;
+				*best = (1 << need) - 1;
+				*best_special = chosen_special;
+			}
+
+			/* Done */
+			return;
+		}
+
+		/* Try different card combinations */
 		ai_choose_defend_aux2(g, who, which, opponent, deficit, list,
-		                      num, special, num_special, 0, 0,
+		                      special, num_special, num, need, 0,
 		                      chosen_special, best, best_special, b_s);
 
 		/* Done */
@@ -6423,15 +7380,18 @@ static void ai_choose_defend_aux1(game *g, int who, int which, int opponent,
 
 	/* Try without current ability */
 	ai_choose_defend_aux1(g, who, which, opponent, deficit, list, num,
-	                      special, num_special, next + 1, chosen_special,
+	                      special, num_special, spec_mil, spec_hand,
+	                      next + 1, chosen_special, military, hand,
 	                      best, best_special, b_s);
 
 	/* Try with current ability */
 	ai_choose_defend_aux1(g, who, which, opponent, deficit, list, num,
-	                      special, num_special, next + 1,
-	                      chosen_special | (1 << next), best, best_special,
-	                      b_s);
+	                      special, num_special, spec_mil, spec_hand,
+	                      next + 1, chosen_special | (1 << next),
+	                      military + spec_mil[next],
+	                      hand + spec_hand[next], best, best_special, b_s);
 }
+
 /*
  * Choose a method to defend against a takeover.
  */
@@ -6442,14 +7402,26 @@ static void ai_choose_defend(game *g, int who, int which, int opponent,
 	double b_s = -1;
 	int n = 0, n_used = 0;
 	int best = 0, best_special = 0, i;
+	int spec_mil[MAX_DECK], spec_hand[MAX_DECK];
 
 	/* XXX Don't look at more than 30 cards to pay with */
 	if (*num > 30) *num = 30;
 
+	/* Put identical cards next to each other */
+	if (!g->simulation) sort_payment(g, list, *num);
+
+	/* Loop over special cards */
+	for (i = 0; i < *num_special; i++)
+	{
+		/* Compute card's contribution to defense */
+		defend_contribution(g, special[i], &spec_mil[i], &spec_hand[i]);
+	}
+
 	/* Find best set of special abilities */
 	ai_choose_defend_aux1(g, who, which, opponent, deficit, list, *num,
-	                      special, *num_special, 0, 0, &best, &best_special,
-	                      &b_s);
+	                      special, *num_special, spec_mil, spec_hand, 0, 0,
+	                      0, -g->p[who].hand_military_spent, &best,
+	                      &best_special, &b_s);
 
 	if (b_s == -1)
 	{
@@ -6850,30 +7822,613 @@ static int score_consume(game *g, int who, int c_idx, int o_idx)
 	/* Check for consuming three goods */
 	if (o_ptr->code & P4_CONSUME_3_DIFF) goods = 3;
 
-	/* Check for consuming all goods */
-	if (o_ptr->code & P4_CONSUME_ALL) goods = 4;
+	/* Check for consuming all goods */
+	if (o_ptr->code & P4_CONSUME_ALL) goods = 4;
+
+	/* Check for "Consume x2" chosen */
+	if (player_chose(g, who, ACT_CONSUME_X2)) vp *= 2;
+
+	/* Compute score */
+	score = (vp * 110 + card * 50) / goods;
+
+	/* Use specific consume powers first */
+	if (!(o_ptr->code & P4_CONSUME_ANY)) score += 6 * o_ptr->times;
+
+	/* Use multi-use powers later */
+	if (o_ptr->times > 1) score -= 5 * o_ptr->times;
+
+	/* Return score */
+	return score;
+}
+
+/*
+ * Mask of consume good type flags.
+ */
+#define CONSUME_TYPE_MASK (P4_CONSUME_ANY | P4_CONSUME_NOVELTY | \
+                           P4_CONSUME_RARE | P4_CONSUME_GENE | P4_CONSUME_ALIEN)
+
+/*
+ * Mark consume powers that are never better than another available power.
+ */
+static void find_consume_skip(game *g, int cidx[], int oidx[], int num,
+                              int skip[])
+{
+	card *c_ptr, *b_ptr;
+	power *o_ptr, *n_ptr;
+	int code1, code2;
+	int type1, type2;
+	int cards1, cards2;
+	int i, j;
+
+	/* Clear skip array */
+	for (i = 0; i < num; i++) skip[i] = 0;
+
+	/* Loop over powers */
+	for (i = 0; i < num; i++)
+	{
+		/* Skip bonus power from prestige trade */
+		if (cidx[i] < 0) continue;
+
+		/* Get card pointer */
+		c_ptr = &g->deck[cidx[i]];
+
+		/* Get power pointer */
+		o_ptr = &c_ptr->d_ptr->powers[oidx[i]];
+
+		/* Do not compare unusual powers */
+		if (o_ptr->code & (P4_DISCARD_HAND | P4_ANTE_CARD |
+		                   P4_CONSUME_PRESTIGE | P4_CONSUME_ALL |
+		                   P4_CONSUME_3_DIFF | P4_CONSUME_N_DIFF))
+		{
+			/* Skip power */
+			continue;
+		}
+
+		/* Loop over other powers */
+		for (j = 0; j < num; j++)
+		{
+			/* Skip first power */
+			if (i == j) continue;
+
+			/* Ignore already skipped powers */
+			if (skip[j]) continue;
+
+			/* Skip bonus power from prestige trade */
+			if (cidx[j] < 0) continue;
+
+			/* Get card pointer */
+			b_ptr = &g->deck[cidx[j]];
+
+			/* Get power pointer */
+			n_ptr = &b_ptr->d_ptr->powers[oidx[j]];
+
+			/* Do not compare unusual powers */
+			if (n_ptr->code & (P4_DISCARD_HAND | P4_ANTE_CARD |
+			                   P4_CONSUME_PRESTIGE |
+			                   P4_CONSUME_ALL | P4_CONSUME_3_DIFF |
+			                   P4_CONSUME_N_DIFF))
+			{
+				/* Skip power */
+				continue;
+			}
+
+			/* Get power codes */
+			code1 = o_ptr->code;
+			code2 = n_ptr->code;
+
+			/* Check for identical powers */
+			if (code1 == code2 &&
+			    o_ptr->value == n_ptr->value &&
+			    o_ptr->times == n_ptr->times)
+			{
+				/* Skip power */
+				skip[i] = 1;
+				break;
+			}
+
+			/* Check for better trade power */
+			if ((code1 & P4_TRADE_ACTION) &&
+			    (code2 & P4_TRADE_ACTION) &&
+			    (code1 & P4_TRADE_NO_BONUS))
+			{
+				/* Skip power */
+				skip[i] = 1;
+				break;
+			}
+
+			/* Stop looking at trade actions */
+			if (code1 & P4_TRADE_ACTION) continue;
+			if (code2 & P4_TRADE_ACTION) continue;
+
+			/* Check for more reward */
+			if (code1 == code2 &&
+			    o_ptr->times == n_ptr->times &&
+			    o_ptr->value < n_ptr->value)
+			{
+				/* Skip power */
+				skip[i] = 1;
+				break;
+			}
+
+			/* Check for identical reward but more times */
+			if (code1 == code2 &&
+			    o_ptr->value == n_ptr->value &&
+			    o_ptr->times > n_ptr->times)
+			{
+				/* Skip power */
+				skip[i] = 1;
+				break;
+			}
+
+			/* Stop looking if times and value not identical */
+			if (o_ptr->times != n_ptr->times ||
+			    o_ptr->value != n_ptr->value) continue;
+
+			/* Get consume types */
+			type1 = code1 & CONSUME_TYPE_MASK;
+			type2 = code2 & CONSUME_TYPE_MASK;
+
+			/* Strip out consume types */
+			code1 &= ~CONSUME_TYPE_MASK;
+			code2 &= ~CONSUME_TYPE_MASK;
+
+			/* Assume no cards rewards */
+			cards1 = cards2 = 0;
+
+			/* Check for 1 card reward */
+			if (code1 & P4_GET_CARD) cards1 = 1;
+			if (code2 & P4_GET_CARD) cards2 = 1;
+
+			/* Check for 2 card reward */
+			if (code1 & P4_GET_2_CARD) cards1 = 2;
+			if (code2 & P4_GET_2_CARD) cards2 = 2;
+
+			/* Check for 3 card reward */
+			if (code1 & P4_GET_3_CARD) cards1 = 3;
+			if (code2 & P4_GET_3_CARD) cards2 = 3;
+
+			/* Strip card rewards from codes */
+			code1 &= ~(P4_GET_CARD | P4_GET_2_CARD | P4_GET_3_CARD);
+			code2 &= ~(P4_GET_CARD | P4_GET_2_CARD | P4_GET_3_CARD);
+
+			/* Check for better card reward */
+			if (code1 == code2 &&
+			    type1 == type2 &&
+			    cards1 < cards2)
+			{
+				/* Skip power */
+				skip[i] = 1;
+				break;
+			}
+
+			/* Check for better reward */
+			if ((type1 == type2) &&
+			    (cards1 == cards2) &&
+			    ((code2 == (code1 | P4_GET_VP)) ||
+			     (code2 == (code1 | P4_GET_PRESTIGE))))
+			{
+				/* Skip power */
+				skip[i] = 1;
+				break;
+			}
+		}
+	}
+}
+
+/*
+ * Maximum number of states searched when planning the order of consume or
+ * produce powers.
+ */
+#define PLAN_MAX_NODES 2000
+
+/*
+ * Size of consume/produce plan transposition table.
+ */
+#define PLAN_HASH_SIZE 4096
+
+/*
+ * Entry in the consume/produce plan transposition table.
+ */
+typedef struct plan_entry
+{
+	/* Hash value of state */
+	uint64_t key;
+
+	/* Plan generation this entry belongs to */
+	int gen;
+
+	/* Best score reachable from this state */
+	double score;
+
+	/* Use no more powers */
+	int stop;
+
+	/* Power to use */
+	int c_idx, o_idx;
+
+} plan_entry;
+
+/*
+ * Transposition table of planned consume/produce states.
+ */
+static ai_local plan_entry plan_hash[PLAN_HASH_SIZE];
+
+/*
+ * Current plan generation.
+ */
+static ai_local int plan_gen;
+
+/*
+ * Player, game, round and phase the current plan was made for.
+ */
+static ai_local int plan_who = -1, plan_round, plan_action;
+static ai_local unsigned int plan_seed;
+
+/*
+ * Planning was abandoned for the current phase.
+ */
+static ai_local int plan_failed;
+
+/*
+ * Number of states searched by current plan.
+ */
+static ai_local int plan_nodes;
+
+/*
+ * Simulated game whose next power choice is being captured.
+ */
+static ai_local game *plan_probe;
+
+/*
+ * Captured game state and power choices.
+ */
+static ai_local game plan_snap;
+static ai_local int plan_captured, plan_num, plan_optional;
+static ai_local int plan_cidx[MAX_DECK], plan_oidx[MAX_DECK];
+
+/*
+ * Compute a key for a player's consume/produce state.
+ *
+ * Only information that changes as powers are used is included, so that
+ * states reached by different power orders are recognized as the same.
+ */
+static uint64_t plan_key(game *g, int who)
+{
+	player *p_ptr;
+	card *c_ptr;
+	unsigned char value[1024];
+	int len = 0;
+	int x;
+
+	/* Get player pointer */
+	p_ptr = &g->p[who];
+
+	/* Start at first active card */
+	x = p_ptr->head[WHERE_ACTIVE];
+
+	/* Loop over active cards */
+	for ( ; x != -1; x = g->deck[x].next)
+	{
+		/* Get card pointer */
+		c_ptr = &g->deck[x];
+
+		/* Add card index, goods and used powers to value */
+		value[len++] = (unsigned char)x;
+		value[len++] = (unsigned char)c_ptr->num_goods;
+		value[len++] = (unsigned char)((c_ptr->misc & MISC_USED_MASK) >>
+		                               MISC_USED_SHIFT);
+	}
+
+	/* Add hand size to value */
+	value[len++] = (unsigned char)(count_player_area(g, who, WHERE_HAND) +
+	                               p_ptr->fake_hand - p_ptr->fake_discards);
+
+	/* Add player's rewards to value */
+	value[len++] = (unsigned char)p_ptr->vp;
+	value[len++] = (unsigned char)p_ptr->prestige;
+	value[len++] = (unsigned char)p_ptr->phase_bonus_used;
+
+	/* Add VP pool to value */
+	value[len++] = (unsigned char)g->vp_pool;
+
+	/* Add player and phase to value */
+	value[len++] = (unsigned char)who;
+	value[len++] = (unsigned char)g->cur_action;
+
+	/* Return key for value */
+	return gen_hash(value, len);
+}
+
+/*
+ * Capture a consume or produce power choice from the probed game.
+ *
+ * Returns 1 if the choice was captured.
+ */
+static int plan_capture(game *g, int cidx[], int oidx[], int num,
+                        int optional)
+{
+	/* Check for game not being probed */
+	if (g != plan_probe || plan_captured) return 0;
+
+	/* Save game state before choice */
+	memcpy(&plan_snap, g, sizeof(game));
+
+	/* Save choices */
+	memcpy(plan_cidx, cidx, sizeof(int) * num);
+	memcpy(plan_oidx, oidx, sizeof(int) * num);
+	plan_num = num;
+	plan_optional = optional;
+
+	/* Mark choice as captured */
+	plan_captured = 1;
+
+	/* Captured */
+	return 1;
+}
+
+/*
+ * Use powers until the player must choose which power to use next.
+ *
+ * Returns 1 and sets the game to the state before the choice if one is
+ * needed, or 0 if no more powers can be used.
+ */
+static int plan_advance(game *g, int who, int produce)
+{
+	/* Probe this game */
+	plan_probe = g;
+	plan_captured = 0;
+
+	/* Use powers until a choice is captured */
+	while (!plan_captured && !g->game_over)
+	{
+		/* Use next power */
+		if (produce ? !produce_action(g, who) : !consume_action(g, who))
+			break;
+	}
+
+	/* Stop probing */
+	plan_probe = NULL;
+
+	/* Check for no choice needed */
+	if (!plan_captured) return 0;
+
+	/* Restore state before choice */
+	memcpy(g, &plan_snap, sizeof(game));
+
+	/* Choice needed */
+	return 1;
+}
+
+/*
+ * Search orders of consume or produce powers, starting with the given
+ * choices.
+ *
+ * States are stored in the plan transposition table, so that states
+ * reached by different orders are only searched once.
+ */
+static double plan_search(game *g, int who, int produce, int cidx[],
+                          int oidx[], int num, int optional)
+{
+	game sim;
+	card *c_ptr;
+	power *o_ptr;
+	plan_entry *e_ptr;
+	uint64_t key;
+	int next_cidx[MAX_DECK], next_oidx[MAX_DECK], next_num, next_optional;
+	int skip[MAX_DECK], later[MAX_DECK], any_now = 0;
+	int i, b_i = -1;
+	double score, b_s = -1;
+
+	/* Get key for state */
+	key = plan_key(g, who);
+
+	/* Get table entry */
+	e_ptr = &plan_hash[key % PLAN_HASH_SIZE];
+
+	/* Check for state already searched */
+	if (e_ptr->gen == plan_gen && e_ptr->key == key) return e_ptr->score;
+
+	/* Check for too many states searched */
+	if (++plan_nodes > PLAN_MAX_NODES) return -1;
+
+	/* Check for optional choice */
+	if (optional)
+	{
+		/* Simulate game */
+		simulate_game(&sim, g, who);
+
+		/* Simulate rest of turn without using more powers */
+		complete_turn(&sim, COMPLETE_ROUND);
+
+		/* Get score for using no more powers */
+		b_s = eval_game(&sim, who);
+	}
+
+	/* Clear skip array */
+	for (i = 0; i < num; i++) skip[i] = 0;
+
+	/* Find consume powers that are never better than another */
+	if (!produce) find_consume_skip(g, cidx, oidx, num, skip);
+
+	/* Loop over choices */
+	for (i = 0; i < num; i++)
+	{
+		/* Assume power can be used now */
+		later[i] = 0;
+
+		/* Skip bonus powers and produce powers */
+		if (cidx[i] < 0 || produce) continue;
+
+		/* Get card pointer */
+		c_ptr = &g->deck[cidx[i]];
+
+		/* Get power pointer */
+		o_ptr = &c_ptr->d_ptr->powers[oidx[i]];
+
+		/* Save optional powers for last */
+		if (o_ptr->code & (P4_DISCARD_HAND | P4_CONSUME_PRESTIGE))
+			later[i] = 1;
+		else if (!skip[i])
+			any_now = 1;
+	}
+
+	/* Loop over choices */
+	for (i = 0; i < num; i++)
+	{
+		/* Skip dominated powers */
+		if (skip[i]) continue;
+
+		/* Skip optional powers if others are available */
+		if (later[i] && any_now) continue;
+
+		/* Simulate game */
+		simulate_game(&sim, g, who);
+
+		/* Use power */
+		if (produce) produce_chosen(&sim, who, cidx[i], oidx[i]);
+		else consume_chosen(&sim, who, cidx[i], oidx[i]);
+
+		/* Check for another choice needed */
+		if (plan_advance(&sim, who, produce))
+		{
+			/* Copy captured choices */
+			next_num = plan_num;
+			next_optional = plan_optional;
+			memcpy(next_cidx, plan_cidx, sizeof(int) * next_num);
+			memcpy(next_oidx, plan_oidx, sizeof(int) * next_num);
+
+			/* Search from next choice */
+			score = plan_search(&sim, who, produce, next_cidx,
+			                    next_oidx, next_num, next_optional);
+
+			/* Check for abandoned search */
+			if (plan_nodes > PLAN_MAX_NODES) return -1;
+		}
+		else
+		{
+			/* Simulate rest of turn */
+			complete_turn(&sim, COMPLETE_ROUND);
+
+			/* Evaluate end state */
+			score = eval_game(&sim, who);
+		}
+
+		/* Check for better */
+		if (score_better(score, b_s))
+		{
+			/* Track best */
+			b_s = score;
+			b_i = i;
+		}
+	}
+
+	/* Save result in table */
+	e_ptr->key = key;
+	e_ptr->gen = plan_gen;
+	e_ptr->score = b_s;
+	e_ptr->stop = b_i == -1;
+	e_ptr->c_idx = b_i == -1 ? -1 : cidx[b_i];
+	e_ptr->o_idx = b_i == -1 ? -1 : oidx[b_i];
+
+	/* Return best score */
+	return b_s;
+}
+
+/*
+ * Choose a consume or produce power using a plan for the whole phase.
+ *
+ * The plan is made at the first choice of the phase, and later choices
+ * are looked up in the plan as long as the game follows it.
+ *
+ * Returns 0 if no plan is available.
+ */
+static int plan_choose(game *g, int who, int produce, int cidx[], int oidx[],
+                       int *num, int optional)
+{
+	game sim;
+	plan_entry *e_ptr;
+	uint64_t key;
+	int i;
+
+	/* Check for plan made for a different phase */
+	if (plan_who != who || plan_round != g->round ||
+	    plan_action != g->cur_action || plan_seed != g->start_seed)
+	{
+		/* Remember phase of plan */
+		plan_who = who;
+		plan_round = g->round;
+		plan_action = g->cur_action;
+		plan_seed = g->start_seed;
+
+		/* Forget old plan */
+		plan_gen++;
+		plan_failed = 0;
+	}
+
+	/* Check for planning already abandoned this phase */
+	if (plan_failed) return 0;
+
+	/* Get key for current state */
+	key = plan_key(g, who);
+
+	/* Get table entry */
+	e_ptr = &plan_hash[key % PLAN_HASH_SIZE];
+
+	/* Check for state not covered by plan */
+	if (e_ptr->gen != plan_gen || e_ptr->key != key)
+	{
+		/* Forget old plan */
+		plan_gen++;
+
+		/* Clear number of states searched */
+		plan_nodes = 0;
+
+		/* Simulate game */
+		simulate_game(&sim, g, who);
+
+		/* Search power orders */
+		plan_search(&sim, who, produce, cidx, oidx, *num, optional);
 
-	/* Check for "Consume x2" chosen */
-	if (player_chose(g, who, ACT_CONSUME_X2)) vp *= 2;
+		/* Check for abandoned search */
+		if (plan_nodes > PLAN_MAX_NODES)
+		{
+			/* Forget partial plan */
+			plan_gen++;
 
-	/* Compute score */
-	score = (vp * 110 + card * 50) / goods;
+			/* Do not try again this phase */
+			plan_failed = 1;
+			return 0;
+		}
+	}
 
-	/* Use specific consume powers first */
-	if (!(o_ptr->code & P4_CONSUME_ANY)) score += 6 * o_ptr->times;
+	/* Check for no more powers */
+	if (e_ptr->stop)
+	{
+		/* Check for mandatory power */
+		if (!optional) return 0;
 
-	/* Use multi-use powers later */
-	if (o_ptr->times > 1) score -= 5 * o_ptr->times;
+		/* Select nothing */
+		*num = 0;
+		return 1;
+	}
 
-	/* Return score */
-	return score;
-}
+	/* Loop over choices */
+	for (i = 0; i < *num; i++)
+	{
+		/* Check for planned power */
+		if (cidx[i] == e_ptr->c_idx && oidx[i] == e_ptr->o_idx)
+		{
+			/* Select power */
+			cidx[0] = cidx[i];
+			oidx[0] = oidx[i];
+			*num = 1;
+			return 1;
+		}
+	}
 
-/*
- * Mask of consume good type flags.
- */
-#define CONSUME_TYPE_MASK (P4_CONSUME_ANY | P4_CONSUME_NOVELTY | \
-                           P4_CONSUME_RARE | P4_CONSUME_GENE | P4_CONSUME_ALIEN)
+	/* Planned power not available */
+	return 0;
+}
 
 /*
  * Choose consume power to use.
@@ -6882,12 +8437,9 @@ static void ai_choose_consume(game *g, int who, int cidx[], int oidx[],
                               int *num, int optional)
 {
 	game sim;
-	card *c_ptr, *b_ptr;
-	power *o_ptr, *n_ptr;
-	int code1, code2;
-	int type1, type2;
-	int cards1, cards2;
-	int i, j, best = -1, skip[100];
+	card *c_ptr;
+	power *o_ptr;
+	int i, best = -1, skip[100];
 	double score, b_s = -1;
 
 	/* Check for simple powers */
@@ -6916,6 +8468,14 @@ static void ai_choose_consume(game *g, int who, int cidx[], int oidx[],
 		}
 	}
 
+	/* Check for choice being captured by planner */
+	if (plan_capture(g, cidx, oidx, *num, optional))
+	{
+		/* Use no power if possible, otherwise the first */
+		*num = optional ? 0 : 1;
+		return;
+	}
+
 	/* Check for simulated opponent's turn */
 	if (g->simulation && who != g->sim_who)
 	{
@@ -6945,158 +8505,14 @@ static void ai_choose_consume(game *g, int who, int cidx[], int oidx[],
 	/* Clear skip array */
 	for (i = 0; i < *num; i++) skip[i] = 0;
 
-	/* Loop over powers */
-	for (i = 0; i < *num; i++)
+	/* Do not check for skippable powers in simulated games */
+	if (!g->simulation)
 	{
-		/* Do not check for skippable powers in simulated games */
-		if (g->simulation) break;
-
-		/* Skip bonus power from prestige trade */
-		if (cidx[i] < 0) continue;
-
-		/* Get card pointer */
-		c_ptr = &g->deck[cidx[i]];
-
-		/* Get power pointer */
-		o_ptr = &c_ptr->d_ptr->powers[oidx[i]];
-
-		/* Do not compare unusual powers */
-		if (o_ptr->code & (P4_DISCARD_HAND | P4_ANTE_CARD |
-		                   P4_CONSUME_PRESTIGE | P4_CONSUME_ALL |
-		                   P4_CONSUME_3_DIFF | P4_CONSUME_N_DIFF))
-		{
-			/* Skip power */
-			continue;
-		}
-
-		/* Loop over other powers */
-		for (j = 0; j < *num; j++)
-		{
-			/* Skip first power */
-			if (i == j) continue;
-
-			/* Ignore already skipped powers */
-			if (skip[j]) continue;
-
-			/* Skip bonus power from prestige trade */
-			if (cidx[j] < 0) continue;
-
-			/* Get card pointer */
-			b_ptr = &g->deck[cidx[j]];
-
-			/* Get power pointer */
-			n_ptr = &b_ptr->d_ptr->powers[oidx[j]];
-
-			/* Do not compare unusual powers */
-			if (n_ptr->code & (P4_DISCARD_HAND | P4_ANTE_CARD |
-			                   P4_CONSUME_PRESTIGE |
-			                   P4_CONSUME_ALL | P4_CONSUME_3_DIFF |
-			                   P4_CONSUME_N_DIFF))
-			{
-				/* Skip power */
-				continue;
-			}
-
-			/* Get power codes */
-			code1 = o_ptr->code;
-			code2 = n_ptr->code;
-
-			/* Check for identical powers */
-			if (code1 == code2 &&
-			    o_ptr->value == n_ptr->value &&
-			    o_ptr->times == n_ptr->times)
-			{
-				/* Skip power */
-				skip[i] = 1;
-				break;
-			}
-
-			/* Check for better trade power */
-			if ((code1 & P4_TRADE_ACTION) &&
-			    (code2 & P4_TRADE_ACTION) &&
-			    (code1 & P4_TRADE_NO_BONUS))
-			{
-				/* Skip power */
-				skip[i] = 1;
-				break;
-			}
-
-			/* Stop looking at trade actions */
-			if (code1 & P4_TRADE_ACTION) continue;
-			if (code2 & P4_TRADE_ACTION) continue;
-
-			/* Check for more reward */
-			if (code1 == code2 &&
-			    o_ptr->times == n_ptr->times &&
-			    o_ptr->value < n_ptr->value)
-			{
-				/* Skip power */
-				skip[i] = 1;
-				break;
-			}
-
-			/* Check for identical reward but more times */
-			if (code1 == code2 &&
-			    o_ptr->value == n_ptr->value &&
-			    o_ptr->times > n_ptr->times)
-			{
-				/* Skip power */
-				skip[i] = 1;
-				break;
-			}
-
-			/* Stop looking if times and value not identical */
-			if (o_ptr->times != n_ptr->times ||
-			    o_ptr->value != n_ptr->value) continue;
-
-			/* Get consume types */
-			type1 = code1 & CONSUME_TYPE_MASK;
-			type2 = code2 & CONSUME_TYPE_MASK;
-
-			/* Strip out consume types */
-			code1 &= ~CONSUME_TYPE_MASK;
-			code2 &= ~CONSUME_TYPE_MASK;
-
-			/* Assume no cards rewards */
-			cards1 = cards2 = 0;
-
-			/* Check for 1 card reward */
-			if (code1 & P4_GET_CARD) cards1 = 1;
-			if (code2 & P4_GET_CARD) cards2 = 1;
-
-			/* Check for 2 card reward */
-			if (code1 & P4_GET_2_CARD) cards1 = 2;
-			if (code2 & P4_GET_2_CARD) cards2 = 2;
-
-			/* Check for 3 card reward */
-			if (code1 & P4_GET_3_CARD) cards1 = 3;
-			if (code2 & P4_GET_3_CARD) cards2 = 3;
-
-			/* Strip card rewards from codes */
-			code1 &= ~(P4_GET_CARD | P4_GET_2_CARD | P4_GET_3_CARD);
-			code2 &= ~(P4_GET_CARD | P4_GET_2_CARD | P4_GET_3_CARD);
-
-			/* Check for better card reward */
-			if (code1 == code2 &&
-			    type1 == type2 &&
-			    cards1 < cards2)
-			{
-				/* Skip power */
-				skip[i] = 1;
-				break;
-			}
+		/* Check for power chosen by plan */
+		if (plan_choose(g, who, 0, cidx, oidx, num, optional)) return;
 
-			/* Check for better reward */
-			if ((type1 == type2) &&
-			    (cards1 == cards2) &&
-			    ((code2 == (code1 | P4_GET_VP)) ||
-			     (code2 == (code1 | P4_GET_PRESTIGE))))
-			{
-				/* Skip power */
-				skip[i] = 1;
-				break;
-			}
-		}
+		/* Find powers that are never better than another */
+		find_consume_skip(g, cidx, oidx, *num, skip);
 	}
 
 	/* Loop over choices */
@@ -7870,6 +9286,13 @@ static void ai_choose_produce(game *g, int who, int cidx[], int oidx[], int num)
 		}
 	}
 
+	/* Check for choice being captured by planner */
+	if (plan_capture(g, cidx, oidx, num, 0)) return;
+
+	/* Check for power chosen by plan in real game */
+	if (!g->simulation && plan_choose(g, who, 1, cidx, oidx, &num, 0))
+		return;
+
 	/* Loop over choices */
 	for (i = 0; i < num; i++)
 	{
@@ -8203,9 +9626,22 @@ static void ai_make_choice(game *g, int who, int type, int list[], int *nl,
 	int i, rv;
 	int *l_ptr;
 
+	/* Use networks of player's tier */
+	select_tier(g, who);
+
 	/* Check for real game */
 	if (!g->simulation)
 	{
+		/* Check for change in final round status */
+		if (endgame != (ai_exact_endgame && game_ends_this_round(g)))
+		{
+			/* Switch search mode */
+			endgame = !endgame;
+
+			/* Forget cached scores from other mode */
+			clear_eval_cache();
+		}
+
 		/* Prepare quick discard list */
 		ai_prepare_discard(g, who);
 
@@ -8483,6 +9919,9 @@ static void ai_game_over(game *g, int who)
 	int scores[MAX_PLAYER];
 	int max = 0, i, n;
 
+	/* Use networks of player's tier */
+	select_tier(g, who);
+
 #if 0
 	if (who == 0)
 	{
@@ -8547,6 +9986,27 @@ static void ai_game_over(game *g, int who)
 	/* Perform final training */
 	perform_training(g, who, result);
 
+	/* Check for experience log */
+	if (ai_experience)
+	{
+		/* Loop over stored input sets (oldest first) */
+		for (i = eval.num_past - 1; i >= 0; i--)
+		{
+			/* Skip input sets that do not belong to us */
+			if (past_player(&eval, i) != who) continue;
+
+			/* Copy past inputs to network */
+			load_past(&eval, i);
+
+			/* Log inputs with final result */
+			write_experience(ai_experience, &eval, eval.input_value,
+			                 who, result);
+		}
+	}
+
+	/* Forget opponent placement results from this game */
+	clear_opp_place_cache();
+
 	/* Check for training done for all players */
 	if (who == g->num_players - 1)
 	{
@@ -8560,6 +10020,65 @@ static void ai_game_over(game *g, int who)
 	}
 }
 
+/*
+ * Return the AI work counters of the calling thread.
+ */
+void ai_get_stats(ai_stats *s)
+{
+	/* Copy counters */
+	*s = stats;
+}
+
+/*
+ * Clear the AI work counters of the calling thread.
+ */
+void ai_clear_stats(void)
+{
+	/* Clear counters */
+	memset(&stats, 0, sizeof(ai_stats));
+}
+
+/*
+ * Exchange the networks used by the AI in the calling thread with others
+ * with the same inputs and outputs.
+ *
+ * Calling this again with the same arguments switches back.  Cached
+ * results of the old networks are forgotten.
+ */
+void ai_swap_nets(net *e, net *r)
+{
+	net tmp;
+
+	/* Swap evaluator networks */
+	tmp = eval;
+	eval = *e;
+	*e = tmp;
+
+	/* Swap role predictor networks */
+	tmp = role;
+	role = *r;
+	*r = tmp;
+
+	/* Forget results of old networks */
+	clear_eval_cache();
+	clear_opp_place_cache();
+}
+
+/*
+ * Return the networks used by the AI in the calling thread.
+ *
+ * The parallel learner uses this to exchange weights between its game
+ * threads and the trainer.
+ */
+void ai_get_nets(net **e, net **r)
+{
+	/* Return evaluator network */
+	*e = &eval;
+
+	/* Return role predictor network */
+	*r = &role;
+}
+
 /*
  * Shutdown.
  */
@@ -8571,6 +10090,9 @@ static void ai_shutdown(game *g, int who)
 	/* Check for already saved */
 	if (saved) return;
 
+	/* Save normal networks */
+	use_tier(0);
+
 	/* Create evaluator filename */
 	sprintf(fname, RFTGDIR "/network/rftg.eval.%d.%d%s.net", g->expanded,
 	        g->num_players, g->advanced ? "a" : "");
@@ -8586,7 +10108,11 @@ static void ai_shutdown(game *g, int who)
 	save_net(&role, fname);
 
 	printf("Role hit: %d, Role miss: %d\n", role_hit, role_miss);
-	printf("Role avg: %f\n", role_avg / (role_hit + role_miss));
+	printf("Role avg: %f\n",
+	       role_avg / 1000000.0 / (role_hit + role_miss));
+	printf("Opp place hit: %d, Opp place miss: %d, Opp place evict: %d\n",
+	       opp_place_hit, opp_place_miss, opp_place_evict);
+	printf("Exact endgame evals: %d\n", exact_evals);
 	printf("Role error: %f\n", role.error / role.num_error);
 	printf("Eval error: %f\n", eval.error / eval.num_error);
 
@@ -8610,6 +10136,22 @@ decisions ai_func =
 	NULL,
 };
 
+/*
+ * Set of AI functions for players of the fast tier.
+ */
+decisions ai_fast_func =
+{
+	ai_fast_initialize,
+	ai_notify_rotation,
+	NULL,
+	ai_make_choice,
+	NULL,
+	ai_explore_sample,
+	ai_game_over,
+	ai_shutdown,
+	NULL,
+};
+
 /*
  * Provide debugging information.
  */
@@ -33,6 +33,11 @@ static game real_game;
  */
 static int player_us;
 
+/*
+ * AI functions to use (normal or fast tier).
+ */
+static decisions *ai_control = &ai_func;
+
 /*
  * Our incoming message buffer
  */
@@ -106,7 +111,7 @@ static void handle_status_meta(char *ptr, int size)
 	init_game(&real_game);
 
 	/* Load AI neural networks for this game */
-	ai_func.init(&real_game, 0, 0);
+	ai_control->init(&real_game, 0, 0);
 
 	/* Loop over goals */
 	for (i = 0; i < MAX_GOAL; i++)
@@ -439,9 +444,12 @@ format_error:
 		exit(1);
 	}
 
+	/* Let AI know which functions control us */
+	real_game.p[player_us].control = ai_control;
+
 	/* Ask AI for decision */
-	ai_func.make_choice(&real_game, player_us, type, list, &num,
-	                    special, &num_special, arg1, arg2, arg3);
+	ai_control->make_choice(&real_game, player_us, type, list, &num,
+	                        special, &num_special, arg1, arg2, arg3);
 
 	/* Start reply */
 	ptr = msg;
@@ -708,6 +716,17 @@ int main(int argc, char *argv[])
 		exit(1);
 	}
 
+	/* Parse arguments */
+	for (i = 1; i < argc; i++)
+	{
+		/* Check for fast AI tier */
+		if (!strcmp(argv[i], "-fast"))
+		{
+			/* Use fast AI functions */
+			ai_control = &ai_fast_func;
+		}
+	}
+
 	/* Create choice logs */
 	for (i = 0; i < MAX_PLAYER; i++)
 	{
@@ -0,0 +1,836 @@
+/*
+ * Race for the Galaxy AI
+ *
+ * Copyright (C) 2009-2015 Keldon Jones
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * Tournament between network weight sets.
+ *
+ * Plays seeded AI games where each seat uses the networks from one of
+ * several directories, rotating seats between games, and reports the
+ * strength and cost of each set.
+ */
+
+#include "rftg.h"
+#include "net.h"
+#include <pthread.h>
+
+/*
+ * Maximum number of weight sets.
+ */
+#define MAX_SETS 8
+
+/*
+ * Stack size of game threads.
+ */
+#define WORKER_STACK (32 * 1024 * 1024)
+
+/*
+ * Print messages?
+ */
+int verbose = 0;
+
+/*
+ * Game options.
+ */
+static int num_players = 2;
+static int expanded, advanced, promo;
+
+/*
+ * Number of games and threads.
+ */
+static int num_games = 100, num_threads = 1;
+
+/*
+ * Random seed of first deal.
+ */
+static unsigned int base_seed;
+
+/*
+ * Weight set names, directories, and whether each set uses the fast tier
+ * files.
+ */
+static char *set_name[MAX_SETS], *set_dir[MAX_SETS];
+static int set_fast[MAX_SETS];
+static int num_sets;
+
+/*
+ * Results of one weight set.
+ */
+typedef struct set_stats
+{
+	/* Seats played */
+	int seats;
+
+	/* Games won (shared wins count partially) */
+	double wins;
+
+	/* Sum of VP margins over best opponent */
+	double margin;
+
+	/* Decisions made */
+	long decisions;
+
+	/* CPU time spent making decisions (seconds) */
+	double cpu;
+
+	/* Games against the first set */
+	int pair_games;
+
+	/* Sum of (and of squares of) per-game scores against the first set */
+	double pair_score, pair_square;
+
+} set_stats;
+
+/*
+ * Results of all weight sets.
+ */
+static set_stats stats[MAX_SETS];
+
+/*
+ * Next game to play.
+ */
+static int next_game;
+
+/*
+ * Lock protecting results and next game.
+ */
+static pthread_mutex_t arena_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * A thread playing arena games.
+ */
+typedef struct arena_thread
+{
+	/* Thread identifier */
+	pthread_t thread;
+
+	/* Game being played */
+	game g;
+
+	/* Networks of each weight set */
+	net eval[MAX_SETS], role[MAX_SETS];
+
+	/* Weight set currently used by the AI (-1 for its own) */
+	int cur;
+
+	/* Weight set of each seat */
+	int seat_set[MAX_PLAYER];
+
+	/* Decisions and CPU time of current game per set */
+	long decisions[MAX_SETS];
+	double cpu[MAX_SETS];
+
+} arena_thread;
+
+/*
+ * Thread state of the calling thread.
+ */
+static __thread arena_thread *self;
+
+/*
+ * Print errors to standard output.
+ */
+void display_error(char *msg)
+{
+	/* Forward message */
+	printf("%s", msg);
+}
+
+/*
+ * Print messages to standard output.
+ */
+void message_add(game *g, char *msg)
+{
+	/* Print if verbose flag set */
+	if (verbose) printf("%s", msg);
+}
+
+/*
+ * Print messages to standard output.
+ */
+void message_add_formatted(game *g, char *msg, char *tag)
+{
+	/* Print without formatting */
+	message_add(g, msg);
+}
+
+/*
+ * Use simple random number generator.
+ */
+int game_rand(game *g)
+{
+	/* Call simple random number generator */
+	return simple_rand(&g->random_seed);
+}
+
+/*
+ * Return CPU time used by the calling thread, in seconds.
+ */
+static double thread_cpu(void)
+{
+	struct timespec ts;
+
+	/* Get thread time */
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+
+	/* Convert to seconds */
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * Make the AI use the networks of a weight set.
+ */
+static void use_set(int s)
+{
+	/* Check for set already in use */
+	if (self->cur == s) return;
+
+	/* Give back networks of old set */
+	if (self->cur >= 0)
+		ai_swap_nets(&self->eval[self->cur], &self->role[self->cur]);
+
+	/* Use networks of new set */
+	if (s >= 0) ai_swap_nets(&self->eval[s], &self->role[s]);
+
+	/* Remember set */
+	self->cur = s;
+}
+
+/*
+ * Keep weight sets with their players when the game rotates them.
+ */
+static void arena_notify_rotation(game *g, int who)
+{
+	int i, first;
+
+	/* Rotate sets once per rotation */
+	if (who == 0)
+	{
+		/* Remember set of old first player */
+		first = self->seat_set[0];
+
+		/* Move sets one space */
+		for (i = 0; i < g->num_players - 1; i++)
+		{
+			/* Copy set */
+			self->seat_set[i] = self->seat_set[i + 1];
+		}
+
+		/* Old first player is now last */
+		self->seat_set[i] = first;
+	}
+
+	/* Call AI function */
+	ai_func.notify_rotation(g, who);
+}
+
+/*
+ * Make a choice with the networks of the player's weight set.
+ */
+static void arena_make_choice(game *g, int who, int type, int list[],
+                              int *nl, int special[], int *ns, int arg1,
+                              int arg2, int arg3)
+{
+	int s = self->seat_set[who];
+	double start;
+
+	/* Use player's networks */
+	use_set(s);
+
+	/* Remember start time */
+	start = thread_cpu();
+
+	/* Let AI choose */
+	ai_func.make_choice(g, who, type, list, nl, special, ns, arg1, arg2,
+	                    arg3);
+
+	/* Count decision and time */
+	self->decisions[s]++;
+	self->cpu[s] += thread_cpu() - start;
+}
+
+/*
+ * Take explore samples with the networks of the player's weight set.
+ */
+static void arena_explore_sample(game *g, int who, int draw, int keep,
+                                 int discard_any)
+{
+	/* Use player's networks */
+	use_set(self->seat_set[who]);
+
+	/* Let AI handle samples */
+	ai_func.explore_sample(g, who, draw, keep, discard_any);
+}
+
+/*
+ * Tell the AI of the player's weight set that the game is over.
+ */
+static void arena_game_over(game *g, int who)
+{
+	/* Use player's networks */
+	use_set(self->seat_set[who]);
+
+	/* Call AI function */
+	ai_func.game_over(g, who);
+}
+
+/*
+ * Arena players never save anything.
+ */
+static void arena_shutdown(game *g, int who)
+{
+}
+
+/*
+ * Decision functions of arena players.
+ */
+static decisions arena_func =
+{
+	NULL,
+	arena_notify_rotation,
+	NULL,
+	arena_make_choice,
+	NULL,
+	arena_explore_sample,
+	arena_game_over,
+	arena_shutdown,
+	NULL,
+};
+
+/*
+ * Load one network of a weight set, sized by its weights file.
+ *
+ * The inputs and outputs are the same as those of the AI's own network.
+ */
+static void load_set_net(net *learn, net *ai, char *kind, int s)
+{
+	char fname[1024];
+	int input, hidden, output, i;
+
+	/* Create filename */
+	sprintf(fname, "%s/rftg.%s.%d.%d%s%s.net", set_dir[s], kind, expanded,
+	        num_players, advanced ? "a" : "", set_fast[s] ? ".fast" : "");
+
+	/* Read network size */
+	if (read_net_size(fname, &input, &hidden, &output) ||
+	    input != ai->num_inputs || output != ai->num_output)
+	{
+		/* Error */
+		fprintf(stderr, "Couldn't load %s\n", fname);
+		exit(1);
+	}
+
+	/* Create network */
+	make_learner(learn, input, hidden, 0, output);
+
+	/* Copy input names, so that loading checks them */
+	for (i = 0; i < input; i++)
+	{
+		/* Copy name */
+		if (ai->input_name[i])
+			learn->input_name[i] = strdup(ai->input_name[i]);
+	}
+
+	/* Load weights */
+	if (load_net(learn, fname))
+	{
+		/* Error */
+		fprintf(stderr, "Couldn't load %s\n", fname);
+		exit(1);
+	}
+
+	/* Never train */
+	learn->alpha = 0.0;
+}
+
+/*
+ * Load the networks of each weight set for the calling thread.
+ */
+static void load_sets(arena_thread *t)
+{
+	net *e, *r;
+	int i;
+
+	/* Get AI networks (for sizes and input names) */
+	ai_get_nets(&e, &r);
+
+	/* Loop over sets */
+	for (i = 0; i < num_sets; i++)
+	{
+		/* Load evaluator and role predictor */
+		load_set_net(&t->eval[i], e, "eval", i);
+		load_set_net(&t->role[i], r, "role", i);
+	}
+}
+
+/*
+ * Add the results of a finished game.
+ *
+ * Must be called with the arena lock held.
+ */
+static void add_results(arena_thread *t)
+{
+	game *g = &t->g;
+	double winners = 0, score, n;
+	int i, j, best, s, o;
+
+	/* Count winners */
+	for (i = 0; i < num_players; i++) winners += g->p[i].winner;
+
+	/* Loop over seats */
+	for (i = 0; i < num_players; i++)
+	{
+		/* Get seat's set */
+		s = t->seat_set[i];
+
+		/* Count seat */
+		stats[s].seats++;
+
+		/* Count (possibly shared) win */
+		if (g->p[i].winner) stats[s].wins += 1.0 / winners;
+
+		/* Find best opponent score */
+		for (j = 0, best = -1000; j < num_players; j++)
+		{
+			/* Skip ourself */
+			if (i == j) continue;
+
+			/* Check for better score */
+			if (g->p[j].end_vp > best) best = g->p[j].end_vp;
+		}
+
+		/* Add margin */
+		stats[s].margin += g->p[i].end_vp - best;
+	}
+
+	/* Loop over sets (other than the first) */
+	for (s = 1; s < num_sets; s++)
+	{
+		/* Clear game's score against first set */
+		score = n = 0;
+
+		/* Loop over pairs of seats */
+		for (i = 0; i < num_players; i++)
+		{
+			/* Skip seats of other sets */
+			if (t->seat_set[i] != s) continue;
+
+			/* Loop over opponents */
+			for (j = 0; j < num_players; j++)
+			{
+				/* Only compare against first set */
+				if (t->seat_set[j] != 0) continue;
+
+				/* Check for win */
+				if (g->p[i].winner > g->p[j].winner ||
+				    (g->p[i].winner == g->p[j].winner &&
+				     g->p[i].end_vp > g->p[j].end_vp)) score += 1;
+
+				/* Check for tie */
+				else if (g->p[i].winner == g->p[j].winner &&
+				         g->p[i].end_vp == g->p[j].end_vp)
+					score += 0.5;
+
+				/* Count pair */
+				n++;
+			}
+		}
+
+		/* Skip game without both sets */
+		if (!n) continue;
+
+		/* Add game's average score */
+		stats[s].pair_games++;
+		stats[s].pair_score += score / n;
+		stats[s].pair_square += (score / n) * (score / n);
+	}
+
+	/* Add decision counts and times */
+	for (o = 0; o < num_sets; o++)
+	{
+		/* Add decisions and time */
+		stats[o].decisions += t->decisions[o];
+		stats[o].cpu += t->cpu[o];
+	}
+}
+
+/*
+ * Play arena games until all are done.
+ */
+static void *arena_main(void *arg)
+{
+	arena_thread *t = (arena_thread *)arg;
+	game *g = &t->g;
+	char buf[1024];
+	int i, k, deal, rot;
+
+	/* Remember thread state */
+	self = t;
+
+	/* AI uses its own networks */
+	t->cur = -1;
+
+	/* Set game options */
+	g->num_players = num_players;
+	g->expanded = expanded;
+	g->advanced = advanced;
+	g->promo = promo;
+	g->goal_disabled = 0;
+	g->takeover_disabled = 0;
+	g->camp = NULL;
+
+	/* Loop over players */
+	for (i = 0; i < num_players; i++)
+	{
+		/* Create player name */
+		sprintf(buf, "Player %d", i);
+		g->p[i].name = strdup(buf);
+
+		/* Set player interfaces to arena functions */
+		g->p[i].control = &arena_func;
+
+		/* Initialize AI without learning */
+		ai_func.init(g, i, 0.0);
+
+		/* Create choice log for player */
+		g->p[i].choice_log = (int *)malloc(sizeof(int) * 4096);
+	}
+
+	/* Load weight sets */
+	load_sets(t);
+
+	/* Play games */
+	while (1)
+	{
+		/* Get next game */
+		pthread_mutex_lock(&arena_lock);
+		k = next_game++;
+		pthread_mutex_unlock(&arena_lock);
+
+		/* Check for all games started */
+		if (k >= num_games) break;
+
+		/* Play each deal once per seat rotation */
+		deal = k / num_players;
+		rot = k % num_players;
+
+		/* Assign weight sets to seats */
+		for (i = 0; i < num_players; i++)
+		{
+			/* Spread sets over seats, then rotate */
+			t->seat_set[i] = ((i + rot) % num_players) * num_sets /
+			                 num_players;
+		}
+
+		/* Clear decision counts */
+		memset(t->decisions, 0, sizeof(t->decisions));
+		memset(t->cpu, 0, sizeof(t->cpu));
+
+		/* Seed game by its deal */
+		g->random_seed = base_seed + deal;
+
+		/* Clear choice logs */
+		for (i = 0; i < num_players; i++)
+		{
+			/* Clear choice log size and position */
+			g->p[i].choice_size = 0;
+			g->p[i].choice_pos = 0;
+		}
+
+		/* Initialize game */
+		init_game(g);
+
+		/* Game is learning game */
+		g->session_id = -2;
+
+		/* Begin game */
+		begin_game(g);
+
+		/* Play game rounds until finished */
+		while (game_round(g));
+
+		/* Score game */
+		score_game(g);
+
+		/* Declare winner */
+		declare_winner(g);
+
+		/* Call player game over functions */
+		for (i = 0; i < num_players; i++)
+		{
+			/* Call game over function */
+			g->p[i].control->game_over(g, i);
+		}
+
+		/* Add results */
+		pthread_mutex_lock(&arena_lock);
+		add_results(t);
+		pthread_mutex_unlock(&arena_lock);
+	}
+
+	/* Give back networks */
+	use_set(-1);
+
+	/* Done */
+	return NULL;
+}
+
+/*
+ * Convert a score between 0 and 1 to an Elo difference.
+ */
+static double elo(double score)
+{
+	/* Avoid infinite differences */
+	if (score < 0.001) score = 0.001;
+	if (score > 0.999) score = 0.999;
+
+	/* Compute difference */
+	return -400.0 * log10(1.0 / score - 1.0);
+}
+
+/*
+ * Print results.
+ */
+static void print_results(double wall)
+{
+	set_stats *s_ptr;
+	double mean, var, err;
+	int i;
+
+	/* Print summary */
+	printf("Games: %d, threads: %d, time: %.1f s (%.2f games/s)\n",
+	       num_games, num_threads, wall, num_games / wall);
+
+	/* Print header */
+	printf("%-3s %-20s %6s %7s %7s %10s %12s\n", "Set", "Weights",
+	       "Seats", "Win%", "Margin", "Decisions", "ms/decision");
+
+	/* Loop over sets */
+	for (i = 0; i < num_sets; i++)
+	{
+		/* Get stats */
+		s_ptr = &stats[i];
+
+		/* Skip sets that never played */
+		if (!s_ptr->seats) continue;
+
+		/* Print set results */
+		printf("%-3d %-20s %6d %6.1f%% %7.2f %10ld %12.3f\n", i,
+		       set_name[i], s_ptr->seats,
+		       100.0 * s_ptr->wins / s_ptr->seats,
+		       s_ptr->margin / s_ptr->seats, s_ptr->decisions,
+		       s_ptr->decisions ?
+		           1000.0 * s_ptr->cpu / s_ptr->decisions : 0.0);
+	}
+
+	/* Loop over other sets */
+	for (i = 1; i < num_sets; i++)
+	{
+		/* Get stats */
+		s_ptr = &stats[i];
+
+		/* Skip sets that never met the first set */
+		if (!s_ptr->pair_games) continue;
+
+		/* Compute mean score per game */
+		mean = s_ptr->pair_score / s_ptr->pair_games;
+
+		/* Compute variance of game scores */
+		var = s_ptr->pair_square / s_ptr->pair_games - mean * mean;
+		if (var < 0) var = 0;
+
+		/* Compute standard error of mean */
+		err = sqrt(var / s_ptr->pair_games);
+
+		/* Print Elo difference with 95% confidence interval */
+		printf("Elo of %s vs %s: %+.1f (95%% CI %+.1f to %+.1f, "
+		       "%d games)\n", set_name[i], set_name[0], elo(mean),
+		       elo(mean - 1.96 * err), elo(mean + 1.96 * err),
+		       s_ptr->pair_games);
+	}
+}
+
+/*
+ * Play a tournament between weight sets.
+ */
+int main(int argc, char *argv[])
+{
+	pthread_attr_t attr;
+	arena_thread *threads;
+	struct timespec start, end;
+	char *ptr;
+	int i;
+
+	/* Set random seed */
+	base_seed = time(NULL);
+
+	/* Read card database */
+	if (read_cards(NULL) < 0)
+	{
+		/* Exit */
+		exit(1);
+	}
+
+	/* Parse arguments */
+	for (i = 1; i < argc; i++)
+	{
+		/* Check for verbosity */
+		if (!strcmp(argv[i], "-v"))
+		{
+			/* Set verbose flag */
+			verbose++;
+		}
+
+		/* Check for number of players */
+		else if (!strcmp(argv[i], "-p"))
+		{
+			/* Set number of players */
+			num_players = atoi(argv[++i]);
+		}
+
+		/* Check for advanced game */
+		else if (!strcmp(argv[i], "-a"))
+		{
+			/* Set advanced flag */
+			advanced = 1;
+		}
+
+		/* Check for expansion level */
+		else if (!strcmp(argv[i], "-e"))
+		{
+			/* Set expansion level */
+			expanded = atoi(argv[++i]);
+		}
+
+		/* Check for promo cards */
+		else if (!strcmp(argv[i], "-o"))
+		{
+			/* Set promo cards */
+			promo = 1;
+		}
+
+		/* Check for number of games */
+		else if (!strcmp(argv[i], "-n"))
+		{
+			/* Set number of games */
+			num_games = atoi(argv[++i]);
+		}
+
+		/* Check for random seed */
+		else if (!strcmp(argv[i], "-r"))
+		{
+			/* Set random seed */
+			base_seed = atoi(argv[++i]);
+		}
+
+		/* Check for number of threads */
+		else if (!strcmp(argv[i], "-t"))
+		{
+			/* Set number of threads */
+			num_threads = atoi(argv[++i]);
+		}
+
+		/* Check for network scoring in final round */
+		else if (!strcmp(argv[i], "-x"))
+		{
+			/* Disable exact endgame scoring */
+			ai_exact_endgame = 0;
+		}
+
+		/* Otherwise argument is a weight set directory */
+		else if (num_sets < MAX_SETS)
+		{
+			/* Remember name */
+			set_name[num_sets] = strdup(argv[i]);
+
+			/* Check for fast tier suffix */
+			ptr = strstr(argv[i], ":fast");
+
+			/* Use fast tier files if suffix found at end */
+			if (ptr && !ptr[5])
+			{
+				/* Remove suffix */
+				*ptr = '\0';
+
+				/* Mark set */
+				set_fast[num_sets] = 1;
+			}
+
+			/* Add set */
+			set_dir[num_sets++] = argv[i];
+		}
+	}
+
+	/* Check for usage (every set needs a seat in each game) */
+	if (num_sets < 2 || num_players < 2 || num_players > MAX_PLAYER ||
+	    num_sets > num_players)
+	{
+		/* Print usage */
+		fprintf(stderr, "Usage: arena [-e exp] [-p players] [-a] [-o] "
+		                "[-n games] [-r seed] [-t threads] [-x] "
+		                "dir1[:fast] dir2[:fast] ...\n");
+		exit(1);
+	}
+
+	/* Need at least one thread */
+	if (num_threads < 1) num_threads = 1;
+
+	/* Never train networks */
+	ai_train = 0;
+
+	/* Create threads */
+	threads = (arena_thread *)calloc(num_threads, sizeof(arena_thread));
+
+	/* Use larger stacks for game threads */
+	pthread_attr_init(&attr);
+	pthread_attr_setstacksize(&attr, WORKER_STACK);
+
+	/* Remember start time */
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	/* Start threads */
+	for (i = 0; i < num_threads; i++)
+	{
+		/* Start thread */
+		if (pthread_create(&threads[i].thread, &attr, arena_main,
+		                   &threads[i]))
+		{
+			/* Error */
+			fprintf(stderr, "Could not create game thread!\n");
+			exit(1);
+		}
+	}
+
+	/* Wait for threads */
+	for (i = 0; i < num_threads; i++)
+	{
+		/* Wait for thread */
+		pthread_join(threads[i].thread, NULL);
+	}
+
+	/* Get end time */
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	/* Print results */
+	print_results(end.tv_sec - start.tv_sec +
+	              (end.tv_nsec - start.tv_nsec) / 1e9);
+
+	/* Done */
+	return 0;
+}
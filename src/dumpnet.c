@@ -27,9 +27,7 @@ int main(int argc, char *argv[])
 	net learner;
 	FILE *fff;
 	int input, hidden, output;
-	int i, j;
-	double *start;
-	char buf[1024], *ptr;
+	char buf[1024];
 
 	fff = fopen(argv[1], "r");
 
@@ -39,42 +37,11 @@ int main(int argc, char *argv[])
 
 	if (sscanf(buf, "%d %d %d", &input, &hidden, &output) != 3) return 1;
 
-	make_learner(&learner, input, hidden, output);
+	make_learner(&learner, input, hidden, 0, output);
 
 	load_net(&learner, argv[1]);
 
-	for (i = 0; i < input; i++) learner.input_value[i] = -1;
-
-	compute_net(&learner);
-
-	start = (double *)malloc(sizeof(double) * output);
-
-	for (i = 0; i < output; i++)
-	{
-		start[i] = learner.win_prob[i];
-	}
-
-	for (i = 0; i < input; i++)
-	{
-		learner.input_value[i] = 1;
-
-		compute_net(&learner);
-
-		strcpy(buf, learner.input_name[i]);
-
-		for (ptr = buf; *ptr; ptr++) if (*ptr == ' ') *ptr = '_';
-
-		printf("%s: ", buf);
-
-		for (j = 0; j < output; j++)
-		{
-			printf("%f ", learner.win_prob[j] - start[j]);
-		}
-
-		printf("\n");
-
-		learner.input_value[i] = -1;
-	}
+	dump_net(&learner, stdout);
 
 	return 0;
 }
@@ -21,6 +21,8 @@
  */
 
 #include "rftg.h"
+#include "net.h"
+#include <pthread.h>
 
 /*
  * Print messages?
@@ -63,20 +65,627 @@ int game_rand(game *g)
 	return simple_rand(&g->random_seed);
 }
 
+/*
+ * Stack size of game threads.
+ *
+ * The AI keeps several game copies on the stack while searching, and its
+ * thread-private caches are placed in the stack area as well.
+ */
+#define WORKER_STACK (32 * 1024 * 1024)
+
+/*
+ * Game options shared by all training games.
+ */
+static int num_players = 3;
+static int expanded, advanced, promo;
+
+/*
+ * Learning rate factor.
+ */
+static double factor = 1.0;
+
+/*
+ * Number of games to play.
+ */
+static int num_games = 100;
+
+/*
+ * Number of game threads (1 plays all games in the main thread).
+ */
+static int num_threads = 1;
+
+/*
+ * Merge finished games in a fixed order, so that results are repeatable.
+ */
+static int deterministic;
+
+/*
+ * Number of iterations of the training schedule (0 to play games once).
+ *
+ * Each iteration plays num_games games and ends with a checkpoint.
+ */
+static int num_iterations;
+
+/*
+ * Schedule iterations already completed when starting.
+ */
+static int first_iteration;
+
+/*
+ * Write a weight dump snapshot every this many iterations (0 for none).
+ */
+static int dump_every = 1;
+
+/*
+ * Random seed of the first game.
+ */
+static unsigned int base_seed;
+
+/*
+ * Number of schedule iterations using the fast learning rate factor.
+ */
+#define FAST_ITERATIONS 100
+
+/*
+ * Learning rate factor of the first schedule iterations.
+ */
+#define FAST_FACTOR 100.0
+
+/*
+ * A thread playing training games.
+ *
+ * Each thread trains its own copy of the networks during a game.  When
+ * the game is over, the trainer adds the change of the copy to the shared
+ * networks and gives the thread the new shared weights.
+ */
+typedef struct worker
+{
+	/* Thread identifier */
+	pthread_t thread;
+
+	/* Worker number */
+	int id;
+
+	/* Game being played */
+	game g;
+
+	/* Networks used by the AI in this thread */
+	net *eval, *role;
+
+	/* Shared weights at the start of the current game */
+	net base_eval, base_role;
+
+	/* Finished game is waiting for the trainer */
+	int ready;
+
+} worker;
+
+/*
+ * Networks trained by all threads, owned by the trainer.
+ */
+static net *shared_eval, *shared_role;
+
+/*
+ * Lock protecting shared networks and worker state.
+ */
+static pthread_mutex_t train_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * Signaled when a worker has finished a game.
+ */
+static pthread_cond_t game_done = PTHREAD_COND_INITIALIZER;
+
+/*
+ * Signaled when the trainer has published new weights.
+ */
+static pthread_cond_t weights_ready = PTHREAD_COND_INITIALIZER;
+
+/*
+ * Set up a training game and initialize its AI players.
+ */
+static void setup_game(game *g, unsigned int seed)
+{
+	char buf[1024];
+	int i;
+
+	/* Set random seed */
+	g->random_seed = seed;
+
+	/* Set number of players */
+	g->num_players = num_players;
+
+	/* Set expansion level */
+	g->expanded = expanded;
+
+	/* Set advanced flag */
+	g->advanced = advanced;
+
+	/* Set promo flag */
+	g->promo = promo;
+
+	/* Assume no options disabled */
+	g->goal_disabled = 0;
+	g->takeover_disabled = 0;
+
+	/* No campaign selected */
+	g->camp = NULL;
+
+	/* Call initialization functions */
+	for (i = 0; i < num_players; i++)
+	{
+		/* Create player name */
+		sprintf(buf, "Player %d", i);
+
+		/* Set player name */
+		g->p[i].name = strdup(buf);
+
+		/* Set player interfaces to AI functions */
+		g->p[i].control = &ai_func;
+
+		/* Initialize AI */
+		g->p[i].control->init(g, i, factor);
+
+		/* Create choice log for player */
+		g->p[i].choice_log = (int *)malloc(sizeof(int) * 4096);
+
+		/* Clear choice log size and position */
+		g->p[i].choice_size = 0;
+		g->p[i].choice_pos = 0;
+	}
+}
+
+/*
+ * Play one training game.
+ */
+static void play_game(game *g)
+{
+	char *names[MAX_PLAYER];
+	int i;
+
+	/* Remember player names */
+	for (i = 0; i < num_players; i++) names[i] = g->p[i].name;
+
+	/* Initialize game */
+	init_game(g);
+
+	/* Game is learning game */
+	g->session_id = -2;
+
+	printf("Start seed: %u\n", g->start_seed);
+
+	/* Begin game */
+	begin_game(g);
+
+	/* Play game rounds until finished */
+	while (game_round(g));
+
+	/* Score game */
+	score_game(g);
+
+	/* Keep result lines of parallel games together */
+	flockfile(stdout);
+
+	/* Print result */
+	for (i = 0; i < num_players; i++)
+	{
+		/* Print score */
+		printf("%s: %d\n", g->p[i].name, g->p[i].end_vp);
+	}
+
+	/* Allow other output */
+	funlockfile(stdout);
+
+	/* Declare winner */
+	declare_winner(g);
+
+	/* Call player game over functions */
+	for (i = 0; i < num_players; i++)
+	{
+		/* Call game over function */
+		g->p[i].control->game_over(g, i);
+
+		/* Clear choice log */
+		g->p[i].choice_size = 0;
+		g->p[i].choice_pos = 0;
+	}
+
+	/* Reset player names */
+	for (i = 0; i < num_players; i++)
+	{
+		/* Reset name */
+		g->p[i].name = names[i];
+	}
+}
+
+/*
+ * Create the filename of a network or training state file.
+ */
+static void train_file(char *buf, char *kind, char *ext)
+{
+	/* Create filename */
+	sprintf(buf, RFTGDIR "/network/rftg.%s.%d.%d%s.%s", kind, expanded,
+	        num_players, advanced ? "a" : "", ext);
+}
+
+/*
+ * Return the learning rate factor of a schedule iteration (from 1).
+ */
+static double schedule_factor(int iter)
+{
+	/* Learn quickly at the start */
+	if (iter <= FAST_ITERATIONS) return FAST_FACTOR;
+
+	/* Use given factor afterwards */
+	return factor;
+}
+
+/*
+ * Read the number of completed schedule iterations from the state file.
+ *
+ * The random seed used for the schedule is restored as well.
+ */
+static int load_state(void)
+{
+	FILE *fff;
+	char fname[1024];
+	int iter;
+	unsigned int seed;
+
+	/* Create state filename */
+	train_file(fname, "train", "state");
+
+	/* Open state file */
+	fff = fopen(fname, "r");
+
+	/* Nothing to resume if no state saved */
+	if (!fff) return 0;
+
+	/* Read completed iterations and random seed */
+	if (fscanf(fff, "%d %u", &iter, &seed) != 2)
+	{
+		/* Ignore broken state */
+		fclose(fff);
+		return 0;
+	}
+
+	/* Done */
+	fclose(fff);
+
+	/* Restore seed */
+	base_seed = seed;
+
+	/* Return completed iterations */
+	return iter;
+}
+
+/*
+ * Save the networks and the schedule state after an iteration.
+ *
+ * Every file is replaced atomically.  The networks are saved before the
+ * state, so an interrupted checkpoint at most repeats one iteration.
+ */
+static void checkpoint(int iter)
+{
+	net *e, *r;
+	FILE *fff;
+	char fname[1024], tmp[1024 + 8], msg[1024 + 64];
+
+	/* Get shared networks */
+	ai_get_nets(&e, &r);
+
+	/* Save evaluator network */
+	train_file(fname, "eval", "net");
+	if (save_net(e, fname))
+	{
+		/* Warn */
+		sprintf(msg, "Warning: Couldn't save %s\n", fname);
+		display_error(msg);
+	}
+
+	/* Save predictor network */
+	train_file(fname, "role", "net");
+	if (save_net(r, fname))
+	{
+		/* Warn */
+		sprintf(msg, "Warning: Couldn't save %s\n", fname);
+		display_error(msg);
+	}
+
+	/* Create state filenames */
+	train_file(fname, "train", "state");
+	sprintf(tmp, "%s.tmp", fname);
+
+	/* Write state to temporary file */
+	fff = fopen(tmp, "w");
+
+	/* Check for success */
+	if (fff)
+	{
+		/* Save completed iterations and random seed */
+		fprintf(fff, "%d %u\n", iter, base_seed);
+		fclose(fff);
+
+		/* Replace old state */
+		rename(tmp, fname);
+	}
+
+	/* Check for weight dump snapshot */
+	if (dump_every && iter % dump_every == 0)
+	{
+		/* Create dump filename */
+		sprintf(fname, "netdump/eval.%d.%d%s.%d.dump", expanded,
+		        num_players, advanced ? "a" : "", iter);
+
+		/* Open dump file */
+		fff = fopen(fname, "w");
+
+		/* Check for success */
+		if (fff)
+		{
+			/* Dump evaluator network */
+			dump_net(e, fff);
+			fclose(fff);
+		}
+	}
+
+	/* Report progress */
+	printf("Iteration %d done\n", iter);
+	fflush(stdout);
+}
+
+/*
+ * Called by the trainer after the training of a game is in the shared
+ * networks.
+ *
+ * At the end of a schedule iteration, save a checkpoint and switch to
+ * the learning rate of the next iteration.  In parallel mode the games
+ * already running keep their learning rate until they finish.
+ */
+static void game_merged(int done)
+{
+	int iter;
+
+	/* Nothing to do without a schedule */
+	if (!num_iterations) return;
+
+	/* Check for end of iteration */
+	if (done % num_games) return;
+
+	/* Compute finished iteration */
+	iter = first_iteration + done / num_games;
+
+	/* Save checkpoint */
+	checkpoint(iter);
+
+	/* Set learning rate of next iteration */
+	ai_set_factor(schedule_factor(iter + 1));
+}
+
+/*
+ * Return the number of games left to play.
+ */
+static int games_left(void)
+{
+	/* Check for schedule */
+	if (num_iterations)
+	{
+		/* Play remaining iterations */
+		return (num_iterations - first_iteration) * num_games;
+	}
+
+	/* Play games once */
+	return num_games;
+}
+
+/*
+ * Give a worker the current shared weights.
+ *
+ * Must be called with the training lock held.
+ */
+static void publish_weights(worker *w)
+{
+	/* Copy shared weights to networks used by the game */
+	copy_net(w->eval, shared_eval);
+	copy_net(w->role, shared_role);
+
+	/* Copy current learning rates */
+	w->eval->alpha = shared_eval->alpha;
+	w->role->alpha = shared_role->alpha;
+
+	/* Remember starting point of the next game */
+	copy_net(&w->base_eval, shared_eval);
+	copy_net(&w->base_role, shared_role);
+}
+
+/*
+ * Play a share of the training games in a separate thread.
+ */
+static void *worker_main(void *arg)
+{
+	worker *w = (worker *)arg;
+	int i, n = games_left();
+
+	/* Set up game */
+	setup_game(&w->g, base_seed);
+
+	/* Get networks used by this thread */
+	ai_get_nets(&w->eval, &w->role);
+
+	/* Create networks holding shared weights */
+	make_learner(&w->base_eval, w->eval->num_inputs, w->eval->num_hidden,
+	             w->eval->num_hidden2, w->eval->num_output);
+	make_learner(&w->base_role, w->role->num_inputs, w->role->num_hidden,
+	             w->role->num_hidden2, w->role->num_output);
+
+	/* Start from shared weights */
+	pthread_mutex_lock(&train_lock);
+	publish_weights(w);
+	pthread_mutex_unlock(&train_lock);
+
+	/* Play every num_threads'th game */
+	for (i = w->id; i < n; i += num_threads)
+	{
+		/* Seed game by its number, independent of thread timing */
+		w->g.random_seed = base_seed + first_iteration * num_games + i;
+
+		/* Play game */
+		play_game(&w->g);
+
+		/* Hand game over to trainer */
+		pthread_mutex_lock(&train_lock);
+		w->ready = 1;
+		pthread_cond_signal(&game_done);
+
+		/* Wait for new weights */
+		while (w->ready) pthread_cond_wait(&weights_ready, &train_lock);
+		pthread_mutex_unlock(&train_lock);
+	}
+
+	/* Destroy copies of shared weights */
+	free_net(&w->base_eval);
+	free_net(&w->base_role);
+
+	/* Done */
+	return NULL;
+}
+
+/*
+ * Play all training games in parallel threads.
+ *
+ * The calling thread acts as trainer, merging the training done in each
+ * finished game into the shared networks.  In deterministic mode games
+ * are merged in order of their number, otherwise in the order they finish.
+ */
+static void play_parallel(void)
+{
+	pthread_attr_t attr;
+	worker *workers, *w;
+	int i, done = 0, n = games_left();
+
+	/* Get shared networks (those of the calling thread) */
+	ai_get_nets(&shared_eval, &shared_role);
+
+	/* Create workers */
+	workers = (worker *)calloc(num_threads, sizeof(worker));
+
+	/* Use larger stacks for game threads */
+	pthread_attr_init(&attr);
+	pthread_attr_setstacksize(&attr, WORKER_STACK);
+
+	/* Start workers */
+	for (i = 0; i < num_threads; i++)
+	{
+		/* Set worker number */
+		workers[i].id = i;
+
+		/* Start thread */
+		if (pthread_create(&workers[i].thread, &attr, worker_main,
+		                   &workers[i]))
+		{
+			/* Error */
+			display_error("Could not create game thread!\n");
+			exit(1);
+		}
+	}
+
+	/* Merge games as they finish */
+	pthread_mutex_lock(&train_lock);
+	while (done < n)
+	{
+		/* Assume no game available */
+		w = NULL;
+
+		/* Check for deterministic order */
+		if (deterministic)
+		{
+			/* Only accept the worker playing the next game */
+			if (workers[done % num_threads].ready)
+				w = &workers[done % num_threads];
+		}
+		else
+		{
+			/* Accept any finished game */
+			for (i = 0; i < num_threads; i++)
+			{
+				/* Check for finished game */
+				if (workers[i].ready)
+				{
+					/* Use this worker */
+					w = &workers[i];
+					break;
+				}
+			}
+		}
+
+		/* Wait for a game if none available */
+		if (!w)
+		{
+			/* Wait */
+			pthread_cond_wait(&game_done, &train_lock);
+			continue;
+		}
+
+		/* Add training done in game to shared networks */
+		merge_net(shared_eval, w->eval, &w->base_eval);
+		merge_net(shared_role, w->role, &w->base_role);
+
+		/* One more game done */
+		done++;
+
+		/* Check for end of schedule iteration */
+		game_merged(done);
+
+		/* Give worker the new weights */
+		publish_weights(w);
+
+		/* Let worker continue */
+		w->ready = 0;
+		pthread_cond_broadcast(&weights_ready);
+	}
+	pthread_mutex_unlock(&train_lock);
+
+	/* Wait for workers to exit */
+	for (i = 0; i < num_threads; i++)
+	{
+		/* Wait for thread */
+		pthread_join(workers[i].thread, NULL);
+	}
+
+	/* Clean up */
+	pthread_attr_destroy(&attr);
+	free(workers);
+}
+
+/*
+ * Read hidden layer sizes given as "hidden" or "hidden x hidden2".
+ */
+static void read_shape(char *arg, int *hidden)
+{
+	/* Clear second layer */
+	hidden[1] = 0;
+
+	/* Read sizes */
+	if (sscanf(arg, "%dx%d", &hidden[0], &hidden[1]) < 1 ||
+	    hidden[0] < 1 || hidden[1] < 0)
+	{
+		/* Error */
+		fprintf(stderr, "Bad network shape %s\n", arg);
+		exit(1);
+	}
+}
+
 /*
  * Play a number of training games.
  */
 int main(int argc, char *argv[])
 {
 	game my_game;
-	int i, j, n = 100;
-	int num_players = 3;
-	int expansion = 0, advanced = 0, promo = 0;
-	char buf[1024], *names[MAX_PLAYER];
-	double factor = 1.0;
+	net *e, *r;
+	char *log_name = NULL, *role_log_name = NULL, msg[1024];
+	int i, n;
 
 	/* Set random seed */
-	my_game.random_seed = time(NULL);
+	base_seed = time(NULL);
 
 	/* Read card database */
 	if (read_cards(NULL) < 0)
@@ -113,7 +722,7 @@ int main(int argc, char *argv[])
 		else if (!strcmp(argv[i], "-e"))
 		{
 			/* Set expansion level */
-			expansion = atoi(argv[++i]);
+			expanded = atoi(argv[++i]);
 		}
 
 		/* Check for promo cards */
@@ -127,14 +736,14 @@ int main(int argc, char *argv[])
 		else if (!strcmp(argv[i], "-n"))
 		{
 			/* Set number of games */
-			n = atoi(argv[++i]);
+			num_games = atoi(argv[++i]);
 		}
 
 		/* Check for random seed */
 		else if (!strcmp(argv[i], "-r"))
 		{
 			/* Set random seed */
-			my_game.random_seed = atoi(argv[++i]);
+			base_seed = atoi(argv[++i]);
 		}
 
 		/* Check for alpha factor */
@@ -143,98 +752,157 @@ int main(int argc, char *argv[])
 			/* Set factor */
 			factor = atof(argv[++i]);
 		}
-	}
-
-	/* Set number of players */
-	my_game.num_players = num_players;
-
-	/* Set expansion level */
-	my_game.expanded = expansion;
-
-	/* Set advanced flag */
-	my_game.advanced = advanced;
 
-	/* Set promo flag */
-	my_game.promo = promo;
+		/* Check for network scoring in final round */
+		else if (!strcmp(argv[i], "-x"))
+		{
+			/* Disable exact endgame scoring */
+			ai_exact_endgame = 0;
+		}
 
-	/* Assume no options disabled */
-	my_game.goal_disabled = 0;
-	my_game.takeover_disabled = 0;
+		/* Check for number of game threads */
+		else if (!strcmp(argv[i], "-t"))
+		{
+			/* Set number of threads */
+			num_threads = atoi(argv[++i]);
+		}
 
-	/* No campaign selected */
-	my_game.camp = NULL;
+		/* Check for deterministic parallel training */
+		else if (!strcmp(argv[i], "-d"))
+		{
+			/* Set deterministic flag */
+			deterministic = 1;
+		}
 
-	/* Call initialization functions */
-	for (i = 0; i < num_players; i++)
-	{
-		/* Create player name */
-		sprintf(buf, "Player %d", i);
+		/* Check for training schedule */
+		else if (!strcmp(argv[i], "-s"))
+		{
+			/* Set number of iterations */
+			num_iterations = atoi(argv[++i]);
+		}
 
-		/* Set player name */
-		my_game.p[i].name = strdup(buf);
-		names[i] = my_game.p[i].name;
+		/* Check for weight dump interval */
+		else if (!strcmp(argv[i], "-k"))
+		{
+			/* Set dump interval */
+			dump_every = atoi(argv[++i]);
+		}
 
-		/* Set player interfaces to AI functions */
-		my_game.p[i].control = &ai_func;
+		/* Check for experience log */
+		else if (!strcmp(argv[i], "-l"))
+		{
+			/* Set log filename */
+			log_name = argv[++i];
+		}
 
-		/* Initialize AI */
-		my_game.p[i].control->init(&my_game, i, factor);
+		/* Check for role experience log */
+		else if (!strcmp(argv[i], "-L"))
+		{
+			/* Set log filename */
+			role_log_name = argv[++i];
+		}
 
-		/* Create choice log for player */
-		my_game.p[i].choice_log = (int *)malloc(sizeof(int) * 4096);
+		/* Check for hidden layers of new evaluator */
+		else if (!strcmp(argv[i], "-H"))
+		{
+			/* Set hidden layer sizes */
+			read_shape(argv[++i], ai_eval_hidden);
+		}
 
-		/* Clear choice log size and position */
-		my_game.p[i].choice_size = 0;
-		my_game.p[i].choice_pos = 0;
+		/* Check for hidden layers of new role predictor */
+		else if (!strcmp(argv[i], "-R"))
+		{
+			/* Set hidden layer sizes */
+			read_shape(argv[++i], ai_role_hidden);
+		}
 	}
 
-	/* Play a number of games */
-	for (i = 0; i < n; i++)
+	/* Need at least one thread */
+	if (num_threads < 1) num_threads = 1;
+
+	/* Check for training schedule */
+	if (num_iterations)
 	{
-		/* Initialize game */
-		init_game(&my_game);
+		/* Resume after last checkpoint */
+		first_iteration = load_state();
 
-		/* Game is learning game */
-		my_game.session_id = -2;
+		/* Report resume */
+		if (first_iteration)
+			printf("Resuming after iteration %d\n", first_iteration);
+	}
 
-		printf("Start seed: %u\n", my_game.start_seed);
+	/* Set up game and load networks */
+	setup_game(&my_game, base_seed);
 
-		/* Begin game */
-		begin_game(&my_game);
+	/* Set learning rate of first schedule iteration */
+	if (num_iterations) ai_set_factor(schedule_factor(first_iteration + 1));
 
-		/* Play game rounds until finished */
-		while (game_round(&my_game));
+	/* Check for experience log */
+	if (log_name)
+	{
+		/* Get networks */
+		ai_get_nets(&e, &r);
 
-		/* Score game */
-		score_game(&my_game);
+		/* Open log */
+		ai_experience = open_experience(e, log_name);
 
-		/* Print result */
-		for (j = 0; j < num_players; j++)
+		/* Check for failure */
+		if (!ai_experience)
 		{
-			/* Print score */
-			printf("%s: %d\n", my_game.p[j].name,
-			                   my_game.p[j].end_vp);
+			/* Error */
+			sprintf(msg, "Couldn't open experience log %s\n", log_name);
+			display_error(msg);
+			exit(1);
 		}
+	}
 
-		/* Declare winner */
-		declare_winner(&my_game);
+	/* Check for role experience log */
+	if (role_log_name)
+	{
+		/* Get networks */
+		ai_get_nets(&e, &r);
 
-		/* Call player game over functions */
-		for (j = 0; j < num_players; j++)
-		{
-			/* Call game over function */
-			my_game.p[j].control->game_over(&my_game, j);
+		/* Open log */
+		ai_role_experience = open_experience(r, role_log_name);
 
-			/* Clear choice log */
-			my_game.p[j].choice_size = 0;
-			my_game.p[j].choice_pos = 0;
+		/* Check for failure */
+		if (!ai_role_experience)
+		{
+			/* Error */
+			sprintf(msg, "Couldn't open experience log %s\n",
+			        role_log_name);
+			display_error(msg);
+			exit(1);
 		}
+	}
 
-		/* Reset player names */
-		for (j = 0; j < num_players; j++)
+	/* Check for parallel games */
+	if (num_threads > 1)
+	{
+		/* Play games in game threads */
+		play_parallel();
+	}
+	else
+	{
+		/* Get number of games */
+		n = games_left();
+
+		/* Play a number of games */
+		for (i = 0; i < n; i++)
 		{
-			/* Reset name */
-			my_game.p[j].name = names[j];
+			/* Seed schedule games by their number */
+			if (num_iterations)
+			{
+				/* Set seed */
+				my_game.random_seed = base_seed +
+				                      first_iteration * num_games + i;
+			}
+
+			/* Play game */
+			play_game(&my_game);
+
+			/* Check for end of schedule iteration */
+			game_merged(i + 1);
 		}
 	}
 
@@ -245,6 +913,10 @@ int main(int argc, char *argv[])
 		my_game.p[i].control->shutdown(&my_game, i);
 	}
 
+	/* Close experience logs */
+	if (ai_experience) fclose(ai_experience);
+	if (ai_role_experience) fclose(ai_role_experience);
+
 	/* Done */
 	return 0;
 }
@@ -27,6 +27,16 @@
  */
 #define PAST_MAX 120
 
+/*
+ * Number of 32-bit words needed for one bit per input (and bias).
+ */
+#define PAST_WORDS(n) (((n) + 32) / 32)
+
+/*
+ * Magic string at the start of experience logs.
+ */
+#define EXP_MAGIC "RFTGEXP1"
+
 /*
  * Create a random weight value.
  */
@@ -37,23 +47,70 @@ static void init_weight(double *wgt)
 }
 
 /*
- * Create a network of the given size.
+ * Create a layer of random weights, and cleared deltas to them.
+ *
+ * There is one row of weights per node in the lower layer.
  */
-void make_learner(net *learn, int input, int hidden, int output)
+static void make_layer(double ***weight, double ***delta, int rows, int cols)
 {
 	int i, j;
 
-	/* Set number of outputs */
-	learn->num_output = output;
+	/* Create rows of weights */
+	*weight = (double **)malloc(sizeof(double *) * rows);
 
-	/* Set number of inputs */
-	learn->num_inputs = input;
+	/* Create rows of weight deltas */
+	*delta = (double **)malloc(sizeof(double *) * rows);
 
-	/* Number of hidden nodes */
-	learn->num_hidden = hidden;
+	/* Loop over weight rows */
+	for (i = 0; i < rows; i++)
+	{
+		/* Create weight row */
+		(*weight)[i] = (double *)malloc(sizeof(double) * cols);
 
-	/* Clear error counters */
-	learn->error = learn->num_error = 0;
+		/* Create weight delta row */
+		(*delta)[i] = (double *)malloc(sizeof(double) * cols);
+
+		/* Randomize weights */
+		for (j = 0; j < cols; j++)
+		{
+			/* Randomize this weight */
+			init_weight(&(*weight)[i][j]);
+
+			/* Clear delta */
+			(*delta)[i][j] = 0;
+		}
+	}
+}
+
+/*
+ * Destroy a layer of weights and deltas.
+ */
+static void free_layer(double **weight, double **delta, int rows)
+{
+	int i;
+
+	/* Loop over rows */
+	for (i = 0; i < rows; i++)
+	{
+		/* Free weight row */
+		free(weight[i]);
+		free(delta[i]);
+	}
+
+	/* Free list of rows */
+	free(weight);
+	free(delta);
+}
+
+/*
+ * Create the arrays used while computing and training a network, whose
+ * sizes are already set.
+ */
+static void make_arrays(net *learn)
+{
+	int i, input = learn->num_inputs;
+	int hidden = learn->num_hidden, hidden2 = learn->num_hidden2;
+	int output = learn->num_output;
 
 	/* Create input array */
 	learn->input_value = (double *)malloc(sizeof(double) * (input + 1));
@@ -70,93 +127,123 @@ void make_learner(net *learn, int input, int hidden, int output)
 	/* Create hidden error array */
 	learn->hidden_error = (double *)malloc(sizeof(double) * hidden);
 
+	/* Create second layer result and error arrays */
+	learn->hidden2_result = (double *)malloc(sizeof(double) * (hidden2 + 1));
+	learn->hidden2_error = (double *)calloc(hidden2 + 1, sizeof(double));
+
+	/* Point to results of last hidden layer */
+	learn->last_result = hidden2 ? learn->hidden2_result :
+	                               learn->hidden_result;
+
 	/* Create output result array */
 	learn->net_result = (double *)malloc(sizeof(double) * output);
 
 	/* Create output probability array */
 	learn->win_prob = (double *)malloc(sizeof(double) * output);
 
-	/* Last input and hidden result are always 1 (for bias) */
+	/* Create output error arrays */
+	learn->output_error = (double *)malloc(sizeof(double) * output);
+	learn->output_grad = (double *)malloc(sizeof(double) * output);
+
+	/* Create common hidden delta array */
+	learn->common_delta = (double *)calloc(hidden, sizeof(double));
+
+	/* Create list of hidden weight rows with deltas */
+	learn->dirty_row = (int *)malloc(sizeof(int) * (input + 1));
+	learn->row_dirty = (char *)calloc(input + 1, sizeof(char));
+	learn->num_dirty = 0;
+
+	/* Last input and hidden results are always 1 (for bias) */
 	learn->input_value[input] = 1.0;
 	learn->hidden_result[hidden] = 1.0;
+	learn->hidden2_result[hidden2] = 1.0;
 
-	/* Create rows of hidden weights */
-	learn->hidden_weight = (double **)malloc(sizeof(double *) *
-	                                         (input + 1));
+	/* Clear hidden sums */
+	memset(learn->hidden_sum, 0, sizeof(double) * hidden);
 
-	/* Create rows of hidden weight deltas */
-	learn->hidden_delta = (double **)malloc(sizeof(double *) *
-	                                        (input + 1));
+	/* Clear hidden errors */
+	memset(learn->hidden_error, 0, sizeof(double) * hidden);
 
-	/* Loop over hidden weight rows */
-	for (i = 0; i < input + 1; i++)
-	{
-		/* Create weight row */
-		learn->hidden_weight[i] = (double *)malloc(sizeof(double) *
-		                                           hidden);
+	/* Clear previous inputs */
+	memset(learn->prev_input, 0, sizeof(double) * (input + 1));
 
-		/* Create weight delta row */
-		learn->hidden_delta[i] = (double *)malloc(sizeof(double) *
-		                                          hidden);
+	/* Create ring buffer of previous inputs */
+	learn->past = (past_set *)malloc(sizeof(past_set) * PAST_MAX);
 
-		/* Randomize weights */
-		for (j = 0; j < hidden; j++)
-		{
-			/* Randomize this weight */
-			init_weight(&learn->hidden_weight[i][j]);
+	/* Create bits of previous inputs */
+	learn->past_bits = (uint32_t *)malloc(sizeof(uint32_t) * 2 * PAST_MAX *
+	                                      PAST_WORDS(input));
 
-			/* Clear delta */
-			learn->hidden_delta[i][j] = 0;
-		}
+	/* Loop over previous input sets */
+	for (i = 0; i < PAST_MAX; i++)
+	{
+		/* Point to this set's bits */
+		learn->past[i].one = learn->past_bits + 2 * i * PAST_WORDS(input);
+		learn->past[i].other = learn->past[i].one + PAST_WORDS(input);
+
+		/* No space for other values yet */
+		learn->past[i].value = NULL;
+		learn->past[i].num_value = learn->past[i].value_size = 0;
 	}
 
-	/* Create rows of output weights */
-	learn->output_weight = (double **)malloc(sizeof(double *) *
-	                                         (hidden + 1));
+	/* No past inputs available */
+	learn->past_next = 0;
+	learn->num_past = 0;
+}
 
-	/* Create rows of output weight deltas */
-	learn->output_delta = (double **)malloc(sizeof(double *) *
-	                                        (hidden + 1));
+/*
+ * Create a network of the given size.
+ *
+ * The second hidden layer is left out if its size is zero.
+ */
+void make_learner(net *learn, int input, int hidden, int hidden2, int output)
+{
+	int i, last = hidden2 ? hidden2 : hidden;
 
-	/* Loop over output weight rows */
-	for (i = 0; i < hidden + 1; i++)
-	{
-		/* Create weight row */
-		learn->output_weight[i] = (double *)malloc(sizeof(double) *
-		                                           output);
+	/* Set number of outputs */
+	learn->num_output = output;
 
-		/* Create weight delta row */
-		learn->output_delta[i] = (double *)malloc(sizeof(double) *
-		                                          output);
+	/* Set number of inputs */
+	learn->num_inputs = input;
 
-		/* Randomize weights */
-		for (j = 0; j < output; j++)
-		{
-			/* Randomize this weight */
-			init_weight(&learn->output_weight[i][j]);
+	/* Number of hidden nodes */
+	learn->num_hidden = hidden;
 
-			/* Clear delta */
-			learn->output_delta[i][j] = 0;
-		}
-	}
+	/* Number of second layer hidden nodes */
+	learn->num_hidden2 = hidden2;
 
-	/* Clear hidden sums */
-	memset(learn->hidden_sum, 0, sizeof(double) * hidden);
+	/* Output layer is computed from last hidden layer */
+	learn->num_last = last;
 
-	/* Clear hidden errors */
-	memset(learn->hidden_error, 0, sizeof(double) * hidden);
+	/* Clear error counters */
+	learn->error = learn->num_error = 0;
 
-	/* Clear previous inputs */
-	memset(learn->prev_input, 0, sizeof(double) * (input + 1));
+	/* Create arrays used while computing */
+	make_arrays(learn);
 
-	/* Create set of previous inputs */
-	learn->past_input = (double **)malloc(sizeof(double *) * PAST_MAX);
+	/* No inputs are pruned */
+	learn->input_pruned = (char *)calloc(input + 1, sizeof(char));
 
-	/* Create set of previous input players */
-	learn->past_input_player = (int *)malloc(sizeof(int) * PAST_MAX);
+	/* Weights are not quantized */
+	learn->q_bits = 0;
+	learn->q_weight8 = NULL;
+	learn->q_weight16 = NULL;
+	learn->q_sum = NULL;
 
-	/* No past inputs available */
-	learn->num_past = 0;
+	/* Create hidden weights */
+	make_layer(&learn->hidden_weight, &learn->hidden_delta, input + 1,
+	           hidden);
+
+	/* Create second layer weights */
+	make_layer(&learn->hidden2_weight, &learn->hidden2_delta, hidden + 1,
+	           hidden2);
+
+	/* Create output weights */
+	make_layer(&learn->output_weight, &learn->output_delta, last + 1,
+	           output);
+
+	/* Weights belong to this network */
+	learn->shared = 0;
 
 	/* No training done */
 	learn->num_training = 0;
@@ -172,6 +259,29 @@ void make_learner(net *learn, int input, int hidden, int output)
 	}
 }
 
+/*
+ * Create a network that computes with the weights of another network.
+ *
+ * Only the arrays used while computing are created, so that several
+ * threads can compute the same weights at once.  The networks must not
+ * be trained while shared, and the original must outlive its copies.
+ */
+void share_net(net *dst, net *src)
+{
+	/* Copy sizes, weights and input names */
+	*dst = *src;
+
+	/* Create own arrays used while computing */
+	make_arrays(dst);
+
+	/* Create own integer sums */
+	if (dst->q_bits)
+		dst->q_sum = (int32_t *)calloc(dst->num_hidden, sizeof(int32_t));
+
+	/* Weights belong to the original network */
+	dst->shared = 1;
+}
+
 /*
  * Normalize a number using a 'sigmoid' function.
  */
@@ -189,12 +299,12 @@ typedef double v2d __attribute__ ((vector_size (16)));
 #endif
 
 /*
- * Compute a neural net's result.
+ * Add the changes in inputs to the hidden node sums, and compute the
+ * hidden node results.
  */
-void compute_net(net *learn)
+static void compute_hidden(net *learn)
 {
 	int i, j;
-	double sum, adj = 0.0;
 #if 0
 	v2d *weight, *hid_sum;
 #endif
@@ -205,6 +315,13 @@ void compute_net(net *learn)
 		/* Check for difference from previous input */
 		if (learn->input_value[i] != learn->prev_input[i])
 		{
+			/* Pruned inputs have no effect */
+			if (learn->input_pruned[i])
+			{
+				/* Store input */
+				learn->prev_input[i] = learn->input_value[i];
+				continue;
+			}
 #if 0
 			for (j = 0; j < learn->num_hidden; j += 2)
 			{
@@ -266,6 +383,132 @@ void compute_net(net *learn)
 		/* Set normalized result */
 		learn->hidden_result[i] = sigmoid(learn->hidden_sum[i]);
 	}
+}
+
+/*
+ * Add the changes in inputs to the hidden node sums of quantized weights,
+ * and compute the hidden node results.
+ *
+ * Changes by whole amounts (nearly all of them) are added to the integer
+ * sums, others to the floating point sums using the original weights.
+ */
+static void compute_hidden_quant(net *learn)
+{
+	int i, j, d, n = learn->num_hidden;
+	int32_t *q_sum = learn->q_sum;
+	int8_t *w8;
+	int16_t *w16;
+	double x;
+
+	/* Loop over inputs */
+	for (i = 0; i < learn->num_inputs + 1; i++)
+	{
+		/* Skip unchanged inputs */
+		if (learn->input_value[i] == learn->prev_input[i]) continue;
+
+		/* Compute change */
+		x = learn->input_value[i] - learn->prev_input[i];
+
+		/* Store input */
+		learn->prev_input[i] = learn->input_value[i];
+
+		/* Pruned inputs have no effect */
+		if (learn->input_pruned[i]) continue;
+
+		/* Get whole part of change */
+		d = (int)x;
+
+		/* Check for fractional change */
+		if (d != x)
+		{
+			/* Loop over hidden weights */
+			for (j = 0; j < n; j++)
+			{
+				/* Adjust sum */
+				learn->hidden_sum[j] += learn->hidden_weight[i][j] * x;
+			}
+
+			/* Next input */
+			continue;
+		}
+
+		/* Check for 8-bit weights */
+		if (learn->q_bits == 8)
+		{
+			/* Get weight row */
+			w8 = learn->q_weight8 + i * n;
+
+			/* Adjust sums */
+			for (j = 0; j < n; j++) q_sum[j] += d * w8[j];
+		}
+		else
+		{
+			/* Get weight row */
+			w16 = learn->q_weight16 + i * n;
+
+			/* Adjust sums */
+			for (j = 0; j < n; j++) q_sum[j] += d * w16[j];
+		}
+	}
+
+	/* Loop over hidden nodes */
+	for (j = 0; j < n; j++)
+	{
+		/* Set normalized result */
+		learn->hidden_result[j] = sigmoid(q_sum[j] * learn->q_scale +
+		                                  learn->hidden_sum[j]);
+	}
+}
+
+/*
+ * Compute the second hidden layer results from the first.
+ */
+static void compute_hidden2(net *learn)
+{
+	int i, j;
+	double sum;
+
+	/* Loop over second layer nodes */
+	for (i = 0; i < learn->num_hidden2; i++)
+	{
+		/* Start sum at zero */
+		sum = 0.0;
+
+		/* Loop over first layer results (and bias) */
+		for (j = 0; j < learn->num_hidden + 1; j++)
+		{
+			/* Add weighted result to sum */
+			sum += learn->hidden_result[j] *
+			       learn->hidden2_weight[j][i];
+		}
+
+		/* Set normalized result */
+		learn->hidden2_result[i] = sigmoid(sum);
+	}
+}
+
+/*
+ * Compute a neural net's result.
+ */
+void compute_net(net *learn)
+{
+	int i, j;
+	double sum, adj = 0.0;
+
+	/* Check for quantized weights */
+	if (learn->q_bits)
+	{
+		/* Compute hidden results with integer weights */
+		compute_hidden_quant(learn);
+	}
+	else
+	{
+		/* Compute hidden results */
+		compute_hidden(learn);
+	}
+
+	/* Compute second hidden layer if any */
+	if (learn->num_hidden2) compute_hidden2(learn);
 
 	/* Clear probability sum */
 	learn->prob_sum = 0.0;
@@ -276,11 +519,11 @@ void compute_net(net *learn)
 		/* Start sum at zero */
 		sum = 0.0;
 
-		/* Loop over hidden results */
-		for (j = 0; j < learn->num_hidden + 1; j++)
+		/* Loop over last hidden layer results */
+		for (j = 0; j < learn->num_last + 1; j++)
 		{
 			/* Add weighted result to sum */
-			sum += learn->hidden_result[j] *
+			sum += learn->last_result[j] *
 			       learn->output_weight[j][i];
 		}
 
@@ -308,77 +551,198 @@ void compute_net(net *learn)
 
 /*
  * Store the current inputs into the past set array.
+ *
+ * Once the array is full, the oldest set is overwritten.
  */
 void store_net(net *learn, int who)
 {
-	int i;
+	past_set *p_ptr;
+	double x;
+	int i, words = PAST_WORDS(learn->num_inputs);
+
+	/* Get next set to overwrite */
+	p_ptr = &learn->past[learn->past_next];
+
+	/* Advance position */
+	learn->past_next = (learn->past_next + 1) % PAST_MAX;
 
-	/* Check for too many past inputs already */
-	if (learn->num_past == PAST_MAX)
+	/* One additional set, unless the oldest was overwritten */
+	if (learn->num_past < PAST_MAX) learn->num_past++;
+
+	/* Copy player index */
+	p_ptr->who = who;
+
+	/* Clear bits */
+	memset(p_ptr->one, 0, sizeof(uint32_t) * words * 2);
+
+	/* Clear other values */
+	p_ptr->num_value = 0;
+
+	/* Loop over inputs (including bias) */
+	for (i = 0; i < learn->num_inputs + 1; i++)
 	{
-		/* Destroy oldest set */
-		free(learn->past_input[0]);
+		/* Get input */
+		x = learn->input_value[i];
 
-		/* Move all inputs up one spot */
-		for (i = 0; i < PAST_MAX - 1; i++)
+		/* Nothing to store for -1 */
+		if (x == -1) continue;
+
+		/* Check for 1 */
+		if (x == 1)
 		{
-			/* Move one set of inputs */
-			learn->past_input[i] = learn->past_input[i + 1];
+			/* Set bit */
+			p_ptr->one[i / 32] |= 1U << (i % 32);
+			continue;
+		}
 
-			/* Move one player index */
-			learn->past_input_player[i] =
-			                  learn->past_input_player[i + 1];
+		/* Mark other value */
+		p_ptr->other[i / 32] |= 1U << (i % 32);
+
+		/* Make space for value if needed */
+		if (p_ptr->num_value == p_ptr->value_size)
+		{
+			/* Grow space */
+			p_ptr->value_size += 8;
+			p_ptr->value = (float *)realloc(p_ptr->value, sizeof(float) *
+			                                p_ptr->value_size);
 		}
 
-		/* We now have one fewer set */
-		learn->num_past--;
+		/* Store value */
+		p_ptr->value[p_ptr->num_value++] = x;
 	}
+}
+
+/*
+ * Forget past stored inputs.
+ */
+void clear_store(net *learn)
+{
+	/* Clear number of past inputs */
+	learn->num_past = 0;
+
+	/* Start at beginning of array */
+	learn->past_next = 0;
+}
 
-	/* Make space for new inputs */
-	learn->past_input[learn->num_past] = malloc(sizeof(double) *
-	                                            (learn->num_inputs + 1));
+/*
+ * Return the player who created a past input set.
+ *
+ * Age 0 is the most recently stored set.
+ */
+int past_player(net *learn, int age)
+{
+	/* Return player of set */
+	return learn->past[(learn->past_next + PAST_MAX - 1 - age) %
+	                   PAST_MAX].who;
+}
 
-	/* Copy inputs */
-	memcpy(learn->past_input[learn->num_past], learn->input_value,
-	       sizeof(double) * (learn->num_inputs + 1));
+/*
+ * Copy a past input set back into the network inputs.
+ *
+ * Age 0 is the most recently stored set.
+ */
+void load_past(net *learn, int age)
+{
+	past_set *p_ptr;
+	uint32_t one, other;
+	int i, n = 0;
 
-	/* Copy player index */
-	learn->past_input_player[learn->num_past] = who;
+	/* Get set */
+	p_ptr = &learn->past[(learn->past_next + PAST_MAX - 1 - age) %
+	                     PAST_MAX];
 
-	/* One additional set */
-	learn->num_past++;
+	/* Loop over inputs (including bias) */
+	for (i = 0; i < learn->num_inputs + 1; i++)
+	{
+		/* Get bits of input */
+		one = p_ptr->one[i / 32] & (1U << (i % 32));
+		other = p_ptr->other[i / 32] & (1U << (i % 32));
+
+		/* Set input */
+		if (one) learn->input_value[i] = 1;
+		else if (other) learn->input_value[i] = p_ptr->value[n++];
+		else learn->input_value[i] = -1;
+	}
 }
 
 /*
- * Clean up past stored inputs.
+ * Accumulate training of the second hidden layer from its node errors,
+ * and pass the errors on to the first hidden layer.
  */
-void clear_store(net *learn)
+static void train_hidden2(net *learn)
 {
-	int i;
+	int i, j;
+	double *w_row, *d_row, *corr = learn->hidden2_error, h, error;
 
-	/* Loop over previous stored inputs */
-	for (i = 0; i < learn->num_past; i++)
+	/* Loop over second layer nodes */
+	for (i = 0; i < learn->num_hidden2; i++)
 	{
-		/* Free inputs */
-		free(learn->past_input[i]);
+		/* Scale error by derivative of node result */
+		corr[i] *= 1 - learn->hidden2_result[i] * learn->hidden2_result[i];
 	}
 
-	/* Clear number of past inputs */
-	learn->num_past = 0;
+	/* Loop over first layer nodes (and bias) */
+	for (j = 0; j < learn->num_hidden + 1; j++)
+	{
+		/* Get weight and delta rows */
+		w_row = learn->hidden2_weight[j];
+		d_row = learn->hidden2_delta[j];
+
+		/* Get hidden result */
+		h = learn->hidden_result[j];
+
+		/* Clear error sum */
+		error = 0.0;
+
+		/* Loop over second layer nodes */
+		for (i = 0; i < learn->num_hidden2; i++)
+		{
+			/* Adjust delta */
+			d_row[i] -= learn->alpha * corr[i] * h;
+
+			/* Sum weights by error */
+			error += w_row[i] * corr[i];
+		}
+
+		/* Compute first layer node's error (bias has none) */
+		if (j < learn->num_hidden) learn->hidden_error[j] += error;
+	}
+
+	/* Clear second layer errors */
+	memset(corr, 0, sizeof(double) * learn->num_hidden2);
 }
 
 /*
  * Train a network so that the current results are more like the desired.
+ *
+ * With output probabilities p and error e, the softmax derivative of
+ * output i with respect to hidden node j reduces to
+ *
+ *   p[i] * (w[j][i] - sum over k of w[j][k] * p[k])
+ *
+ * so the sum is computed once per hidden node.
+ *
+ * Most inputs are -1.  A hidden weight delta of c * x is split into -c,
+ * which is common to all inputs, and c * (x + 1), which is zero for -1
+ * inputs.  Only the common part and the inputs that are not -1 are
+ * touched here; apply_training() adds the common part to every row.
  */
 void train_net(net *learn, double lambda, double *desired)
 {
-	int i, j, k;
-	double error, corr, deriv, hderiv;
-	double *hidden_corr;
+	int i, j;
+	double error, sum, wsum, h, factor;
+	double *w_row, *d_row, *corr, *last_error;
+
+	/* Get errors of last hidden layer */
+	last_error = learn->num_hidden2 ? learn->hidden2_error :
+	                                  learn->hidden_error;
 
 	/* Count error events */
 	learn->num_error += lambda;
 
+	/* Clear sum of weighted errors */
+	sum = 0.0;
+
 	/* Loop over output nodes */
 	for (i = 0; i < learn->num_output; i++)
 	{
@@ -388,72 +752,98 @@ void train_net(net *learn, double lambda, double *desired)
 		/* Accumulate squared error */
 		learn->error += error * error;
 
-		/* Output portion of partial derivatives */
-		deriv = learn->win_prob[i] * (1.0 - learn->win_prob[i]);
+		/* Weight error by output probability */
+		learn->output_error[i] = error * learn->win_prob[i];
 
-		/* Loop over node's weights */
-		for (j = 0; j < learn->num_hidden; j++)
-		{
-			/* Compute correction */
-			corr = -error * learn->hidden_result[j] * deriv;
+		/* Add to sum of weighted errors */
+		sum += learn->output_error[i];
 
-			/* Compute hidden node's effect on output */
-			hderiv = deriv * learn->output_weight[j][i];
+		/* Compute error gradient of output */
+		learn->output_grad[i] = learn->alpha * learn->output_error[i] *
+		                        (1.0 - learn->win_prob[i]);
+	}
 
-			/* Loop over other output nodes */
-			for (k = 0; k < learn->num_output; k++)
-			{
-				/* Skip this output node */
-				if (i == k) continue;
-
-				/* Subtract this node's factor */
-				hderiv -= learn->output_weight[j][k] *
-				          learn->net_result[i] *
-				          learn->net_result[k] /
-				          (learn->prob_sum * learn->prob_sum);
-			}
+	/* Loop over last hidden layer nodes (and bias) */
+	for (j = 0; j < learn->num_last + 1; j++)
+	{
+		/* Get weight and delta rows */
+		w_row = learn->output_weight[j];
+		d_row = learn->output_delta[j];
 
-			/* Compute hidden node's error */
-			learn->hidden_error[j] += error * hderiv;
+		/* Get hidden result */
+		h = learn->last_result[j];
 
-			/* Apply correction */
-			learn->output_delta[j][i] += learn->alpha * corr;
+		/* Apply output corrections */
+		for (i = 0; i < learn->num_output; i++)
+		{
+			/* Adjust delta */
+			d_row[i] -= learn->output_grad[i] * h;
 		}
 
-		/* Compute bias weight's correction */
-		learn->output_delta[j][i] += learn->alpha * -error * deriv;
-	}
+		/* Bias node has no error */
+		if (j == learn->num_last) break;
 
-	/* Create array of hidden weight correction factors */
-	hidden_corr = (double *)malloc(sizeof(double) * learn->num_hidden);
+		/* Clear sums */
+		wsum = error = 0.0;
 
-	/* Loop over hidden nodes */
-	for (i = 0; i < learn->num_hidden; i++)
-	{
-		/* Output portion of partial derivatives */
-		deriv = 1 - (learn->hidden_result[i] * learn->hidden_result[i]);
+		/* Loop over output nodes */
+		for (i = 0; i < learn->num_output; i++)
+		{
+			/* Sum weights by probability */
+			wsum += w_row[i] * learn->win_prob[i];
 
+			/* Sum weights by weighted error */
+			error += w_row[i] * learn->output_error[i];
+		}
+
+		/* Compute hidden node's error */
+		last_error[j] += error - wsum * sum;
+	}
+
+	/* Pass errors through second hidden layer */
+	if (learn->num_hidden2) train_hidden2(learn);
+
+	/* Use hidden error array for correction factors */
+	corr = learn->hidden_error;
+
+	/* Loop over hidden nodes */
+	for (j = 0; j < learn->num_hidden; j++)
+	{
 		/* Calculate correction factor */
-		hidden_corr[i] = deriv * -learn->hidden_error[i] * learn->alpha;
+		corr[j] *= -(1 - learn->hidden_result[j] *
+		                 learn->hidden_result[j]) * learn->alpha;
+
+		/* Add part common to all inputs */
+		learn->common_delta[j] -= corr[j];
 	}
 
-	/* Loop over inputs */
+	/* Loop over inputs (and bias) */
 	for (i = 0; i < learn->num_inputs + 1; i++)
 	{
-		/* Skip zero inputs */
-		if (!learn->input_value[i]) continue;
+		/* Compute remaining factor */
+		factor = learn->input_value[i] + 1;
+
+		/* Skip inputs with nothing remaining */
+		if (!factor) continue;
+
+		/* Get delta row */
+		d_row = learn->hidden_delta[i];
 
 		/* Loop over hidden nodes */
 		for (j = 0; j < learn->num_hidden; j++)
 		{
 			/* Adjust weight */
-			learn->hidden_delta[i][j] += hidden_corr[j] *
-			                                  learn->input_value[i];
+			d_row[j] += corr[j] * factor;
 		}
-	}
 
-	/* Destroy hidden correction factor array */
-	free(hidden_corr);
+		/* Check for row not yet marked */
+		if (!learn->row_dirty[i])
+		{
+			/* Mark row */
+			learn->row_dirty[i] = 1;
+			learn->dirty_row[learn->num_dirty++] = i;
+		}
+	}
 
 	/* Loop over hidden nodes */
 	for (i = 0; i < learn->num_hidden; i++)
@@ -467,14 +857,6 @@ void train_net(net *learn, double lambda, double *desired)
 
 	/* Clear previous inputs */
 	memset(learn->prev_input, 0, sizeof(double) * (learn->num_inputs + 1));
-
-#ifdef NOISY
-	compute_net();
-	for (i = 0; i < learn->num_output; i++)
-	{
-		printf("%lf -> %lf: %lf\n", orig[i], desired[i], learn->win_prob[i]);
-	}
-#endif
 }
 
 /*
@@ -483,9 +865,10 @@ void train_net(net *learn, double lambda, double *desired)
 void apply_training(net *learn)
 {
 	int i, j;
+	double *w_row, *d_row, *common = learn->common_delta;
 
-	/* Loop over hidden nodes */
-	for (i = 0; i < learn->num_hidden + 1; i++)
+	/* Loop over last hidden layer nodes */
+	for (i = 0; i < learn->num_last + 1; i++)
 	{
 		/* Loop over output nodes */
 		for (j = 0; j < learn->num_output; j++)
@@ -498,19 +881,182 @@ void apply_training(net *learn)
 		}
 	}
 
+	/* Loop over first layer nodes */
+	for (i = 0; learn->num_hidden2 && i < learn->num_hidden + 1; i++)
+	{
+		/* Loop over second layer nodes */
+		for (j = 0; j < learn->num_hidden2; j++)
+		{
+			/* Apply training */
+			learn->hidden2_weight[i][j] += learn->hidden2_delta[i][j];
+
+			/* Clear delta */
+			learn->hidden2_delta[i][j] = 0;
+		}
+	}
+
+	/* Nothing more to do if no training was done */
+	if (!learn->num_dirty) return;
+
+	/* Loop over rows with accumulated deltas */
+	for (i = 0; i < learn->num_dirty; i++)
+	{
+		/* Get rows */
+		w_row = learn->hidden_weight[learn->dirty_row[i]];
+		d_row = learn->hidden_delta[learn->dirty_row[i]];
+
+		/* Loop over hidden nodes */
+		for (j = 0; j < learn->num_hidden; j++)
+		{
+			/* Apply training (pruned rows stay zero) */
+			if (!learn->input_pruned[learn->dirty_row[i]])
+				w_row[j] += d_row[j];
+
+			/* Clear delta */
+			d_row[j] = 0;
+		}
+
+		/* Clear mark */
+		learn->row_dirty[learn->dirty_row[i]] = 0;
+	}
+
+	/* No rows left with deltas */
+	learn->num_dirty = 0;
+
 	/* Loop over input values */
 	for (i = 0; i < learn->num_inputs + 1; i++)
 	{
+		/* Skip pruned inputs */
+		if (learn->input_pruned[i]) continue;
+
+		/* Get row */
+		w_row = learn->hidden_weight[i];
+
 		/* Loop over hidden nodes */
 		for (j = 0; j < learn->num_hidden; j++)
 		{
-			/* Apply training */
-			learn->hidden_weight[i][j] += learn->hidden_delta[i][j];
+			/* Apply common training */
+			w_row[j] += common[j];
+		}
+	}
 
-			/* Clear delta */
-			learn->hidden_delta[i][j] = 0;
+	/* Clear common delta */
+	memset(common, 0, sizeof(double) * learn->num_hidden);
+}
+
+/*
+ * Forget the stored hidden sums, so that they are recomputed from scratch.
+ *
+ * Needed whenever the weights change other than through training.
+ */
+static void reset_sums(net *learn)
+{
+	/* Clear hidden sums */
+	memset(learn->hidden_sum, 0, sizeof(double) * learn->num_hidden);
+
+	/* Clear previous inputs */
+	memset(learn->prev_input, 0, sizeof(double) * (learn->num_inputs + 1));
+
+	/* Clear quantized sums */
+	if (learn->q_bits)
+		memset(learn->q_sum, 0, sizeof(int32_t) * learn->num_hidden);
+}
+
+/*
+ * Copy weights and training counters from one network to another of the
+ * same size.
+ */
+void copy_net(net *dst, net *src)
+{
+	int i;
+
+	/* Copy hidden weight rows */
+	for (i = 0; i < src->num_inputs + 1; i++)
+	{
+		/* Copy row */
+		memcpy(dst->hidden_weight[i], src->hidden_weight[i],
+		       sizeof(double) * src->num_hidden);
+	}
+
+	/* Copy second layer weight rows */
+	for (i = 0; src->num_hidden2 && i < src->num_hidden + 1; i++)
+	{
+		/* Copy row */
+		memcpy(dst->hidden2_weight[i], src->hidden2_weight[i],
+		       sizeof(double) * src->num_hidden2);
+	}
+
+	/* Copy output weight rows */
+	for (i = 0; i < src->num_last + 1; i++)
+	{
+		/* Copy row */
+		memcpy(dst->output_weight[i], src->output_weight[i],
+		       sizeof(double) * src->num_output);
+	}
+
+	/* Copy pruned inputs */
+	memcpy(dst->input_pruned, src->input_pruned, src->num_inputs + 1);
+
+	/* Copy counters */
+	dst->error = src->error;
+	dst->num_error = src->num_error;
+	dst->num_training = src->num_training;
+
+	/* Old hidden sums are no longer valid */
+	reset_sums(dst);
+}
+
+/*
+ * Add the training a copy of a network has done since it was copied from
+ * the given base network.
+ */
+void merge_net(net *dst, net *src, net *base)
+{
+	int i, j;
+
+	/* Loop over hidden weight rows */
+	for (i = 0; i < src->num_inputs + 1; i++)
+	{
+		/* Loop over hidden nodes */
+		for (j = 0; j < src->num_hidden; j++)
+		{
+			/* Add change of weight */
+			dst->hidden_weight[i][j] += src->hidden_weight[i][j] -
+			                            base->hidden_weight[i][j];
 		}
 	}
+
+	/* Loop over second layer weight rows */
+	for (i = 0; src->num_hidden2 && i < src->num_hidden + 1; i++)
+	{
+		/* Loop over second layer nodes */
+		for (j = 0; j < src->num_hidden2; j++)
+		{
+			/* Add change of weight */
+			dst->hidden2_weight[i][j] += src->hidden2_weight[i][j] -
+			                             base->hidden2_weight[i][j];
+		}
+	}
+
+	/* Loop over output weight rows */
+	for (i = 0; i < src->num_last + 1; i++)
+	{
+		/* Loop over output nodes */
+		for (j = 0; j < src->num_output; j++)
+		{
+			/* Add change of weight */
+			dst->output_weight[i][j] += src->output_weight[i][j] -
+			                            base->output_weight[i][j];
+		}
+	}
+
+	/* Add change of counters */
+	dst->error += src->error - base->error;
+	dst->num_error += src->num_error - base->num_error;
+	dst->num_training += src->num_training - base->num_training;
+
+	/* Old hidden sums are no longer valid */
+	reset_sums(dst);
 }
 
 /*
@@ -520,45 +1066,56 @@ void free_net(net *learn)
 {
 	int i;
 
-	/* Free simple arrays */
+	/* Free arrays used while computing */
 	free(learn->input_value);
 	free(learn->prev_input);
 	free(learn->hidden_sum);
 	free(learn->hidden_result);
 	free(learn->hidden_error);
+	free(learn->hidden2_result);
+	free(learn->hidden2_error);
 	free(learn->net_result);
 	free(learn->win_prob);
-
-	/* Free rows of hidden weights */
-	for (i = 0; i < learn->num_inputs + 1; i++)
+	free(learn->output_error);
+	free(learn->output_grad);
+	free(learn->common_delta);
+	free(learn->dirty_row);
+	free(learn->row_dirty);
+
+	/* Free values of past input sets */
+	for (i = 0; i < PAST_MAX; i++)
 	{
-		/* Free weight row */
-		free(learn->hidden_weight[i]);
-		free(learn->hidden_delta[i]);
+		/* Free other values */
+		free(learn->past[i].value);
 	}
 
-	/* Free list of rows */
-	free(learn->hidden_weight);
-	free(learn->hidden_delta);
+	/* Free past input sets */
+	free(learn->past);
+	free(learn->past_bits);
 
-	/* Free rows of output weights */
-	for (i = 0; i < learn->num_hidden + 1; i++)
+	/* Check for weights of another network */
+	if (learn->shared)
 	{
-		/* Free weight row */
-		free(learn->output_weight[i]);
-		free(learn->output_delta[i]);
+		/* Free own integer sums */
+		free(learn->q_sum);
+
+		/* Leave the rest to the original network */
+		return;
 	}
 
-	/* Free list of rows */
-	free(learn->output_weight);
-	free(learn->output_delta);
+	/* Free pruned input flags */
+	free(learn->input_pruned);
 
-	/* Clear old past input sets */
-	clear_store(learn);
+	/* Free quantized weights */
+	unquantize_net(learn);
 
-	/* Free list of past inputs */
-	free(learn->past_input);
-	free(learn->past_input_player);
+	/* Free weights */
+	free_layer(learn->hidden_weight, learn->hidden_delta,
+	           learn->num_inputs + 1);
+	free_layer(learn->hidden2_weight, learn->hidden2_delta,
+	           learn->num_hidden + 1);
+	free_layer(learn->output_weight, learn->output_delta,
+	           learn->num_last + 1);
 
 	/* Free input names */
 	for (i = 0; i < learn->num_inputs; i++)
@@ -571,14 +1128,267 @@ void free_net(net *learn)
 	free(learn->input_name);
 }
 
+/*
+ * Remove an input from a network, so that it no longer has any effect.
+ */
+void prune_input(net *learn, int input)
+{
+	/* Clear weights */
+	memset(learn->hidden_weight[input], 0, sizeof(double) *
+	                                       learn->num_hidden);
+
+	/* Mark input */
+	learn->input_pruned[input] = 1;
+
+	/* Old hidden sums are no longer valid */
+	reset_sums(learn);
+}
+
+/*
+ * Read the size of the network stored in a weights file.
+ */
+int read_net_size(char *fname, int *input, int *hidden, int *output)
+{
+	FILE *fff;
+	int rv;
+
+	/* Open weights file */
+	fff = fopen(fname, "r");
+
+	/* Check for failure */
+	if (!fff) return -1;
+
+	/* Read network size from file */
+	rv = fscanf(fff, "%d %d %d\n", input, hidden, output);
+
+	/* Done */
+	fclose(fff);
+
+	/* Check for failure */
+	return rv == 3 ? 0 : -1;
+}
+
+/*
+ * Use integer copies of the hidden weights when computing the network.
+ *
+ * Each integer step is worth the given amount, and weights too large to
+ * be represented are clipped.  Computing the network then no longer uses
+ * the hidden weights, so the network must not be trained.
+ */
+void quantize_net(net *learn, int bits, double scale)
+{
+	int i, j, n = learn->num_hidden;
+	double max = bits == 8 ? 127 : 32767, x;
+
+	/* Forget old integer weights */
+	unquantize_net(learn);
+
+	/* Create integer weights */
+	if (bits == 8)
+		learn->q_weight8 = (int8_t *)malloc(sizeof(int8_t) *
+		                                    (learn->num_inputs + 1) * n);
+	else
+		learn->q_weight16 = (int16_t *)malloc(sizeof(int16_t) *
+		                                      (learn->num_inputs + 1) * n);
+
+	/* Loop over weight rows */
+	for (i = 0; i < learn->num_inputs + 1; i++)
+	{
+		/* Loop over hidden nodes */
+		for (j = 0; j < n; j++)
+		{
+			/* Compute nearest step */
+			x = floor(learn->hidden_weight[i][j] / scale + 0.5);
+
+			/* Clip to range */
+			if (x > max) x = max;
+			if (x < -max) x = -max;
+
+			/* Store weight */
+			if (bits == 8) learn->q_weight8[i * n + j] = x;
+			else learn->q_weight16[i * n + j] = x;
+		}
+	}
+
+	/* Create integer sums */
+	learn->q_sum = (int32_t *)calloc(n, sizeof(int32_t));
+
+	/* Remember quantization */
+	learn->q_bits = bits;
+	learn->q_scale = scale;
+
+	/* Old hidden sums are no longer valid */
+	reset_sums(learn);
+}
+
+/*
+ * Go back to computing the network with the original weights.
+ */
+void unquantize_net(net *learn)
+{
+	/* Check for no integer weights */
+	if (!learn->q_bits) return;
+
+	/* Free integer weights and sums */
+	free(learn->q_weight8);
+	free(learn->q_weight16);
+	free(learn->q_sum);
+
+	/* Clear pointers */
+	learn->q_weight8 = NULL;
+	learn->q_weight16 = NULL;
+	learn->q_sum = NULL;
+
+	/* Use original weights */
+	learn->q_bits = 0;
+
+	/* Old hidden sums are no longer valid */
+	reset_sums(learn);
+}
+
+/*
+ * Create the name of the quantization file kept next to a weights file.
+ *
+ * A ".net" suffix is replaced by ".quant".
+ */
+static void quant_name(char *dst, int size, char *fname)
+{
+	int len = strlen(fname);
+
+	/* Check for weights file suffix */
+	if (len > 4 && !strcmp(fname + len - 4, ".net"))
+	{
+		/* Replace suffix */
+		snprintf(dst, size, "%.*s.quant", len - 4, fname);
+	}
+	else
+	{
+		/* Add suffix */
+		snprintf(dst, size, "%s.quant", fname);
+	}
+}
+
+/*
+ * Load the quantization of a network from the file kept next to the
+ * given weights file, and quantize the network's current weights.
+ */
+int load_quant(net *learn, char *fname)
+{
+	FILE *fff;
+	char name[1024];
+	int input, hidden, output, bits;
+	double scale;
+
+	/* Create filename */
+	quant_name(name, sizeof(name), fname);
+
+	/* Open quantization file */
+	fff = fopen(name, "r");
+
+	/* Check for failure */
+	if (!fff) return -1;
+
+	/* Read network size, bits and scale */
+	if (fscanf(fff, "%d %d %d\n%d\n%lf\n", &input, &hidden, &output,
+	           &bits, &scale) != 5)
+	{
+		/* Failure */
+		fclose(fff);
+		return -1;
+	}
+
+	/* Done */
+	fclose(fff);
+
+	/* Check for mismatch */
+	if (input != learn->num_inputs ||
+	    hidden != learn->num_hidden ||
+	    output != learn->num_output) return -1;
+
+	/* Check for bad values */
+	if ((bits != 8 && bits != 16) || scale <= 0) return -1;
+
+	/* Quantize weights */
+	quantize_net(learn, bits, scale);
+
+	/* Success */
+	return 0;
+}
+
+/*
+ * Save the quantization of a network next to the given weights file.
+ */
+int save_quant(net *learn, char *fname)
+{
+	FILE *fff;
+	char name[1024];
+
+	/* Create filename */
+	quant_name(name, sizeof(name), fname);
+
+	/* Open output file */
+	fff = fopen(name, "w");
+
+	/* Check for failure */
+	if (!fff) return -1;
+
+	/* Save network size */
+	fprintf(fff, "%d %d %d\n", learn->num_inputs, learn->num_hidden,
+	                           learn->num_output);
+
+	/* Save bits and scale */
+	fprintf(fff, "%d\n%.17g\n", learn->q_bits, learn->q_scale);
+
+	/* Done */
+	return fclose(fff) ? -1 : 0;
+}
+
+/*
+ * Change the hidden layer sizes of a network.
+ *
+ * The input names and learning rate are kept, but the weights are new.
+ */
+static void resize_net(net *learn, int hidden, int hidden2)
+{
+	net tmp;
+	int i;
+
+	/* Create network of new size */
+	make_learner(&tmp, learn->num_inputs, hidden, hidden2,
+	             learn->num_output);
+
+	/* Move input names */
+	for (i = 0; i < learn->num_inputs; i++)
+	{
+		/* Move name */
+		tmp.input_name[i] = learn->input_name[i];
+		learn->input_name[i] = NULL;
+	}
+
+	/* Keep learning rate */
+	tmp.alpha = learn->alpha;
+
+	/* Destroy old network */
+	free_net(learn);
+
+	/* Use new network */
+	*learn = tmp;
+}
+
 /*
  * Load network weights from disk.
+ *
+ * The first line of the file gives the number of inputs, hidden nodes and
+ * outputs, followed by the number of second layer hidden nodes if there
+ * are any.  The network is resized to the hidden layers of the file.
+ *
+ * Inputs whose weights are all zero are marked as pruned.
  */
 int load_net(net *learn, char *fname)
 {
 	FILE *fff;
 	int i, j;
-	int input, hidden, output;
+	int input, hidden, output, hidden2 = 0;
 	char name[80];
 
 	/* Open weights file */
@@ -587,13 +1397,27 @@ int load_net(net *learn, char *fname)
 	/* Check for failure */
 	if (!fff) return -1;
 
-	/* Read network size from file */
-	if (fscanf(fff, "%d %d %d\n", &input, &hidden, &output) != 3) return -1;
+	/* Integer weights would no longer match */
+	unquantize_net(learn);
+
+	/* Read size line */
+	if (!fgets(name, 80, fff)) return -1;
+
+	/* Read network size */
+	if (sscanf(name, "%d %d %d %d", &input, &hidden, &output,
+	           &hidden2) < 3) return -1;
 
 	/* Check for mismatch */
 	if (input != learn->num_inputs ||
-	    hidden != learn->num_hidden ||
-	    output != learn->num_output) return -1;
+	    output != learn->num_output ||
+	    hidden < 1 || hidden2 < 0) return -1;
+
+	/* Check for different hidden layers */
+	if (hidden != learn->num_hidden || hidden2 != learn->num_hidden2)
+	{
+		/* Resize network */
+		resize_net(learn, hidden, hidden2);
+	}
 
 	/* Read number of training iterations */
 	if (fscanf(fff, "%d\n", &learn->num_training) != 1) return -1;
@@ -634,11 +1458,23 @@ int load_net(net *learn, char *fname)
 		}
 	}
 
+	/* Loop over second layer nodes */
+	for (i = 0; i < learn->num_hidden2; i++)
+	{
+		/* Loop over weights */
+		for (j = 0; j < learn->num_hidden + 1; j++)
+		{
+			/* Load a weight */
+			if (fscanf(fff, "%lf\n",
+			           &learn->hidden2_weight[j][i]) != 1) return -1;
+		}
+	}
+
 	/* Loop over output nodes */
 	for (i = 0; i < learn->num_output; i++)
 	{
 		/* Loop over weights */
-		for (j = 0; j < learn->num_hidden + 1; j++)
+		for (j = 0; j < learn->num_last + 1; j++)
 		{
 			/* Load a weight */
 			if (fscanf(fff, "%lf\n",
@@ -646,6 +1482,23 @@ int load_net(net *learn, char *fname)
 		}
 	}
 
+	/* Loop over inputs */
+	for (i = 0; i < learn->num_inputs; i++)
+	{
+		/* Look for nonzero weight */
+		for (j = 0; j < learn->num_hidden; j++)
+		{
+			/* Check weight */
+			if (learn->hidden_weight[i][j] != 0) break;
+		}
+
+		/* Mark input as pruned if no weight found */
+		learn->input_pruned[i] = (j == learn->num_hidden);
+	}
+
+	/* Old hidden sums are no longer valid */
+	reset_sums(learn);
+
 	/* Done */
 	fclose(fff);
 
@@ -655,18 +1508,34 @@ int load_net(net *learn, char *fname)
 
 /*
  * Save network weights to disk.
+ *
+ * The weights are written to a temporary file first, which then replaces
+ * the old file, so that an interrupted save never leaves a partial file.
  */
-void save_net(net *learn, char *fname)
+int save_net(net *learn, char *fname)
 {
 	FILE *fff;
+	char tmp[1024];
 	int i, j;
 
+	/* Create temporary filename */
+	snprintf(tmp, sizeof(tmp), "%s.tmp", fname);
+
 	/* Open output file */
-	fff = fopen(fname, "w");
+	fff = fopen(tmp, "w");
+
+	/* Check for failure */
+	if (!fff) return -1;
 
 	/* Save network size */
-	fprintf(fff, "%d %d %d\n", learn->num_inputs, learn->num_hidden,
-	                           learn->num_output);
+	fprintf(fff, "%d %d %d", learn->num_inputs, learn->num_hidden,
+	                         learn->num_output);
+
+	/* Save second layer size if any */
+	if (learn->num_hidden2) fprintf(fff, " %d", learn->num_hidden2);
+
+	/* End line */
+	fprintf(fff, "\n");
 
 	/* Save training iterations */
 	fprintf(fff, "%d\n", learn->num_training);
@@ -698,17 +1567,276 @@ void save_net(net *learn, char *fname)
 		}
 	}
 
+	/* Loop over second layer nodes */
+	for (i = 0; i < learn->num_hidden2; i++)
+	{
+		/* Loop over weights */
+		for (j = 0; j < learn->num_hidden + 1; j++)
+		{
+			/* Save a weight */
+			fprintf(fff, "%.12le\n", learn->hidden2_weight[j][i]);
+		}
+	}
+
 	/* Loop over output nodes */
 	for (i = 0; i < learn->num_output; i++)
 	{
 		/* Loop over weights */
-		for (j = 0; j < learn->num_hidden + 1; j++)
+		for (j = 0; j < learn->num_last + 1; j++)
 		{
 			/* Save a weight */
 			fprintf(fff, "%.12le\n", learn->output_weight[j][i]);
 		}
 	}
 
+	/* Check for write failure */
+	if (ferror(fff))
+	{
+		/* Remove partial file */
+		fclose(fff);
+		remove(tmp);
+		return -1;
+	}
+
 	/* Done */
-	fclose(fff);
+	if (fclose(fff)) return -1;
+
+	/* Replace old file */
+	if (rename(tmp, fname)) return -1;
+
+	/* Success */
+	return 0;
+}
+
+/*
+ * Print the effect of each input on the network outputs.
+ *
+ * Each line gives the change in output probabilities when a single input
+ * is set, compared to all inputs being clear.
+ */
+void dump_net(net *learn, FILE *fff)
+{
+	double *start;
+	char buf[1024], *ptr;
+	int i, j;
+
+	/* Clear all inputs */
+	for (i = 0; i < learn->num_inputs; i++) learn->input_value[i] = -1;
+
+	/* Compute network */
+	compute_net(learn);
+
+	/* Create array of starting probabilities */
+	start = (double *)malloc(sizeof(double) * learn->num_output);
+
+	/* Remember starting probabilities */
+	for (i = 0; i < learn->num_output; i++)
+	{
+		/* Copy probability */
+		start[i] = learn->win_prob[i];
+	}
+
+	/* Loop over inputs */
+	for (i = 0; i < learn->num_inputs; i++)
+	{
+		/* Set this input */
+		learn->input_value[i] = 1;
+
+		/* Compute network */
+		compute_net(learn);
+
+		/* Copy input name */
+		strcpy(buf, learn->input_name[i] ? learn->input_name[i] : "");
+
+		/* Replace spaces */
+		for (ptr = buf; *ptr; ptr++) if (*ptr == ' ') *ptr = '_';
+
+		/* Print input name */
+		fprintf(fff, "%s: ", buf);
+
+		/* Loop over outputs */
+		for (j = 0; j < learn->num_output; j++)
+		{
+			/* Print change in probability */
+			fprintf(fff, "%f ", learn->win_prob[j] - start[j]);
+		}
+
+		/* End line */
+		fprintf(fff, "\n");
+
+		/* Clear input again */
+		learn->input_value[i] = -1;
+	}
+
+	/* Destroy starting probabilities */
+	free(start);
+}
+
+/*
+ * Open an experience log for appending training samples of a network.
+ *
+ * A new log starts with a header giving the network size and input
+ * names.  When appending to an existing log, its header must match the
+ * network.  Returns NULL on failure.
+ */
+FILE *open_experience(net *learn, char *fname)
+{
+	FILE *fff;
+	int32_t size[2];
+	char magic[8], *name;
+	int i, c;
+
+	/* Open log for appending */
+	fff = fopen(fname, "a+b");
+
+	/* Check for failure */
+	if (!fff) return NULL;
+
+	/* Check for empty file */
+	fseek(fff, 0, SEEK_END);
+	if (ftell(fff) == 0)
+	{
+		/* Create header */
+		size[0] = learn->num_inputs;
+		size[1] = learn->num_output;
+
+		/* Write magic string and network size */
+		fwrite(EXP_MAGIC, 1, 8, fff);
+		fwrite(size, sizeof(int32_t), 2, fff);
+
+		/* Write input names */
+		for (i = 0; i < learn->num_inputs; i++)
+		{
+			/* Get name */
+			name = learn->input_name[i] ? learn->input_name[i] : "";
+
+			/* Write name with terminator */
+			fwrite(name, 1, strlen(name) + 1, fff);
+		}
+
+		/* Done */
+		fflush(fff);
+		return fff;
+	}
+
+	/* Read existing header */
+	rewind(fff);
+	if (fread(magic, 1, 8, fff) != 8 ||
+	    fread(size, sizeof(int32_t), 2, fff) != 2 ||
+	    memcmp(magic, EXP_MAGIC, 8) ||
+	    size[0] != learn->num_inputs || size[1] != learn->num_output)
+	{
+		/* Log belongs to a different network */
+		fclose(fff);
+		return NULL;
+	}
+
+	/* Compare input names */
+	for (i = 0; i < learn->num_inputs; i++)
+	{
+		/* Get name */
+		name = learn->input_name[i] ? learn->input_name[i] : "";
+
+		/* Compare characters including terminator */
+		do
+		{
+			/* Read character */
+			c = fgetc(fff);
+
+			/* Check for mismatch */
+			if (c != (unsigned char)*name)
+			{
+				/* Log belongs to a different network */
+				fclose(fff);
+				return NULL;
+			}
+
+		} while (*name++);
+	}
+
+	/* Writes go to end of file */
+	fseek(fff, 0, SEEK_END);
+
+	/* Success */
+	return fff;
+}
+
+/*
+ * Append one training sample to an experience log.
+ *
+ * Most inputs are -1, so only the index and value of other inputs are
+ * stored.  A record is:
+ *
+ *   uint16 number of stored inputs
+ *   uint8 player, uint8 number of outputs
+ *   float outcome[outputs]
+ *   uint16 index[stored inputs]
+ *   float value[stored inputs]
+ *
+ * The record is written with a single call, so several threads can share
+ * one log.
+ */
+void write_experience(FILE *fff, net *learn, double *input, int who,
+                      double *outcome)
+{
+	unsigned char *buf, *ptr;
+	uint16_t num = 0, idx;
+	float val;
+	int i;
+
+	/* Count inputs to store */
+	for (i = 0; i < learn->num_inputs; i++)
+	{
+		/* Count inputs that are set */
+		if (input[i] != -1) num++;
+	}
+
+	/* Create record buffer */
+	buf = (unsigned char *)malloc(4 + sizeof(float) * learn->num_output +
+	                              (sizeof(uint16_t) + sizeof(float)) * num);
+
+	/* Store number of inputs, player and number of outputs */
+	memcpy(buf, &num, sizeof(uint16_t));
+	buf[2] = who;
+	buf[3] = learn->num_output;
+	ptr = buf + 4;
+
+	/* Store outcome */
+	for (i = 0; i < learn->num_output; i++)
+	{
+		/* Store one output */
+		val = outcome[i];
+		memcpy(ptr, &val, sizeof(float));
+		ptr += sizeof(float);
+	}
+
+	/* Store indices of set inputs */
+	for (i = 0; i < learn->num_inputs; i++)
+	{
+		/* Skip clear inputs */
+		if (input[i] == -1) continue;
+
+		/* Store index */
+		idx = i;
+		memcpy(ptr, &idx, sizeof(uint16_t));
+		ptr += sizeof(uint16_t);
+	}
+
+	/* Store values of set inputs */
+	for (i = 0; i < learn->num_inputs; i++)
+	{
+		/* Skip clear inputs */
+		if (input[i] == -1) continue;
+
+		/* Store value */
+		val = input[i];
+		memcpy(ptr, &val, sizeof(float));
+		ptr += sizeof(float);
+	}
+
+	/* Write record */
+	fwrite(buf, 1, ptr - buf, fff);
+
+	/* Destroy buffer */
+	free(buf);
 }
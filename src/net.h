@@ -22,9 +22,39 @@
 #include <stdlib.h>
 #include <string.h>
 #include <math.h>
+#ifdef WIN32
+#include "stdint.h"
+#else
+#include <stdint.h>
+#endif
 
 /*
- * A two-layer neural net.
+ * A stored set of past inputs.
+ *
+ * Nearly all inputs are -1 or 1, so these are kept as bits.  Inputs with
+ * other values are flagged and their values kept separately.
+ */
+typedef struct past_set
+{
+	/* Player who created inputs */
+	int who;
+
+	/* Inputs equal to 1 */
+	uint32_t *one;
+
+	/* Inputs with values other than -1 and 1 */
+	uint32_t *other;
+
+	/* Values of other inputs (in input order) */
+	float *value;
+
+	/* Number of other values, and space allocated for them */
+	int num_value, value_size;
+
+} past_set;
+
+/*
+ * A neural net with one or two hidden layers.
  */
 typedef struct net
 {
@@ -43,6 +73,12 @@ typedef struct net
 	/* Number of hidden nodes */
 	int num_hidden;
 
+	/* Number of nodes in second hidden layer (0 if none) */
+	int num_hidden2;
+
+	/* Number of nodes in last hidden layer */
+	int num_last;
+
 	/* Number of output nodes */
 	int num_output;
 
@@ -52,6 +88,12 @@ typedef struct net
 	/* Accumulated deltas to hidden weights */
 	double **hidden_delta;
 
+	/* Second hidden layer weights */
+	double **hidden2_weight;
+
+	/* Accumulated deltas to second hidden layer weights */
+	double **hidden2_delta;
+
 	/* Output layer weights */
 	double **output_weight;
 
@@ -64,6 +106,38 @@ typedef struct net
 	/* Cumulative hidden node error */
 	double *hidden_error;
 
+	/* Accumulated delta common to all hidden weight rows */
+	double *common_delta;
+
+	/* Hidden weight rows with accumulated deltas */
+	int *dirty_row;
+	int num_dirty;
+
+	/* Flag for each hidden weight row with accumulated deltas */
+	char *row_dirty;
+
+	/* Flag for each input that has been pruned (all weights zero) */
+	char *input_pruned;
+
+	/* Bits of quantized hidden weights (0 if not quantized) */
+	int q_bits;
+
+	/* Value of one step of quantized hidden weights */
+	double q_scale;
+
+	/* Quantized hidden weights (one row of hidden nodes per input) */
+	int8_t *q_weight8;
+	int16_t *q_weight16;
+
+	/* Hidden node sums of quantized weights */
+	int32_t *q_sum;
+
+	/* Output errors weighted by output probability */
+	double *output_error;
+
+	/* Output error gradients */
+	double *output_grad;
+
 	/* Set of input values */
 	double *input_value;
 
@@ -73,6 +147,15 @@ typedef struct net
 	/* Set of hidden results */
 	double *hidden_result;
 
+	/* Set of second hidden layer results */
+	double *hidden2_result;
+
+	/* Cumulative second hidden layer node error */
+	double *hidden2_error;
+
+	/* Results of last hidden layer */
+	double *last_result;
+
 	/* Set of network results */
 	double *net_result;
 
@@ -82,11 +165,14 @@ typedef struct net
 	/* Sum that we divide results by to get probablities */
 	double prob_sum;
 
-	/* Sets of past inputs */
-	double **past_input;
+	/* Ring buffer of past input sets */
+	past_set *past;
+
+	/* Bits of all past input sets */
+	uint32_t *past_bits;
 
-	/* Player who created past inputs */
-	int *past_input_player;
+	/* Position of next past input set to store */
+	int past_next;
 
 	/* Number of past input sets available */
 	int num_past;
@@ -97,15 +183,34 @@ typedef struct net
 	/* Names of inputs */
 	char **input_name;
 
+	/* Weights and input names belong to another network */
+	int shared;
+
 } net;
 
 /* External functions */
-extern void make_learner(net *learn, int inputs, int hidden, int output);
+extern void make_learner(net *learn, int inputs, int hidden, int hidden2,
+                         int output);
 extern void compute_net(net *learn);
 extern void store_net(net *learn, int who);
 extern void clear_store(net *learn);
+extern int past_player(net *learn, int age);
+extern void load_past(net *learn, int age);
 extern void train_net(net *learn, double lambda, double *desired);
 extern void apply_training(net *learn);
+extern void copy_net(net *dst, net *src);
+extern void share_net(net *dst, net *src);
+extern void merge_net(net *dst, net *src, net *base);
+extern void prune_input(net *learn, int input);
 extern void free_net(net *learn);
+extern int read_net_size(char *fname, int *input, int *hidden, int *output);
+extern void quantize_net(net *learn, int bits, double scale);
+extern void unquantize_net(net *learn);
+extern int load_quant(net *learn, char *fname);
+extern int save_quant(net *learn, char *fname);
 extern int load_net(net *learn, char *fname);
-extern void save_net(net *learn, char *fname);
+extern int save_net(net *learn, char *fname);
+extern void dump_net(net *learn, FILE *fff);
+extern FILE *open_experience(net *learn, char *fname);
+extern void write_experience(FILE *fff, net *learn, double *input, int who,
+                             double *outcome);
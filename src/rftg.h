@@ -604,9 +604,10 @@
 #define FORMAT_DEBUG "debug"
 
 /*
- * Forward declaration.
+ * Forward declarations.
  */
 struct game;
+struct net;
 
 /*
  * A card's special power.
@@ -1105,6 +1106,28 @@ typedef struct campaign_status
 
 } campaign_status;
 
+/*
+ * Counters of work done by the AI.
+ */
+typedef struct ai_stats
+{
+	/* Game state evaluations and cache hits */
+	long eval_lookup, eval_hit;
+
+	/* Evaluator network computations */
+	long eval_compute;
+
+	/* Role predictor network computations */
+	long role_compute;
+
+	/* Opponent placement cache lookups and hits */
+	long opp_place_lookup, opp_place_hit;
+
+	/* Finished games scored exactly */
+	long exact_eval;
+
+} ai_stats;
+
 
 /*
  * External variables.
@@ -1122,7 +1145,15 @@ extern char *search_name[MAX_SEARCH];
 extern char *player_labels[MAX_PLAYER];
 extern char *location_names[MAX_WHERE];
 extern decisions ai_func;
+extern decisions ai_fast_func;
 extern decisions gui_func;
+extern int ai_exact_endgame;
+extern int ai_train;
+extern int ai_share_nets;
+extern int ai_eval_hidden[2];
+extern int ai_role_hidden[2];
+extern FILE *ai_experience;
+extern FILE *ai_role_experience;
 
 /*
  * Macro functions.
@@ -1243,6 +1274,11 @@ extern void declare_winner(game *g);
 extern void ai_debug(game *g, double win_prob[MAX_PLAYER][MAX_PLAYER],
                               double *role[], double *action_score[],
                               int *num_action);
+extern void ai_set_factor(double factor);
+extern void ai_get_nets(struct net **e, struct net **r);
+extern void ai_swap_nets(struct net *e, struct net *r);
+extern void ai_get_stats(ai_stats *s);
+extern void ai_clear_stats(void);
 
 extern int load_game(game *g, char *filename);
 extern int save_game(game *g, char *filename, int player_us);
@@ -0,0 +1,818 @@
+/*
+ * Race for the Galaxy AI
+ *
+ * Copyright (C) 2009-2015 Keldon Jones
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * Batch simulator.
+ *
+ * Plays AI-only games with fixed networks on several threads, for
+ * balance analysis and for measuring the cost of the AI.
+ */
+
+#include "rftg.h"
+#include <pthread.h>
+
+/*
+ * Stack size of game threads.
+ */
+#define WORKER_STACK (32 * 1024 * 1024)
+
+/*
+ * Print messages?
+ */
+int verbose = 0;
+
+/*
+ * Game options.
+ */
+static int num_players = 2;
+static int expanded, advanced, promo;
+static int goal_disabled, takeover_disabled;
+static campaign *camp;
+
+/*
+ * Number of games and threads.
+ */
+static int num_games = 100, num_threads = 1;
+
+/*
+ * Random seed of first game.
+ */
+static unsigned int base_seed;
+
+/*
+ * Output files for per-game results and aggregated statistics.
+ */
+static FILE *csv_file, *json_file;
+
+/*
+ * Decision functions of simulated players (normal and fast AI tier).
+ */
+static decisions sim_func, sim_fast_func;
+
+/*
+ * Number of players using the fast AI tier.
+ */
+static int num_fast;
+
+/*
+ * Aggregated results.
+ */
+static struct
+{
+	/* Games finished */
+	int games;
+
+	/* Wins by position in turn order (shared wins count partially) */
+	double wins[MAX_PLAYER];
+
+	/* Sum of winning scores */
+	long win_vp;
+
+	/* Sum of rounds played */
+	long rounds;
+
+	/* Decisions made */
+	long decisions;
+
+	/* CPU time spent making decisions (seconds) */
+	double cpu;
+
+	/* Decisions made and CPU time spent by fast players */
+	long fast_decisions;
+	double fast_cpu;
+
+	/* AI work counters */
+	ai_stats ai;
+
+} total;
+
+/*
+ * Next game to play.
+ */
+static int next_game;
+
+/*
+ * Lock protecting results, output files and next game.
+ */
+static pthread_mutex_t sim_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * A thread playing simulated games.
+ */
+typedef struct sim_thread
+{
+	/* Thread identifier */
+	pthread_t thread;
+
+	/* Game being played */
+	game g;
+
+	/* Decisions made and CPU time spent in current game */
+	long decisions;
+	double cpu;
+
+	/* Part of the above by fast players */
+	long fast_decisions;
+	double fast_cpu;
+
+} sim_thread;
+
+/*
+ * Thread state of the calling thread.
+ */
+static __thread sim_thread *self;
+
+/*
+ * Print errors to standard output.
+ */
+void display_error(char *msg)
+{
+	/* Forward message */
+	printf("%s", msg);
+}
+
+/*
+ * Print messages to standard output.
+ */
+void message_add(game *g, char *msg)
+{
+	/* Print if verbose flag set */
+	if (verbose) printf("%s", msg);
+}
+
+/*
+ * Print messages to standard output.
+ */
+void message_add_formatted(game *g, char *msg, char *tag)
+{
+	/* Print without formatting */
+	message_add(g, msg);
+}
+
+/*
+ * Use simple random number generator.
+ */
+int game_rand(game *g)
+{
+	/* Call simple random number generator */
+	return simple_rand(&g->random_seed);
+}
+
+/*
+ * Return CPU time used by the calling thread, in seconds.
+ */
+static double thread_cpu(void)
+{
+	struct timespec ts;
+
+	/* Get thread time */
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+
+	/* Convert to seconds */
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * Make a choice with the AI, counting and timing it.
+ */
+static void sim_make_choice(game *g, int who, int type, int list[], int *nl,
+                            int special[], int *ns, int arg1, int arg2,
+                            int arg3)
+{
+	double start, used;
+
+	/* Remember start time */
+	start = thread_cpu();
+
+	/* Let AI choose */
+	ai_func.make_choice(g, who, type, list, nl, special, ns, arg1, arg2,
+	                    arg3);
+
+	/* Count decision and time */
+	used = thread_cpu() - start;
+	self->decisions++;
+	self->cpu += used;
+
+	/* Check for fast player */
+	if (g->p[who].control == &sim_fast_func)
+	{
+		/* Count decision and time */
+		self->fast_decisions++;
+		self->fast_cpu += used;
+	}
+}
+
+/*
+ * Simulated players never save anything.
+ */
+static void sim_shutdown(game *g, int who)
+{
+}
+
+/*
+ * Write the results of a finished game as CSV rows.
+ *
+ * Must be called with the simulator lock held.
+ */
+static void write_csv(game *g, int k, unsigned int seed)
+{
+	player *p_ptr;
+	int i;
+
+	/* Loop over players */
+	for (i = 0; i < g->num_players; i++)
+	{
+		/* Get player pointer */
+		p_ptr = &g->p[i];
+
+		/* Write row (player number is taken from "Player N" name) */
+		fprintf(csv_file, "%d,%u,%d,%d,\"%s\",%d,%d,%d,%d,%d,%d\n",
+		        k, seed, atoi(p_ptr->name + 7), i,
+		        g->deck[p_ptr->start].d_ptr->name, p_ptr->end_vp,
+		        p_ptr->vp, p_ptr->goal_vp, p_ptr->prestige,
+		        p_ptr->winner, g->round);
+	}
+}
+
+/*
+ * Add the results of a finished game.
+ *
+ * Must be called with the simulator lock held.
+ */
+static void add_results(sim_thread *t)
+{
+	game *g = &t->g;
+	double winners = 0;
+	int i;
+
+	/* Count game */
+	total.games++;
+
+	/* Count winners */
+	for (i = 0; i < g->num_players; i++) winners += g->p[i].winner;
+
+	/* Loop over players */
+	for (i = 0; i < g->num_players; i++)
+	{
+		/* Skip losers */
+		if (!g->p[i].winner) continue;
+
+		/* Count (possibly shared) win for turn order position */
+		total.wins[i] += 1.0 / winners;
+
+		/* Add winning score */
+		total.win_vp += g->p[i].end_vp;
+	}
+
+	/* Add rounds */
+	total.rounds += g->round;
+
+	/* Add decisions and time */
+	total.decisions += t->decisions;
+	total.cpu += t->cpu;
+	total.fast_decisions += t->fast_decisions;
+	total.fast_cpu += t->fast_cpu;
+}
+
+/*
+ * Play simulated games until all are done.
+ */
+static void *sim_main(void *arg)
+{
+	sim_thread *t = (sim_thread *)arg;
+	game *g = &t->g;
+	ai_stats s;
+	char buf[1024];
+	unsigned int seed;
+	int i, k;
+
+	/* Remember thread state */
+	self = t;
+
+	/* Set game options */
+	g->num_players = num_players;
+	g->expanded = expanded;
+	g->advanced = advanced;
+	g->promo = promo;
+	g->goal_disabled = goal_disabled;
+	g->takeover_disabled = takeover_disabled;
+	g->camp = camp;
+
+	/* Loop over players */
+	for (i = 0; i < g->num_players; i++)
+	{
+		/* Create player name */
+		sprintf(buf, "Player %d", i);
+		g->p[i].name = strdup(buf);
+
+		/* Set player interfaces to simulator functions */
+		g->p[i].control = i < num_fast ? &sim_fast_func : &sim_func;
+
+		/* Initialize AI without learning */
+		g->p[i].control->init(g, i, 0.0);
+
+		/* Create choice log for player */
+		g->p[i].choice_log = (int *)malloc(sizeof(int) * 4096);
+	}
+
+	/* Clear AI work counters */
+	ai_clear_stats();
+
+	/* Play games */
+	while (1)
+	{
+		/* Get next game */
+		pthread_mutex_lock(&sim_lock);
+		k = next_game++;
+		pthread_mutex_unlock(&sim_lock);
+
+		/* Check for all games started */
+		if (k >= num_games) break;
+
+		/* Seed game by its number */
+		seed = base_seed + k;
+		g->random_seed = seed;
+
+		/* Clear decision count */
+		t->decisions = t->fast_decisions = 0;
+		t->cpu = t->fast_cpu = 0;
+
+		/* Clear choice logs */
+		for (i = 0; i < g->num_players; i++)
+		{
+			/* Clear choice log size and position */
+			g->p[i].choice_size = 0;
+			g->p[i].choice_pos = 0;
+		}
+
+		/* Initialize game */
+		init_game(g);
+
+		/* Game is simulated game */
+		g->session_id = -2;
+
+		/* Begin game */
+		begin_game(g);
+
+		/* Play game rounds until finished */
+		while (game_round(g));
+
+		/* Score game */
+		score_game(g);
+
+		/* Declare winner */
+		declare_winner(g);
+
+		/* Call player game over functions */
+		for (i = 0; i < g->num_players; i++)
+		{
+			/* Call game over function */
+			g->p[i].control->game_over(g, i);
+		}
+
+		/* Add results */
+		pthread_mutex_lock(&sim_lock);
+		add_results(t);
+		if (csv_file) write_csv(g, k, seed);
+		pthread_mutex_unlock(&sim_lock);
+	}
+
+	/* Get AI work counters */
+	ai_get_stats(&s);
+
+	/* Add to totals */
+	pthread_mutex_lock(&sim_lock);
+	total.ai.eval_lookup += s.eval_lookup;
+	total.ai.eval_hit += s.eval_hit;
+	total.ai.eval_compute += s.eval_compute;
+	total.ai.role_compute += s.role_compute;
+	total.ai.opp_place_lookup += s.opp_place_lookup;
+	total.ai.opp_place_hit += s.opp_place_hit;
+	total.ai.exact_eval += s.exact_eval;
+	pthread_mutex_unlock(&sim_lock);
+
+	/* Done */
+	return NULL;
+}
+
+/*
+ * Return a ratio, or zero if the divisor is zero.
+ */
+static double ratio(double a, double b)
+{
+	/* Avoid division by zero */
+	return b ? a / b : 0.0;
+}
+
+/*
+ * Print aggregated statistics.
+ */
+static void print_stats(double wall)
+{
+	int i;
+
+	/* Print games */
+	printf("Games: %d (%d players, expansion %d%s%s%s%s%s%s)\n",
+	       total.games, num_players, expanded,
+	       advanced ? ", advanced" : "", promo ? ", promo" : "",
+	       goal_disabled ? ", no goals" : "",
+	       takeover_disabled ? ", no takeovers" : "",
+	       camp ? ", campaign " : "", camp ? camp->name : "");
+
+	/* Print speed */
+	printf("Threads: %d, time: %.1f s, games/s: %.2f, decisions/s: %.1f\n",
+	       num_threads, wall, ratio(total.games, wall),
+	       ratio(total.decisions, wall));
+
+	/* Print decision cost */
+	printf("Decisions: %ld, ms/decision: %.3f\n", total.decisions,
+	       1000.0 * ratio(total.cpu, total.decisions));
+
+	/* Print cost of both tiers */
+	if (num_fast)
+	{
+		/* Print decision cost */
+		printf("ms/decision: normal %.3f, fast %.3f\n",
+		       1000.0 * ratio(total.cpu - total.fast_cpu,
+		                      total.decisions - total.fast_decisions),
+		       1000.0 * ratio(total.fast_cpu, total.fast_decisions));
+	}
+
+	/* Print AI work */
+	printf("Eval calls: %ld, cache hits: %.1f%%, net computes: %ld, "
+	       "exact: %ld\n", total.ai.eval_lookup,
+	       100.0 * ratio(total.ai.eval_hit, total.ai.eval_lookup),
+	       total.ai.eval_compute, total.ai.exact_eval);
+	printf("Role computes: %ld, opp place lookups: %ld, "
+	       "cache hits: %.1f%%\n", total.ai.role_compute,
+	       total.ai.opp_place_lookup,
+	       100.0 * ratio(total.ai.opp_place_hit,
+	                     total.ai.opp_place_lookup));
+
+	/* Print results */
+	printf("Average rounds: %.2f, average winning score: %.2f\n",
+	       ratio(total.rounds, total.games),
+	       ratio(total.win_vp, total.games));
+
+	/* Print win rates by position */
+	printf("Win%% by position:");
+	for (i = 0; i < num_players; i++)
+		printf(" %.1f", 100.0 * ratio(total.wins[i], total.games));
+	printf("\n");
+}
+
+/*
+ * Write aggregated statistics as JSON.
+ */
+static void write_json(double wall)
+{
+	int i;
+
+	/* Write options */
+	fprintf(json_file, "{\n");
+	fprintf(json_file, "  \"players\": %d,\n", num_players);
+	fprintf(json_file, "  \"expansion\": %d,\n", expanded);
+	fprintf(json_file, "  \"advanced\": %d,\n", advanced);
+	fprintf(json_file, "  \"promo\": %d,\n", promo);
+	fprintf(json_file, "  \"goals_disabled\": %d,\n", goal_disabled);
+	fprintf(json_file, "  \"takeovers_disabled\": %d,\n",
+	        takeover_disabled);
+	fprintf(json_file, "  \"campaign\": \"%s\",\n", camp ? camp->name : "");
+	fprintf(json_file, "  \"seed\": %u,\n", base_seed);
+	fprintf(json_file, "  \"threads\": %d,\n", num_threads);
+	fprintf(json_file, "  \"fast_players\": %d,\n", num_fast);
+
+	/* Write speed */
+	fprintf(json_file, "  \"games\": %d,\n", total.games);
+	fprintf(json_file, "  \"seconds\": %.3f,\n", wall);
+	fprintf(json_file, "  \"games_per_sec\": %.3f,\n",
+	        ratio(total.games, wall));
+	fprintf(json_file, "  \"decisions\": %ld,\n", total.decisions);
+	fprintf(json_file, "  \"decisions_per_sec\": %.3f,\n",
+	        ratio(total.decisions, wall));
+	fprintf(json_file, "  \"ms_per_decision\": %.4f,\n",
+	        1000.0 * ratio(total.cpu, total.decisions));
+	fprintf(json_file, "  \"fast_decisions\": %ld,\n",
+	        total.fast_decisions);
+	fprintf(json_file, "  \"fast_ms_per_decision\": %.4f,\n",
+	        1000.0 * ratio(total.fast_cpu, total.fast_decisions));
+
+	/* Write AI work */
+	fprintf(json_file, "  \"eval_calls\": %ld,\n", total.ai.eval_lookup);
+	fprintf(json_file, "  \"eval_cache_hit_rate\": %.4f,\n",
+	        ratio(total.ai.eval_hit, total.ai.eval_lookup));
+	fprintf(json_file, "  \"eval_computes\": %ld,\n",
+	        total.ai.eval_compute);
+	fprintf(json_file, "  \"exact_evals\": %ld,\n", total.ai.exact_eval);
+	fprintf(json_file, "  \"role_computes\": %ld,\n",
+	        total.ai.role_compute);
+	fprintf(json_file, "  \"opp_place_lookups\": %ld,\n",
+	        total.ai.opp_place_lookup);
+	fprintf(json_file, "  \"opp_place_cache_hit_rate\": %.4f,\n",
+	        ratio(total.ai.opp_place_hit, total.ai.opp_place_lookup));
+
+	/* Write results */
+	fprintf(json_file, "  \"avg_rounds\": %.3f,\n",
+	        ratio(total.rounds, total.games));
+	fprintf(json_file, "  \"avg_winning_vp\": %.3f,\n",
+	        ratio(total.win_vp, total.games));
+	fprintf(json_file, "  \"win_rate_by_position\": [");
+	for (i = 0; i < num_players; i++)
+	{
+		/* Write rate */
+		fprintf(json_file, "%s%.4f", i ? ", " : "",
+		        ratio(total.wins[i], total.games));
+	}
+	fprintf(json_file, "]\n}\n");
+}
+
+/*
+ * Play a batch of simulated games.
+ */
+int main(int argc, char *argv[])
+{
+	pthread_attr_t attr;
+	sim_thread *threads;
+	struct timespec start, end;
+	char *camp_name = NULL;
+	double wall;
+	int i;
+
+	/* Set random seed */
+	base_seed = time(NULL);
+
+	/* Read card database */
+	if (read_cards(NULL) < 0)
+	{
+		/* Exit */
+		exit(1);
+	}
+
+	/* Parse arguments */
+	for (i = 1; i < argc; i++)
+	{
+		/* Check for verbosity */
+		if (!strcmp(argv[i], "-v"))
+		{
+			/* Set verbose flag */
+			verbose++;
+		}
+
+		/* Check for number of players */
+		else if (!strcmp(argv[i], "-p"))
+		{
+			/* Set number of players */
+			num_players = atoi(argv[++i]);
+		}
+
+		/* Check for advanced game */
+		else if (!strcmp(argv[i], "-a"))
+		{
+			/* Set advanced flag */
+			advanced = 1;
+		}
+
+		/* Check for expansion level */
+		else if (!strcmp(argv[i], "-e"))
+		{
+			/* Set expansion level */
+			expanded = atoi(argv[++i]);
+		}
+
+		/* Check for promo cards */
+		else if (!strcmp(argv[i], "-o"))
+		{
+			/* Set promo cards */
+			promo = 1;
+		}
+
+		/* Check for goals off */
+		else if (!strcmp(argv[i], "-nog"))
+		{
+			/* Set goals off */
+			goal_disabled = 1;
+		}
+
+		/* Check for takeovers off */
+		else if (!strcmp(argv[i], "-not"))
+		{
+			/* Set takeovers off */
+			takeover_disabled = 1;
+		}
+
+		/* Check for campaign name */
+		else if (!strcmp(argv[i], "-c"))
+		{
+			/* Set campaign name */
+			camp_name = argv[++i];
+		}
+
+		/* Check for number of games */
+		else if (!strcmp(argv[i], "-n"))
+		{
+			/* Set number of games */
+			num_games = atoi(argv[++i]);
+		}
+
+		/* Check for random seed */
+		else if (!strcmp(argv[i], "-r"))
+		{
+			/* Set random seed */
+			base_seed = atoi(argv[++i]);
+		}
+
+		/* Check for number of threads */
+		else if (!strcmp(argv[i], "-t"))
+		{
+			/* Set number of threads */
+			num_threads = atoi(argv[++i]);
+		}
+
+		/* Check for network scoring in final round */
+		else if (!strcmp(argv[i], "-x"))
+		{
+			/* Disable exact endgame scoring */
+			ai_exact_endgame = 0;
+		}
+
+		/* Check for fast AI players */
+		else if (!strcmp(argv[i], "-fast"))
+		{
+			/* Set number of fast players */
+			num_fast = atoi(argv[++i]);
+		}
+
+		/* Check for per-game results file */
+		else if (!strcmp(argv[i], "-csv"))
+		{
+			/* Open file */
+			csv_file = fopen(argv[++i], "w");
+
+			/* Check for failure */
+			if (!csv_file)
+			{
+				/* Error */
+				perror(argv[i]);
+				exit(1);
+			}
+		}
+
+		/* Check for statistics file */
+		else if (!strcmp(argv[i], "-json"))
+		{
+			/* Open file */
+			json_file = fopen(argv[++i], "w");
+
+			/* Check for failure */
+			if (!json_file)
+			{
+				/* Error */
+				perror(argv[i]);
+				exit(1);
+			}
+		}
+
+		/* Unknown argument */
+		else
+		{
+			/* Print usage */
+			fprintf(stderr, "Usage: rftgsim [-e exp] [-p players] [-a] "
+			                "[-o] [-nog] [-not] [-c campaign] "
+			                "[-n games] [-r seed] [-t threads] [-x] "
+			                "[-fast players] "
+			                "[-csv games.csv] [-json stats.json]\n");
+			exit(1);
+		}
+	}
+
+	/* Check for campaign */
+	if (camp_name)
+	{
+		/* Read campaigns */
+		read_campaign();
+
+		/* Find campaign */
+		camp = find_campaign(camp_name);
+
+		/* Check for failure */
+		if (!camp)
+		{
+			/* Error */
+			fprintf(stderr, "Unknown campaign %s\n", camp_name);
+			exit(1);
+		}
+
+		/* Override game options with campaign versions */
+		expanded = camp->expanded;
+		if (num_players < camp->min_num_players)
+			num_players = camp->min_num_players;
+		if (num_players > camp->max_num_players)
+			num_players = camp->max_num_players;
+		if (camp->advanced >= 0) advanced = camp->advanced;
+		if (camp->goal_disabled >= 0) goal_disabled = camp->goal_disabled;
+		if (camp->takeover_disabled >= 0)
+			takeover_disabled = camp->takeover_disabled;
+	}
+
+	/* Check for bad options */
+	if (num_players < 2 || num_players > MAX_PLAYER)
+	{
+		/* Error */
+		fprintf(stderr, "Bad number of players\n");
+		exit(1);
+	}
+
+	/* Need at least one thread */
+	if (num_threads < 1) num_threads = 1;
+
+	/* Use AI functions, with timed decisions */
+	sim_func = ai_func;
+	sim_func.make_choice = sim_make_choice;
+	sim_func.shutdown = sim_shutdown;
+
+	/* Use fast AI functions, with timed decisions */
+	sim_fast_func = ai_fast_func;
+	sim_fast_func.make_choice = sim_make_choice;
+	sim_fast_func.shutdown = sim_shutdown;
+
+	/* Never train networks */
+	ai_train = 0;
+
+	/* Write CSV header */
+	if (csv_file)
+	{
+		/* Write header */
+		fprintf(csv_file, "game,seed,player,position,start,end_vp,vp,"
+		                  "goal_vp,prestige,winner,rounds\n");
+	}
+
+	/* Create threads */
+	threads = (sim_thread *)calloc(num_threads, sizeof(sim_thread));
+
+	/* Use larger stacks for game threads */
+	pthread_attr_init(&attr);
+	pthread_attr_setstacksize(&attr, WORKER_STACK);
+
+	/* Remember start time */
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	/* Start threads */
+	for (i = 0; i < num_threads; i++)
+	{
+		/* Start thread */
+		if (pthread_create(&threads[i].thread, &attr, sim_main,
+		                   &threads[i]))
+		{
+			/* Error */
+			fprintf(stderr, "Could not create game thread!\n");
+			exit(1);
+		}
+	}
+
+	/* Wait for threads */
+	for (i = 0; i < num_threads; i++)
+	{
+		/* Wait for thread */
+		pthread_join(threads[i].thread, NULL);
+	}
+
+	/* Get end time */
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	/* Compute elapsed time */
+	wall = end.tv_sec - start.tv_sec + (end.tv_nsec - start.tv_nsec) / 1e9;
+
+	/* Print statistics */
+	print_stats(wall);
+
+	/* Check for statistics file */
+	if (json_file)
+	{
+		/* Write statistics */
+		write_json(wall);
+		fclose(json_file);
+	}
+
+	/* Close per-game results */
+	if (csv_file) fclose(csv_file);
+
+	/* Done */
+	return 0;
+}
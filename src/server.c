@@ -21,11 +21,20 @@
  * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
  */
 
+/* Needed for accept4() */
+#define _GNU_SOURCE
+
 #include "rftg.h"
 #include "comm.h"
 #include <mysql/mysql.h>
 #include <pthread.h>
 #include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/uio.h>
+#include <ucontext.h>
 
 /*
  * Server settings.
@@ -53,6 +62,129 @@
  */
 #define CHOICE_LOG_LEN    4096
 
+/*
+ * Most connections the connection list has room for.
+ *
+ * Address space for the whole list is reserved at startup, but memory is
+ * only used for the part of the list actually reached.
+ */
+#define MAX_CONN (1 << 20)
+
+/*
+ * Largest message accepted from a client.
+ *
+ * Limits the memory a client can make us use for incoming data.
+ */
+#define MAX_MSG_LEN (1 << 20)
+
+/*
+ * Least free space in the incoming buffer before reading.
+ */
+#define READ_LEN 4096
+
+/*
+ * Most unsent output kept for a connection.
+ *
+ * Clients that fall further behind are disconnected.
+ */
+#define OUT_HIGH_WATER (4 << 20)
+
+/*
+ * Most queued messages handed to the kernel in one write.
+ */
+#define MAX_IOV 64
+
+/*
+ * Most database writes waiting to be run.
+ */
+#define DB_QUEUE_LEN 4096
+
+/*
+ * Most database writes run in one transaction.
+ */
+#define DB_BATCH_LEN 256
+
+/*
+ * Kinds of database writes.
+ *
+ * Each kind except DBW_OTHER is run with its own prepared statement.  A
+ * queued write of choices or waiting status replaces an earlier queued
+ * write of the same row.
+ */
+#define DBW_OTHER    0
+#define DBW_CHOICES  1
+#define DBW_WAITING  2
+#define DBW_MESSAGE  3
+#define DBW_JOIN     4
+#define DBW_LEAVE    5
+#define DBW_SEAT     6
+#define DBW_AI       7
+#define DBW_SEED     8
+#define DBW_JOURNAL  9
+#define DBW_COMPACT  10
+#define DBW_SNAPSHOT 11
+#define DBW_NUM      12
+
+/*
+ * Number of journal rows of a player's choices kept before the log is
+ * compacted into a single row.
+ */
+#define JOURNAL_COMPACT 64
+
+/*
+ * Version of the game snapshot format.
+ *
+ * Must be changed whenever the layout of saved snapshots changes.
+ */
+#define SNAPSHOT_VERSION 1
+
+/*
+ * Length of a game snapshot.
+ */
+#define SNAPSHOT_LEN (sizeof(snapshot_head) + sizeof(game) + \
+                      sizeof(int16_t) * MAX_DECK)
+
+/*
+ * Size of the stack of a game in memory.
+ *
+ * Stack pages are only backed by memory once a game touches them.
+ */
+#define GAME_STACK_LEN (512 * 1024)
+
+/*
+ * Number of pooled database connections used for reading.
+ */
+#define DB_POOL_LEN 4
+
+/*
+ * Most events handled per wait.
+ */
+#define MAX_EVENTS 256
+
+/*
+ * Event identifiers of the listening socket and the housekeeping timer.
+ *
+ * Events of connections are identified by connection ID.
+ */
+#define EV_LISTEN -1
+#define EV_TIMER  -2
+
+/*
+ * An outgoing message, shared by every connection it is queued on.
+ */
+typedef struct out_msg
+{
+	/* Number of queues (and senders) holding this message */
+	int refs;
+
+	/* Length of message */
+	int len;
+
+	/* Message data */
+	char data[];
+
+} out_msg;
+
 /*
  * A connection from a client.
  */
@@ -65,19 +197,40 @@ typedef struct conn
 	int ai;
 
 	/* Data buffer for incoming bytes */
-	char buf[BUF_LEN];
+	char *buf;
 
 	/* Amount of data currently in buffer */
 	int buf_full;
 
-	/* Data buffer for unsent messages */
-	char *out_buf;
+	/* Current size of incoming buffer */
+	int buf_size;
+
+	/* Message currently being handled (inside incoming buffer) */
+	char *msg;
+
+	/* Queue of unsent messages (circular) */
+	out_msg **out_queue;
+
+	/* Position of first message in queue */
+	int out_first;
+
+	/* Number of messages in queue */
+	int out_num;
+
+	/* Current size of queue */
+	int out_max;
+
+	/* Amount of first message already sent */
+	int out_off;
 
 	/* Amount of data needing to be sent */
 	int out_len;
 
-	/* Current size of outgoing buffer */
-	int out_size;
+	/* Unsent output grew too large */
+	int out_full;
+
+	/* Waiting for socket to become writable */
+	int out_watched;
 
 	/* Connection state */
 	int state;
@@ -143,6 +296,31 @@ typedef struct choice
 
 } choice;
 
+/*
+ * Start of a snapshot of a game taken at the end of a round.
+ *
+ * Followed by a copy of the game structure with all pointers cleared, and
+ * the library index of each card's design.
+ */
+typedef struct snapshot_head
+{
+	/* Snapshot format version */
+	int version;
+
+	/* Size of game structure */
+	int game_size;
+
+	/* Round the snapshot was taken after */
+	int round;
+
+	/* Position in random byte pool */
+	int random_pos;
+
+	/* User in each seat, since players are rotated after start worlds */
+	int uids[MAX_PLAYER];
+
+} snapshot_head;
+
 /*
  * A game to be started, or in progress.
  */
@@ -160,18 +338,36 @@ typedef struct session
 	/* Game number */
 	int gid;
 
-	/* Game information */
-	game g;
+	/* Game information (only while game is in memory) */
+	game *g;
 
 	/* Game information remembered by each client */
-	game old[MAX_PLAYER];
+	game *old;
 
 	/* Outstanding choice for each player */
-	choice out[MAX_PLAYER];
+	choice *out;
+
+	/* Game should be paged out when next waiting on a player */
+	int unload;
+
+	/* Time since no player has been connected to started game */
+	time_t idle_since;
+
+	/* Snapshot to compare with full replay (debug mode only) */
+	char *check_snap;
 
 	/* Whether game is replaying or not */
 	int replaying;
 
+	/* Length of each player's choice log already saved */
+	int choices_saved[MAX_PLAYER];
+
+	/* Number of journal rows saved since each player's log was compacted */
+	int journal_rows[MAX_PLAYER];
+
+	/* AI player's choice is queued for an AI worker thread */
+	int ai_queued[MAX_PLAYER];
+
 	/* Pool of random bytes */
 	unsigned char random_pool[MAX_RAND];
 
@@ -220,8 +416,18 @@ typedef struct session
 	/* Mutex for access to session variables */
 	pthread_mutex_t session_mutex;
 
-	/* Condition variable to signal game thread when reply is ready */
-	pthread_cond_t wait_cond;
+	/* Context to resume game at, and its stack */
+	ucontext_t ctx;
+	char *stack;
+
+	/* Context of worker thread running game */
+	ucontext_t *worker_ctx;
+
+	/* Game is waiting for a reply before it can continue */
+	int blocked;
+
+	/* Game has finished (or been paged out) and is not to be resumed */
+	int finished;
 
 	/* Time since last player joined */
 	time_t last_join;
@@ -232,15 +438,60 @@ typedef struct session
 /*
  * List of all active connections.
  */
-static conn c_list[1024];
+static conn *c_list;
 static int num_conn;
 
+/*
+ * Descriptor of the event queue all sockets are watched with.
+ */
+static int epoll_fd;
+
 /*
  * List of active game sessions.
  */
 static session s_list[1024];
 static int num_session;
 
+/*
+ * Queue (circular) of sessions whose games are ready to run.
+ */
+static int run_queue[1024];
+static int run_first, run_num;
+
+/*
+ * Mutex and condition for queue of games ready to run.
+ */
+static pthread_mutex_t run_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t run_cond = PTHREAD_COND_INITIALIZER;
+
+/*
+ * Number of worker threads games are run on.
+ */
+static int num_workers = 4;
+
+/*
+ * Queue (circular) of AI players whose choices are to be made, each given
+ * as session ID times MAX_PLAYER plus player index.
+ */
+static int ai_queue[1024 * MAX_PLAYER];
+static int ai_first, ai_num;
+
+/*
+ * Mutex and condition for queue of AI choices.
+ */
+static pthread_mutex_t ai_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t ai_cond = PTHREAD_COND_INITIALIZER;
+
+/*
+ * Mutex held while initializing AI players, since the networks are shared.
+ */
+static pthread_mutex_t ai_init_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * Number of threads to run AI players on (0 to use AI client programs).
+ */
+static int num_ai_workers = 0;
+
 /*
  * Tick size (in seconds).
  */
@@ -266,6 +517,11 @@ static int ping_timeout = 20;
  */
 static int game_timeout = 3600;
 
+/*
+ * Timeout (in seconds) to page out started games no player is connected to.
+ */
+static int unload_timeout = 600;
+
 /*
  * Log exports folder.
  */
@@ -287,9 +543,103 @@ static char* server_name = NULL;
 static int debug_server = 0;
 
 /*
- * Connection to the database server.
+ * Idle connections to the database server, used for reading.
+ */
+static MYSQL *db_idle[DB_POOL_LEN];
+static int db_num_idle;
+
+/*
+ * Mutex and condition for the connection pool.
+ */
+static pthread_mutex_t db_pool_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t db_pool_cond = PTHREAD_COND_INITIALIZER;
+
+/*
+ * A database write waiting to be run.
+ */
+typedef struct db_write
+{
+	/* Kind of write */
+	int kind;
+
+	/* Game and user of row written */
+	int gid, uid;
+
+	/* Seat, AI flag, waiting state or choice log position written */
+	int value;
+
+	/* Query to run (DBW_OTHER only) */
+	char *query;
+
+	/* Choice log, random byte pool or message text written */
+	char *data;
+	unsigned long len;
+
+	/* Message format */
+	char *tag;
+	unsigned long tag_len;
+
+	/* Order in which write was queued */
+	unsigned long seq;
+
+} db_write;
+
+/*
+ * Queue of database writes (circular), run by the database writer thread.
  */
-MYSQL *mysql;
+static db_write db_queue[DB_QUEUE_LEN];
+static int db_first, db_num;
+
+/*
+ * Batch of writes being run by the database writer thread.
+ */
+static db_write db_batch[DB_BATCH_LEN];
+static int db_batch_num;
+
+/*
+ * Order of last write queued, and of last write run.
+ */
+static unsigned long db_seq_queued, db_seq_done;
+
+/*
+ * Mutex for database write queue.
+ */
+static pthread_mutex_t db_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * Signaled when writes are queued, and when the writer finishes a batch.
+ */
+static pthread_cond_t db_queued_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t db_done_cond = PTHREAD_COND_INITIALIZER;
+
+/*
+ * Connection to the database server used by the writer thread.
+ */
+static MYSQL *db_writer_mysql;
+
+/*
+ * Statements of each kind of write, prepared on the writer connection.
+ */
+static MYSQL_STMT *db_stmt[DBW_NUM];
+
+/*
+ * Query text of each kind of write.
+ */
+static char *db_stmt_query[DBW_NUM] =
+{
+	NULL,
+	"REPLACE INTO choices VALUES (?, ?, ?)",
+	"UPDATE attendance SET waiting=? WHERE gid=? AND uid=?",
+	"INSERT INTO messages (gid, uid, message, format) VALUES (?, ?, ?, ?)",
+	"INSERT INTO attendance (uid, gid) VALUES (?, ?)",
+	"DELETE FROM attendance WHERE uid=? AND gid=?",
+	"UPDATE attendance SET seat=? WHERE gid=? AND uid=?",
+	"UPDATE attendance SET ai=? WHERE gid=? AND uid=?",
+	"INSERT IGNORE INTO seed VALUES (?, ?)",
+	"REPLACE INTO choice_journal VALUES (?, ?, ?, ?)",
+	"DELETE FROM choice_journal WHERE gid=? AND uid=? AND pos<?",
+	"REPLACE INTO snapshots VALUES (?, ?, ?)",
+};
 
 /*
  * Log message to stdout.
@@ -323,6 +673,651 @@ static void server_log(char *format, ...)
 }
 
 
+/*
+ * Open a connection to the database server.
+ *
+ * Exits on failure.
+ */
+static MYSQL *db_connect(char *host, char *user, char *pw, char *db)
+{
+	MYSQL *m;
+	my_bool reconnect = 1;
+
+	/* Initialize database library */
+	m = mysql_init(NULL);
+
+	/* Check for error */
+	if (!m)
+	{
+		/* Print error and exit */
+		server_log("Couldn't initialize database library!");
+		exit(1);
+	}
+
+	/* Attempt to connect to database server */
+	if (!mysql_real_connect(m, host, user, pw, db, 0, NULL, 0))
+	{
+		/* Print error and exit */
+		server_log("Database connection: %s", mysql_error(m));
+		exit(1);
+	}
+
+	/* Reconnect automatically when connection to database is lost */
+	mysql_options(m, MYSQL_OPT_RECONNECT, &reconnect);
+
+	/* Return connection */
+	return m;
+}
+
+/*
+ * Take an idle database connection from the pool, waiting if none is idle.
+ *
+ * The connection must be given back with db_put().
+ */
+static MYSQL *db_get(void)
+{
+	MYSQL *m;
+
+	/* Grab mutex */
+	pthread_mutex_lock(&db_pool_mutex);
+
+	/* Wait for idle connection */
+	while (!db_num_idle) pthread_cond_wait(&db_pool_cond, &db_pool_mutex);
+
+	/* Take connection */
+	m = db_idle[--db_num_idle];
+
+	/* Release mutex */
+	pthread_mutex_unlock(&db_pool_mutex);
+
+	/* Return connection */
+	return m;
+}
+
+/*
+ * Give a database connection back to the pool.
+ */
+static void db_put(MYSQL *m)
+{
+	/* Grab mutex */
+	pthread_mutex_lock(&db_pool_mutex);
+
+	/* Add connection to idle list */
+	db_idle[db_num_idle++] = m;
+
+	/* Wake a thread waiting for a connection */
+	pthread_cond_signal(&db_pool_cond);
+
+	/* Release mutex */
+	pthread_mutex_unlock(&db_pool_mutex);
+}
+
+/*
+ * Free the data of a database write.
+ */
+static void db_free_write(db_write *w)
+{
+	/* Free query and data */
+	free(w->query);
+	free(w->data);
+	free(w->tag);
+}
+
+/*
+ * Queue a write to be run by the database writer thread.
+ *
+ * A write of choices or waiting status replaces a queued write of the same
+ * row that has not been started, and a journal append is joined to a
+ * queued append it continues.  Only waits if the queue is full.
+ */
+static void db_queue_write(db_write *new_w)
+{
+	db_write *w;
+	int i;
+
+	/* Grab mutex */
+	pthread_mutex_lock(&db_mutex);
+
+	/* Check for choice journal append */
+	if (new_w->kind == DBW_JOURNAL)
+	{
+		/* Look backwards for latest queued write of player's choices */
+		for (i = db_num - 1; i >= 0; i--)
+		{
+			/* Get queued write */
+			w = &db_queue[(db_first + i) % DB_QUEUE_LEN];
+
+			/* Skip writes of other rows */
+			if (w->kind < DBW_JOURNAL || w->gid != new_w->gid ||
+			    w->uid != new_w->uid) continue;
+
+			/* Stop unless this append is continued by the new one */
+			if (w->kind != DBW_JOURNAL ||
+			    w->value + w->len / sizeof(int) != new_w->value) break;
+
+			/* Add new entries to queued append */
+			w->data = (char *)realloc(w->data, w->len + new_w->len);
+			memcpy(w->data + w->len, new_w->data, new_w->len);
+			w->len += new_w->len;
+
+			/* Free new write */
+			db_free_write(new_w);
+
+			/* Release mutex */
+			pthread_mutex_unlock(&db_mutex);
+
+			/* Done */
+			return;
+		}
+	}
+
+	/* Check for write that may replace an earlier one */
+	if (new_w->kind == DBW_CHOICES || new_w->kind == DBW_WAITING)
+	{
+		/* Loop over queued writes */
+		for (i = 0; i < db_num; i++)
+		{
+			/* Get queued write */
+			w = &db_queue[(db_first + i) % DB_QUEUE_LEN];
+
+			/* Skip writes of other rows */
+			if (w->kind != new_w->kind || w->gid != new_w->gid ||
+			    w->uid != new_w->uid) continue;
+
+			/* Replace write, keeping its place in queue */
+			db_free_write(w);
+			new_w->seq = w->seq;
+			*w = *new_w;
+
+			/* Release mutex */
+			pthread_mutex_unlock(&db_mutex);
+
+			/* Done */
+			return;
+		}
+	}
+
+	/* Wait for room in queue */
+	while (db_num == DB_QUEUE_LEN)
+		pthread_cond_wait(&db_done_cond, &db_mutex);
+
+	/* Number write in order of queueing */
+	new_w->seq = ++db_seq_queued;
+
+	/* Add write to end of queue */
+	db_queue[(db_first + db_num) % DB_QUEUE_LEN] = *new_w;
+	db_num++;
+
+	/* Wake writer thread */
+	pthread_cond_signal(&db_queued_cond);
+
+	/* Release mutex */
+	pthread_mutex_unlock(&db_mutex);
+}
+
+/*
+ * Queue a write of a row with a prepared statement.
+ *
+ * The data (of given length) and tag are copied, and may be NULL.
+ */
+static void db_write_row(int kind, int gid, int uid, int value,
+                         void *data, int len, char *tag)
+{
+	db_write w;
+
+	/* Clear write */
+	memset(&w, 0, sizeof(db_write));
+
+	/* Set row and value */
+	w.kind = kind;
+	w.gid = gid;
+	w.uid = uid;
+	w.value = value;
+
+	/* Check for data */
+	if (data)
+	{
+		/* Copy data */
+		w.data = (char *)malloc(len + 1);
+		memcpy(w.data, data, len);
+		w.len = len;
+	}
+
+	/* Check for tag */
+	if (tag)
+	{
+		/* Copy tag */
+		w.tag = strdup(tag);
+		w.tag_len = strlen(tag);
+	}
+
+	/* Queue write */
+	db_queue_write(&w);
+}
+
+/*
+ * Queue a query of a game that needs no results.
+ */
+static void db_write_simple(int gid, char *query)
+{
+	db_write w;
+
+	/* Clear write */
+	memset(&w, 0, sizeof(db_write));
+
+	/* Copy query */
+	w.kind = DBW_OTHER;
+	w.gid = gid;
+	w.query = strdup(query);
+
+	/* Queue write */
+	db_queue_write(&w);
+}
+
+/*
+ * Wait until the queued database writes of a game have been run.
+ *
+ * Called before reading data of the game that may still be waiting to be
+ * written.  Writes of other games are not waited for.
+ */
+static void db_flush(int gid)
+{
+	unsigned long last = 0;
+	int i;
+
+	/* Grab mutex */
+	pthread_mutex_lock(&db_mutex);
+
+	/* Loop over writes being run */
+	for (i = 0; i < db_batch_num; i++)
+	{
+		/* Remember write of game */
+		if (db_batch[i].gid == gid) last = db_batch[i].seq;
+	}
+
+	/* Loop over queued writes */
+	for (i = 0; i < db_num; i++)
+	{
+		/* Remember write of game */
+		if (db_queue[(db_first + i) % DB_QUEUE_LEN].gid == gid)
+			last = db_queue[(db_first + i) % DB_QUEUE_LEN].seq;
+	}
+
+	/* Wait for writer thread to run last write of game */
+	while (db_seq_done < last)
+		pthread_cond_wait(&db_done_cond, &db_mutex);
+
+	/* Release mutex */
+	pthread_mutex_unlock(&db_mutex);
+}
+
+/*
+ * Prepare (or prepare again) the statements of the writer connection.
+ */
+static void db_prepare(void)
+{
+	int i;
+
+	/* Loop over kinds of writes */
+	for (i = 0; i < DBW_NUM; i++)
+	{
+		/* Skip kinds without statement */
+		if (!db_stmt_query[i]) continue;
+
+		/* Close old statement */
+		if (db_stmt[i]) mysql_stmt_close(db_stmt[i]);
+
+		/* Create statement */
+		db_stmt[i] = mysql_stmt_init(db_writer_mysql);
+
+		/* Check for failure */
+		if (!db_stmt[i]) continue;
+
+		/* Prepare statement */
+		if (mysql_stmt_prepare(db_stmt[i], db_stmt_query[i],
+		                       strlen(db_stmt_query[i])))
+		{
+			/* Print error */
+			server_log("%s", mysql_stmt_error(db_stmt[i]));
+
+			/* Forget statement */
+			mysql_stmt_close(db_stmt[i]);
+			db_stmt[i] = NULL;
+		}
+	}
+}
+
+/*
+ * Set a statement parameter to an integer.
+ */
+static void bind_int(MYSQL_BIND *bind, int *x)
+{
+	/* Set type and location */
+	bind->buffer_type = MYSQL_TYPE_LONG;
+	bind->buffer = x;
+}
+
+/*
+ * Set a statement parameter to a string or binary data.
+ */
+static void bind_data(MYSQL_BIND *bind, enum enum_field_types type,
+                      char *data, unsigned long *len)
+{
+	/* Set type and location */
+	bind->buffer_type = type;
+	bind->buffer = data;
+	bind->buffer_length = *len;
+	bind->length = len;
+}
+
+/*
+ * Run one queued database write on the writer connection.
+ *
+ * Return 0 on success, or -1 on error.
+ */
+static int db_run_write(db_write *w)
+{
+	MYSQL_BIND bind[4];
+	MYSQL_STMT *stmt;
+	my_bool is_null = 0;
+	char *waiting = "";
+	unsigned long waiting_len;
+
+	/* Check for plain query */
+	if (w->kind == DBW_OTHER)
+	{
+		/* Run query */
+		mysql_query(db_writer_mysql, w->query);
+
+		/* Check for error */
+		if (*mysql_error(db_writer_mysql))
+		{
+			/* Print error */
+			server_log("%s", mysql_error(db_writer_mysql));
+			return -1;
+		}
+
+		/* Done */
+		return 0;
+	}
+
+	/* Clear parameters */
+	memset(bind, 0, sizeof(bind));
+
+	/* Set parameters in order of statement */
+	switch (w->kind)
+	{
+		/* Choice log */
+		case DBW_CHOICES:
+			bind_int(&bind[0], &w->gid);
+			bind_int(&bind[1], &w->uid);
+			bind_data(&bind[2], MYSQL_TYPE_BLOB, w->data, &w->len);
+			break;
+
+		/* Waiting status */
+		case DBW_WAITING:
+
+			/* Check waiting status */
+			switch (w->value)
+			{
+				case WAIT_READY:
+					waiting = "READY";
+					break;
+				case WAIT_BLOCKED:
+					waiting = "BLOCKED";
+					break;
+				case WAIT_OPTION:
+					waiting = "OPTION";
+					break;
+				default:
+					is_null = 1;
+					break;
+			}
+
+			/* Set status (or NULL) */
+			waiting_len = strlen(waiting);
+			bind_data(&bind[0], MYSQL_TYPE_STRING, waiting, &waiting_len);
+			bind[0].is_null = &is_null;
+			bind_int(&bind[1], &w->gid);
+			bind_int(&bind[2], &w->uid);
+			break;
+
+		/* Game message */
+		case DBW_MESSAGE:
+			bind_int(&bind[0], &w->gid);
+			bind_int(&bind[1], &w->uid);
+			bind_data(&bind[2], MYSQL_TYPE_STRING, w->data, &w->len);
+			bind_data(&bind[3], MYSQL_TYPE_STRING, w->tag, &w->tag_len);
+			break;
+
+		/* Attendance */
+		case DBW_JOIN:
+		case DBW_LEAVE:
+			bind_int(&bind[0], &w->uid);
+			bind_int(&bind[1], &w->gid);
+			break;
+
+		/* Seat or AI control flag */
+		case DBW_SEAT:
+		case DBW_AI:
+			bind_int(&bind[0], &w->value);
+			bind_int(&bind[1], &w->gid);
+			bind_int(&bind[2], &w->uid);
+			break;
+
+		/* Random byte pool */
+		case DBW_SEED:
+			bind_int(&bind[0], &w->gid);
+			bind_data(&bind[1], MYSQL_TYPE_BLOB, w->data, &w->len);
+			break;
+
+		/* Choice log entries from a position */
+		case DBW_JOURNAL:
+			bind_int(&bind[0], &w->gid);
+			bind_int(&bind[1], &w->uid);
+			bind_int(&bind[2], &w->value);
+			bind_data(&bind[3], MYSQL_TYPE_BLOB, w->data, &w->len);
+			break;
+
+		/* Journal rows before a position */
+		case DBW_COMPACT:
+			bind_int(&bind[0], &w->gid);
+			bind_int(&bind[1], &w->uid);
+			bind_int(&bind[2], &w->value);
+			break;
+
+		/* Game snapshot */
+		case DBW_SNAPSHOT:
+			bind_int(&bind[0], &w->gid);
+			bind_int(&bind[1], &w->value);
+			bind_data(&bind[2], MYSQL_TYPE_BLOB, w->data, &w->len);
+			break;
+	}
+
+	/* Get statement */
+	stmt = db_stmt[w->kind];
+
+	/* Run statement */
+	if (stmt && !mysql_stmt_bind_param(stmt, bind) &&
+	    !mysql_stmt_execute(stmt)) return 0;
+
+	/* Print error */
+	server_log("%s", stmt ? mysql_stmt_error(stmt) :
+	                        mysql_error(db_writer_mysql));
+
+	/* Failure */
+	return -1;
+}
+
+/*
+ * Reconnect the writer connection after an error, if it was lost.
+ */
+static void db_reconnect(void)
+{
+	/* Reconnect if needed */
+	mysql_ping(db_writer_mysql);
+
+	/* Prepared statements do not survive reconnects */
+	db_prepare();
+}
+
+/*
+ * Run a batch of queued writes in one transaction.
+ *
+ * Return 0 if the transaction was committed, or -1 if it was rolled back
+ * (or lost with the connection).
+ */
+static int db_run_batch(db_write batch[], int n)
+{
+	int i;
+
+	/* Start transaction */
+	if (mysql_query(db_writer_mysql, "START TRANSACTION"))
+	{
+		/* Print error */
+		server_log("%s", mysql_error(db_writer_mysql));
+		return -1;
+	}
+
+	/* Loop over writes */
+	for (i = 0; i < n; i++)
+	{
+		/* Run write */
+		if (db_run_write(&batch[i]))
+		{
+			/* Undo earlier writes of batch */
+			mysql_query(db_writer_mysql, "ROLLBACK");
+			return -1;
+		}
+	}
+
+	/* Finish transaction */
+	if (mysql_query(db_writer_mysql, "COMMIT"))
+	{
+		/* Print error */
+		server_log("%s", mysql_error(db_writer_mysql));
+		return -1;
+	}
+
+	/* Success */
+	return 0;
+}
+
+/*
+ * Run one queued write on its own, outside any transaction.
+ */
+static void db_run_single(db_write *w)
+{
+	int tries;
+
+	/* Try twice, in case the connection was lost and regained */
+	for (tries = 0; tries < 2; tries++)
+	{
+		/* Run write */
+		if (!db_run_write(w)) return;
+
+		/* Reconnect if needed */
+		db_reconnect();
+	}
+
+	/* Game messages must not be lost */
+	if (w->kind == DBW_MESSAGE) exit(1);
+}
+
+/*
+ * Database writer thread.
+ *
+ * Runs queued writes in batches, each batch in one transaction.  A batch
+ * that fails is rolled back and run again after reconnecting; if it fails
+ * again, its writes are run one at a time so that one bad write does not
+ * lose the others.
+ */
+static void *db_writer(void *arg)
+{
+	int i, n, tries, done;
+
+	/* Prepare database library for this thread */
+	mysql_thread_init();
+
+	/* Prepare statements */
+	db_prepare();
+
+	/* Loop forever */
+	while (1)
+	{
+		/* Grab mutex */
+		pthread_mutex_lock(&db_mutex);
+
+		/* Wait for queued writes */
+		while (db_num == 0)
+			pthread_cond_wait(&db_queued_cond, &db_mutex);
+
+		/* Take writes from front of queue */
+		for (n = 0; n < db_num && n < DB_BATCH_LEN; n++)
+		{
+			/* Copy write */
+			db_batch[n] = db_queue[(db_first + n) % DB_QUEUE_LEN];
+		}
+
+		/* Remove writes from queue */
+		db_first = (db_first + n) % DB_QUEUE_LEN;
+		db_num -= n;
+
+		/* Mark batch in progress */
+		db_batch_num = n;
+
+		/* Let waiting threads queue more writes */
+		pthread_cond_broadcast(&db_done_cond);
+
+		/* Release mutex */
+		pthread_mutex_unlock(&db_mutex);
+
+		/* Batch not written yet */
+		done = 0;
+
+		/* Try several writes twice in one transaction */
+		for (tries = 0; n > 1 && tries < 2; tries++)
+		{
+			/* Run batch */
+			if (!db_run_batch(db_batch, n))
+			{
+				/* Batch written */
+				done = 1;
+				break;
+			}
+
+			/* Reconnect if needed */
+			db_reconnect();
+		}
+
+		/* Loop over writes */
+		for (i = 0; i < n; i++)
+		{
+			/* Run write on its own if batch was not written */
+			if (!done) db_run_single(&db_batch[i]);
+
+			/* Free write */
+			db_free_write(&db_batch[i]);
+		}
+
+		/* Grab mutex */
+		pthread_mutex_lock(&db_mutex);
+
+		/* Batch is done */
+		db_seq_done = db_batch[n - 1].seq;
+		db_batch_num = 0;
+
+		/* Wake threads waiting for writes to finish */
+		pthread_cond_broadcast(&db_done_cond);
+
+		/* Release mutex */
+		pthread_mutex_unlock(&db_mutex);
+	}
+
+	/* Never reached */
+	return NULL;
+}
+
 /*
  * Check for a user in the database with the given password.
  *
@@ -332,6 +1327,7 @@ static void server_log(char *format, ...)
  */
 static int db_user(char *user, char *pass)
 {
+	MYSQL *mysql = db_get();
 	MYSQL_RES *res1, *res2;
 	MYSQL_ROW row1, row2;
 	char query[1024];
@@ -382,6 +1378,9 @@ static int db_user(char *user, char *pass)
 		/* Free result */
 		mysql_free_result(res1);
 
+		/* Give back database connection */
+		db_put(mysql);
+
 		/* Return ID */
 		return uid;
 	}
@@ -408,6 +1407,9 @@ static int db_user(char *user, char *pass)
 		mysql_free_result(res1);
 		mysql_free_result(res2);
 
+		/* Give back database connection */
+		db_put(mysql);
+
 		/* Return ID */
 		return uid;
 	}
@@ -416,6 +1418,9 @@ static int db_user(char *user, char *pass)
 	mysql_free_result(res1);
 	mysql_free_result(res2);
 
+	/* Give back database connection */
+	db_put(mysql);
+
 	/* Bad password */
 	return -1;
 }
@@ -425,6 +1430,7 @@ static int db_user(char *user, char *pass)
  */
 static void db_user_name(int uid, char *name)
 {
+	MYSQL *mysql = db_get();
 	MYSQL_RES *res;
 	MYSQL_ROW row;
 	char query[1024];
@@ -446,6 +1452,9 @@ static void db_user_name(int uid, char *name)
 
 	/* Free result */
 	mysql_free_result(res);
+
+	/* Give back database connection */
+	db_put(mysql);
 }
 
 /*
@@ -455,6 +1464,7 @@ static void db_user_name(int uid, char *name)
  */
 static int db_new_game(int sid)
 {
+	MYSQL *mysql = db_get();
 	MYSQL_RES *res;
 	MYSQL_ROW row;
 	session *s_ptr = &s_list[sid];
@@ -507,6 +1517,9 @@ static int db_new_game(int sid)
 	/* Free result */
 	mysql_free_result(res);
 
+	/* Give back database connection */
+	db_put(mysql);
+
 	/* Return ID */
 	return gid;
 }
@@ -516,6 +1529,7 @@ static int db_new_game(int sid)
  */
 static void db_load_sessions(void)
 {
+	MYSQL *mysql = db_get();
 	MYSQL_RES *res;
 	MYSQL_ROW row;
 	session *s_ptr;
@@ -582,6 +1596,9 @@ static void db_load_sessions(void)
 
 	/* Free results */
 	mysql_free_result(res);
+
+	/* Give back database connection */
+	db_put(mysql);
 }
 
 /*
@@ -589,6 +1606,7 @@ static void db_load_sessions(void)
  */
 static void db_load_attendance(void)
 {
+	MYSQL *mysql = db_get();
 	MYSQL_RES *res;
 	MYSQL_ROW row;
 	session *s_ptr;
@@ -596,7 +1614,7 @@ static void db_load_attendance(void)
 	int i;
 
 	/* Run query */
-	mysql_query(mysql, "SELECT uid, gid, ai \
+	mysql_query(mysql, "SELECT uid, gid, ai, waiting \
 	                    FROM attendance \
 	                    JOIN games USING (gid) \
 	                    WHERE state='WAITING' OR state='STARTED' \
@@ -643,7 +1661,14 @@ static void db_load_attendance(void)
 
 		/* Set AI control */
 		s_ptr->ai_control[s_ptr->num_users] = ai;
-		s_ptr->g.p[s_ptr->num_users].ai = ai;
+
+		/* Remember saved waiting status, until game is restored */
+		if (!row[3] || !strcmp(row[3], "READY"))
+			s_ptr->waiting[s_ptr->num_users] = WAIT_READY;
+		else if (!strcmp(row[3], "OPTION"))
+			s_ptr->waiting[s_ptr->num_users] = WAIT_OPTION;
+		else
+			s_ptr->waiting[s_ptr->num_users] = WAIT_BLOCKED;
 
 		/* Count users */
 		s_ptr->num_users++;
@@ -651,21 +1676,88 @@ static void db_load_attendance(void)
 
 	/* Free results */
 	mysql_free_result(res);
+
+	/* Give back database connection */
+	db_put(mysql);
 }
 
 /*
- * Add a player to a game in the database.
+ * Put the users of a started session back in the seats saved when the game
+ * began, before the engine rotated them.
  */
-static void db_join_game(int uid, int gid)
+static void db_load_seats(int sid)
 {
+	MYSQL *mysql = db_get();
+	MYSQL_RES *res;
+	MYSQL_ROW row;
+	session *s_ptr = &s_list[sid];
 	char query[1024];
+	int uids[MAX_PLAYER], n = 0;
+	int i, j, temp;
 
 	/* Create query */
-	sprintf(query, "INSERT INTO attendance (uid, gid) VALUES (%d, %d)",
-	        uid, gid);
+	sprintf(query, "SELECT uid FROM attendance WHERE gid=%d ORDER BY seat",
+	        s_ptr->gid);
 
 	/* Run query */
 	mysql_query(mysql, query);
+
+	/* Fetch results */
+	res = mysql_store_result(mysql);
+
+	/* Loop over rows returned */
+	while (res && n < MAX_PLAYER && (row = mysql_fetch_row(res)))
+	{
+		/* Get user in seat */
+		uids[n++] = strtol(row[0], NULL, 0);
+	}
+
+	/* Free result */
+	mysql_free_result(res);
+
+	/* Give back database connection */
+	db_put(mysql);
+
+	/* Check for different users */
+	if (n != s_ptr->num_users) return;
+
+	/* Loop over seats */
+	for (i = 0; i < n; i++)
+	{
+		/* Look for user of seat */
+		for (j = i; j < n; j++)
+		{
+			/* Check for match */
+			if (s_ptr->uids[j] == uids[i]) break;
+		}
+
+		/* Skip users not found */
+		if (j == n) continue;
+
+		/* Swap user into seat */
+		temp = s_ptr->uids[i];
+		s_ptr->uids[i] = s_ptr->uids[j];
+		s_ptr->uids[j] = temp;
+
+		/* Swap connection */
+		temp = s_ptr->cids[i];
+		s_ptr->cids[i] = s_ptr->cids[j];
+		s_ptr->cids[j] = temp;
+
+		/* Swap AI control */
+		temp = s_ptr->ai_control[i];
+		s_ptr->ai_control[i] = s_ptr->ai_control[j];
+		s_ptr->ai_control[j] = temp;
+	}
+}
+
+/*
+ * Add a player to a game in the database.
+ */
+static void db_join_game(int uid, int gid)
+{
+	/* Queue attendance */
+	db_write_row(DBW_JOIN, gid, uid, 0, NULL, 0, NULL);
 }
 
 /*
@@ -673,14 +1765,8 @@ static void db_join_game(int uid, int gid)
  */
 static void db_leave_game(int uid, int gid)
 {
-	char query[1024];
-
-	/* Create query */
-	sprintf(query, "DELETE FROM attendance WHERE uid=%d AND gid=%d",
-	        uid, gid);
-
-	/* Run query */
-	mysql_query(mysql, query);
+	/* Queue removal of attendance */
+	db_write_row(DBW_LEAVE, gid, uid, 0, NULL, 0, NULL);
 }
 
 /*
@@ -690,12 +1776,14 @@ static void db_leave_game(int uid, int gid)
  */
 static int db_load_game_state(int sid)
 {
+	MYSQL *mysql = db_get();
 	MYSQL_RES *res;
 	MYSQL_ROW row;
 	session *s_ptr = &s_list[sid];
+	player *p_ptr;
 	unsigned long *field_len;
 	char query[1024];
-	int i;
+	int i, pos;
 
 	/* Create query */
 	sprintf(query, "SELECT pool FROM seed WHERE gid=%d", s_ptr->gid);
@@ -712,6 +1800,9 @@ static int db_load_game_state(int sid)
 		/* Free result */
 		mysql_free_result(res);
 
+		/* Give back database connection */
+		db_put(mysql);
+
 		/* No pool to load */
 		return 0;
 	}
@@ -752,15 +1843,72 @@ static int db_load_game_state(int sid)
 		field_len = mysql_fetch_lengths(res);
 
 		/* Copy log */
-		memcpy(s_ptr->g.p[i].choice_log, row[0], field_len[0]);
+		memcpy(s_ptr->g->p[i].choice_log, row[0], field_len[0]);
 
 		/* Remember length */
-		s_ptr->g.p[i].choice_size = field_len[0] / sizeof(int);
+		s_ptr->g->p[i].choice_size = field_len[0] / sizeof(int);
+
+		/* Free result */
+		mysql_free_result(res);
+	}
+
+	/* Loop over players in session */
+	for (i = 0; i < s_ptr->num_users; i++)
+	{
+		/* Get player pointer */
+		p_ptr = &s_ptr->g->p[i];
+
+		/* Create query to load choices saved since log was compacted */
+		sprintf(query, "SELECT pos, log FROM choice_journal \
+		                WHERE gid=%d AND uid=%d ORDER BY pos",
+		        s_ptr->gid, s_ptr->uids[i]);
+
+		/* Run query */
+		mysql_query(mysql, query);
+
+		/* Fetch results */
+		res = mysql_store_result(mysql);
+
+		/* Loop over rows returned */
+		while (res && (row = mysql_fetch_row(res)))
+		{
+			/* Get length of entries in bytes */
+			field_len = mysql_fetch_lengths(res);
+
+			/* Get position of entries */
+			pos = strtol(row[0], NULL, 0);
+
+			/* Skip rows not fitting log */
+			if (pos < 0 || pos > p_ptr->choice_size ||
+			    pos + field_len[1] / sizeof(int) > CHOICE_LOG_LEN)
+			{
+				/* Print error */
+				server_log("Bad choice journal row for gid %d uid %d at %d",
+				           s_ptr->gid, s_ptr->uids[i], pos);
+				continue;
+			}
+
+			/* Copy entries */
+			memcpy(p_ptr->choice_log + pos, row[1], field_len[1]);
+
+			/* Extend log */
+			if (pos + field_len[1] / sizeof(int) > p_ptr->choice_size)
+				p_ptr->choice_size = pos + field_len[1] / sizeof(int);
+
+			/* Count journal rows */
+			s_ptr->journal_rows[i]++;
+		}
 
 		/* Free result */
 		mysql_free_result(res);
+
+		/* Entire log is saved */
+		s_ptr->choices_saved[i] = p_ptr->choice_size;
 	}
 
+	/* Give back database connection */
+	db_put(mysql);
+
 	/* Success */
 	return 1;
 }
@@ -772,7 +1920,7 @@ static int db_load_game_state(int sid)
 static void db_save_game_state(int sid)
 {
 	session *s_ptr = &s_list[sid];
-	char query[4096], pool[4096], *status = "";
+	char query[1024], *status = "";
 
 	/* Determine session status */
 	switch (s_ptr->state)
@@ -787,24 +1935,17 @@ static void db_save_game_state(int sid)
 	sprintf(query, "UPDATE games SET state='%s' WHERE gid=%d", status,
 	        s_ptr->gid);
 
-	/* Run query */
-	mysql_query(mysql, query);
+	/* Queue query */
+	db_write_simple(s_ptr->gid, query);
 
 	/* No need to save further data if game has not started or is finished */
 	if (s_ptr->state == SS_WAITING ||
 	    s_ptr->state == SS_ABANDONED ||
 	    s_ptr->state == SS_DONE) return;
 
-	/* Escape random byte pool */
-	mysql_real_escape_string(mysql, pool, (char *)s_ptr->random_pool,
-	                         MAX_RAND);
-
-	/* Create query to save random byte pool */
-	sprintf(query, "INSERT IGNORE INTO seed VALUES (%d, '%s')",
-	        s_ptr->gid, pool);
-
-	/* Run query */
-	mysql_query(mysql, query);
+	/* Queue random byte pool */
+	db_write_row(DBW_SEED, s_ptr->gid, 0, 0, s_ptr->random_pool, MAX_RAND,
+	             NULL);
 }
 
 /*
@@ -813,19 +1954,14 @@ static void db_save_game_state(int sid)
 static void db_save_seats(int sid)
 {
 	session *s_ptr = &s_list[sid];
-	char query[1024];
 	int i;
 
 	/* Loop over players in game */
 	for (i = 0; i < s_ptr->num_users; i++)
 	{
-		/* Update seat number */
-		sprintf(query, "UPDATE attendance SET seat=%d \
-		                WHERE gid=%d AND uid=%d",
-		                i, s_ptr->gid, s_ptr->uids[i]);
-
-		/* Run query */
-		mysql_query(mysql, query);
+		/* Queue seat number */
+		db_write_row(DBW_SEAT, s_ptr->gid, s_ptr->uids[i], i,
+		             NULL, 0, NULL);
 	}
 }
 
@@ -835,45 +1971,83 @@ static void db_save_seats(int sid)
 static void db_save_ai_control(int sid)
 {
 	session *s_ptr = &s_list[sid];
-	char query[1024];
 	int i;
 
 	/* Loop over players in game */
 	for (i = 0; i < s_ptr->num_users; i++)
 	{
-		/* Update seat number */
-		sprintf(query, "UPDATE attendance SET ai=%d \
-		                WHERE gid=%d AND uid=%d",
-		                s_ptr->ai_control[i], s_ptr->gid,
-		                s_ptr->uids[i]);
-
-		/* Run query */
-		mysql_query(mysql, query);
+		/* Queue AI control flag */
+		db_write_row(DBW_AI, s_ptr->gid, s_ptr->uids[i],
+		             s_ptr->ai_control[i], NULL, 0, NULL);
 	}
 }
 
 /*
- * Save a player's choice log to the database.
+ * Save a player's whole choice log as one row, and drop the journal rows
+ * it replaces.
+ */
+static void db_compact_choices(int sid, int who)
+{
+	session *s_ptr = &s_list[sid];
+	player *p_ptr;
+
+	/* Get player pointer */
+	p_ptr = &s_ptr->g->p[who];
+
+	/* Queue choice log, replacing any earlier unsaved log */
+	db_write_row(DBW_CHOICES, s_ptr->gid, s_ptr->uids[who], 0,
+	             p_ptr->choice_log, sizeof(int) * p_ptr->choice_size, NULL);
+
+	/* Queue removal of journal rows included in log */
+	db_write_row(DBW_COMPACT, s_ptr->gid, s_ptr->uids[who],
+	             p_ptr->choice_size, NULL, 0, NULL);
+
+	/* Entire log is saved */
+	s_ptr->choices_saved[who] = p_ptr->choice_size;
+
+	/* No journal rows left */
+	s_ptr->journal_rows[who] = 0;
+}
+
+/*
+ * Save the new part of a player's choice log to the database.
+ *
+ * Only the entries added since the last save are appended to the choice
+ * journal, until enough rows have piled up to compact the log.
  */
 static void db_save_choices(int sid, int who)
 {
 	session *s_ptr = &s_list[sid];
 	player *p_ptr;
-	char query[20000], log[20000];
+	int saved;
 
 	/* Get player pointer */
-	p_ptr = &s_ptr->g.p[who];
+	p_ptr = &s_ptr->g->p[who];
 
-	/* Escape choice log string */
-	mysql_real_escape_string(mysql, log, (char *)p_ptr->choice_log,
-	                         sizeof(int) * p_ptr->choice_size);
+	/* Get length already saved */
+	saved = s_ptr->choices_saved[who];
 
-	/* Create query */
-	sprintf(query, "REPLACE INTO choices VALUES (%d, %d, '%s')", s_ptr->gid,
-	        s_ptr->uids[who], log);
+	/* Check for nothing new */
+	if (p_ptr->choice_size <= saved) return;
 
-	/* Run query */
-	mysql_query(mysql, query);
+	/* Check for many journal rows */
+	if (s_ptr->journal_rows[who] >= JOURNAL_COMPACT)
+	{
+		/* Save whole log instead */
+		db_compact_choices(sid, who);
+		return;
+	}
+
+	/* Queue new entries */
+	db_write_row(DBW_JOURNAL, s_ptr->gid, s_ptr->uids[who], saved,
+	             p_ptr->choice_log + saved,
+	             sizeof(int) * (p_ptr->choice_size - saved), NULL);
+
+	/* Remember length saved */
+	s_ptr->choices_saved[who] = p_ptr->choice_size;
+
+	/* Count journal rows */
+	s_ptr->journal_rows[who]++;
 }
 
 /*
@@ -882,33 +2056,292 @@ static void db_save_choices(int sid, int who)
 static void db_save_waiting(int sid, int who)
 {
 	session *s_ptr = &s_list[sid];
-	char query[1024];
-	char *state_str;
 
-	/* Check waiting status */
-	switch (s_ptr->waiting[who])
+	/* Queue waiting status, replacing any earlier unsaved status */
+	db_write_row(DBW_WAITING, s_ptr->gid, s_ptr->uids[who],
+	             s_ptr->waiting[who], NULL, 0, NULL);
+}
+
+/*
+ * Write a snapshot of a session's game to the given buffer.
+ *
+ * The buffer must hold SNAPSHOT_LEN bytes.  Pointers are left out, and
+ * card designs are saved as library indices, so that the snapshot can be
+ * restored by another server process.
+ */
+static void pack_snapshot(session *s_ptr, char *buf)
+{
+	snapshot_head *h_ptr = (snapshot_head *)buf;
+	game *g = (game *)(buf + sizeof(snapshot_head));
+	int16_t *index = (int16_t *)(buf + sizeof(snapshot_head) + sizeof(game));
+	int i;
+
+	/* Clear snapshot */
+	memset(buf, 0, SNAPSHOT_LEN);
+
+	/* Set snapshot header */
+	h_ptr->version = SNAPSHOT_VERSION;
+	h_ptr->game_size = sizeof(game);
+	h_ptr->round = s_ptr->g->round;
+	h_ptr->random_pos = s_ptr->random_pos;
+
+	/* Save user in each seat */
+	for (i = 0; i < s_ptr->num_users; i++) h_ptr->uids[i] = s_ptr->uids[i];
+
+	/* Copy game */
+	memcpy(g, s_ptr->g, sizeof(game));
+
+	/* Clear game pointers */
+	g->camp = NULL;
+	g->camp_status = NULL;
+	g->human_name = NULL;
+
+	/* Session ID is given when restored */
+	g->session_id = 0;
+
+	/* Loop over players */
+	for (i = 0; i < MAX_PLAYER; i++)
 	{
-		case WAIT_READY:
-			state_str = "'READY'";
-			break;
-		case WAIT_BLOCKED:
-			state_str = "'BLOCKED'";
-			break;
-		case WAIT_OPTION:
-			state_str = "'OPTION'";
-			break;
-		default:
-			state_str = "NULL";
-			break;
+		/* Clear player pointers */
+		g->p[i].name = NULL;
+		g->p[i].control = NULL;
+		g->p[i].choice_log = NULL;
+		g->p[i].choice_history = NULL;
+
+		/* Choice log may have grown since, so only positions are kept */
+		g->p[i].choice_size = 0;
 	}
 
-	/* Update waiting status */
-	sprintf(query, "UPDATE attendance SET waiting=%s \
-	                WHERE gid=%d AND uid=%d",
-	               state_str, s_ptr->gid, s_ptr->uids[who]);
+	/* Loop over cards */
+	for (i = 0; i < MAX_DECK; i++)
+	{
+		/* Save design index */
+		index[i] = g->deck[i].d_ptr ? g->deck[i].d_ptr - library : -1;
+
+		/* Clear design pointer */
+		g->deck[i].d_ptr = NULL;
+	}
+}
+
+/*
+ * Restore a session's game from a snapshot.
+ *
+ * The session's choice logs must already be loaded.  Return 0 (leaving the
+ * game untouched) if the snapshot does not fit this server or the logs.
+ */
+static int unpack_snapshot(session *s_ptr, char *buf, int len)
+{
+	snapshot_head *h_ptr = (snapshot_head *)buf;
+	game *g = (game *)(buf + sizeof(snapshot_head));
+	int16_t *index = (int16_t *)(buf + sizeof(snapshot_head) + sizeof(game));
+	player saved[MAX_PLAYER];
+	int seat[MAX_PLAYER], uids[MAX_PLAYER], cids[MAX_PLAYER];
+	int ai_control[MAX_PLAYER], choices_saved[MAX_PLAYER];
+	int journal_rows[MAX_PLAYER];
+	int i, j;
+
+	/* Check snapshot format */
+	if (len != SNAPSHOT_LEN || h_ptr->version != SNAPSHOT_VERSION ||
+	    h_ptr->game_size != sizeof(game) ||
+	    h_ptr->random_pos < 0 || h_ptr->random_pos > MAX_RAND) return 0;
+
+	/* Check game parameters */
+	if (g->num_players != s_ptr->num_users ||
+	    g->expanded != s_ptr->g->expanded ||
+	    g->advanced != s_ptr->g->advanced) return 0;
+
+	/* Loop over players in snapshot */
+	for (i = 0; i < s_ptr->num_users; i++)
+	{
+		/* Look for user's current seat */
+		for (j = 0; j < s_ptr->num_users; j++)
+		{
+			/* Check for match */
+			if (s_ptr->uids[j] == h_ptr->uids[i]) break;
+		}
+
+		/* Check for user missing from session */
+		if (j == s_ptr->num_users) return 0;
+
+		/* Remember seat */
+		seat[i] = j;
+
+		/* Check that snapshot does not need choices missing from log */
+		if (g->p[i].choice_pos > s_ptr->g->p[j].choice_size ||
+		    g->p[i].choice_unread_pos > s_ptr->g->p[j].choice_size)
+			return 0;
+	}
+
+	/* Loop over cards */
+	for (i = 0; i < MAX_DECK; i++)
+	{
+		/* Check design index */
+		if (index[i] < -1 || index[i] >= num_design) return 0;
+	}
+
+	/* Remember current players */
+	memcpy(saved, s_ptr->g->p, sizeof(saved));
+	memcpy(uids, s_ptr->uids, sizeof(uids));
+	memcpy(cids, s_ptr->cids, sizeof(cids));
+	memcpy(ai_control, s_ptr->ai_control, sizeof(ai_control));
+	memcpy(choices_saved, s_ptr->choices_saved, sizeof(choices_saved));
+	memcpy(journal_rows, s_ptr->journal_rows, sizeof(journal_rows));
+
+	/* Copy game */
+	memcpy(s_ptr->g, g, sizeof(game));
+
+	/* Restore game pointers and session ID */
+	s_ptr->g->camp = NULL;
+	s_ptr->g->camp_status = NULL;
+	s_ptr->g->human_name = NULL;
+	s_ptr->g->session_id = s_ptr->sid;
+
+	/* Loop over players */
+	for (i = 0; i < s_ptr->num_users; i++)
+	{
+		/* Get player's current seat */
+		j = seat[i];
+
+		/* Restore player pointers */
+		s_ptr->g->p[i].name = saved[j].name;
+		s_ptr->g->p[i].control = saved[j].control;
+		s_ptr->g->p[i].choice_log = saved[j].choice_log;
+		s_ptr->g->p[i].choice_history = saved[j].choice_history;
+
+		/* Keep entire loaded log */
+		s_ptr->g->p[i].choice_size = saved[j].choice_size;
+
+		/* Keep current AI flag */
+		s_ptr->g->p[i].ai = saved[j].ai;
+
+		/* Move user to seat of snapshot */
+		s_ptr->uids[i] = uids[j];
+		s_ptr->cids[i] = cids[j];
+		s_ptr->ai_control[i] = ai_control[j];
+		s_ptr->choices_saved[i] = choices_saved[j];
+		s_ptr->journal_rows[i] = journal_rows[j];
+	}
+
+	/* Loop over cards */
+	for (i = 0; i < MAX_DECK; i++)
+	{
+		/* Restore design pointer */
+		s_ptr->g->deck[i].d_ptr = index[i] < 0 ? NULL : &library[index[i]];
+	}
+
+	/* Restore position in random byte pool */
+	s_ptr->random_pos = h_ptr->random_pos;
+
+	/* Success */
+	return 1;
+}
+
+/*
+ * Compare a game replayed from the start with its saved snapshot.
+ *
+ * Used in debug mode, to check that resuming from the snapshot would have
+ * given the same game.
+ */
+static void check_snapshot(session *s_ptr, char *snap)
+{
+	char *buf;
+
+	/* Make buffer */
+	buf = (char *)malloc(SNAPSHOT_LEN);
+
+	/* Write snapshot of replayed game */
+	pack_snapshot(s_ptr, buf);
+
+	/* Compare snapshots */
+	if (memcmp(buf, snap, SNAPSHOT_LEN))
+	{
+		/* Print error */
+		server_log("S:%d Snapshot of round %d differs from replay",
+		           s_ptr->sid, s_ptr->g->round);
+	}
+	else
+	{
+		/* Log message */
+		server_log("S:%d Snapshot of round %d matches replay",
+		           s_ptr->sid, s_ptr->g->round);
+	}
+
+	/* Free buffer */
+	free(buf);
+}
+
+/*
+ * Save a snapshot of a game at the end of a round.
+ *
+ * Queued after the choices made so far, so a saved snapshot never needs
+ * choices that are not saved.
+ */
+static void db_save_snapshot(int sid)
+{
+	session *s_ptr = &s_list[sid];
+	char *buf;
+
+	/* Make buffer */
+	buf = (char *)malloc(SNAPSHOT_LEN);
+
+	/* Write snapshot */
+	pack_snapshot(s_ptr, buf);
+
+	/* Queue snapshot, replacing earlier snapshot of game */
+	db_write_row(DBW_SNAPSHOT, s_ptr->gid, 0, s_ptr->g->round,
+	             buf, SNAPSHOT_LEN, NULL);
+
+	/* Free buffer */
+	free(buf);
+}
+
+/*
+ * Load the latest snapshot of a game into the given buffer.
+ *
+ * Return the length of the snapshot, or 0 if there is none.
+ */
+static int db_load_snapshot(int sid, char *buf)
+{
+	MYSQL *mysql = db_get();
+	MYSQL_RES *res;
+	MYSQL_ROW row;
+	unsigned long *field_len;
+	char query[1024];
+	int len = 0;
+
+	/* Create query */
+	sprintf(query, "SELECT round, state FROM snapshots WHERE gid=%d",
+	        s_list[sid].gid);
 
 	/* Run query */
 	mysql_query(mysql, query);
+
+	/* Fetch results */
+	res = mysql_store_result(mysql);
+
+	/* Check for row returned */
+	if (res && (row = mysql_fetch_row(res)))
+	{
+		/* Get length of snapshot */
+		field_len = mysql_fetch_lengths(res);
+
+		/* Copy snapshot if it fits */
+		if (field_len[1] <= SNAPSHOT_LEN)
+		{
+			/* Copy snapshot */
+			memcpy(buf, row[1], field_len[1]);
+			len = field_len[1];
+		}
+	}
+
+	/* Free result */
+	mysql_free_result(res);
+
+	/* Give back database connection */
+	db_put(mysql);
+
+	/* Return length */
+	return len;
 }
 
 /*
@@ -916,6 +2349,7 @@ static void db_save_waiting(int sid, int who)
  */
 static void export_log(FILE *fff, int gid)
 {
+	MYSQL *mysql = db_get();
 	MYSQL_RES *res;
 	MYSQL_ROW row;
 	char query[1024];
@@ -986,6 +2420,9 @@ static void export_log(FILE *fff, int gid)
 
 	/* Free results */
 	mysql_free_result(res);
+
+	/* Give back database connection */
+	db_put(mysql);
 }
 
 /*
@@ -1001,34 +2438,37 @@ static void db_save_results(int sid)
 	/* Save finished choice logs */
 	for (i = 0; i < s_ptr->num_users; i++)
 	{
-		/* Save choice log for this player */
-		db_save_choices(sid, i);
+		/* Save whole choice log for this player */
+		db_compact_choices(sid, i);
 	}
 
 	/* Loop over players */
 	for (i = 0; i < s_ptr->num_users; i++)
 	{
 		/* Get player pointer */
-		p_ptr = &s_ptr->g.p[i];
+		p_ptr = &s_ptr->g->p[i];
 
 		/* Get tiebreaker value for player */
-		tie = count_player_area(&s_ptr->g, i, WHERE_HAND) +
-		      count_player_area(&s_ptr->g, i, WHERE_GOOD);
+		tie = count_player_area(s_ptr->g, i, WHERE_HAND) +
+		      count_player_area(s_ptr->g, i, WHERE_GOOD);
 
 		/* Create query */
 		sprintf(query, "INSERT INTO results VALUES (%d, %d, %d, %d,%d)",
 		        s_ptr->gid, s_ptr->uids[i], p_ptr->end_vp, tie,
 		        p_ptr->winner);
 
-		/* Run query */
-		mysql_query(mysql, query);
+		/* Queue query */
+		db_write_simple(s_ptr->gid, query);
 	}
 
+	/* Wait for game log to be written before exporting it */
+	db_flush(s_ptr->gid);
+
 	/* Create file name */
 	sprintf(filename, "%s/Game_%06d.xml", export_folder, s_ptr->gid);
 
 	/* Export game to file */
-	if (export_game(&s_ptr->g, filename, export_style_sheet, server_name,
+	if (export_game(s_ptr->g, filename, export_style_sheet, server_name,
 	    -1, NULL, 0, NULL, 1, export_log, NULL, s_ptr->gid) < 0)
 	{
 		/* Log error */
@@ -1046,31 +2486,11 @@ static void db_save_results(int sid)
  */
 static void db_save_message(int sid, int uid, char* txt, char* tag)
 {
-	char query[1024];
-	char etxt[1024], etag[1024];
-
 	/* Do not save message if game is replaying */
 	if (s_list[sid].replaying) return;
 
-	/* Escape message and format */
-	mysql_real_escape_string(mysql, etxt, txt, strlen(txt));
-	mysql_real_escape_string(mysql, etag, tag, strlen(tag));
-
-	/* Create insertion query */
-	sprintf(query, "INSERT INTO messages (gid, uid, message, format) \
-	                VALUES (%d, %d, '%s', '%s')",
-	        s_list[sid].gid, uid, etxt, etag);
-
-	/* Send query */
-	mysql_query(mysql, query);
-
-	/* Check for error */
-	if (*mysql_error(mysql))
-	{
-		/* Print error */
-		server_log("%s", mysql_error(mysql));
-		exit(1);
-	}
+	/* Queue message */
+	db_write_row(DBW_MESSAGE, s_list[sid].gid, uid, 0, txt, strlen(txt), tag);
 }
 
 /*
@@ -1078,6 +2498,7 @@ static void db_save_message(int sid, int uid, char* txt, char* tag)
  */
 static void replay_messages(int gid, int cid)
 {
+	MYSQL *mysql = db_get();
 	MYSQL_RES *res;
 	MYSQL_ROW row;
 	char query[1024];
@@ -1090,6 +2511,9 @@ static void replay_messages(int gid, int cid)
 	               "ORDER BY mid",
 	               gid, c_list[cid].uid, FORMAT_CHAT);
 
+	/* Wait for recent messages to be written */
+	db_flush(gid);
+
 	/* Run query */
 	mysql_query(mysql, query);
 
@@ -1171,16 +2595,195 @@ static void replay_messages(int gid, int cid)
 
 	/* Free results */
 	mysql_free_result(res);
+
+	/* Give back database connection */
+	db_put(mysql);
 }
 
 /*
- * Send a message to a client.
+ * Update the events waited for on a connection's socket.
+ *
+ * Readable events are always wanted, writable events only while output is
+ * left unsent.  Must be called with the connection mutex held (or before
+ * the connection is in use).
  */
-void send_msg(int cid, char *msg)
+static void watch_conn(int cid, int op)
 {
-	conn *c;
-	int size, x;
+	struct epoll_event ev;
+	conn *c = &c_list[cid];
+
+	/* Events are reported when they first occur */
+	ev.events = EPOLLIN | EPOLLRDHUP | EPOLLET;
+
+	/* Check for unsent output */
+	if (c->out_len > 0) ev.events |= EPOLLOUT;
+
+	/* Identify connection */
+	ev.data.u32 = cid;
+
+	/* Update event queue */
+	if (epoll_ctl(epoll_fd, op, c->fd, &ev) < 0) perror("epoll_ctl");
+
+	/* Remember whether writable events are wanted */
+	c->out_watched = c->out_len > 0;
+}
+
+/*
+ * Create a shared outgoing message from a message buffer.
+ *
+ * The caller holds one reference, to be dropped with release_out_msg().
+ */
+static out_msg *new_out_msg(char *msg)
+{
+	out_msg *m;
 	char *ptr;
+	int size;
+
+	/* Go to size area of message */
+	ptr = msg + 4;
+
+	/* Read size */
+	get_integer(&size, msg, HEADER_LEN, &ptr);
+
+	/* Allocate message */
+	m = (out_msg *)malloc(sizeof(out_msg) + size);
+
+	/* Held by caller only */
+	m->refs = 1;
+
+	/* Copy message */
+	m->len = size;
+	memcpy(m->data, msg, size);
+
+	/* Return message */
+	return m;
+}
+
+/*
+ * Drop a reference to an outgoing message, freeing it when unused.
+ */
+static void release_out_msg(out_msg *m)
+{
+	/* Free message when last reference is gone */
+	if (__sync_sub_and_fetch(&m->refs, 1) == 0) free(m);
+}
+
+/*
+ * Drop all unsent output of a connection.
+ *
+ * Must be called with the connection mutex held.
+ */
+static void clear_out_queue(conn *c)
+{
+	/* Release queued messages */
+	while (c->out_num > 0)
+	{
+		/* Release first message */
+		release_out_msg(c->out_queue[c->out_first]);
+
+		/* Advance to next message */
+		c->out_first = (c->out_first + 1) % c->out_max;
+		c->out_num--;
+	}
+
+	/* Nothing left to send */
+	c->out_first = 0;
+	c->out_off = 0;
+	c->out_len = 0;
+}
+
+/*
+ * Send as much unsent output of a connection as possible.
+ *
+ * Must be called with the connection mutex held.
+ */
+static void flush_conn(int cid)
+{
+	conn *c = &c_list[cid];
+	struct iovec iov[MAX_IOV];
+	out_msg *m;
+	int i, n, x;
+
+	/* Loop until everything is sent or the socket is full */
+	while (c->out_num > 0)
+	{
+		/* Gather queued messages */
+		for (n = 0; n < c->out_num && n < MAX_IOV; n++)
+		{
+			/* Get message */
+			m = c->out_queue[(c->out_first + n) % c->out_max];
+
+			/* Point at unsent part of message */
+			iov[n].iov_base = m->data;
+			iov[n].iov_len = m->len;
+		}
+
+		/* Skip part of first message already sent */
+		iov[0].iov_base = (char *)iov[0].iov_base + c->out_off;
+		iov[0].iov_len -= c->out_off;
+
+		/* Send as much as possible */
+		x = writev(c->fd, iov, n);
+
+		/* Check for errors */
+		if (x < 0)
+		{
+			/* Check for interruption */
+			if (errno == EINTR) continue;
+
+			/* Stop when socket is full */
+			if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+
+			perror("writev");
+
+			/* Connection is broken, drop output */
+			clear_out_queue(c);
+			break;
+		}
+
+		/* Reduce amount left by amount sent */
+		c->out_len -= x;
+
+		/* Add first message's sent part */
+		x += c->out_off;
+
+		/* Remove completely sent messages */
+		for (i = 0; i < n; i++)
+		{
+			/* Get message */
+			m = c->out_queue[c->out_first];
+
+			/* Stop at partly sent message */
+			if (x < m->len) break;
+
+			/* Remove message from queue */
+			x -= m->len;
+			release_out_msg(m);
+			c->out_first = (c->out_first + 1) % c->out_max;
+			c->out_num--;
+		}
+
+		/* Remember amount sent of new first message */
+		c->out_off = x;
+
+		/* Stop unless everything given was sent */
+		if (i < n) break;
+	}
+
+	/* Wait for writable socket only while output is left */
+	if ((c->out_len > 0) != c->out_watched) watch_conn(cid, EPOLL_CTL_MOD);
+}
+
+/*
+ * Queue a shared message to a client.
+ *
+ * The connection takes its own reference to the message.
+ */
+static void send_out_msg(int cid, out_msg *m)
+{
+	conn *c;
+	out_msg **queue;
+	int i;
 
 	/* Ensure valid connection */
 	if (cid < 0) return;
@@ -1191,60 +2794,93 @@ void send_msg(int cid, char *msg)
 	/* Check for kicked player */
 	if (c->fd < 0) return;
 
-	/* Go to size area of message */
-	ptr = msg + 4;
-
-	/* Read size */
-	get_integer(&size, msg, HEADER_LEN, &ptr);
-
 	/* Grab mutex for connection */
 	pthread_mutex_lock(&c->conn_mutex);
 
-	/* Check for insufficient buffer size to hold message */
-	if (c->out_size < c->out_len + size)
+	/* Check for connection closed or already too far behind */
+	if (c->fd < 0 || c->out_full)
 	{
-		/* Reallocate buffer */
-		c->out_buf = (char *)realloc(c->out_buf, c->out_len + size);
+		/* Release connection mutex */
+		pthread_mutex_unlock(&c->conn_mutex);
+		return;
 	}
 
-	/* Copy current message to end of buffer */
-	memcpy(c->out_buf + c->out_len, msg, size);
+	/* Check for slow client (local AI clients are never dropped) */
+	if (!c->ai && c->out_len + m->len > OUT_HIGH_WATER)
+	{
+		/* Drop unsent output */
+		clear_out_queue(c);
 
-	/* Add to current buffer length */
-	c->out_len += size;
+		/* Mark client to be kicked */
+		c->out_full = 1;
 
-	/* Attempt to send full amount of buffer */
-	x = send(c->fd, c->out_buf, c->out_len, 0);
+		/* Wake main loop to kick client */
+		shutdown(c->fd, SHUT_RDWR);
 
-	/* Check for errors */
-	if (x < 0)
+		/* Release connection mutex */
+		pthread_mutex_unlock(&c->conn_mutex);
+		return;
+	}
+
+	/* Check for full queue */
+	if (c->out_num == c->out_max)
 	{
-		/* Check for try again error */
-		if (errno == EAGAIN || errno == EWOULDBLOCK)
+		/* Allocate larger queue */
+		queue = (out_msg **)malloc(sizeof(out_msg *) *
+		                           (c->out_max ? 2 * c->out_max : 16));
+
+		/* Copy queued messages to start of new queue */
+		for (i = 0; i < c->out_num; i++)
 		{
-			/* Release mutex */
-			pthread_mutex_unlock(&c->conn_mutex);
-			return;
+			/* Copy message pointer */
+			queue[i] = c->out_queue[(c->out_first + i) % c->out_max];
 		}
 
-		/* Print error */
-		perror("send");
-
-		/* Release mutex */
-		pthread_mutex_unlock(&c->conn_mutex);
-		return;
+		/* Replace queue */
+		free(c->out_queue);
+		c->out_queue = queue;
+		c->out_first = 0;
+		c->out_max = c->out_max ? 2 * c->out_max : 16;
 	}
 
-	/* Reduce buffer length by amount sent */
-	c->out_len -= x;
+	/* Add message to end of queue */
+	__sync_add_and_fetch(&m->refs, 1);
+	c->out_queue[(c->out_first + c->out_num) % c->out_max] = m;
+	c->out_num++;
+
+	/* Add to amount needing to be sent */
+	c->out_len += m->len;
 
-	/* Shift buffer */
-	memmove(c->out_buf, c->out_buf + x, c->out_len);
+	/* Send what we can (unless earlier output is still waiting) */
+	if (c->out_num == 1) flush_conn(cid);
 
 	/* Release connection mutex */
 	pthread_mutex_unlock(&c->conn_mutex);
 }
 
+/*
+ * Send a message to a client.
+ */
+void send_msg(int cid, char *msg)
+{
+	out_msg *m;
+
+	/* Ensure valid connection */
+	if (cid < 0) return;
+
+	/* Check for kicked player */
+	if (c_list[cid].fd < 0) return;
+
+	/* Create message */
+	m = new_out_msg(msg);
+
+	/* Queue message */
+	send_out_msg(cid, m);
+
+	/* Drop our reference */
+	release_out_msg(m);
+}
+
 /*
  * Create a new AI client connection.
  */
@@ -1264,6 +2900,14 @@ static int new_ai_client(int sid)
 	/* Check for end of list reached */
 	if (i == num_conn)
 	{
+		/* Check for full list */
+		if (num_conn == MAX_CONN)
+		{
+			/* Print error */
+			server_log("Too many connections for AI client");
+			return -1;
+		}
+
 		/* Increase count of active connections */
 		num_conn++;
 	}
@@ -1272,7 +2916,7 @@ static int new_ai_client(int sid)
 	c_list[i].state = CS_PLAYING;
 
 	/* Create a socket pair to communicate with AI client */
-	socketpair(AF_UNIX, SOCK_STREAM, 0, fds);
+	socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fds);
 
 	/* Fork a child process */
 	switch (fork())
@@ -1320,6 +2964,9 @@ static int new_ai_client(int sid)
 
 			/* Remember socket */
 			c_list[i].fd = fds[0];
+
+			/* Set socket to nonblocking */
+			fcntl(fds[0], F_SETFL, O_NONBLOCK);
 			break;
 	}
 
@@ -1335,8 +2982,21 @@ static int new_ai_client(int sid)
 	/* Clear buffer length */
 	c_list[i].buf_full = 0;
 
+	/* Release buffer grown by a previous user's large messages */
+	if (c_list[i].buf_size > 4 * READ_LEN)
+	{
+		/* Free buffer */
+		free(c_list[i].buf);
+		c_list[i].buf = NULL;
+		c_list[i].buf_size = 0;
+	}
+
 	/* Clear outgoing buffer length */
 	c_list[i].out_len = 0;
+	c_list[i].out_full = 0;
+
+	/* Watch socket */
+	watch_conn(i, EPOLL_CTL_ADD);
 
 	/* Clear username */
 	strcpy(c_list[i].user, "AI client");
@@ -1374,8 +3034,31 @@ static void send_player_one(int dest, int who)
  */
 static void send_player(int who)
 {
+	char msg[BUF_LEN], *ptr = msg;
+	out_msg *m;
 	int i;
 
+	/* Start message */
+	start_msg(&ptr, c_list[who].state == CS_DISCONN ? MSG_PLAYER_LEFT :
+	                                                  MSG_PLAYER_NEW);
+
+	/* Add username */
+	put_string(c_list[who].user, &ptr);
+
+	/* Check for connected player */
+	if (c_list[who].state != CS_DISCONN)
+	{
+		/* Add playing flag and "is you" flag (cleared for others) */
+		put_integer(c_list[who].state == CS_PLAYING, &ptr);
+		put_integer(0, &ptr);
+	}
+
+	/* Finish message */
+	finish_msg(msg, ptr);
+
+	/* Create message shared by all other clients */
+	m = new_out_msg(msg);
+
 	/* Loop over connections */
 	for (i = 0; i < num_conn; i++)
 	{
@@ -1386,9 +3069,20 @@ static void send_player(int who)
 		/* Skip AI connections */
 		if (c_list[i].ai) continue;
 
+		/* Send own information separately */
+		if (i == who)
+		{
+			/* Send information */
+			send_player_one(i, who);
+			continue;
+		}
+
 		/* Send information */
-		send_player_one(i, who);
+		send_out_msg(i, m);
 	}
+
+	/* Drop our reference */
+	release_out_msg(m);
 }
 
 /*
@@ -1522,8 +3216,12 @@ static void send_open_sessions(int cid)
 static void send_to_session(int sid, char *msg)
 {
 	session *s_ptr = &s_list[sid];
+	out_msg *m;
 	int i, cid;
 
+	/* Create message shared by all clients */
+	m = new_out_msg(msg);
+
 	/* Loop over users in a session */
 	for (i = 0; i < s_ptr->num_users; i++)
 	{
@@ -1534,8 +3232,11 @@ static void send_to_session(int sid, char *msg)
 		if (cid < 0) continue;
 
 		/* Send to client */
-		send_msg(cid, msg);
+		send_out_msg(cid, m);
 	}
+
+	/* Drop our reference */
+	release_out_msg(m);
 }
 
 /*
@@ -1582,6 +3283,9 @@ void message_add(game *g, char *txt)
 	/* Save message to db */
 	db_save_message(g->session_id, -1, txt, "");
 
+	/* Replayed messages were already sent from saved log */
+	if (s_list[g->session_id].replaying) return;
+
 	/* Create log message */
 	start_msg(&ptr, MSG_LOG);
 
@@ -1613,6 +3317,9 @@ void message_add_formatted(game *g, char *txt, char *tag)
 	/* Save message to db */
 	db_save_message(g->session_id, -1, txt, tag);
 
+	/* Replayed messages were already sent from saved log */
+	if (s_list[g->session_id].replaying) return;
+
 	/* Create log message */
 	start_msg(&ptr, MSG_LOG_FORMAT);
 
@@ -1629,6 +3336,190 @@ void message_add_formatted(game *g, char *txt, char *tag)
 	send_to_session(g->session_id, msg);
 }
 
+/*
+ * Free the in-memory state of a session's game.
+ *
+ * Called with the session mutex held.
+ */
+static void free_game(session *s_ptr)
+{
+	int i;
+
+	/* Loop over players */
+	for (i = 0; i < s_ptr->num_users; i++)
+	{
+		/* Free choice log and name */
+		free(s_ptr->g->p[i].choice_log);
+		free(s_ptr->g->p[i].name);
+	}
+
+	/* Free game structures */
+	free(s_ptr->g);
+	free(s_ptr->old);
+	free(s_ptr->out);
+	free(s_ptr->check_snap);
+
+	/* Game is no longer in memory */
+	s_ptr->g = NULL;
+	s_ptr->old = NULL;
+	s_ptr->out = NULL;
+	s_ptr->check_snap = NULL;
+}
+
+/*
+ * Queue a game to be run by a worker thread.
+ */
+static void queue_game(session *s_ptr)
+{
+	/* Grab mutex */
+	pthread_mutex_lock(&run_mutex);
+
+	/* Add session to end of queue */
+	run_queue[(run_first + run_num) % 1024] = s_ptr->sid;
+	run_num++;
+
+	/* Wake a worker thread */
+	pthread_cond_signal(&run_cond);
+
+	/* Release mutex */
+	pthread_mutex_unlock(&run_mutex);
+}
+
+/*
+ * Wake a game waiting for a reply, so that it checks whether it can
+ * continue.
+ *
+ * Called with the session mutex held.
+ */
+static void wake_game(session *s_ptr)
+{
+	/* Check for game not waiting */
+	if (!s_ptr->blocked) return;
+
+	/* Game is no longer waiting */
+	s_ptr->blocked = 0;
+
+	/* Run game again */
+	queue_game(s_ptr);
+}
+
+/*
+ * Switch from a game back to the worker thread running it.
+ *
+ * Called from the game with the session mutex held.  The worker thread
+ * releases the mutex, and the worker that resumes the game grabs it again.
+ */
+static void game_yield(session *s_ptr)
+{
+	/* Save game context and resume worker */
+	swapcontext(&s_ptr->ctx, s_ptr->worker_ctx);
+}
+
+/*
+ * Worker thread.
+ *
+ * Runs queued games until they have to wait for a reply, finish, or are
+ * paged out.
+ */
+static void *game_worker(void *arg)
+{
+	session *s_ptr;
+	ucontext_t ctx;
+
+	/* Prepare database library for this thread */
+	mysql_thread_init();
+
+	/* Loop forever */
+	while (1)
+	{
+		/* Grab mutex */
+		pthread_mutex_lock(&run_mutex);
+
+		/* Wait for game ready to run */
+		while (run_num == 0) pthread_cond_wait(&run_cond, &run_mutex);
+
+		/* Take session from front of queue */
+		s_ptr = &s_list[run_queue[run_first]];
+		run_first = (run_first + 1) % 1024;
+		run_num--;
+
+		/* Release mutex */
+		pthread_mutex_unlock(&run_mutex);
+
+		/* Acquire session mutex */
+		pthread_mutex_lock(&s_ptr->session_mutex);
+
+		/* Return here when game yields */
+		s_ptr->worker_ctx = &ctx;
+
+		/* Run game */
+		swapcontext(&ctx, &s_ptr->ctx);
+
+		/* Check for game that will not be resumed */
+		if (s_ptr->finished)
+		{
+			/* Free stack of game */
+			munmap(s_ptr->stack, GAME_STACK_LEN);
+			s_ptr->stack = NULL;
+		}
+
+		/* Release session mutex */
+		pthread_mutex_unlock(&s_ptr->session_mutex);
+	}
+
+	/* Never reached */
+	return NULL;
+}
+
+/*
+ * Page a game out of memory and stop running it.
+ *
+ * Called from the game, with the session mutex held, while waiting on a
+ * player.  The game is restored from the database once a player connects
+ * again.
+ */
+static void page_out_game(session *s_ptr)
+{
+	int i, cid;
+
+	/* Log message */
+	server_log("S:%d Paging out game", s_ptr->sid);
+
+	/* Loop over players */
+	for (i = 0; i < s_ptr->num_users; i++)
+	{
+		/* Get connection ID */
+		cid = s_ptr->cids[i];
+
+		/* Skip players without AI client */
+		if (!s_ptr->ai_control[i] || cid < 0) continue;
+
+		/* Grab connection mutex */
+		pthread_mutex_lock(&c_list[cid].conn_mutex);
+
+		/* Close AI connection (the main thread cleans up after it) */
+		if (c_list[cid].fd >= 0) shutdown(c_list[cid].fd, SHUT_RDWR);
+
+		/* Release connection mutex */
+		pthread_mutex_unlock(&c_list[cid].conn_mutex);
+
+		/* Forget AI client */
+		s_ptr->cids[i] = -1;
+	}
+
+	/* Free game */
+	free_game(s_ptr);
+
+	/* Game is paged out */
+	s_ptr->unload = 0;
+
+	/* Game is not to be resumed */
+	s_ptr->finished = 1;
+
+	/* Give worker thread back (never returns) */
+	game_yield(s_ptr);
+}
+
 /*
  * Wait for player to have an answer ready.
  */
@@ -1648,11 +3539,18 @@ static void server_wait(game *g, int who)
 		/* Wait until player is ready */
 		while (s_ptr->waiting[who])
 		{
+			/* Page game out if asked to while waiting on a human */
+			if (s_ptr->unload && !s_ptr->ai_control[who])
+				page_out_game(s_ptr);
+
 			/* Log message */
 			server_log("S:%d waiting on player %d", g->session_id, who);
 
-			/* Wait for signal */
-			pthread_cond_wait(&s_ptr->wait_cond, &s_ptr->session_mutex);
+			/* Game is waiting for a reply */
+			s_ptr->blocked = 1;
+
+			/* Let worker thread run other games until woken */
+			game_yield(s_ptr);
 		}
 
 		/* Log message */
@@ -1763,21 +3661,21 @@ static void update_meta(int sid)
 	for (i = 0; i < MAX_GOAL; i++)
 	{
 		/* Add goal presence to message */
-		put_integer(s_ptr->g.goal_active[i], &ptr);
+		put_integer(s_ptr->g->goal_active[i], &ptr);
 	}
 
 	/* Loop over players */
 	for (i = 0; i < s_ptr->num_users; i++)
 	{
 		/* Add player's name to message */
-		put_string(s_ptr->g.p[i].name, &ptr);
+		put_string(s_ptr->g->p[i].name, &ptr);
 	}
 
 	/* Loop over players again */
 	for (i = 0; i < s_ptr->num_users; i++)
 	{
 		/* Add ai flag to message */
-		put_integer(s_ptr->g.p[i].ai, &ptr);
+		put_integer(s_ptr->g->p[i].ai, &ptr);
 	}
 
 	/* Finish message */
@@ -1852,6 +3750,9 @@ static void obfuscate_game(game *ob, game *g, int who)
 		ob->deck[j].owner = g->deck[i].owner;
 		ob->deck[j].start_where = g->deck[i].start_where;
 		ob->deck[j].start_owner = g->deck[i].start_owner;
+
+		/* Forget good covered by substitute when it was last a good */
+		ob->deck[j].covering = -1;
 	}
 
 	/* Loop over cards */
@@ -1934,10 +3835,10 @@ static void update_status_one(int sid, int who)
 	int i, j;
 
 	/* Obfuscate hidden information for this player */
-	obfuscate_game(&obfus, &s_ptr->g, who);
+	obfuscate_game(&obfus, s_ptr->g, who);
 
 	/* Check for change in player status */
-	for (i = 0; i < s_ptr->g.num_players; i++)
+	for (i = 0; i < s_ptr->g->num_players; i++)
 	{
 		/* Check for difference in status */
 		if (player_changed(&obfus.p[i], &s_ptr->old[who].p[i]) ||
@@ -1994,7 +3895,7 @@ static void update_status_one(int sid, int who)
 			put_integer(p_ptr->phase_bonus_used, &ptr);
 			put_integer(p_ptr->bonus_military, &ptr);
 			/* Xeno military bonus transmitted only for XI games */
-			if (s_ptr->g.expanded == EXP_XI)
+			if (s_ptr->g->expanded == EXP_XI)
 				put_integer(p_ptr->bonus_military_xeno, &ptr);
 			put_integer(p_ptr->bonus_reduce, &ptr);
 
@@ -2072,8 +3973,8 @@ static void update_status_one(int sid, int who)
 		for (i = 0; i < MAX_GOAL; i++)
 		{
 			/* Put availabiltiy and progress counts */
-			put_integer(s_ptr->g.goal_avail[i], &ptr);
-			put_integer(s_ptr->g.goal_most[i], &ptr);
+			put_integer(s_ptr->g->goal_avail[i], &ptr);
+			put_integer(s_ptr->g->goal_most[i], &ptr);
 		}
 
 		/* Finish message */
@@ -2113,20 +4014,20 @@ static void update_status(int sid)
 	start_msg(&ptr, MSG_STATUS_MISC);
 
 	/* Add round number to message */
-	put_integer(s_ptr->g.round, &ptr);
+	put_integer(s_ptr->g->round, &ptr);
 
 	/* Add size of VP pool to message */
-	put_integer(s_ptr->g.vp_pool, &ptr);
+	put_integer(s_ptr->g->vp_pool, &ptr);
 
 	/* Loop over actions */
 	for (i = 0; i < MAX_ACTION; i++)
 	{
 		/* Add flag for action selected */
-		put_integer(s_ptr->g.action_selected[i], &ptr);
+		put_integer(s_ptr->g->action_selected[i], &ptr);
 	}
 
 	/* Add current action to message */
-	put_integer(s_ptr->g.cur_action, &ptr);
+	put_integer(s_ptr->g->cur_action, &ptr);
 
 	/* Finish message */
 	finish_msg(msg, ptr);
@@ -2167,7 +4068,7 @@ static void update_waiting(int sid)
 static void server_notify_rotation(game *g, int who)
 {
 	session *s_ptr = &s_list[g->session_id];
-	int temp_uid, temp_cid, temp_ai;
+	int temp_uid, temp_cid, temp_ai, temp_saved, temp_rows;
 	int i;
 
 	/* XXX Only do this once per set of players */
@@ -2177,6 +4078,8 @@ static void server_notify_rotation(game *g, int who)
 	temp_uid = s_ptr->uids[0];
 	temp_cid = s_ptr->cids[0];
 	temp_ai = s_ptr->ai_control[0];
+	temp_saved = s_ptr->choices_saved[0];
+	temp_rows = s_ptr->journal_rows[0];
 
 	/* Loop over players */
 	for (i = 0; i < s_ptr->num_users - 1; i++)
@@ -2185,12 +4088,16 @@ static void server_notify_rotation(game *g, int who)
 		s_ptr->uids[i] = s_ptr->uids[i + 1];
 		s_ptr->cids[i] = s_ptr->cids[i + 1];
 		s_ptr->ai_control[i] = s_ptr->ai_control[i + 1];
+		s_ptr->choices_saved[i] = s_ptr->choices_saved[i + 1];
+		s_ptr->journal_rows[i] = s_ptr->journal_rows[i + 1];
 	}
 
 	/* Store old player 0 info in last spot */
 	s_ptr->uids[i] = temp_uid;
 	s_ptr->cids[i] = temp_cid;
 	s_ptr->ai_control[i] = temp_ai;
+	s_ptr->choices_saved[i] = temp_saved;
+	s_ptr->journal_rows[i] = temp_rows;
 
 	/* Loop over players */
 	for (i = 0; i < s_ptr->num_users; i++)
@@ -2206,13 +4113,311 @@ static void server_notify_rotation(game *g, int who)
 	update_meta(g->session_id);
 }
 
+/*
+ * Queue the choice of an AI player to be made by an AI worker thread.
+ *
+ * Called with the session mutex held.
+ */
+static void queue_ai(int sid, int who)
+{
+	session *s_ptr = &s_list[sid];
+
+	/* Check for choice already queued */
+	if (s_ptr->ai_queued[who]) return;
+
+	/* Mark choice as queued */
+	s_ptr->ai_queued[who] = 1;
+
+	/* Grab mutex */
+	pthread_mutex_lock(&ai_mutex);
+
+	/* Add player to end of queue */
+	ai_queue[(ai_first + ai_num) % (1024 * MAX_PLAYER)] =
+	                                             sid * MAX_PLAYER + who;
+	ai_num++;
+
+	/* Wake an AI worker thread */
+	pthread_cond_signal(&ai_cond);
+
+	/* Release mutex */
+	pthread_mutex_unlock(&ai_mutex);
+}
+
+/*
+ * Return true if an AI player's choice still has to be made.
+ *
+ * Called with the session mutex held.
+ */
+static int ai_choice_needed(session *s_ptr, int who)
+{
+	/* Check for game no longer in memory */
+	if (!s_ptr->g) return 0;
+
+	/* Check for player no longer waited on */
+	if (!s_ptr->ai_control[who] || s_ptr->waiting[who] != WAIT_BLOCKED)
+		return 0;
+
+	/* Check for choice already made */
+	return s_ptr->g->p[who].choice_size == s_ptr->g->p[who].choice_pos;
+}
+
+/*
+ * Copy the game as seen by one player, for the AI to make choices on.
+ *
+ * Hidden information is removed as for the status sent to clients, and
+ * the copy is given its own choice logs.
+ */
+static void ai_copy_game(game *ai_g, session *s_ptr, int who, int *logs[])
+{
+	card *c_ptr;
+	int i, j;
+
+	/* Obfuscate hidden information for this player */
+	obfuscate_game(ai_g, s_ptr->g, who);
+
+	/* Loop over players */
+	for (i = 0; i < ai_g->num_players; i++)
+	{
+		/* Loop over locations */
+		for (j = 0; j < MAX_WHERE; j++)
+		{
+			/* Clear card lists */
+			ai_g->p[i].head[j] = ai_g->p[i].start_head[j] = -1;
+		}
+	}
+
+	/* Rebuild card lists from obfuscated locations, as a client would */
+	for (i = 0; i < ai_g->deck_size; i++)
+	{
+		/* Get card pointer */
+		c_ptr = &ai_g->deck[i];
+
+		/* Clear links */
+		c_ptr->next = c_ptr->start_next = -1;
+
+		/* Check for owner */
+		if (c_ptr->owner != -1)
+		{
+			/* Add card to beginning of list */
+			c_ptr->next = ai_g->p[c_ptr->owner].head[c_ptr->where];
+			ai_g->p[c_ptr->owner].head[c_ptr->where] = i;
+		}
+
+		/* Check for start of phase owner */
+		if (c_ptr->start_owner != -1)
+		{
+			/* Add card to beginning of start of phase list */
+			c_ptr->start_next =
+			  ai_g->p[c_ptr->start_owner].start_head[c_ptr->start_where];
+			ai_g->p[c_ptr->start_owner].start_head[c_ptr->start_where] = i;
+		}
+
+		/* Card's location is known to everyone once revealed */
+		if (c_ptr->where == WHERE_ACTIVE || c_ptr->where == WHERE_ASIDE)
+			c_ptr->misc |= MISC_KNOWN_MASK;
+
+		/* Our cards in hand and saved cards are known to us */
+		if (c_ptr->owner == who &&
+		    (c_ptr->where == WHERE_HAND || c_ptr->where == WHERE_SAVED))
+			c_ptr->misc |= 1 << who;
+	}
+
+	/* Check for actions not yet revealed */
+	if (ai_g->cur_action < ACT_SEARCH &&
+	    !count_active_flags(ai_g, who, FLAG_SELECT_LAST))
+	{
+		/* Loop over players */
+		for (i = 0; i < ai_g->num_players; i++)
+		{
+			/* Clear actions */
+			ai_g->p[i].action[0] = ai_g->p[i].action[1] = -1;
+		}
+	}
+
+	/* Loop over players */
+	for (i = 0; i < ai_g->num_players; i++)
+	{
+		/* Use own choice log, starting from empty */
+		ai_g->p[i].choice_log = logs[i];
+		ai_g->p[i].choice_size = ai_g->p[i].choice_pos = 0;
+
+		/* Only the AI player makes choices */
+		ai_g->p[i].control = NULL;
+	}
+
+	/* Let AI know which functions control us */
+	ai_g->p[who].control = &ai_func;
+}
+
+/*
+ * Store the choices an AI worker thread made for a player.
+ *
+ * Called with the session mutex held.
+ */
+static void add_ai_choices(int sid, int who, int *log, int n)
+{
+	session *s_ptr = &s_list[sid];
+	player *p_ptr = &s_ptr->g->p[who];
+
+	/* Check for choice log overflow */
+	if (p_ptr->choice_size + n > CHOICE_LOG_LEN)
+	{
+		/* Print error */
+		server_log("S:%d P:%d Choice log overflow", sid, who);
+		return;
+	}
+
+	/* Log message */
+	server_log("S:%d P:%d Received choice type %d position %d from AI", sid,
+	           who, log[0], p_ptr->choice_size);
+
+	/* Copy choices to end of choice log */
+	memcpy(&p_ptr->choice_log[p_ptr->choice_size], log, sizeof(int) * n);
+
+	/* Mark new size of choice log */
+	p_ptr->choice_size += n;
+
+	/* Save new choices to database */
+	db_save_choices(sid, who);
+
+	/* Mark player as ready */
+	s_ptr->waiting[who] = WAIT_READY;
+
+	/* Save waiting status */
+	db_save_waiting(sid, who);
+
+	/* Log message */
+	server_log("S:%d P:%d READY", sid, who);
+
+	/* Wake game to continue */
+	wake_game(s_ptr);
+
+	/* Update waiting status */
+	update_waiting(sid);
+}
+
+/*
+ * AI worker thread.
+ *
+ * Makes the queued choices of AI players by calling the AI directly, on a
+ * copy of the game as seen by the player.
+ */
+static void *ai_worker(void *arg)
+{
+	session *s_ptr;
+	game *ai_g;
+	choice o;
+	int *logs[MAX_PLAYER];
+	int sid, who, gid, pos, i;
+	int last_sid = -1, last_who = -1, last_gid = -1;
+
+	/* Create game copy */
+	ai_g = (game *)malloc(sizeof(game));
+
+	/* Loop over players */
+	for (i = 0; i < MAX_PLAYER; i++)
+	{
+		/* Create choice log for copy */
+		logs[i] = (int *)malloc(sizeof(int) * CHOICE_LOG_LEN);
+	}
+
+	/* Loop forever */
+	while (1)
+	{
+		/* Grab mutex */
+		pthread_mutex_lock(&ai_mutex);
+
+		/* Wait for queued choice */
+		while (ai_num == 0) pthread_cond_wait(&ai_cond, &ai_mutex);
+
+		/* Take player from front of queue */
+		sid = ai_queue[ai_first] / MAX_PLAYER;
+		who = ai_queue[ai_first] % MAX_PLAYER;
+		ai_first = (ai_first + 1) % (1024 * MAX_PLAYER);
+		ai_num--;
+
+		/* Release mutex */
+		pthread_mutex_unlock(&ai_mutex);
+
+		/* Get session pointer */
+		s_ptr = &s_list[sid];
+
+		/* Acquire session mutex */
+		pthread_mutex_lock(&s_ptr->session_mutex);
+
+		/* Choice is no longer queued */
+		s_ptr->ai_queued[who] = 0;
+
+		/* Check for choice no longer needed */
+		if (!ai_choice_needed(s_ptr, who))
+		{
+			/* Release session mutex */
+			pthread_mutex_unlock(&s_ptr->session_mutex);
+			continue;
+		}
+
+		/* Copy game as seen by player */
+		ai_copy_game(ai_g, s_ptr, who, logs);
+
+		/* Copy choice to make */
+		o = s_ptr->out[who];
+
+		/* Remember game and log position choice is made for */
+		gid = s_ptr->gid;
+		pos = s_ptr->g->p[who].choice_size;
+
+		/* Release session mutex while AI thinks */
+		pthread_mutex_unlock(&s_ptr->session_mutex);
+
+		/* Check for different player than last time */
+		if (sid != last_sid || who != last_who || gid != last_gid)
+		{
+			/* Grab mutex */
+			pthread_mutex_lock(&ai_init_mutex);
+
+			/* Load networks and forget state of previous player */
+			ai_func.init(ai_g, who, 0);
+
+			/* Release mutex */
+			pthread_mutex_unlock(&ai_init_mutex);
+
+			/* Remember player */
+			last_sid = sid;
+			last_who = who;
+			last_gid = gid;
+		}
+
+		/* Ask AI for decision */
+		ai_func.make_choice(ai_g, who, o.type, o.list, &o.num, o.special,
+		                    &o.num_special, o.arg1, o.arg2, o.arg3);
+
+		/* Acquire session mutex */
+		pthread_mutex_lock(&s_ptr->session_mutex);
+
+		/* Store choices unless game moved on (or was paged out) */
+		if (s_ptr->gid == gid && ai_choice_needed(s_ptr, who) &&
+		    s_ptr->g->p[who].choice_size == pos)
+		{
+			/* Add choices to player's log */
+			add_ai_choices(sid, who, logs[who],
+			               ai_g->p[who].choice_size);
+		}
+
+		/* Release session mutex */
+		pthread_mutex_unlock(&s_ptr->session_mutex);
+	}
+
+	/* Never reached */
+	return NULL;
+}
+
 /*
  * (Re-)Ask a client to make a game choice.
  */
 static void ask_client(int sid, int who)
 {
 	session *s_ptr = &s_list[sid];
-	game *g = &s_ptr->g;
+	game *g = s_ptr->g;
 	choice *o_ptr;
 	int cid;
 	char msg[BUF_LEN], *ptr = msg;
@@ -2234,9 +4439,6 @@ static void ask_client(int sid, int who)
 		return;
 	}
 
-	/* Check for no player */
-	if (cid < 0) return;
-
 	/* Check for choice already received */
 	if (g->p[who].choice_size > g->p[who].choice_pos)
 	{
@@ -2244,6 +4446,17 @@ static void ask_client(int sid, int who)
 		return;
 	}
 
+	/* Check for AI player run by the server */
+	if (s_ptr->ai_control[who] && num_ai_workers)
+	{
+		/* Have an AI worker thread make choice */
+		queue_ai(sid, who);
+		return;
+	}
+
+	/* Check for no player */
+	if (cid < 0) return;
+
 	/* Check for prepare message */
 	if (o_ptr->type == CHOICE_PREPARE)
 	{
@@ -2467,12 +4680,28 @@ static void kick_player(int cid, char *reason)
 	/* Set state to disconnected */
 	c_list[cid].state = CS_DISCONN;
 
-	/* Close connection */
-	close(c_list[cid].fd);
+	/* Grab mutex for connection */
+	pthread_mutex_lock(&c_list[cid].conn_mutex);
+
+	/* Check for open connection */
+	if (c_list[cid].fd >= 0)
+	{
+		/* Stop watching socket (forked AI clients may share it) */
+		epoll_ctl(epoll_fd, EPOLL_CTL_DEL, c_list[cid].fd, NULL);
+
+		/* Close connection */
+		close(c_list[cid].fd);
+	}
 
 	/* Clear file descriptor */
 	c_list[cid].fd = -1;
 
+	/* Drop unsent output */
+	clear_out_queue(&c_list[cid]);
+
+	/* Release connection mutex */
+	pthread_mutex_unlock(&c_list[cid].conn_mutex);
+
 	/* Send disconnect to everyone */
 	send_player(cid);
 
@@ -2551,11 +4780,11 @@ static int verify_choice(session *s_ptr, int who, int type, int list[], int nl,
 static void handle_choice(int cid, int size)
 {
 	session *s_ptr;
-	player *p_ptr = NULL;
+	player *p_ptr;
 	int who, i, x, sid, pos, type, nl, ns, got_choice = 0;
 	int len_choices, process_choices = 0;
 	int *l_ptr, *list, *special;
-	char *msg_buf = c_list[cid].buf;
+	char *msg_buf = c_list[cid].msg;
 	char *ptr = msg_buf;
 
 	/* Get session ID from player */
@@ -2571,20 +4800,26 @@ static void handle_choice(int cid, int size)
 	for (who = 0; who < s_ptr->num_users; who++)
 	{
 		/* Check for matching client ID */
-		if (s_ptr->cids[who] == cid)
-		{
-			/* Get player pointer */
-			p_ptr = &s_ptr->g.p[who];
-			break;
-		}
+		if (s_ptr->cids[who] == cid) break;
 	}
 
 	/* Do nothing if client is not a player */
-	if (!p_ptr) return;
+	if (who == s_ptr->num_users) return;
 
 	/* Grab session mutex */
 	pthread_mutex_lock(&s_ptr->session_mutex);
 
+	/* Check for game no longer in memory */
+	if (!s_ptr->g)
+	{
+		/* Release mutex */
+		pthread_mutex_unlock(&s_ptr->session_mutex);
+		return;
+	}
+
+	/* Get player pointer */
+	p_ptr = &s_ptr->g->p[who];
+
 	/* Skip header */
 	ptr += HEADER_LEN;
 
@@ -2718,15 +4953,9 @@ static void handle_choice(int cid, int size)
 	/* Mark new size of choice log */
 	p_ptr->choice_size = l_ptr - p_ptr->choice_log;
 
-	/* Release session mutex */
-	pthread_mutex_unlock(&s_ptr->session_mutex);
-
-	/* Save choice log to database */
+	/* Save new choices to database */
 	db_save_choices(sid, who);
 
-	/* Acquire mutex for session */
-	pthread_mutex_lock(&s_ptr->session_mutex);
-
 	/* Check for blocked player */
 	if (s_ptr->waiting[who] == WAIT_BLOCKED && got_choice)
 	{
@@ -2743,8 +4972,8 @@ static void handle_choice(int cid, int size)
 	/* Mark time of activity */
 	c_list[cid].last_active = time(NULL);
 
-	/* Signal game thread to continue */
-	pthread_cond_signal(&s_ptr->wait_cond);
+	/* Wake game to continue */
+	wake_game(s_ptr);
 
 	/* Update waiting status */
 	update_waiting(sid);
@@ -2811,8 +5040,8 @@ static void handle_prepare(int cid)
 		server_log("S:%d P:%d READY", sid, who);
 	}
 
-	/* Signal game thread to continue */
-	pthread_cond_signal(&s_ptr->wait_cond);
+	/* Wake game to continue */
+	wake_game(s_ptr);
 
 	/* Update waiting status */
 	update_waiting(sid);
@@ -2841,6 +5070,9 @@ void server_private_message(game *g, int who, char *txt, char *tag)
 	/* Save message to db */
 	db_save_message(g->session_id, uid, txt, tag);
 
+	/* Replayed messages were already sent from saved log */
+	if (s_list[g->session_id].replaying) return;
+
 	/* Check for no connection */
 	if (cid < 0) return;
 
@@ -2882,12 +5114,41 @@ decisions server_func =
 
 /*
  * Accept a new connection.
+ *
+ * Returns 0 when there are no more connections waiting.
  */
-static void accept_conn(int listen_fd)
+static int accept_conn(int listen_fd)
 {
 	struct sockaddr_in peer_addr;
 	socklen_t size = sizeof(struct sockaddr_in);
-	int i;
+	int i, fd;
+
+	/* Accept connection */
+	fd = accept4(listen_fd, (struct sockaddr *)&peer_addr, &size,
+	             SOCK_NONBLOCK | SOCK_CLOEXEC);
+
+	/* Check for failure */
+	if (fd < 0)
+	{
+		/* Check for no more connections waiting */
+		if (errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+
+		/* Check for recoverable error */
+		if (errno == ECONNABORTED || errno == EINTR) return 1;
+
+		/* Check for too many open files */
+		if (errno == EMFILE || errno == ENFILE || errno == ENOBUFS ||
+		    errno == ENOMEM)
+		{
+			/* Print error, and try again when next connection arrives */
+			perror("accept");
+			return 0;
+		}
+
+		/* Print error and exit */
+		perror("accept");
+		exit(1);
+	}
 
 	/* Loop through current list looking for an empty spot */
 	for (i = 0; i < num_conn; i++)
@@ -2900,30 +5161,24 @@ static void accept_conn(int listen_fd)
 	/* Check for end of list reached */
 	if (i == num_conn)
 	{
+		/* Check for full list */
+		if (num_conn == MAX_CONN)
+		{
+			/* Refuse connection */
+			close(fd);
+			return 1;
+		}
+
 		/* Increase count of active connections */
 		num_conn++;
 	}
 
-	/* Accept connection */
-	c_list[i].fd = accept(listen_fd, (struct sockaddr *)&peer_addr, &size);
+	/* Remember socket */
+	c_list[i].fd = fd;
 
 	/* Connection is not local AI */
 	c_list[i].ai = 0;
 
-	/* Check for failure */
-	if (c_list[i].fd < 0)
-	{
-		/* Check for recoverable error */
-		if (errno == EAGAIN) return;
-
-		/* Print error and exit */
-		perror("accept");
-		exit(1);
-	}
-
-	/* Set socket to nonblocking */
-	fcntl(c_list[i].fd, F_SETFL, O_NONBLOCK);
-
 	/* Set state to initialized */
 	c_list[i].state = CS_INIT;
 
@@ -2936,8 +5191,21 @@ static void accept_conn(int listen_fd)
 	/* Clear buffer length */
 	c_list[i].buf_full = 0;
 
+	/* Release buffer grown by a previous user's large messages */
+	if (c_list[i].buf_size > 4 * READ_LEN)
+	{
+		/* Free buffer */
+		free(c_list[i].buf);
+		c_list[i].buf = NULL;
+		c_list[i].buf_size = 0;
+	}
+
 	/* Clear outgoing buffer length */
 	c_list[i].out_len = 0;
+	c_list[i].out_full = 0;
+
+	/* Watch socket */
+	watch_conn(i, EPOLL_CTL_ADD);
 
 	/* Clear username */
 	strcpy(c_list[i].user, "");
@@ -2947,6 +5215,9 @@ static void accept_conn(int listen_fd)
 
 	/* Log new connection */
 	server_log("State for connection %d set to INIT", i);
+
+	/* Check for more */
+	return 1;
 }
 
 /*
@@ -3082,20 +5353,40 @@ static void switch_ai(int sid, int who)
 	/* Acquire session mutex */
 	pthread_mutex_lock(&s_ptr->session_mutex);
 
-	/* Create a new AI connection */
-	cid = new_ai_client(sid);
+	/* Check for game no longer in memory */
+	if (!s_ptr->g)
+	{
+		/* Release session mutex */
+		pthread_mutex_unlock(&s_ptr->session_mutex);
+		return;
+	}
+
+	/* Check for AI players run by the server */
+	if (num_ai_workers)
+	{
+		/* No connection for AI player */
+		cid = -1;
+
+		/* Forget connection of replaced player */
+		s_ptr->cids[who] = cid;
+	}
+	else
+	{
+		/* Create a new AI connection */
+		cid = new_ai_client(sid);
 
-	/* Save client ID in session */
-	s_ptr->cids[who] = cid;
+		/* Save client ID in session */
+		s_ptr->cids[who] = cid;
 
-	/* Client is playing */
-	c_list[cid].state = CS_PLAYING;
+		/* Client is playing */
+		c_list[cid].state = CS_PLAYING;
 
-	/* Log connection state */
-	server_log("State for connection %d set to PLAYING", cid);
+		/* Log connection state */
+		server_log("State for connection %d set to PLAYING", cid);
 
-	/* Log game seat */
-	server_log("S:%d P:%d Connection %d joined", sid, who, cid);
+		/* Log game seat */
+		server_log("S:%d P:%d Connection %d joined", sid, who, cid);
+	}
 
 	/* Log player state */
 	log_waiting(sid, who, s_ptr->waiting[who]);
@@ -3108,14 +5399,14 @@ static void switch_ai(int sid, int who)
 
 	/* Mark player as AI */
 	s_ptr->ai_control[who] = 1;
-	s_ptr->g.p[who].ai = 1;
+	s_ptr->g->p[who].ai = 1;
 
 	/* Save AI control in database */
 	db_save_ai_control(sid);
 
 	/* Format message */
 	sprintf(text, "%s has been placed under AI control.",
-	        s_ptr->g.p[who].name);
+	        s_ptr->g->p[who].name);
 
 	/* Send to session */
 	send_gamechat(sid, -1, "", text, 1);
@@ -3128,6 +5419,9 @@ static void switch_ai(int sid, int who)
 
 		/* Save waiting status */
 		db_save_waiting(sid, who);
+
+		/* Wake game to continue */
+		wake_game(s_ptr);
 	}
 
 	/* Send new waiting status */
@@ -3143,30 +5437,26 @@ static void switch_ai(int sid, int who)
 /*
  * Run a started game.
  *
- * This function runs in a new thread.
- */
-void *run_game(void *arg)
-{
-	session *s_ptr = (session *)arg;
-	int i;
-
-	/* Initialize condition variable */
-	pthread_cond_init(&s_ptr->wait_cond, NULL);
-
-	/* Acquire session mutex */
-	pthread_mutex_lock(&s_ptr->session_mutex);
+ * This function runs on its own stack, and is resumed by the worker
+ * threads (with the session mutex held) whenever it can continue.
+ */
+static void run_game(int sid)
+{
+	session *s_ptr = &s_list[sid];
+	char *snap;
+	int i, snap_len, resumed = 0;
 
 	/* Initialize game */
-	init_game(&s_ptr->g);
+	init_game(s_ptr->g);
 
 	/* Assume we are not replaying game */
 	s_ptr->replaying = 0;
 
 	/* Loop over all players in game */
-	for (i = 0; i < s_ptr->g.num_players; ++i)
+	for (i = 0; i < s_ptr->g->num_players; ++i)
 	{
 		/* Check for choices in log */
-		if (s_ptr->g.p[i].choice_size > 0)
+		if (s_ptr->g->p[i].choice_size > 0)
 		{
 			/* Set replaying flag */
 			s_ptr->replaying = 1;
@@ -3175,7 +5465,53 @@ void *run_game(void *arg)
 	}
 
 	/* Save session ID in game structure */
-	s_ptr->g.session_id = s_ptr - s_list;
+	s_ptr->g->session_id = s_ptr - s_list;
+
+	/* Check for game to replay */
+	if (s_ptr->replaying)
+	{
+		/* Make snapshot buffer */
+		snap = (char *)malloc(SNAPSHOT_LEN);
+
+		/* Load latest snapshot of game */
+		snap_len = db_load_snapshot(s_ptr->sid, snap);
+
+		/* Resume from snapshot, unless checking it against full replay */
+		if (snap_len && !debug_server)
+		{
+			/* Restore game from snapshot */
+			resumed = unpack_snapshot(s_ptr, snap, snap_len);
+
+			/* Check for success */
+			if (resumed)
+			{
+				/* Log message */
+				server_log("S:%d Resuming after round %d", s_ptr->sid,
+				           s_ptr->g->round);
+			}
+			else
+			{
+				/* Print error */
+				server_log("S:%d Snapshot not usable, replaying whole game",
+				           s_ptr->sid);
+			}
+
+			/* Snapshot is no longer needed */
+			snap_len = 0;
+		}
+
+		/* Check for snapshot to compare with full replay */
+		if (snap_len == SNAPSHOT_LEN)
+		{
+			/* Keep snapshot until replay reaches its round */
+			s_ptr->check_snap = snap;
+		}
+		else
+		{
+			/* Free snapshot buffer */
+			free(snap);
+		}
+	}
 
 	/* Send meta status to clients */
 	update_meta(s_ptr - s_list);
@@ -3190,17 +5526,33 @@ void *run_game(void *arg)
 		send_msgf(s_ptr->cids[i], MSG_SEAT, "d", i);
 	}
 
-	/* Begin game */
-	begin_game(&s_ptr->g);
+	/* Begin game, unless resumed from a later round */
+	if (!resumed) begin_game(s_ptr->g);
 
 	/* Play game rounds until finished */
-	while (game_round(&s_ptr->g));
+	while (game_round(s_ptr->g))
+	{
+		/* Check for replay reaching round of snapshot */
+		if (s_ptr->check_snap && s_ptr->g->round ==
+		                         ((snapshot_head *)s_ptr->check_snap)->round)
+		{
+			/* Compare replayed game with snapshot */
+			check_snapshot(s_ptr, s_ptr->check_snap);
+
+			/* Snapshot is checked */
+			free(s_ptr->check_snap);
+			s_ptr->check_snap = NULL;
+		}
+
+		/* Save snapshot unless round was replayed */
+		if (!s_ptr->replaying) db_save_snapshot(s_ptr->sid);
+	}
 
 	/* Score game */
-	score_game(&s_ptr->g);
+	score_game(s_ptr->g);
 
 	/* Declare winner */
-	declare_winner(&s_ptr->g);
+	declare_winner(s_ptr->g);
 
 	/* Send status to everyone */
 	update_status(s_ptr - s_list);
@@ -3227,8 +5579,17 @@ void *run_game(void *arg)
 	/* Save results */
 	db_save_results(s_ptr->sid);
 
-	/* Done */
-	return NULL;
+	/* Acquire session mutex */
+	pthread_mutex_lock(&s_ptr->session_mutex);
+
+	/* Free game */
+	free_game(s_ptr);
+
+	/* Game is not to be resumed */
+	s_ptr->finished = 1;
+
+	/* Give worker thread back (never returns) */
+	game_yield(s_ptr);
 }
 
 /*
@@ -3238,7 +5599,6 @@ static void start_session(int sid)
 {
 	session *s_ptr = &s_list[sid];
 	char name[80];
-	pthread_t t;
 	int i;
 
 	/* Check for advanced flag and more than two players */
@@ -3248,50 +5608,66 @@ static void start_session(int sid)
 		s_ptr->advanced = 0;
 	}
 
+	/* Create game structures */
+	s_ptr->g = (game *)calloc(1, sizeof(game));
+	s_ptr->old = (game *)calloc(s_ptr->num_users, sizeof(game));
+	s_ptr->out = (choice *)calloc(s_ptr->num_users, sizeof(choice));
+
+	/* Game is not paged out while starting */
+	s_ptr->unload = 0;
+	s_ptr->idle_since = 0;
+
 	/* Copy paramaters to game structure */
-	s_ptr->g.num_players = s_ptr->num_users;
-	s_ptr->g.expanded = s_ptr->expanded;
-	s_ptr->g.advanced = s_ptr->advanced;
-	s_ptr->g.goal_disabled = s_ptr->disable_goal;
-	s_ptr->g.takeover_disabled = s_ptr->disable_takeover;
-	s_ptr->g.camp = NULL;
+	s_ptr->g->num_players = s_ptr->num_users;
+	s_ptr->g->expanded = s_ptr->expanded;
+	s_ptr->g->advanced = s_ptr->advanced;
+	s_ptr->g->goal_disabled = s_ptr->disable_goal;
+	s_ptr->g->takeover_disabled = s_ptr->disable_takeover;
+	s_ptr->g->camp = NULL;
 
 	/* Save session ID in game structure */
-	s_ptr->g.session_id = sid;
+	s_ptr->g->session_id = sid;
 
 	/* Loop over players */
 	for (i = 0; i < s_ptr->num_users; i++)
 	{
 		/* Set player interface function */
-		s_ptr->g.p[i].control = &server_func;
+		s_ptr->g->p[i].control = &server_func;
 
 		/* Create choice log */
-		s_ptr->g.p[i].choice_log = (int *)malloc(sizeof(int) * CHOICE_LOG_LEN);
+		s_ptr->g->p[i].choice_log = (int *)malloc(sizeof(int) * CHOICE_LOG_LEN);
 
 		/* Clear choice log size and position */
-		s_ptr->g.p[i].choice_size = 0;
-		s_ptr->g.p[i].choice_pos = 0;
+		s_ptr->g->p[i].choice_size = 0;
+		s_ptr->g->p[i].choice_pos = 0;
+
+		/* Nothing saved yet */
+		s_ptr->choices_saved[i] = 0;
+		s_ptr->journal_rows[i] = 0;
 
 		/* Get player's name */
 		db_user_name(s_ptr->uids[i], name);
 
 		/* Copy player's name */
-		s_ptr->g.p[i].name = strdup(name);
+		s_ptr->g->p[i].name = strdup(name);
 
 		/* Clear waiting amount */
 		s_ptr->wait_ticks[i] = 0;
 
+		/* Player is not waited on until game asks */
+		s_ptr->waiting[i] = WAIT_READY;
+
 		/* Check for AI-controlled player */
 		if (s_ptr->ai_control[i])
 		{
-			/* Create AI client connection */
-			s_ptr->cids[i] = new_ai_client(sid);
-			s_ptr->g.p[i].ai = 1;
+			/* Create AI client connection, unless run by the server */
+			s_ptr->cids[i] = num_ai_workers ? -1 : new_ai_client(sid);
+			s_ptr->g->p[i].ai = 1;
 		}
 		else
 		{
 			/* Player is not AI-controlled */
-			s_ptr->g.p[i].ai = 0;
+			s_ptr->g->p[i].ai = 0;
 		}
 	}
 
@@ -3308,27 +5684,110 @@ static void start_session(int sid)
 		db_save_seats(sid);
 	}
 
-	/* Start a thread to run game */
-	pthread_create(&t, NULL, run_game, (void *)s_ptr);
+	/* Make stack for game */
+	s_ptr->stack = (char *)mmap(NULL, GAME_STACK_LEN, PROT_READ | PROT_WRITE,
+	                            MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE |
+	                            MAP_STACK, -1, 0);
+
+	/* Check for error */
+	if (s_ptr->stack == MAP_FAILED)
+	{
+		/* Message and exit */
+		perror("mmap");
+		exit(1);
+	}
+
+	/* Catch stack overflows with a guard page at bottom of stack */
+	mprotect(s_ptr->stack, getpagesize(), PROT_NONE);
+
+	/* Create context to run game in */
+	getcontext(&s_ptr->ctx);
+	s_ptr->ctx.uc_stack.ss_sp = s_ptr->stack;
+	s_ptr->ctx.uc_stack.ss_size = GAME_STACK_LEN;
+	s_ptr->ctx.uc_link = NULL;
+	makecontext(&s_ptr->ctx, (void (*)(void))run_game, 1, sid);
+
+	/* Game is ready to start */
+	s_ptr->blocked = 0;
+	s_ptr->finished = 0;
+
+	/* Have a worker thread start game */
+	queue_game(s_ptr);
+}
+
+/*
+ * Make sure the game of a started session is in memory.
+ *
+ * Games are only restored from the database (from their latest snapshot
+ * and the choices made since) when a player connects or an AI player has
+ * to act.  Called with the session mutex held.  Return 1 if the game was
+ * restored.
+ */
+static int load_session(int sid)
+{
+	session *s_ptr = &s_list[sid];
+
+	/* Cancel paging out game */
+	s_ptr->unload = 0;
+
+	/* Check for game in memory or not running */
+	if (s_ptr->g || s_ptr->state != SS_STARTED) return 0;
+
+	/* Log message */
+	server_log("S:%d Restoring game", sid);
+
+	/* Wait for game data still being saved */
+	db_flush(s_ptr->gid);
+
+	/* Put users back in their seats from before the game began */
+	db_load_seats(sid);
+
+	/* Start game */
+	start_session(sid);
+
+	/* Game is restored */
+	return 1;
 }
 
 /*
- * Start any session that is in the "STARTED" state.
+ * Restore started sessions that are not blocked on a human player.
  *
- * This should only be called once during server setup.
+ * Other started games stay out of memory until a player connects.  This
+ * should only be called once during server setup.
  */
 static void start_all_sessions(void)
 {
-	int i;
+	session *s_ptr;
+	int i, j;
 
 	/* Loop over sessions */
 	for (i = 0; i < num_session; i++)
 	{
+		/* Get session pointer */
+		s_ptr = &s_list[i];
+
 		/* Skip sessions that aren't started */
-		if (s_list[i].state != SS_STARTED) continue;
+		if (s_ptr->state != SS_STARTED) continue;
+
+		/* Loop over users in session */
+		for (j = 0; j < s_ptr->num_users; j++)
+		{
+			/* Stop at human player the game is blocked on */
+			if (!s_ptr->ai_control[j] &&
+			    s_ptr->waiting[j] == WAIT_BLOCKED) break;
+		}
+
+		/* Leave game out of memory until the player connects */
+		if (j < s_ptr->num_users) continue;
 
-		/* Start session */
-		start_session(i);
+		/* Acquire session mutex */
+		pthread_mutex_lock(&s_ptr->session_mutex);
+
+		/* Restore game, so that AI players can act */
+		load_session(i);
+
+		/* Release session mutex */
+		pthread_mutex_unlock(&s_ptr->session_mutex);
 	}
 }
 
@@ -3341,9 +5800,9 @@ static void handle_login(int cid, int size)
 	session *s_ptr;
 	char user[1024], pass[1024], version[1024];
 	char text[1024];
-	char *msg_buf = c_list[cid].buf;
+	char *msg_buf = c_list[cid].msg;
 	char *ptr = msg_buf;
-	int i, j;
+	int i, j, restored;
 
 	/* Ensure client is in INIT state */
 	if (c_list[cid].state != CS_INIT)
@@ -3363,7 +5822,7 @@ static void handle_login(int cid, int size)
 		goto format_error;
 
 	/* Check for release information */
-	if (ptr - msg_buf < c_list[cid].buf_full)
+	if (ptr - msg_buf < size)
 	{
 		/* Use release as version */
 		if (!get_string(c_list[cid].version, 80, msg_buf, size, &ptr))
@@ -3563,6 +6022,12 @@ static void handle_login(int cid, int size)
 			/* Lock session mutex */
 			pthread_mutex_lock(&s_ptr->session_mutex);
 
+			/* Restore game if it is not in memory */
+			restored = load_session(i);
+
+			/* Restoring may have moved user to another seat */
+			j = session_uid(i, c_list[cid].uid);
+
 			/* Tell client that game has started */
 			send_msgf(cid, MSG_START, "");
 
@@ -3587,17 +6052,21 @@ static void handle_login(int cid, int size)
 			/* Send to session */
 			send_gamechat(i, -1, "", text, 0);
 
-			/* Tell client about game state */
-			update_meta(i);
+			/* Check for game that was already running */
+			if (!restored && s_ptr->g)
+			{
+				/* Tell client about game state */
+				update_meta(i);
 
-			/* Give player a seat number */
-			send_msgf(cid, MSG_SEAT, "d", j);
+				/* Give player a seat number */
+				send_msgf(cid, MSG_SEAT, "d", j);
 
-			/* Update waiting status */
-			update_waiting(i);
+				/* Update waiting status */
+				update_waiting(i);
 
-			/* Ask player to answer last choice */
-			ask_client(i, j);
+				/* Ask player to answer last choice */
+				ask_client(i, j);
+			}
 
 			/* Release session mutex */
 			pthread_mutex_unlock(&s_ptr->session_mutex);
@@ -3638,7 +6107,7 @@ static void handle_create(int cid, int size)
 	char pass[2048], desc[2048];
 	int sid, i, x;
 	int maxp;
-	char *msg_buf = c_list[cid].buf;
+	char *msg_buf = c_list[cid].msg;
 	char *ptr = msg_buf;
 
 	/* Check for player already in game */
@@ -3800,7 +6269,7 @@ static void handle_join(int cid, int size)
 	char pass[1024];
 	int sid;
 	int i;
-	char *msg_buf = c_list[cid].buf;
+	char *msg_buf = c_list[cid].msg;
 	char *ptr = msg_buf;
 
 	/* Skip header */
@@ -3965,7 +6434,7 @@ static void handle_remove(int cid, int size)
 	session *s_ptr;
 	int i, sid;
 	char buf[1024], name[80];
-	char *msg_buf = c_list[cid].buf;
+	char *msg_buf = c_list[cid].msg;
 	char *ptr = msg_buf;
 
 	/* Skip header */
@@ -4046,7 +6515,7 @@ static void handle_add_ai(int cid, int size)
 	session *s_ptr;
 	int sid, uid;
 	int i;
-	char *msg_buf = c_list[cid].buf;
+	char *msg_buf = c_list[cid].msg;
 	char *ptr = msg_buf;
 
 	/* Skip header */
@@ -4222,7 +6691,7 @@ static void handle_start(int cid, int size)
 	int sid;
 	int i;
 	char text[1024];
-	char *msg_buf = c_list[cid].buf;
+	char *msg_buf = c_list[cid].msg;
 	char *ptr = msg_buf;
 
 	/* Skip header */
@@ -4320,9 +6789,10 @@ format_error:
  */
 static void handle_chat(int cid, int size)
 {
-	char chat[1024];
-	int i;
-	char *msg_buf = c_list[cid].buf;
+	char chat[1024], msg[BUF_LEN];
+	out_msg *m;
+	int i, max;
+	char *msg_buf = c_list[cid].msg;
 	char *ptr = msg_buf;
 
 	/* Skip header */
@@ -4331,9 +6801,36 @@ static void handle_chat(int cid, int size)
 	/* Read chat message */
 	if (!get_string(chat, 1024, msg_buf, size, &ptr)) goto format_error;
 
+	/* Compute longest text that fits in a message with sender's name */
+	max = BUF_LEN - HEADER_LEN - strlen(c_list[cid].user) - 2;
+
+	/* Check for text too long */
+	if (strlen(chat) > max)
+	{
+		/* Do not split a multibyte character */
+		while (max > 0 && ((unsigned char)chat[max] & 0xc0) == 0x80) max--;
+
+		/* Truncate text */
+		chat[max] = '\0';
+	}
+
 	/* Check for sender in lobby */
 	if (c_list[cid].state == CS_LOBBY)
 	{
+		/* Start message */
+		ptr = msg;
+		start_msg(&ptr, MSG_CHAT);
+
+		/* Add sender and text */
+		put_string(c_list[cid].user, &ptr);
+		put_string(chat, &ptr);
+
+		/* Finish message */
+		finish_msg(msg, ptr);
+
+		/* Create message shared by all clients */
+		m = new_out_msg(msg);
+
 		/* Loop over all clients in lobby */
 		for (i = 0; i < num_conn; i++)
 		{
@@ -4341,8 +6838,11 @@ static void handle_chat(int cid, int size)
 			if (c_list[i].state == CS_DISCONN) continue;
 
 			/* Send chat to player */
-			send_msgf(i, MSG_CHAT, "ss", c_list[cid].user, chat);
+			send_out_msg(i, m);
 		}
+
+		/* Drop our reference */
+		release_out_msg(m);
 	}
 	else
 	{
@@ -4370,14 +6870,14 @@ format_error:
  */
 static void handle_msg(int cid)
 {
-	char *ptr = c_list[cid].buf;
+	char *ptr = c_list[cid].msg;
 	int type, size;
 
 	/* Read message type */
-	get_integer(&type, c_list[cid].buf, HEADER_LEN, &ptr);
+	get_integer(&type, c_list[cid].msg, HEADER_LEN, &ptr);
 
 	/* Read message size */
-	get_integer(&size, c_list[cid].buf, HEADER_LEN, &ptr);
+	get_integer(&size, c_list[cid].msg, HEADER_LEN, &ptr);
 
 	/* Check for non-login message from client in INIT state */
 	if (c_list[cid].state == CS_INIT && type != MSG_LOGIN)
@@ -4496,39 +6996,45 @@ static void handle_msg(int cid)
 
 /*
  * Handle incoming data from a client.
+ *
+ * As much data as is available is read, and every complete message in it
+ * is handled.  A partial message is kept for the next call.
+ *
+ * Returns 0 when no more data is available (or the client is gone).
  */
-static void handle_data(int cid)
+static int handle_data(int cid)
 {
 	conn *c;
-	char *ptr;
-	int x, size;
+	char *ptr, *size_ptr;
+	int x, size, left;
 
 	/* Get pointer to connection */
 	c = &c_list[cid];
 
-	/* Determine number of bytes to read */
-	if (c->buf_full < HEADER_LEN)
+	/* Check for too little free space */
+	if (c->buf_size - c->buf_full < READ_LEN)
 	{
-		/* Undetermined message size, by default use the header size */
-		size = HEADER_LEN;
-	}
-	else
-	{
-		/*
-		 * Read message size. Note: size != HEADER_LEN because messages of this
-		 * size are handled as soon as their length has been determined.
-		 */
-		ptr = c->buf + 4;
-		get_integer(&size, c->buf, HEADER_LEN, &ptr);
+		/* Grow buffer */
+		c->buf_size = c->buf_size ? 2 * c->buf_size : READ_LEN;
+		c->buf = (char *)realloc(c->buf, c->buf_size);
 	}
 
-	/* Try to read as many bytes as needed */
-	x = recv(c->fd, c->buf + c->buf_full, size - c->buf_full, 0);
+	/* Read as many bytes as fit */
+	x = recv(c->fd, c->buf + c->buf_full, c->buf_size - c->buf_full, 0);
 
 	if (x < 0)
 	{
+		/* Check for no more data */
+		if (errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+
+		/* Check for interruption */
+		if (errno == EINTR) return 1;
+
 		perror("recv");
-		return;
+
+		/* Client is gone */
+		kick_player(cid, "Connection error");
+		return 0;
 	}
 
 	/* Check for no bytes read */
@@ -4536,49 +7042,72 @@ static void handle_data(int cid)
 	{
 		/* Client closed connection */
 		kick_player(cid, "Client closed connection");
-		return;
+		return 0;
 	}
 
 	/* Add to amount read */
 	c->buf_full += x;
 
-	/* Check for complete message header if message size was not determined */
-	if (size == HEADER_LEN && c->buf_full >= HEADER_LEN)
+	/* Mark time of last data seen */
+	c->last_seen = time(NULL);
+	c->ping_sent = 0;
+
+	/* Start at beginning of buffer */
+	ptr = c->buf;
+	left = c->buf_full;
+
+	/* Loop over complete message headers */
+	while (left >= HEADER_LEN)
 	{
-		/* Determine length of incoming message, error case cannot happen */
-		ptr = c->buf + 4;
-		get_integer(&size, c->buf, HEADER_LEN, &ptr);
+		/* Read message size */
+		size_ptr = ptr + 4;
+		get_integer(&size, ptr, HEADER_LEN, &size_ptr);
 
 		/* Check for illegally small message */
 		if (size < HEADER_LEN)
 		{
 			/* Kick client */
 			kick_player(cid, "Message too small");
-			return;
+			return 0;
 		}
 
 		/* Check for too long message */
-		if (size > BUF_LEN)
+		if (size > MAX_MSG_LEN)
 		{
 			/* Close connection */
 			kick_player(cid, "Message too long");
-			return;
+			return 0;
 		}
-	}
 
-	/* Check for complete message */
-	if (c->buf_full == size)
-	{
+		/* Stop at incomplete message */
+		if (left < size) break;
+
 		/* Handle message */
+		c->msg = ptr;
 		handle_msg(cid);
 
-		/* Clear buffer */
-		c->buf_full = 0;
+		/* Stop if client was kicked */
+		if (c->fd < 0) return 0;
+
+		/* Check for client too far behind reading its output */
+		if (c->out_full)
+		{
+			/* Remove client */
+			kick_player(cid, "Too much unsent output");
+			return 0;
+		}
+
+		/* Advance to next message */
+		ptr += size;
+		left -= size;
 	}
 
-	/* Mark time of last data seen */
-	c->last_seen = time(NULL);
-	c->ping_sent = 0;
+	/* Move partial message to start of buffer */
+	if (ptr != c->buf) memmove(c->buf, ptr, left);
+	c->buf_full = left;
+
+	/* More data may be available */
+	return 1;
 }
 
 /*
@@ -4730,6 +7259,29 @@ static void do_housekeeping(void)
 			if (s_ptr->cids[j] >= 0) num++;
 		}
 
+		/* Check for game in memory that nobody is connected to */
+		if (!num && s_ptr->g)
+		{
+			/* Remember when game became idle */
+			if (!s_ptr->idle_since) s_ptr->idle_since = cur_time;
+
+			/* Check for game idle too long */
+			if (unload_timeout > 0 && !s_ptr->unload &&
+			    cur_time - s_ptr->idle_since >= unload_timeout)
+			{
+				/* Page game out when it next waits on a human */
+				s_ptr->unload = 1;
+
+				/* Wake game */
+				wake_game(s_ptr);
+			}
+		}
+		else
+		{
+			/* Game is not idle */
+			s_ptr->idle_since = 0;
+		}
+
 		/* Release mutex */
 		pthread_mutex_unlock(&s_ptr->session_mutex);
 
@@ -4818,6 +7370,48 @@ static void do_housekeeping(void)
 	}
 }
 
+/*
+ * Handle the events reported for a connection.
+ */
+static void handle_conn_events(int cid, uint32_t events)
+{
+	conn *c = &c_list[cid];
+
+	/* Check for connection closed while handling earlier events */
+	if (c->fd < 0) return;
+
+	/* Check for client too far behind reading its output */
+	if (c->out_full)
+	{
+		/* Remove client */
+		kick_player(cid, "Too much unsent output");
+		return;
+	}
+
+	/* Check for incoming data or hangup */
+	if (events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))
+	{
+		/* Read until no more data is available */
+		while (c->fd >= 0 && handle_data(cid));
+	}
+
+	/* Check for connection closed */
+	if (c->fd < 0) return;
+
+	/* Check for socket ready to send more */
+	if (events & EPOLLOUT)
+	{
+		/* Grab mutex for connection */
+		pthread_mutex_lock(&c->conn_mutex);
+
+		/* Send unsent output */
+		if (c->fd >= 0) flush_conn(cid);
+
+		/* Release connection mutex */
+		pthread_mutex_unlock(&c->conn_mutex);
+	}
+}
+
 /*
  * Initialize connection to database, open main listening socket, then loop
  * forever waiting for incoming data on connections.
@@ -4825,12 +7419,13 @@ static void do_housekeeping(void)
 int main(int argc, char *argv[])
 {
 	struct sockaddr_in listen_addr;
-	struct timeval sel_timeout;
-	fd_set readfds, writefds;
-	int listen_fd;
+	struct epoll_event ev, events[MAX_EVENTS];
+	struct itimerspec tick;
+	struct rlimit limit;
+	uint64_t expired;
+	pthread_t t;
+	int listen_fd, timer_fd;
 	int i, n;
-	my_bool reconnect = 1;
-	time_t last_housekeep = 0;
 	int port = 16309;
 	char *db = "rftg";
 	char *db_user = "rftg";
@@ -4854,10 +7449,16 @@ int main(int argc, char *argv[])
 			printf("  -k     Timeout to replace players with A.I. in ticks (%d seconds).\n", tick_size);
 			printf("            0 means do not replace players. Default: 30\n");
 			printf("  -gt    Timeout to drop games that haven't been started yet. Default: 3600\n");
+			printf("  -ut    Timeout in seconds to page out started games no player is connected\n");
+			printf("            to. 0 means keep games in memory. Default: 600\n");
+			printf("  -w     Number of worker threads to run games on. Default: 4\n");
+			printf("  -ai    Number of threads to run AI players on inside the server. 0 means\n");
+			printf("            run an AI client program for each AI player. Default: 0\n");
 			printf("  -e     Folder to put exported games. Default: \".\"\n");
 			printf("  -s     Server name (to be used in exports). Default: [none]\n");
 			printf("  -ss    XSLT style sheets for exported games. Default: [none]\n");
-			printf("  -debug Accept debug card messages.\n");
+			printf("  -debug Accept debug card messages, and check game snapshots against\n");
+			printf("            full replays when resuming games.\n");
 			printf("  -h     Print this usage text and exit.\n\n");
 			printf("For more information, see the following web sites:\n");
 			printf("  http://keldon.net/rftg\n  https://github.com/bnordli/rftg/wiki\n");
@@ -4921,6 +7522,27 @@ int main(int argc, char *argv[])
 			game_timeout = atoi(argv[++i]);
 		}
 
+		/* Check for unload timeout settings */
+		if (!strcmp(argv[i], "-ut"))
+		{
+			/* Set new unload timeout */
+			unload_timeout = atoi(argv[++i]);
+		}
+
+		/* Check for number of worker threads */
+		if (!strcmp(argv[i], "-w"))
+		{
+			/* Set number of worker threads */
+			num_workers = atoi(argv[++i]);
+		}
+
+		/* Check for number of AI worker threads */
+		if (!strcmp(argv[i], "-ai"))
+		{
+			/* Set number of AI worker threads */
+			num_ai_workers = atoi(argv[++i]);
+		}
+
 		/* Check for server name */
 		if (!strcmp(argv[i], "-s"))
 		{
@@ -4950,6 +7572,22 @@ int main(int argc, char *argv[])
 		}
 	}
 
+	/* Check for no worker threads to run games on */
+	if (num_workers < 1)
+	{
+		/* Print error and exit */
+		server_log("Need at least one worker thread (-w)!");
+		exit(1);
+	}
+
+	/* Check for negative number of AI worker threads */
+	if (num_ai_workers < 0)
+	{
+		/* Print error and exit */
+		server_log("Number of AI worker threads (-ai) can't be negative!");
+		exit(1);
+	}
+
 	/* Read card library */
 	if (read_cards(NULL) < 0)
 	{
@@ -4957,27 +7595,72 @@ int main(int argc, char *argv[])
 		exit(1);
 	}
 
-	/* Initialize database library */
-	mysql = mysql_init(NULL);
+	/* Open pool of connections for reading */
+	for (i = 0; i < DB_POOL_LEN; i++)
+	{
+		/* Connect to database server */
+		db_idle[db_num_idle++] = db_connect(db_host, db_user, db_pw, db);
+	}
+
+	/* Open connection for database writer thread */
+	db_writer_mysql = db_connect(db_host, db_user, db_pw, db);
+
+	/* Start database writer thread */
+	pthread_create(&t, NULL, db_writer, NULL);
+
+	/* Allow as many open sockets as the system lets us */
+	if (!getrlimit(RLIMIT_NOFILE, &limit))
+	{
+		/* Raise limit to maximum */
+		limit.rlim_cur = limit.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &limit);
+	}
+
+	/* Reserve space for connection list */
+	c_list = (conn *)mmap(NULL, sizeof(conn) * MAX_CONN,
+	                      PROT_READ | PROT_WRITE,
+	                      MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
 
 	/* Check for error */
-	if (!mysql)
+	if (c_list == MAP_FAILED)
 	{
-		/* Print error and exit */
-		server_log("Couldn't initialize database library!");
+		/* Message and exit */
+		perror("mmap");
 		exit(1);
 	}
 
-	/* Attempt to connect to database server */
-	if (!mysql_real_connect(mysql, db_host, db_user, db_pw, db, 0, NULL, 0))
+	/* Create event queue */
+	epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+
+	/* Check for error */
+	if (epoll_fd < 0)
 	{
-		/* Print error and exit */
-		server_log("Database connection: %s", mysql_error(mysql));
+		/* Message and exit */
+		perror("epoll_create1");
 		exit(1);
 	}
 
-	/* Reconnect automatically when connection to database is lost */
-	mysql_options(mysql, MYSQL_OPT_RECONNECT, &reconnect);
+	/* Start worker threads to run games on */
+	for (i = 0; i < num_workers; i++)
+	{
+		/* Start worker thread */
+		pthread_create(&t, NULL, game_worker, NULL);
+	}
+
+	/* Check for AI players run by the server */
+	if (num_ai_workers)
+	{
+		/* Load each network once for all threads, and never train it */
+		ai_share_nets = 1;
+		ai_train = 0;
+
+		/* Start AI worker threads */
+		for (i = 0; i < num_ai_workers; i++)
+		{
+			/* Start AI worker thread */
+			pthread_create(&t, NULL, ai_worker, NULL);
+		}
+	}
 
 	/* Read game states from database */
 	db_load_sessions();
@@ -4993,7 +7676,7 @@ int main(int argc, char *argv[])
 	signal(SIGCHLD, SIG_IGN);
 
 	/* Create main socket for new connections */
-	listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+	listen_fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
 
 	/* Check for error */
 	if (listen_fd < 0)
@@ -5018,105 +7701,91 @@ int main(int argc, char *argv[])
 	}
 
 	/* Establish listening queue */
-	if (listen(listen_fd, 10) < 0)
+	if (listen(listen_fd, SOMAXCONN) < 0)
 	{
 		/* Message and exit */
 		perror("listen");
 		exit(1);
 	}
 
+	/* Watch for new connections */
+	ev.events = EPOLLIN | EPOLLET;
+	ev.data.u32 = (uint32_t)EV_LISTEN;
+	epoll_ctl(epoll_fd, EPOLL_CTL_ADD, listen_fd, &ev);
+
+	/* Create housekeeping timer */
+	timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+
+	/* Check for error */
+	if (timer_fd < 0)
+	{
+		/* Message and exit */
+		perror("timerfd_create");
+		exit(1);
+	}
+
+	/* Expire once every tick */
+	tick.it_value.tv_sec = tick.it_interval.tv_sec = tick_size;
+	tick.it_value.tv_nsec = tick.it_interval.tv_nsec = 0;
+	timerfd_settime(timer_fd, 0, &tick, NULL);
+
+	/* Watch timer */
+	ev.events = EPOLLIN;
+	ev.data.u32 = (uint32_t)EV_TIMER;
+	epoll_ctl(epoll_fd, EPOLL_CTL_ADD, timer_fd, &ev);
+
 	/* Print ready message */
 	server_log("Server ready. Listening on port %d...", port);
 
 	/* Loop forever */
 	while (1)
 	{
-		/* Clear set of connections to listen on */
-		FD_ZERO(&readfds);
-
-		/* Clear set of connections to wait for ability to write */
-		FD_ZERO(&writefds);
+		/* Wait for events */
+		n = epoll_wait(epoll_fd, events, MAX_EVENTS, -1);
 
-		/* Add main listening socket to list */
-		FD_SET(listen_fd, &readfds);
-
-		/* Track biggest file descriptor */
-		n = listen_fd;
-
-		/* Loop over active connections */
-		for (i = 0; i < num_conn; i++)
+		/* Check for error */
+		if (n < 0)
 		{
-			/* Check for still active */
-			if (c_list[i].fd > 0)
-			{
-				/* Add descriptor to set */
-				FD_SET(c_list[i].fd, &readfds);
-
-				/* Track biggest file descriptor */
-				if (c_list[i].fd > n) n = c_list[i].fd;
-
-				/* Grab connection mutex */
-				pthread_mutex_lock(&c_list[i].conn_mutex);
-
-				/* Check for unsent data */
-				if (c_list[i].out_len > 0)
-				{
-					/* Add to write set */
-					FD_SET(c_list[i].fd, &writefds);
-				}
+			/* Retry after signal */
+			if (errno == EINTR) continue;
 
-				/* Release connection mutex */
-				pthread_mutex_unlock(&c_list[i].conn_mutex);
-			}
+			/* Message and exit */
+			perror("epoll_wait");
+			exit(1);
 		}
 
-		/* Wait no more than one tick */
-		sel_timeout.tv_sec = tick_size;
-		sel_timeout.tv_usec = 0;
-
-		/* Wait for activity on any connection */
-		select(n + 1, &readfds, &writefds, NULL, &sel_timeout);
-
-		/* Check for new incoming connection */
-		if (FD_ISSET(listen_fd, &readfds))
+		/* Loop over events */
+		for (i = 0; i < n; i++)
 		{
-			/* Accept new connection */
-			accept_conn(listen_fd);
-		}
+			/* Check for new incoming connections */
+			if ((int)events[i].data.u32 == EV_LISTEN)
+			{
+				/* Accept all waiting connections */
+				while (accept_conn(listen_fd));
+			}
 
-		/* Loop over active connections */
-		for (i = 0; i < num_conn; i++)
-		{
-			/* Check for still active */
-			if (c_list[i].fd > 0)
+			/* Check for housekeeping timer */
+			else if ((int)events[i].data.u32 == EV_TIMER)
 			{
-				/* Check for activity on this connection */
-				if (FD_ISSET(c_list[i].fd, &readfds))
+				/* Clear timer expiration */
+				if (read(timer_fd, &expired, sizeof(expired)) < 0 &&
+				    errno != EAGAIN)
 				{
-					/* Handle incoming data */
-					handle_data(i);
+					/* Print error */
+					perror("read");
 				}
 
-				/* Check for connection closed */
-				if (c_list[i].fd < 0) continue;
-
-				/* Check for unsent data ready to send */
-				if (FD_ISSET(c_list[i].fd, &writefds))
-				{
-					/* Send ping to flush buffer */
-					send_msgf(i, MSG_PING, "");
-				}
+				/* Perform housekeeping */
+				do_housekeeping();
 			}
-		}
-
-		/* Check time since last housekeeping */
-		if (time(NULL) - last_housekeep >= tick_size)
-		{
-			/* Perform housekeeping */
-			do_housekeeping();
 
-			/* Remember time */
-			last_housekeep = time(NULL);
+			/* Otherwise event is for a connection */
+			else
+			{
+				/* Handle connection events */
+				handle_conn_events(events[i].data.u32,
+				                   events[i].events);
+			}
 		}
 	}
 }
@@ -0,0 +1,1017 @@
+/*
+ * Race for the Galaxy AI
+ *
+ * Copyright (C) 2009-2015 Keldon Jones
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * Offline trainer.
+ *
+ * Trains a network from experience logs written by the learner (-l and
+ * -L options), instead of from games played online.
+ *
+ * With a teacher network (-d option), the network is trained to match the
+ * teacher's outputs on the logged inputs instead of the logged outcomes.
+ * This is used to distill the normal networks into smaller ones for the
+ * fast AI tier, optionally keeping only the most important inputs (-k).
+ *
+ * With the -q option, the network given with -w is not trained, but its
+ * hidden weights are quantized to 8 or 16 bits.  The scale is calibrated
+ * on the logged inputs and checked against the original weights, and
+ * saved next to the weights file if accurate enough (-e option).
+ *
+ * With the -B option, networks of each of the given shapes are trained
+ * on most of the logged samples, and the training speed, the inference
+ * time and the error on the remaining samples are reported, to help pick
+ * the cheapest network shape worth comparing in the arena.
+ */
+
+#include "net.h"
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+
+/*
+ * Magic string at the start of experience logs.
+ */
+#define EXP_MAGIC "RFTGEXP1"
+
+/*
+ * Network size (from first log).
+ */
+static int num_inputs = -1, num_output;
+
+/*
+ * Input names (from first log).
+ */
+static char **input_name;
+
+/*
+ * Start of every record in all logs.
+ */
+static unsigned char **sample;
+static int num_sample, sample_size;
+
+/*
+ * Map an experience log into memory and find its records.
+ */
+static int map_log(char *fname)
+{
+	struct stat st;
+	unsigned char *data, *ptr, *end, *name;
+	int32_t size[2];
+	uint16_t num, idx;
+	int fd, i, first, start;
+
+	/* Open log */
+	fd = open(fname, O_RDONLY);
+
+	/* Check for failure */
+	if (fd < 0 || fstat(fd, &st) < 0)
+	{
+		/* Error */
+		fprintf(stderr, "Couldn't open %s\n", fname);
+		return -1;
+	}
+
+	/* Check for too small file */
+	if (st.st_size < 8 + 2 * sizeof(int32_t))
+	{
+		/* Error */
+		fprintf(stderr, "%s is not an experience log\n", fname);
+		close(fd);
+		return -1;
+	}
+
+	/* Map file */
+	data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+	/* Mapping stays valid after close */
+	close(fd);
+
+	/* Check for failure */
+	if (data == MAP_FAILED)
+	{
+		/* Error */
+		fprintf(stderr, "Couldn't map %s\n", fname);
+		return -1;
+	}
+
+	/* Records are read in random order */
+	madvise(data, st.st_size, MADV_RANDOM);
+
+	/* Get network size */
+	memcpy(size, data + 8, sizeof(size));
+
+	/* Check header */
+	if (memcmp(data, EXP_MAGIC, 8) || size[0] < 1 || size[0] > 65536 ||
+	    size[1] < 1 || size[1] > 255 ||
+	    (num_inputs >= 0 &&
+	     (size[0] != num_inputs || size[1] != num_output)))
+	{
+		/* Error */
+		fprintf(stderr, "%s does not match other logs\n", fname);
+		munmap(data, st.st_size);
+		return -1;
+	}
+
+	/* Get start of input names */
+	ptr = data + 8 + sizeof(size);
+	end = data + st.st_size;
+
+	/* Remember whether this is the first log */
+	first = num_inputs < 0;
+
+	/* Check for first log */
+	if (first)
+	{
+		/* Remember network size */
+		num_inputs = size[0];
+		num_output = size[1];
+
+		/* Create array of input names */
+		input_name = (char **)malloc(sizeof(char *) * num_inputs);
+	}
+
+	/* Loop over input names */
+	for (i = 0; i < size[0]; i++)
+	{
+		/* Find terminator within file */
+		name = memchr(ptr, 0, end - ptr);
+
+		/* Check for truncated names */
+		if (!name)
+		{
+			/* Error */
+			fprintf(stderr, "%s has truncated input names\n", fname);
+			munmap(data, st.st_size);
+			return -1;
+		}
+
+		/* Check for first log */
+		if (first)
+		{
+			/* Copy name */
+			input_name[i] = strdup((char *)ptr);
+		}
+
+		/* Skip name and terminator */
+		ptr = name + 1;
+	}
+
+	/* Remember first record of this log */
+	start = num_sample;
+
+	/* Loop over records */
+	while (ptr + 4 <= end)
+	{
+		/* Get number of stored inputs */
+		memcpy(&num, ptr, sizeof(uint16_t));
+
+		/* Check for truncated record */
+		if (ptr + 4 + sizeof(float) * ptr[3] +
+		    (sizeof(uint16_t) + sizeof(float)) * num > end) break;
+
+		/* Check for record of a different network */
+		if (ptr[3] != num_output)
+		{
+			/* Error */
+			fprintf(stderr, "%s has a corrupt record\n", fname);
+			num_sample = start;
+			munmap(data, st.st_size);
+			return -1;
+		}
+
+		/* Loop over indices of stored inputs */
+		for (i = 0; i < num; i++)
+		{
+			/* Get index */
+			memcpy(&idx, ptr + 4 + sizeof(float) * num_output +
+			             sizeof(uint16_t) * i, sizeof(uint16_t));
+
+			/* Check for index outside network */
+			if (idx >= num_inputs) break;
+		}
+
+		/* Check for bad index */
+		if (i < num)
+		{
+			/* Error */
+			fprintf(stderr, "%s has a corrupt record\n", fname);
+			num_sample = start;
+			munmap(data, st.st_size);
+			return -1;
+		}
+
+		/* Make room for record */
+		if (num_sample == sample_size)
+		{
+			/* Grow array */
+			sample_size = sample_size ? sample_size * 2 : 65536;
+			sample = (unsigned char **)realloc(sample,
+			                   sizeof(unsigned char *) * sample_size);
+		}
+
+		/* Remember record */
+		sample[num_sample++] = ptr;
+
+		/* Skip to next record */
+		ptr += 4 + sizeof(float) * ptr[3] +
+		       (sizeof(uint16_t) + sizeof(float)) * num;
+	}
+
+	/* Success */
+	return 0;
+}
+
+/*
+ * Set network inputs and desired outputs from a record.
+ */
+static void load_sample(net *learn, unsigned char *ptr, double *desired)
+{
+	unsigned char *idx_ptr, *val_ptr;
+	uint16_t num, idx;
+	float val;
+	int i;
+
+	/* Get number of stored inputs */
+	memcpy(&num, ptr, sizeof(uint16_t));
+
+	/* Skip to outcome */
+	ptr += 4;
+
+	/* Copy outcome */
+	for (i = 0; i < num_output; i++)
+	{
+		/* Copy one output */
+		memcpy(&val, ptr, sizeof(float));
+		desired[i] = val;
+		ptr += sizeof(float);
+	}
+
+	/* Clear all inputs */
+	for (i = 0; i < num_inputs; i++) learn->input_value[i] = -1;
+
+	/* Get start of indices and values */
+	idx_ptr = ptr;
+	val_ptr = ptr + sizeof(uint16_t) * num;
+
+	/* Set stored inputs */
+	for (i = 0; i < num; i++)
+	{
+		/* Get index and value */
+		memcpy(&idx, idx_ptr + sizeof(uint16_t) * i, sizeof(uint16_t));
+		memcpy(&val, val_ptr + sizeof(float) * i, sizeof(float));
+
+		/* Set input */
+		learn->input_value[idx] = val;
+	}
+}
+
+/*
+ * Load a teacher network.
+ */
+static void load_teacher(net *teacher, char *fname)
+{
+	int input, hidden, output, i;
+
+	/* Read network size */
+	if (read_net_size(fname, &input, &hidden, &output))
+	{
+		/* Error */
+		fprintf(stderr, "Couldn't load %s\n", fname);
+		exit(1);
+	}
+
+	/* Check for mismatch with logs */
+	if (input != num_inputs || output != num_output)
+	{
+		/* Error */
+		fprintf(stderr, "%s does not match logs\n", fname);
+		exit(1);
+	}
+
+	/* Create network */
+	make_learner(teacher, input, hidden, 0, output);
+
+	/* Set input names */
+	for (i = 0; i < num_inputs; i++)
+		teacher->input_name[i] = strdup(input_name[i]);
+
+	/* Load weights */
+	if (load_net(teacher, fname))
+	{
+		/* Error */
+		fprintf(stderr, "Couldn't load %s\n", fname);
+		exit(1);
+	}
+}
+
+/*
+ * Prune all but the given fraction of inputs of a network, keeping those
+ * with the largest weights in the teacher network.
+ */
+static void prune_inputs(net *learn, net *teacher, double keep)
+{
+	double *size, sum;
+	int *order, i, j, k, n;
+
+	/* Create arrays of input sizes and order */
+	size = (double *)malloc(sizeof(double) * num_inputs);
+	order = (int *)malloc(sizeof(int) * num_inputs);
+
+	/* Loop over inputs */
+	for (i = 0; i < num_inputs; i++)
+	{
+		/* Start sum at zero */
+		sum = 0.0;
+
+		/* Sum squares of teacher weights */
+		for (j = 0; j < teacher->num_hidden; j++)
+			sum += teacher->hidden_weight[i][j] *
+			       teacher->hidden_weight[i][j];
+
+		/* Remember size */
+		size[i] = sum;
+
+		/* Insert input into order (largest first) */
+		for (k = i; k > 0 && size[order[k - 1]] < sum; k--)
+			order[k] = order[k - 1];
+		order[k] = i;
+	}
+
+	/* Compute number of inputs to keep */
+	n = keep * num_inputs + 0.5;
+
+	/* Prune the rest */
+	for (i = n; i < num_inputs; i++) prune_input(learn, order[i]);
+
+	printf("Kept %d of %d inputs\n", n, num_inputs);
+
+	/* Free arrays */
+	free(size);
+	free(order);
+}
+
+/*
+ * Shuffle the first given number of samples.
+ */
+static void shuffle_samples(int num)
+{
+	unsigned char *tmp;
+	int i, j;
+
+	/* Loop over samples */
+	for (i = num - 1; i > 0; i--)
+	{
+		/* Pick sample to swap with */
+		j = rand() % (i + 1);
+
+		/* Swap */
+		tmp = sample[i];
+		sample[i] = sample[j];
+		sample[j] = tmp;
+	}
+}
+
+/*
+ * Train a network for one pass over the first given number of samples,
+ * in random order.
+ *
+ * If a teacher is given, its outputs are used instead of the logged ones.
+ */
+static void train_pass(net *learn, net *teacher, int num, int batch)
+{
+	double *desired;
+	int i, j, n = 0;
+
+	/* Create array of desired outputs */
+	desired = (double *)malloc(sizeof(double) * num_output);
+
+	/* Shuffle samples */
+	shuffle_samples(num);
+
+	/* Clear error counters */
+	learn->error = learn->num_error = 0;
+
+	/* Loop over samples */
+	for (i = 0; i < num; i++)
+	{
+		/* Set inputs and desired outputs */
+		load_sample(learn, sample[i], desired);
+
+		/* Check for teacher */
+		if (teacher)
+		{
+			/* Copy inputs to teacher */
+			memcpy(teacher->input_value, learn->input_value,
+			       sizeof(double) * num_inputs);
+
+			/* Compute teacher */
+			compute_net(teacher);
+
+			/* Use teacher's outputs instead */
+			for (j = 0; j < num_output; j++)
+				desired[j] = teacher->win_prob[j];
+		}
+
+		/* Compute network */
+		compute_net(learn);
+
+		/* Accumulate training */
+		train_net(learn, 1.0, desired);
+
+		/* Apply training at end of mini-batch */
+		if (++n == batch)
+		{
+			/* Apply */
+			apply_training(learn);
+			n = 0;
+		}
+	}
+
+	/* Apply rest of last mini-batch */
+	apply_training(learn);
+
+	/* Count training iteration */
+	learn->num_training++;
+
+	/* Free array */
+	free(desired);
+}
+
+/*
+ * Read hidden layer sizes given as "hidden" or "hidden x hidden2".
+ *
+ * Returns the number of sizes read, or 0 if invalid.
+ */
+static int read_shape(char *arg, int *hidden, int *hidden2)
+{
+	int n;
+
+	/* Clear second layer */
+	*hidden2 = 0;
+
+	/* Read sizes */
+	n = sscanf(arg, "%dx%d", hidden, hidden2);
+
+	/* Check for bad sizes */
+	if (n < 1 || *hidden < 1 || *hidden2 < 0) return 0;
+
+	/* Return sizes read */
+	return n;
+}
+
+/*
+ * Return the seconds elapsed since the given time.
+ */
+static double elapsed(struct timespec *start)
+{
+	struct timespec now;
+
+	/* Get current time */
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	/* Compute difference */
+	return (now.tv_sec - start->tv_sec) +
+	       (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+/*
+ * Compare network shapes.
+ *
+ * The samples are split into a training part and a tenth held out.  For
+ * each shape (comma separated), a new network is trained on the training
+ * part, and the training samples per second, the time to compute one
+ * held out position, and the mean squared error on held out positions
+ * are printed.
+ *
+ * Held out positions have nothing in common, so every input is looked at
+ * when computing the network; during search consecutive positions differ
+ * in few inputs, and computing is faster.
+ */
+static void bench_shapes(char *shapes, net *teacher, int passes, int batch,
+                         double alpha)
+{
+	struct timespec start;
+	net learn;
+	char *ptr;
+	double *desired, train_time, eval_time, error, diff;
+	int num_train, hidden, hidden2, seed, i, j, k;
+
+	/* Create array of desired outputs */
+	desired = (double *)malloc(sizeof(double) * num_output);
+
+	/* Shuffle once, so every shape holds out the same samples */
+	shuffle_samples(num_sample);
+
+	/* Compute training part */
+	num_train = num_sample - num_sample / 10;
+
+	/* Remember random state, so every shape trains in the same order */
+	seed = rand();
+
+	printf("%-10s %8s %14s %12s %12s\n", "shape", "weights",
+	       "train samples/s", "ns/position", "error");
+
+	/* Loop over shapes */
+	for (ptr = strtok(shapes, ","); ptr; ptr = strtok(NULL, ","))
+	{
+		/* Read shape */
+		if (!read_shape(ptr, &hidden, &hidden2))
+		{
+			/* Error */
+			fprintf(stderr, "Bad network shape %s\n", ptr);
+			exit(1);
+		}
+
+		/* Use same random state for each shape */
+		srand(seed);
+
+		/* Create network */
+		make_learner(&learn, num_inputs, hidden, hidden2, num_output);
+
+		/* Set input names */
+		for (i = 0; i < num_inputs; i++)
+			learn.input_name[i] = strdup(input_name[i]);
+
+		/* Set learning rate */
+		learn.alpha = alpha;
+
+		/* Remember start time */
+		clock_gettime(CLOCK_MONOTONIC, &start);
+
+		/* Train */
+		for (i = 0; i < passes; i++)
+			train_pass(&learn, teacher, num_train, batch);
+
+		/* Compute training time */
+		train_time = elapsed(&start);
+
+		/* Clear error */
+		error = 0.0;
+
+		/* Remember start time */
+		clock_gettime(CLOCK_MONOTONIC, &start);
+
+		/* Loop over held out samples */
+		for (i = num_train; i < num_sample; i++)
+		{
+			/* Set inputs and desired outputs */
+			load_sample(&learn, sample[i], desired);
+
+			/* Compute network */
+			compute_net(&learn);
+
+			/* Check for teacher */
+			if (teacher)
+			{
+				/* Copy inputs to teacher */
+				memcpy(teacher->input_value, learn.input_value,
+				       sizeof(double) * num_inputs);
+
+				/* Compute teacher */
+				compute_net(teacher);
+
+				/* Use teacher's outputs instead */
+				for (j = 0; j < num_output; j++)
+					desired[j] = teacher->win_prob[j];
+			}
+
+			/* Add squared errors */
+			for (k = 0; k < num_output; k++)
+			{
+				/* Compute difference */
+				diff = learn.win_prob[k] - desired[k];
+
+				/* Add squared difference */
+				error += diff * diff;
+			}
+		}
+
+		/* Compute evaluation time */
+		eval_time = elapsed(&start);
+
+		printf("%-10s %8d %14.0f %12.0f %12.6f\n", ptr,
+		       (num_inputs + 1) * hidden +
+		       (hidden + 1) * hidden2 +
+		       ((hidden2 ? hidden2 : hidden) + 1) * num_output,
+		       passes * num_train / train_time,
+		       eval_time * 1e9 / (num_sample - num_train),
+		       error / (num_sample - num_train));
+
+		/* Destroy network */
+		free_net(&learn);
+	}
+
+	/* Free array */
+	free(desired);
+}
+
+/*
+ * Fractions of largest hidden weights to represent without clipping.
+ */
+static double quant_clip[] = { 1.0, 0.9999, 0.999, 0.99, 0.98, 0 };
+
+/*
+ * Compare function for sorting weights.
+ */
+static int cmp_double(const void *a, const void *b)
+{
+	double x = *(double *)a, y = *(double *)b;
+
+	/* Compare */
+	return x < y ? -1 : x > y;
+}
+
+/*
+ * Compute the network on every logged input set, and return the mean
+ * difference from the given outputs.  The largest difference and time
+ * taken per input set are returned as well.
+ */
+static double compare_outputs(net *learn, double *ref, double *max_diff,
+                              double *ns)
+{
+	struct timespec start, end;
+	double sum = 0.0, diff, *desired;
+	int i, j;
+
+	/* Create array of desired outputs (unused) */
+	desired = (double *)malloc(sizeof(double) * num_output);
+
+	/* Clear largest difference */
+	*max_diff = 0.0;
+
+	/* Remember start time */
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	/* Loop over samples */
+	for (i = 0; i < num_sample; i++)
+	{
+		/* Set inputs */
+		load_sample(learn, sample[i], desired);
+
+		/* Compute network */
+		compute_net(learn);
+
+		/* Check for reference outputs */
+		if (!ref) continue;
+
+		/* Loop over outputs */
+		for (j = 0; j < num_output; j++)
+		{
+			/* Compute difference */
+			diff = fabs(learn->win_prob[j] - ref[i * num_output + j]);
+
+			/* Add difference */
+			sum += diff;
+
+			/* Track largest difference */
+			if (diff > *max_diff) *max_diff = diff;
+		}
+	}
+
+	/* Get end time */
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	/* Compute time per sample */
+	*ns = ((end.tv_sec - start.tv_sec) * 1e9 +
+	       (end.tv_nsec - start.tv_nsec)) / num_sample;
+
+	/* Free array */
+	free(desired);
+
+	/* Return mean difference */
+	return sum / ((double)num_sample * num_output);
+}
+
+/*
+ * Quantize the hidden weights of a network, choosing the scale that best
+ * keeps the network's outputs on the logged inputs.
+ *
+ * Returns the mean difference in outputs.
+ */
+static double calibrate_quant(net *learn, int bits)
+{
+	double *ref, *weight, max_diff, ns, ns_double, diff, best = -1;
+	double scale, best_scale = 0;
+	int i, j, k, n = 0;
+
+	/* Create array of reference outputs */
+	ref = (double *)malloc(sizeof(double) * num_sample * num_output);
+
+	/* Loop over samples */
+	for (i = 0; i < num_sample; i++)
+	{
+		/* Set inputs */
+		load_sample(learn, sample[i], ref + i * num_output);
+
+		/* Compute network with original weights */
+		compute_net(learn);
+
+		/* Save outputs */
+		for (j = 0; j < num_output; j++)
+			ref[i * num_output + j] = learn->win_prob[j];
+	}
+
+	/* Time original weights */
+	compare_outputs(learn, NULL, &max_diff, &ns_double);
+
+	/* Create array of weight sizes */
+	weight = (double *)malloc(sizeof(double) * (num_inputs + 1) *
+	                          learn->num_hidden);
+
+	/* Copy weight sizes */
+	for (i = 0; i < num_inputs + 1; i++)
+	{
+		/* Loop over hidden nodes */
+		for (j = 0; j < learn->num_hidden; j++)
+			weight[n++] = fabs(learn->hidden_weight[i][j]);
+	}
+
+	/* Sort weight sizes */
+	qsort(weight, n, sizeof(double), cmp_double);
+
+	/* Loop over clipping fractions */
+	for (k = 0; quant_clip[k]; k++)
+	{
+		/* Find largest weight not clipped */
+		i = quant_clip[k] * (n - 1);
+
+		/* Compute scale */
+		scale = weight[i] / (bits == 8 ? 127 : 32767);
+
+		/* Skip empty networks */
+		if (scale <= 0) continue;
+
+		/* Quantize */
+		quantize_net(learn, bits, scale);
+
+		/* Compare outputs */
+		diff = compare_outputs(learn, ref, &max_diff, &ns);
+
+		printf("Clip %.4f: scale %g, mean diff %g, max diff %g, "
+		       "%.0f ns (%.0f ns unquantized)\n", quant_clip[k], scale,
+		       diff, max_diff, ns, ns_double);
+
+		/* Check for better scale */
+		if (best < 0 || diff < best)
+		{
+			/* Remember scale */
+			best = diff;
+			best_scale = scale;
+		}
+	}
+
+	/* Use best scale */
+	if (best_scale > 0) quantize_net(learn, bits, best_scale);
+
+	/* Free arrays */
+	free(ref);
+	free(weight);
+
+	/* Return difference */
+	return best;
+}
+
+/*
+ * Train a network from experience logs.
+ */
+int main(int argc, char *argv[])
+{
+	net learn, teacher;
+	double alpha = 0.0001, keep = 1.0, tolerance = 0.002, diff;
+	char *out_name = NULL, *in_name = NULL, *teacher_name = NULL;
+	char *shapes = NULL;
+	int hidden = 50, hidden2 = 0, passes = 10, batch = 32, bits = 0;
+	int i;
+
+	/* Set random seed */
+	srand(time(NULL));
+
+	/* Parse arguments */
+	for (i = 1; i < argc; i++)
+	{
+		/* Check for number of hidden nodes */
+		if (!strcmp(argv[i], "-h"))
+		{
+			/* Set hidden nodes */
+			if (!read_shape(argv[++i], &hidden, &hidden2))
+			{
+				/* Error */
+				fprintf(stderr, "Bad network shape %s\n", argv[i]);
+				exit(1);
+			}
+		}
+
+		/* Check for shapes to compare */
+		else if (!strcmp(argv[i], "-B"))
+		{
+			/* Set shapes */
+			shapes = argv[++i];
+		}
+
+		/* Check for number of passes */
+		else if (!strcmp(argv[i], "-n"))
+		{
+			/* Set passes */
+			passes = atoi(argv[++i]);
+		}
+
+		/* Check for mini-batch size */
+		else if (!strcmp(argv[i], "-b"))
+		{
+			/* Set batch size */
+			batch = atoi(argv[++i]);
+		}
+
+		/* Check for learning rate */
+		else if (!strcmp(argv[i], "-a"))
+		{
+			/* Set learning rate */
+			alpha = atof(argv[++i]);
+		}
+
+		/* Check for random seed */
+		else if (!strcmp(argv[i], "-r"))
+		{
+			/* Set random seed */
+			srand(atoi(argv[++i]));
+		}
+
+		/* Check for starting weights */
+		else if (!strcmp(argv[i], "-w"))
+		{
+			/* Set input network */
+			in_name = argv[++i];
+		}
+
+		/* Check for output network */
+		else if (!strcmp(argv[i], "-o"))
+		{
+			/* Set output network */
+			out_name = argv[++i];
+		}
+
+		/* Check for teacher network */
+		else if (!strcmp(argv[i], "-d"))
+		{
+			/* Set teacher network */
+			teacher_name = argv[++i];
+		}
+
+		/* Check for quantization */
+		else if (!strcmp(argv[i], "-q"))
+		{
+			/* Set bits */
+			bits = atoi(argv[++i]);
+		}
+
+		/* Check for allowed quantization error */
+		else if (!strcmp(argv[i], "-e"))
+		{
+			/* Set tolerance */
+			tolerance = atof(argv[++i]);
+		}
+
+		/* Check for fraction of inputs to keep */
+		else if (!strcmp(argv[i], "-k"))
+		{
+			/* Set fraction to keep */
+			keep = atof(argv[++i]);
+		}
+
+		/* Otherwise argument is a log */
+		else if (map_log(argv[i]))
+		{
+			/* Exit */
+			exit(1);
+		}
+	}
+
+	/* Check for usage */
+	if ((!out_name && !bits && !shapes) || batch < 1 || num_sample == 0 || keep <= 0 ||
+	    keep > 1 || (keep < 1 && !teacher_name) ||
+	    (bits && (!in_name || (bits != 8 && bits != 16))))
+	{
+		/* Print usage */
+		fprintf(stderr, "Usage: trainnet [-h hidden[xhidden2]] "
+		                "[-n passes] [-b batch] [-a alpha] [-r seed] "
+		                "[-w start.net] [-d teacher.net [-k keep]] "
+		                "-o out.net log...\n"
+		                "       trainnet -q 8|16 [-e tolerance] "
+		                "-w weights.net log...\n"
+		                "       trainnet -B shape,shape... [-n passes] "
+		                "[-b batch] [-a alpha] [-r seed] "
+		                "[-d teacher.net] log...\n");
+		exit(1);
+	}
+
+	/* Check for shapes to compare */
+	if (shapes)
+	{
+		/* Load teacher if any */
+		if (teacher_name) load_teacher(&teacher, teacher_name);
+
+		/* Compare shapes */
+		bench_shapes(shapes, teacher_name ? &teacher : NULL, passes,
+		             batch, alpha);
+
+		/* Done */
+		return 0;
+	}
+
+	/* Create network (resized to starting weights, if any) */
+	make_learner(&learn, num_inputs, hidden, hidden2, num_output);
+
+	/* Set input names */
+	for (i = 0; i < num_inputs; i++) learn.input_name[i] = input_name[i];
+
+	/* Check for starting weights */
+	if (in_name && load_net(&learn, in_name))
+	{
+		/* Error */
+		fprintf(stderr, "Couldn't load %s\n", in_name);
+		exit(1);
+	}
+
+	/* Check for quantization */
+	if (bits)
+	{
+		/* Choose scale */
+		diff = calibrate_quant(&learn, bits);
+
+		/* Check for too inaccurate */
+		if (diff < 0 || diff > tolerance)
+		{
+			/* Error */
+			fprintf(stderr, "Quantized outputs differ by %g (more than "
+			                "%g)\n", diff, tolerance);
+			exit(1);
+		}
+
+		/* Save quantization */
+		if (save_quant(&learn, in_name))
+		{
+			/* Error */
+			fprintf(stderr, "Couldn't save quantization of %s\n",
+			        in_name);
+			exit(1);
+		}
+
+		/* Done */
+		return 0;
+	}
+
+	/* Check for teacher */
+	if (teacher_name)
+	{
+		/* Load teacher */
+		load_teacher(&teacher, teacher_name);
+
+		/* Prune least important inputs */
+		if (keep < 1) prune_inputs(&learn, &teacher, keep);
+	}
+
+	/* Set learning rate */
+	learn.alpha = alpha;
+
+	printf("Training on %d samples\n", num_sample);
+
+	/* Loop over passes */
+	for (i = 0; i < passes; i++)
+	{
+		/* Train one pass */
+		train_pass(&learn, teacher_name ? &teacher : NULL, num_sample,
+		           batch);
+
+		printf("Pass %d: error %f\n", i + 1, learn.error / learn.num_error);
+	}
+
+	/* Save network */
+	if (save_net(&learn, out_name))
+	{
+		/* Error */
+		fprintf(stderr, "Couldn't save %s\n", out_name);
+		exit(1);
+	}
+
+	/* Done */
+	return 0;
+}